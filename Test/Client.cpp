@@ -6,11 +6,11 @@ Description :
         - Program is a basic chat system that operates on the Linux OS
         - Program will consist of a server and client, with the server creating the socket
           and the client making a connection request and starting the chat
-        - The chat will facilitate a "ping-pong" communication style with the client first
-          sending a message and the server responding
+        - Messages, control packets and file data are all sent as frames on logical channels of the
+          same connection, so either user can send messages at any time, even during a file transfer
         - Either the server or client can request a file to be transferred by sending FILE
           as a message and stating the file desired
-        - The inputted file by the server/client will be used to create a new file in the 
+        - The inputted file by the server/client will be used to create a new file in the
           respective system and store the transferred data
 
         - As a result, THE FULL PATH OF THE DESIRED FILENAME WHEN REQUESTING IS NEEDED FOR THE
@@ -22,10 +22,108 @@ Description :
           to send the full file, otherwise an empty file of the same name will be sent after
           a message acknowledging the file transfer acceptance and declaring when the file transfer
           is complete
-        - The user that sends the file will wait for the other's response after a complete transfer
+        - File data is split into frames on its own channel, frames on the chat channel are always
+          sent ahead of file frames so a large transfer does not hold up the chat
         - If N is inputted, the user that requested the file will be sent the rejection message
           and will be set to send another message
 
+        - Every file request has its own transfer ID, the file is sent on the channel matching
+          that ID so many requests can be made back to back and are served at the same time,
+          each file being sent one chunk in turn so they share the connection equally
+        - FILE followed by filenames (FILE a.txt b.png) requests every file at once without prompts
+        - A directory is requested like a file (FILE Test), the sender lists every file below it and sends a
+          manifest of paths and sizes followed by the data of every file back to back on the transfer's channel,
+          small files are packed together into the same frames and large files are written from the file
+          straight into the socket (sendfile()), the requester recreates the directory with the same layout
+        - File requests from the server are answered depending on the -accept policy :
+              ASK  - client user is asked Y/N and the filename to send (default)
+              ALL  - requested file is sent without asking, only for paths below the client's folder
+                     (symlinks are resolved first, so a link can't point outside it)
+              NONE - every file request is rejected
+
+        - File data sent can be limited with token buckets, a chunk is only queued once both the
+          transfer and the client as a whole have tokens for it :
+              -file-rate   - limit of every single file transfer
+              -total-rate  - limit of all file transfers of the client
+          Rates are in bytes per second, a K, M or G after the number multiplies it by 1024, 1024^2 or 1024^3
+
+        - JOIN room and LEAVE room join/leave a named chat room on the server, @room message sends a
+          message to every other member of the room, room messages are shown with the room's name
+
+        - The socket is handled by one I/O thread that never writes to the terminal itself, output is handed
+          through a lock-free queue to a renderer thread that writes it in batches, and typed lines are
+          read by an input thread and handed back through another queue, so a slow terminal can't hold
+          up the chat (built with -pthread on Linux)
+        - STATS displays how long output waits before being written to the terminal (p50/p99)
+
+        - -capture file records every frame sent and received, with its time and file data, in a compact
+          binary capture file (see Capture File) that Replay can feed back into a server for comparing builds
+
+        - -tls encrypts the connection to a server started with -tls, the server's self-signed certificate
+          fingerprint is displayed and, if given with -tls-pin, must match or the client ends :
+              KERNEL - once the handshake is done OpenSSL hands the keys to the kernel (kTLS) where the
+                       kernel has the tls ULP, frames are then encrypted by the kernel as they are written and
+                       large files of directories go out with sendfile(), otherwise falls back to USER (the
+                       "Encrypted with" line displays which one is used)
+              USER   - every frame is encrypted by OpenSSL before being written
+          TLS needs the program built with -DUSE_TLS and linked with -lssl -lcrypto
+
+        - -udp asks a server started with -udp to take small chat frames (messages, errors and room frames)
+          as datagrams, so a lost packet only holds up the message it carried and not the file data queued
+          behind it on TCP. Datagrams have sequence numbers and selective ACKs, lost datagrams are sent
+          again by a timer set from the measured round trip and frames are delivered in the order they
+          were sent. File transfers, handshake and exit frames stay on TCP, and chat moves back to TCP for
+          good if the server stops answering datagrams (see Datagram Header). Not offered with -tls
+        - STATS also displays datagrams sent, sent again and received
+
+        - -local connects to a server on the same host started with -local through its Unix domain socket
+          (/tmp/chat-port.sock, server IP is not used), which skips the TCP/IP stack :
+              UNIX - frames are sent on the Unix domain socket
+              SHM  - shared memory holding a ring for each direction is handed to the server with the
+                     connection request, frames are then copied through the rings and the server is woken
+                     with an eventfd only while it sleeps (see Shared Memory Rings), falls back to UNIX if
+                     the server does not take them
+          Files sent either way are passed as file descriptors (SCM_RIGHTS) instead of being read and sent,
+          the receiving end copies them itself (copy_file_range()) a chunk at a time, so rate limits do not
+          apply to them. Not offered with -tls or -udp
+        - STATS also displays the transport and files passed
+
+        - While files are sent or received over TCP the link is measured through TCP_INFO (round trip and
+          delivery rate) every 100 ms, and the chunk of file data put in each frame and the socket buffers
+          follow its bandwidth-delay product. Chunks start at 1 KB and grow to a sixteenth of the product
+          (64 KB at most). Socket buffers are only ever raised, to twice the product, and only past what the
+          kernel has already given the socket on its own
+        - STATS also displays chunk size, round trip, delivery rate and socket buffers while files are sent
+          or received
+
+        - -batch file runs the client without a console for scripts, reading lines from a commands file (- for
+          standard input, so a pipe can be used) instead of the console. Lines are messages and commands just
+          as if typed, except FILE must be followed by filenames since nothing is prompted for, and -accept
+          ASK is answered as NONE. Standard output only carries what is received, one JSON object per line :
+              {"type":"message","from":0,"text":"..."}              - message from server
+              {"type":"room","from":3,"room":"name","text":"..."}   - room message, from 0 is the server
+              {"type":"file","id":1,"status":"complete","text":"name"}  - requested file is done, status
+                                                                      may also be incomplete or rejected
+              {"type":"exit","from":0,"text":"..."}                 - server has exited
+              {"type":"ping","rtt":120,"text":"..."}                - answer to PING, round trip in microseconds
+          everything else the client displays goes to standard error. Once the commands file ends (or has
+          EXIT) the client exits after every file transfer is done, messages received later are not waited for
+        - Input lines are only taken while little is queued for the server, and back to back chat frames are
+          written to the socket with one send, so a commands file is sent as fast as the server takes it
+
+        - PING measures the round trip to the server through the chat (queues and all), and how far the server's
+          clock is ahead of the client's, which is taken as none when it is within half the round trip (same host)
+        - -trace file sends every room message inside a trace frame holding the time it was sent, the server adds
+          the times it read it from the socket and started writing it to each member, and a client receiving a
+          traced room message records the time it read it, handed it to the renderer and had it written to the
+          terminal. Messages to the server alone are never traced, nobody records them. Stages of every traced
+          message received (and of every PING) are written to file as Chrome trace JSON, which opens in Perfetto
+          or chrome://tracing : to server, server, to client, client and render, on the receiving client's clock.
+          A PING is sent once chat starts to measure the server's clock. Traced frames are always sent on TCP
+
+Usage : Client [port] [server IP] [-accept ASK|ALL|NONE] [-file-rate rate] [-total-rate rate] [-capture file]
+               [-tls KERNEL|USER] [-tls-pin fingerprint] [-udp] [-local UNIX|SHM] [-batch file] [-trace file]
+
 main()
     - Creates socket to performs communications
     - Intialzes all variables to be used in between functions and sockets other then temp variables
@@ -35,13 +133,100 @@ main()
 
 FileSend()
     - Function for initiating the sending of files
-    - Obtains filename and desired approach after receiving request
+    - Opens the file and places the ACK and file start frame in the send queue, file data frames
+      are then queued by QueueFile() as the socket drains the queue
     - Sends files of any type
 
 FileReceive()
-    - Function for receiving file data from other user after sending request from SendMessage()
-    - Returns back to sending a message if other user rejects request, otherwise file receiving 
-      begins and saves in inputted file name/path
+    - Function for requesting a file from the server under a new transfer ID, the file data is
+      saved in inputted file name/path by ReceiveFileFrame() as it arrives
+
+ListDirectory() / QueueManifest()
+    - Lists every regular file below a directory being sent, and queues the manifest frames of its files
+
+DirectoryChunk()
+    - Queues next chunk of a directory's data, packing small files together and queueing large files as
+      frames whose data is written straight from the file
+
+ReadManifest() / WriteDirectory()
+    - Adds files listed in a manifest frame to a directory being received, and splits received data between
+      its files, creating them (and their directories) in manifest order
+
+BelowFolder()
+    - Checks a requested path, with its symlinks resolved, is below the working folder (-accept ALL)
+
+ValidEntry() / MakePath()
+    - Checks a path received in a manifest stays below the directory, and creates every directory of a path
+
+CanSplice() / SpliceSend() / CloseSplices()
+    - Checks file data may be written to the connection with sendfile() (unencrypted or kernel TLS), writes
+      data of a queued file frame from its file, and closes files of queued frames not yet written
+
+CloseTransfers()
+    - Closes every file being sent to or received from the server
+
+SetupPacing() / TunePacing() / PacingStats()
+    - Sets up link measurements of the connection, measures the link through TCP_INFO and sizes file chunks
+      and socket buffers from its bandwidth-delay product, and formats the measurements for STATS
+
+ReceiveFileFrame()
+    - Handles frames received on a file channel (start, data and end of file), checking data against the
+      checksum the server sends with files from its cache
+
+FileChecksum()
+    - Returns the checksum (FNV-1a) of file data
+
+StartTLS() / KernelTLS()
+    - Makes TLS handshake with server and checks its certificate fingerprint, and checks the kernel encrypts
+      what is written to the connection
+
+SocketSend() / SocketReceive()
+    - Writes/reads socket like send()/recv(), going through TLS when the connection is encrypted
+
+CloseTLS()
+    - Sends TLS close message and frees connection's TLS state
+
+SetupDatagram() / DatagramFrame() / DatagramBusy()
+    - Sets up UDP state of the connection, checks a frame may be sent as a datagram, and checks frames
+      are still waiting on ACK
+
+SendDatagram() / QueueDatagram() / FillWindow()
+    - Sends one datagram with ACK of everything received, queues a chat frame to be sent as a datagram,
+      and sends queued frames while the window has room
+
+ReceiveDatagram()
+    - Handles ACKs of a datagram received (round trip, fast retransmit) and hands on its frame once every
+      earlier frame has been received, ACK'ing it right away
+
+DatagramTimer() / DatagramFallback()
+    - Sends again datagrams not ACK'd in time (and hello until the server answers) and finds when the next
+      one is due, and hands every frame not known to be received back to be sent on TCP once the server
+      stopped answering
+
+ReadDatagrams() / DrainDatagrams()
+    - Reads every datagram the server has sent, and waits a short time for datagrams to be ACK'd before
+      the exit message is sent
+
+DatagramStats()
+    - Formats counters of the UDP connection for STATS
+
+SetupLocal() / CloseLocal()
+    - Sets up state of connection on this host, and unmaps rings and closes every file descriptor it holds
+
+CreateRings() / UseRings()
+    - Creates shared memory rings and eventfds to be passed with connection request, and moves everything
+      sent and received onto the rings
+
+SendHandles() / ReadHandles()
+    - Writes/reads Unix domain socket, passing file descriptors waiting to be passed with the bytes written
+      and keeping file descriptors received in the order they were sent
+
+LocalSend() / LocalReceive()
+    - Writes/reads server on this host like send()/recv(), through the rings once they are used
+
+TakeHandle() / PassedFile() / CopyHandle() / CopyFiles()
+    - Takes next file descriptor passed by server, checks it is a regular file holding the length claimed for
+      it, copies a chunk of a passed file into its output file, and copies a chunk of every file server has passed, returning true while more is left
 
 CheckConnection()
     - Checks connection with server before starting chat
@@ -56,22 +241,111 @@ ReceiveMessage()
       display of server's messages
     - Displays error messages if any
 
+ProcessInbox()
+    - Splits bytes received from the server into frames and passes them on to ProcessFrame()
+
+ProcessFrame()
+    - Passes a frame received from the server (on TCP or as a datagram) on by type
+
+ReceiveRoomMessage() / RoomSender()
+    - Displays a message relayed by the server from a room the client is in
+
+QueueEvent() / FileEvent() / JSONText() / UTF8Length()
+    - Writes a received message (or end of a requested file) as a JSON line on standard output with -batch,
+      escaping its text so every line parses (bytes that are not UTF-8 become U+FFFD)
+
+QueueTraced() / ReceiveTraced()
+    - Places a frame in the send queue inside a trace frame, and hands the trace of a received traced frame
+      to the output line of its message
+
+QueuePing() / ReceivePing()
+    - Sends a PING, and displays the round trip once it is answered, keeping the server's clock offset
+
+PutStamp() / GetStamp()
+    - Writes and reads a time of trace fields in network byte order
+
+QueueRoom()
+    - Places a room join, leave or message frame in the send queue
+
+QueuePacket()
+    - Places a packet in the chat queue
+
+QueueFrame()
+    - Places a frame in the chat queue, small chat frames are handed to QueueDatagram() instead when
+      the server takes UDP
+
+QueueFile()
+    - Reads the next chunk of each file being sent in turn into the file queue while the queue has room
+    - Transfers without tokens are skipped, returns time until a rate limited transfer can continue
+
+SetupBucket()
+    - Sets up token bucket for a rate limit, starting full
+
+RefillBucket()
+    - Adds tokens to bucket for time passed since it was last refilled
+
+BucketWait()
+    - Returns time until bucket has tokens again, 0 if it has tokens now
+
+MonotonicTime()
+    - Returns current time of clock that is never set back, used for refilling token buckets
+
+ParseRate()
+    - Converts rate given on command line into bytes per second
+
+FlushQueue()
+    - Priority scheduler, writes frames from the chat queue first and from the file queue only
+      when no chat frames are waiting, as much as the socket accepts without blocking
+    - Back to back chat frames are joined and written together, up to 64 KB at once
+
+CreateFrame()
+    - Places frame header in front of data to be sent through socket
+
 CreateHeader()
     - Creates the packet header to be sent through sockets
 
 Exit()
     - Performs exit functions and ends program
 
+StartDisplay() / StopDisplay()
+    - Starts the renderer and input threads and points std::cout at the renderer's queue, and waits
+      for all output to be written once chat ends
+
+RenderLoop()
+    - Renderer thread, writes every line waiting in the output queue to the terminal with one write
+
+ReadLoop()
+    - Input thread, reads the console (or commands file) and hands every whole line to the I/O thread
+
+SetupQueue() / PushLine() / PopLine() / QueueIdle()
+    - Bounded single producer, single consumer lock-free ring of lines, the consumer sleeps on a
+      pipe that the producer only writes to once the consumer has marked itself idle
+
+LatencyBucket() / LatencyBound() / PrintLatency()
+    - Histogram of time from output being handed over to being written, and display of its percentiles
+
+WriteTrace() / TraceEvent()
+    - Renderer thread records the stages of a traced message once it has been written, as Chrome trace events
+
+OpenCapture() / CaptureFrame()
+    - Creates capture file, and records a frame in it with its direction and time
+
 Chat()
     - Endless loop that performs SendMessage() and ReceiveMessage until server or client chooses to leave
     - Also closes all file descriptors created in main
 
-Header Fields :
-Flags - 
+Frame Header Fields :
+Type (8 bits), Flags (8 bits), Channel (16 bits), Length (32 bits), followed by Length bytes of data
+
+Channel -
+        0 : Chat channel (messages and control messages)
+        1 - 65535 : Transfer ID, used by file request/ACK/ignored packets and the frames of that file
+
+Flags -
         0 - 000 : EXIT code
         1 - 001 : (NONE - Simple Message/File sent)
         2 - 010 : Message Corruption/Error
-        3 - 011 : File Corruption/Error 
+        3 - 011 : File Corruption/Error
         4 - 100 : ACK ACK
         6 - 110 : Connection Request ACK
         7 - 111 : Connection Request
@@ -81,10 +355,52 @@ Types -
         1 - 01 : File Request
         2 - 10 : File Request ACK
         3 - 11 : File Request IGNORED
+        4 - 100 : File Start (file channel, data is 8 byte file size, optionally followed by 8 byte checksum of the
+                  file's data, FNV-1a)
+        5 - 101 : File Data (file channel)
+        6 - 110 : File End (file channel)
+        7 - 111 : Room Join (data is room name)
+        8 - 1000 : Room Leave (data is room name)
+        9 - 1001 : Room Message (data is room name, a null byte, then message, server puts ID of client that sent
+                   it in front, 32 bits, 0 for server)
+        10 - 1010 : File Handle (file channel, data is 8 byte file size, file itself is passed as a file
+                    descriptor on the Unix domain socket, same host only)
+        11 - 1011 : Directory Manifest (file channel, sent in place of File Start when a directory is requested,
+                    data is entries of file size (64 bits), path length (16 bits) and path below directory, a
+                    large directory takes several manifest frames, File Data frames then hold the data of every
+                    file in manifest order and File End follows the last file)
+        12 - 1100 : Traced Frame (data is trace fields, then a whole message or room message frame)
+        13 - 1101 : PING (client sends its time, 64 bits, server answers with that time followed by the times it
+                    read and answered it)
 
 Message Length
 
 Message{ .................... }
+
+Trace Fields :
+Message number (64 bits, given by sender), Sent (64 bits), Server Received (64 bits), Server Forwarded (64 bits), times
+are monotonic clock of server's host in nanoseconds (sender converts its own time with clock offset measured by PING),
+0 until stamped. Client reading a traced frame converts them to its own clock
+
+Capture File :
+Magic "CCAP" (4 bytes), Version (8 bits), Role (8 bits, 0 server, 1 client), Reserved (16 bits), then for every frame
+Time (32 bits, microseconds since previous frame), Direction (8 bits, 0 sent, 1 received), Reserved (24 bits),
+Connection (32 bits, client ID on server, 0 on client), followed by the whole frame as sent through the socket
+(client's connection request/ACK ACK are not recorded, Replay makes its own handshake)
+
+Datagram Header :
+Token (32 bits, given to client in connection request ACK), Kind (8 bits, 0 hello, 1 data, 2 ACK), Reserved (24 bits),
+Sequence (32 bits, of frame in data datagram), Ack (32 bits, every frame up to it has been received),
+Selective (32 bits, bit n set if frame Ack + 2 + n has been received), followed by one whole frame for data datagrams
+Client asks for UDP with "UDP" as data of its connection request, server answers with "UDP token" in the ACK
+
+Shared Memory Rings :
+Client on same host passes shared memory, the server's eventfd and its own eventfd (SCM_RIGHTS) with "SHM" as data of its
+connection request, server answers with "SHM" in the ACK once it has mapped them, everything after ACK ACK is sent through
+the rings. Memory holds ring 0 (client to server) then ring 1 (server to client), each is Head (64 bits, bytes read), padding,
+Tail (64 bits, bytes written), padding, Sleeping (reader waits on its eventfd), Full (writer waits for room), followed by
+LOCAL_RING_SIZE bytes of data. Memory is a memfd sealed against shrinking, growing and further seals. File descriptors
+passed once rings are used are sent on the socket with one byte each, ahead of the frame that uses them
 */
 
 #include <iostream>
@@ -92,6 +408,17 @@ Message{ .................... }
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <streambuf>
+#include <algorithm>
+#include <stddef.h>
 
 #ifndef UNICODE
 #define UNICODE
@@ -113,46 +440,526 @@ Message{ .................... }
   #include <arpa/inet.h>
   #include <netdb.h>  /* Needed for getaddrinfo() and freeaddrinfo() */
   #include <unistd.h> /* Needed for close() */
+  #include <poll.h>   /* Needed for poll() */
+  #include <netinet/tcp.h>    /* Needed for TCP_NODELAY and TCP_INFO */
+  #include <signal.h> /* Needed for signal() */
+  #include <sys/un.h>     /* Needed for Unix domain sockets (-local) */
+  #include <sys/mman.h>   /* Needed for mmap() and memfd of shared memory rings */
+  #include <sys/eventfd.h>    /* Needed for eventfd() */
+  #include <sys/stat.h>   /* Needed for fstat() */
+  #include <sys/sendfile.h>   /* Needed for sendfile() */
+  #include <dirent.h>     /* Needed for opendir() of directory transfers */
+  #include <limits.h>     /* Needed for PATH_MAX of realpath() */
+#endif
+
+#ifdef USE_TLS
+  #include <openssl/ssl.h>    /* Needed for TLS connection (-tls) */
+  #include <openssl/err.h>
+  #include <openssl/x509.h>
+#else
+  typedef struct ssl_st SSL;  /* Connection is never encrypted, TLS state is always NULL */
 #endif
 
 //List of predefined and global variables for easy scalability
 #define DEFAULT_PORT 12345               //Default port number used if one is not entered
 #define DEFAULT_HOSTNAME "Connors-MBP"  //Default hostname for connecting to server
 #define MAX_LENGTH 1024                 //Max length of message that can be sent or received
-#define MAX_SIZE 1024                   //Max size of buffer for transferring files
+#define MAX_SIZE 1024                   //Size of file chunks before link is measured, smallest chunk used
+#define MAX_CHUNK 65536                 //Largest chunk of file data put in one frame
+#define FILE_QUEUE_SIZE 16384           //Max bytes of file data queued ahead of socket
+
+#define CHAT_CHANNEL 0          //Channel for messages and control packets
+#define TRACE_SIZE 32           //Bytes of trace fields in front of a traced frame
+#define MAX_TRANSFERS 32        //Max files being sent to or requested from server at once
+#define MAX_FRAME 65536         //Max length of data in a single frame, larger frames are treated as corrupted
+#define UNSENT_LIMIT 32768      //Max bytes left unsent in socket buffer, keeps file data from building up ahead of chat
+#define RATE_BURST 50           //Milliseconds of data a rate limit lets through at once after being idle
+#define OUTPUT_QUEUE_SIZE 8192  //Output lines that can wait for renderer thread (power of 2)
+#define INPUT_QUEUE_SIZE 256    //Typed lines that can wait for I/O thread (power of 2)
+#define BATCH_QUEUE_SIZE 16384  //Lines of commands file that can wait for I/O thread with -batch (power of 2)
+#define BATCH_READ 65536        //Bytes of commands file read at once with -batch
+#define INPUT_BACKLOG 262144    //Bytes queued for server before further input lines are left waiting
+#define CHAT_WRITE 65536        //Max bytes of back to back chat frames written with one send
+#define RENDER_BATCH 65536      //Max bytes written to terminal at once
+#define LATENCY_BUCKETS 128     //Buckets of display latency histogram
+
+//Capture file values
+#define CAPTURE_MAGIC "CCAP"        //First bytes of every capture file
+#define CAPTURE_VERSION 2           //Version of capture file layout
+#define CAPTURE_SERVER 0            //Capture recorded by server
+#define CAPTURE_CLIENT 1            //Capture recorded by client
+#define CAPTURE_SENT 0              //Frame was sent
+#define CAPTURE_RECEIVED 1          //Frame was received
+#define CAPTURE_BUFFER 1048576      //Bytes of capture buffered before being written to disk
+
+//Chat datagram values
+#define UDP_MAX_FRAME 1200      //Largest frame sent as a datagram, larger chat frames stay on TCP
+#define UDP_WINDOW 32           //Max datagrams sent and not yet ACK'd (bits of selective ACK)
+#define UDP_PENDING 1024        //Max chat frames waiting for room in window, sent on TCP past it
+#define UDP_FIRST_TIMEOUT 200   //Retransmit timeout before first round trip is measured (ms)
+#define UDP_MIN_TIMEOUT 20      //Lowest retransmit timeout (ms)
+#define UDP_MAX_TIMEOUT 1000    //Highest retransmit timeout (ms)
+#define UDP_GIVE_UP 3000        //Time a datagram (or hello) goes without ACK before chat moves back to TCP (ms)
+#define UDP_FAST_RETRANSMIT 3   //ACKs of later datagrams before a missing datagram is sent again
+#define UDP_ADDRESS_WAIT 2000   //Time frames wait for peer's first datagram before chat moves back to TCP (ms)
+#define UDP_DRAIN 500           //Max time waiting for datagrams to be ACK'd before exiting (ms)
+#define DATAGRAM_HELLO 0        //Client telling server its address, answered with an ACK
+#define DATAGRAM_DATA 1         //Chat frame
+#define DATAGRAM_ACK 2          //ACK only
+
+//Same host transport values
+#define LOCAL_PATH "/tmp/chat-%d.sock"  //Unix domain socket of server on this host, by port number
+#define LOCAL_RING_SIZE 1048576 //Bytes of data in each shared memory ring
+#define LOCAL_MAX_HANDLES 16    //Max file descriptors passed with one write
+#define FILE_COPY_CHUNK 4194304 //Max bytes of a passed file copied at once, keeps chat moving during large copies
+#define DIRECTORY_MAX_FILES 100000  //Max files sent/received in one directory transfer
+#define DIRECTORY_MAX_NAME 4096     //Max length of a path in a directory transfer
+#define DIRECTORY_SPLICE_SIZE 262144    //Files of a directory at least this large are written with sendfile() instead of being packed
+#define CHECKSUM_START 14695981039346656037ULL  //FNV-1a offset basis, checksum of no data
+#define CHECKSUM_PRIME 1099511628211ULL         //FNV-1a prime
+#define TUNE_INTERVAL 100       //Time between link measurements while files are sent or received (ms)
+#define CHUNKS_PER_BDP 16       //File chunks that fit in bandwidth-delay product of link
+#define MAX_SOCKET_BUFFER 67108864  //Largest socket buffer asked for
+#define LOCAL_NONE 0            //Server is connected to over TCP
+#define LOCAL_UNIX 1            //Frames are sent on Unix domain socket
+#define LOCAL_SHM 2             //Frames are sent through shared memory rings, Unix domain socket if server does not take them
+
+//TLS modes
+#define TLS_NONE 0              //Connection is not encrypted
+#define TLS_KERNEL 1            //Kernel encrypts once handshake is done, OpenSSL if kernel can't
+#define TLS_USER 2              //OpenSSL encrypts everything
+
+//Console input states of the client
+#define CONSOLE_CHAT 0          //Input is message/command
+#define CONSOLE_FILE_ANSWER 1   //Input is Y/N answer to file request from server
+#define CONSOLE_FILE_SEND 2     //Input is filename of file being sent to server
+#define CONSOLE_FILE_REQUEST 3  //Input is filename being requested from server
+
+//File request policies
+#define ACCEPT_ASK 0            //Ask client user to answer every file request
+#define ACCEPT_ALL 1            //Send requested files without asking
+#define ACCEPT_NONE 2           //Reject every file request
 
 //Protocol header structure for sending messages/files/and error/control signals
 struct MessageProtocol{
     unsigned int Type : 2;       //Specifies whether it is file or message base (2 bits)
     unsigned int Flags : 3;      //Delivers requests/errors/success messages (3 bits)
     unsigned int Length;         //Specifies length of message being sent
+    unsigned short Channel;      //Transfer ID for file request/ACK/ignored, CHAT_CHANNEL otherwise
     char Message[MAX_LENGTH];    //Message or file being sent
 };
 
-//Function Prototypes for file transfer and 
-bool FileSend(int, struct MessageProtocol, bool[]);        //Function for requesting to send file from server side
-bool FileReceive(int, struct MessageProtocol, bool[]);     //Function for receiving file from client side
-bool CheckConnection(int, struct MessageProtocol);         //Function for checking connection to client
-bool SendMessage(int, struct MessageProtocol, bool[]);     //Function for sending message to client
-bool ReceiveMessage(int, struct MessageProtocol, bool[]);   //Function for receiving and displaying message from client
+//Header placed in front of every frame sent through sockets
+struct FrameHeader{
+    unsigned char Type;         //Type of frame (see Types)
+    unsigned char Flags;        //Delivers requests/errors/success messages
+    unsigned short Channel;     //Logical channel frame belongs to
+    unsigned int Length;        //Length of data following header
+};
+
+//Header at start of capture file
+struct CaptureHeader{
+    char Magic[4];              //CAPTURE_MAGIC
+    unsigned char Version;      //CAPTURE_VERSION
+    unsigned char Role;         //Program that recorded capture (CAPTURE_SERVER or CAPTURE_CLIENT)
+    unsigned short Reserved;
+};
+
+//Header placed in front of every frame in capture file
+struct CaptureRecord{
+    unsigned int Time;          //Microseconds since previous frame
+    unsigned char Direction;    //CAPTURE_SENT or CAPTURE_RECEIVED
+    unsigned char Reserved[3];
+    unsigned int Connection;    //Client ID frame was sent to/received from, 0 on client
+};
+
+//Header placed in front of every datagram, followed by one chat frame for data datagrams
+struct DatagramHeader{
+    unsigned int Token;         //Token given to client in connection request ACK
+    unsigned char Kind;         //DATAGRAM_ kind
+    unsigned char Reserved[3];
+    unsigned int Sequence;      //Sequence number of frame, 0 if datagram holds no frame
+    unsigned int Ack;           //Every frame up to this sequence number has been received
+    unsigned int Selective;     //Bit n set if frame Ack + 2 + n has been received
+};
+
+//Capture file being recorded
+struct Capture{
+    FILE* File;                 //Capture file
+    long long Last;             //Time of last frame recorded (nanoseconds)
+};
+
+//Settings given on command line
+struct ClientSettings{
+    int Accept;                 //Policy for answering file requests (ACCEPT_ values)
+    double FileRate;            //Bytes per second limit of every file transfer, 0 for no limit
+    double TotalRate;           //Bytes per second limit of every file transfer together, 0 for no limit
+    struct Capture* Capture;    //Capture frames are recorded in, NULL if not capturing
+    int TLSMode;                //Encryption of connection (TLS_ values)
+    const char* Pin;            //Fingerprint server's certificate must have, NULL to accept any
+    SSL* TLS;                   //TLS state of connection, NULL if not encrypted
+    bool UDP;                   //Ask server to take chat frames as datagrams
+    int Local;                  //Transport to server on this host (LOCAL_ values)
+    int BatchFD;                //Commands file read with -batch (0 for standard input), -1 on console
+    FILE* Trace;                //Trace file (Chrome trace JSON) written with -trace, NULL if not tracing
+};
+
+//Token bucket for limiting rate of file data, tokens are bytes that may be queued
+struct TokenBucket{
+    double Rate;                //Tokens added every second, 0 for no limit
+    double Burst;               //Max tokens bucket can hold
+    double Tokens;              //Tokens in bucket, may fall below 0 after a whole chunk is taken
+    long long Last;             //Time of last refill (nanoseconds)
+};
+
+//File of a directory being sent/received
+struct DirectoryFile{
+    std::string Name;           //Path below directory
+    long int Size;              //Bytes of file
+};
+
+//File data of a queued frame that is written with sendfile() once the frame's header is written
+struct Splice{
+    int FD;                     //Duplicate of file, closed once its data is written
+    long long Offset;           //Position of data in file
+    size_t Length;              //Bytes of data not yet written
+};
+
+//Link of a connection measured through TCP_INFO, file chunk and socket buffer sizes follow its bandwidth-delay product
+struct Pacing{
+    int Chunk;                  //Bytes of file data put in each frame
+    long long Checked;          //Time link was last measured (nanoseconds), 0 if never measured
+    unsigned int RTT;           //Smoothed round trip (microseconds)
+    unsigned long long Rate;    //Delivery rate (bytes per second)
+    size_t BDP;                 //Largest bandwidth-delay product measured sending (bytes)
+    size_t ReceiveBDP;          //Largest data received in a round trip measured by kernel (bytes)
+    int SendBuffer;             //Size of socket send buffer (bytes)
+    int ReceiveBuffer;          //Size of socket receive buffer (bytes)
+    int SendLimit;              //Largest send buffer the kernel allows (bytes, twice net.core.wmem_max)
+    int ReceiveLimit;           //Largest receive buffer the kernel allows (bytes, twice net.core.rmem_max)
+    unsigned int Raised;        //Times a socket buffer was raised
+};
+
+#ifdef TCP_INFO
+//tcp_info as filled in by newer kernels, glibc's tcp_info ends before the delivery rate
+struct LinkInfo{
+    struct tcp_info Base;
+    unsigned long long PacingRate;
+    unsigned long long MaxPacingRate;
+    unsigned long long BytesAcked;
+    unsigned long long BytesReceived;
+    unsigned int SegsOut;
+    unsigned int SegsIn;
+    unsigned int NotSentBytes;
+    unsigned int MinRTT;
+    unsigned int DataSegsIn;
+    unsigned int DataSegsOut;
+    unsigned long long DeliveryRate;    //Bytes per second (Linux 4.9)
+};
+#endif
+
+//State of a single file transfer, frames of the file are sent on the channel matching its ID
+struct Transfer{
+    int ID;                     //Transfer ID given by user that requested the file
+    FILE* File;                 //File being sent/received, NULL if it couldn't be opened
+    std::string Name;           //Filename being sent/saved
+    long int Remaining;         //Bytes of file not yet queued/received
+    bool Started;               //True once start frame has been queued/received
+    struct TokenBucket Bucket;  //Rate limit of file being sent
+    int Source;                 //File descriptor passed by server that file is copied from, -1 if data comes in frames
+    bool Directory;             //True if a whole directory is being sent/received, Name is the directory
+    std::vector<struct DirectoryFile> Entries;  //Files of directory, their data is sent in this order
+    size_t Next;                //Entry after the one being read/written
+    long int Left;              //Bytes of current entry not yet read/written
+    long long Offset;           //Bytes of current entry already read (sender only)
+    bool Verify;                //True if start frame carried a checksum of file (receiver only)
+    unsigned long long Checksum;    //Checksum of file sent in start frame (receiver only)
+    unsigned long long Hash;    //Checksum of data received so far (receiver only)
+};
+
+//File request from server waiting on client user's answer
+struct FileRequest{
+    int ID;                     //Transfer ID of request
+    std::string Name;           //File requested
+};
+
+//Datagram sent and not yet ACK'd
+struct SentDatagram{
+    std::string Frame;              //Chat frame sent
+    long long Time;                 //Time it was last sent (nanoseconds)
+    long long First;                //Time it was first sent (nanoseconds)
+    int Tries;                      //Times it has been sent
+    int Missed;                     //ACKs of later datagrams received since it was last sent
+};
+
+//Chat frames sent as datagrams to/received as datagrams from one peer, frames are delivered in the order they were sent
+struct Datagram{
+    unsigned int Token;             //Token of connection, sent in every datagram
+    struct sockaddr_in Address;     //Address datagrams are sent to
+    bool Known;                     //Set once peer's address is known
+    bool Failed;                    //Set once peer stopped answering, chat is sent on TCP from then on
+    long long Hello;                //Time hello was last sent, 0 once server has answered (client only)
+    long long Asked;                //Time first hello was sent (client only)
+    long long Waiting;              //Time frames started waiting for peer's address (server only)
+    unsigned int NextSequence;      //Sequence number of next frame sent
+    std::map<unsigned int, struct SentDatagram> Unacked;    //Frames sent and not ACK'd by sequence number
+    std::deque<std::string> Pending;    //Frames waiting for room in window
+    unsigned int Expected;          //Sequence number of next frame to be delivered
+    std::map<unsigned int, std::string> Early;  //Frames received ahead of a missing frame
+    long long RTT;                  //Smoothed round trip time (nanoseconds), 0 until measured
+    long long Variance;             //Round trip time variation (nanoseconds)
+    long long Timeout;              //Retransmit timeout (nanoseconds)
+
+    unsigned int Sent;              //Frames sent (first time)
+    unsigned int Retransmits;       //Frames sent again
+    unsigned int Received;          //Data datagrams received
+    unsigned int Duplicates;        //Data datagrams received more than once
+};
+
+//One direction of shared memory rings, followed by LOCAL_RING_SIZE bytes of data, positions only grow and are
+//wrapped into the data when used
+struct RingHeader{
+    std::atomic<unsigned long long> Head;   //Bytes read, only moved by reader
+    char HeadPad[56];                       //Keeps positions on separate cache lines
+    std::atomic<unsigned long long> Tail;   //Bytes written, only moved by writer
+    char TailPad[56];
+    std::atomic<bool> Sleeping;             //Set while reader is waiting on its eventfd
+    std::atomic<bool> Full;                 //Set while writer is waiting for room
+};
+
+//Connection to a peer on the same host over a Unix domain socket, and the shared memory rings once both ends use them
+struct Local{
+    void* Memory;                   //Shared memory holding both rings, NULL if rings are not used
+    struct RingHeader* In;          //Ring data is read from, NULL until rings are used
+    struct RingHeader* Out;         //Ring data is written to, NULL until rings are used
+    int WakeFD;                     //Eventfd peer signals once In has data or Out has room, -1 without rings
+    int PeerFD;                     //Eventfd signalled to wake peer, -1 without rings
+    std::deque<int> Outgoing;       //File descriptors waiting to be passed, sent with next bytes written
+    std::deque<int> Incoming;       //File descriptors passed by peer, in the order they were sent
+    unsigned int Passed;            //Files passed to peer as file descriptors
+};
+
+//State of connection to server
+struct Connection{
+    int SocketFD;                   //Socket file descriptor for communicating with server
+    bool Closed;                    //Set once server has exited or connection has failed
+    std::string Inbox;              //Data received from server not yet processed
+
+    std::deque<std::string> ChatQueue;  //Chat frames, always sent ahead of file frames
+    std::deque<std::string> FileQueue;  //File frames, only sent when no chat frames are waiting
+    std::string Current;            //Frame currently being written to socket
+    size_t Offset;                  //Bytes of current frame already written
+    std::deque<struct Splice> Splices;  //File data of file frames queued without it, in queue order
+    struct Splice Splicing;         //File data of current frame, written once its header is
+    size_t QueuedBytes;             //Bytes of every queued frame and current frame
+
+    std::deque<struct Transfer*> Sends;         //Files being sent to server, served in turn
+    std::map<int, struct Transfer*> Receives;   //Files requested from server by transfer ID
+    int NextTransfer;               //Last transfer ID given to file requested from server
+    struct TokenBucket Bucket;      //Rate limit of every file sent to server
+    struct Pacing Pace;             //Link measurements, chunk and socket buffer sizes of connection
+    struct Capture* Capture;        //Capture frames are recorded in, NULL if not capturing
+    SSL* TLS;                       //TLS state of connection, NULL if not encrypted
+    int DatagramFD;                 //UDP socket chat datagrams are sent and received on, -1 if not used
+    struct Datagram* UDP;           //State of chat sent as datagrams, NULL if server did not offer UDP
+    struct Local* Local;            //State of connection on this host, NULL if server is connected to over TCP
+    struct LineQueue* Events;       //Queue received messages are written to as JSON lines (-batch), NULL on console
+    bool Tracing;                   //Room messages sent are placed in trace frames (-trace)
+    unsigned long long NextTrace;   //Number of last traced message or PING sent
+    long long ClockOffset;          //Server's monotonic clock ahead of client's, measured by PING (nanoseconds)
+    struct Trace* Pending;          //Trace of message being handled with -batch, taken by its event line
+};
+
+//Times a traced message (or PING) passed each stage, on client's monotonic clock (nanoseconds)
+struct Trace{
+    unsigned long long ID;          //Number sender gave message, or number of PING
+    int From;                       //Client that sent message (0 for server), -1 for a PING
+    long long Sent;                 //Sender queued message
+    long long ServerReceived;       //Server read frame
+    long long ServerForwarded;      //Server queued frame to this client
+    long long Received;             //Client read frame
+    long long Queued;               //Message was handed to renderer
+    long long Displayed;            //Message was written to terminal
+};
+
+//Line handed between threads, with time it was handed over
+struct Line{
+    std::string Text;               //Line of text (output may hold several lines)
+    long long Time;                 //Time line was pushed (nanoseconds)
+    struct Trace* Trace;            //Trace of message on line, recorded by renderer once written, NULL if untraced
+};
+
+//Bounded lock-free ring of lines between two threads, only one thread pushes and only one thread pops
+struct LineQueue{
+    std::vector<struct Line> Slots;     //Ring of lines, size is a power of 2
+    size_t Mask;                        //Slots.size() - 1, wraps positions into ring
+    std::atomic<size_t> Head;           //Next position to pop, only moved by consumer
+    char HeadPad[64];                   //Keeps positions on separate cache lines
+    std::atomic<size_t> Tail;           //Next position to push, only moved by producer
+    char TailPad[64];
+    std::atomic<bool> Sleeping;         //Set while consumer is waiting on wake pipe
+    std::atomic<bool> Closed;           //Set once producer will push no more lines
+    int WakeFD[2];                      //Pipe written by producer to wake consumer
+};
+
+//Stream buffer placed under std::cout, collects output of I/O thread and hands every flushed
+//message to the renderer thread instead of writing to the terminal
+class DisplayBuffer : public std::streambuf{
+public:
+    struct LineQueue* Output;           //Queue read by renderer thread
+    std::string Pending;                //Output not yet flushed
+    struct Trace* Trace;                //Trace handed to renderer with next flush, NULL if none
+protected:
+    int overflow(int);
+    std::streamsize xsputn(const char*, std::streamsize);
+    int sync();
+};
+
+//Console threads, the I/O thread only hands lines to them so a slow terminal never holds up sockets
+struct Display{
+    struct LineQueue Output;            //Lines waiting to be written to terminal, pushed by I/O thread
+    struct LineQueue Input;             //Lines typed on console, pushed by input thread
+    std::atomic<unsigned long> Latency[LATENCY_BUCKETS];   //Lines written by time from being pushed to being on screen
+    DisplayBuffer Buffer;               //Buffer std::cout writes into while display is running
+    std::streambuf* Terminal;           //Buffer std::cout had before, restored once display stops
+    std::thread Renderer;               //Writes output to terminal in batches
+    std::thread Reader;                 //Reads typed lines from console
+    int InputFD;                        //Console, or commands file with -batch
+    FILE* TraceFile;                    //Trace file renderer records traced messages in (-trace), NULL if not tracing
+    bool TraceWritten;                  //Trace file has an event, later events are placed after a comma
+    bool Batch;                         //Set with -batch, std::cout stays on standard error and only events are rendered
+};
+
+//State of client's console input, used since input is read between socket events
+struct ConsoleState{
+    int Mode;                       //What the next inputted line is used for (CONSOLE_ values)
+    struct Display* Display;        //Threads writing and reading console
+    std::deque<struct FileRequest> Requests;    //File requests waiting on answer
+    bool Exiting;                   //Commands file has ended (-batch), chat ends once every transfer is done
+};
+
+//Function Prototypes for file transfer and
+bool FileSend(struct Connection*, int, const char*, struct ClientSettings);    //Function for sending file to server
+bool FileReceive(struct Connection*, const char*);      //Function for requesting file from server
+void CloseTransfers(struct Connection*);                //Function for closing files of every transfer
+void SetupPacing(int, struct Pacing*);                  //Function for setting up link measurements of connection
+void TunePacing(int, struct Pacing*);                   //Function for sizing file chunks and socket buffers from link
+std::string PacingStats(struct Pacing*);                //Function for formatting link measurements
+bool CheckConnection(int, struct ClientSettings, struct MessageProtocol, unsigned int&, struct Local*);   //Function for checking connection to server
+SSL* StartTLS(int, struct ClientSettings);              //Function for making TLS handshake with server
+bool KernelTLS(SSL*);                                   //Function for checking kernel encrypts what is written to connection
+int SocketSend(int, SSL*, const char*, size_t, int);    //Function for writing socket, through TLS if encrypted
+int SocketReceive(int, SSL*, char*, size_t, int);       //Function for reading socket, through TLS if encrypted
+void CloseTLS(SSL*);                                    //Function for ending TLS on connection
+void SetupDatagram(struct Datagram*, unsigned int);     //Function for setting up UDP state
+bool DatagramFrame(const std::string&);                 //Function for checking frame may be sent as datagram
+bool DatagramBusy(struct Datagram*);                    //Function for checking frames are waiting on ACK
+void SendDatagram(int, struct Datagram*, int, unsigned int, const std::string*);   //Function for sending one datagram
+bool QueueDatagram(int, struct Datagram*, const std::string&);  //Function for queueing frame to be sent as datagram
+void FillWindow(int, struct Datagram*);                 //Function for sending queued frames while window has room
+void ReceiveDatagram(int, struct Datagram*, const char*, size_t, bool, std::vector<std::string>&);  //Function for handling datagram received
+int DatagramTimer(int, struct Datagram*);               //Function for sending again datagrams not ACK'd in time
+void DatagramFallback(struct Datagram*, std::vector<std::string>&);    //Function for taking back frames to be sent on TCP
+void ReadDatagrams(struct Connection*, bool, std::vector<std::string>&);   //Function for reading datagrams from server
+void DrainDatagrams(struct Connection*);                //Function for waiting on datagram ACKs before exiting
+std::string DatagramStats(struct Datagram*);            //Function for formatting UDP counters
+void SetupLocal(struct Local*);                         //Function for setting up state of connection on this host
+bool CreateRings(struct Local*);                        //Function for creating shared memory rings
+void UseRings(struct Local*, bool);                     //Function for moving data onto shared memory rings
+int SendHandles(int, struct Local*, const char*, size_t);   //Function for writing socket, passing waiting file descriptors
+int ReadHandles(int, struct Local*, char*, size_t);     //Function for reading socket, keeping passed file descriptors
+int LocalSend(int, struct Local*, const char*, size_t);     //Function for writing to server on this host
+int LocalReceive(int, struct Local*, char*, size_t);    //Function for reading from server on this host
+int TakeHandle(int, struct Local*);                     //Function for taking next passed file descriptor
+long int CopyHandle(int, FILE*, long int);              //Function for copying chunk of passed file
+bool PassedFile(int, long int);                         //Function for checking passed file may be copied
+bool CopyFiles(struct Connection*);                     //Function for copying chunk of every file passed by server
+void CloseLocal(struct Local*);                         //Function for unmapping rings and closing passed file descriptors
+bool ListDirectory(const std::string&, const std::string&, std::vector<struct DirectoryFile>&);    //Function for listing files below directory
+size_t QueueManifest(struct Transfer*, std::deque<std::string>&);   //Function for queueing manifest of directory
+int DirectoryChunk(struct Transfer*, int, bool, std::deque<std::string>&, std::deque<struct Splice>&);   //Function for queueing next chunk of directory
+bool ReadManifest(struct Transfer*, const char*, size_t);           //Function for adding files of manifest to directory
+void WriteDirectory(struct Transfer*, const char*, size_t);         //Function for writing data of directory into its files
+bool ValidEntry(const std::string&);                    //Function for checking path of directory file
+bool BelowFolder(const char*);                          //Function for checking path resolves below working folder
+void MakePath(const std::string&);                      //Function for creating directories of path
+bool CanSplice(SSL*, struct Local*, struct Capture*);   //Function for checking file data may be written with sendfile()
+int SpliceSend(int, SSL*, struct Splice*);              //Function for writing file data of frame from its file
+void CloseSplices(std::deque<struct Splice>&, struct Splice*);  //Function for closing files of frames not yet written
+unsigned long long FileChecksum(const char*, size_t, unsigned long long);  //Function for checksum of file data
+bool SendMessage(struct Connection*, struct ConsoleState&, std::string, struct ClientSettings);  //Function for handling client input
+bool ReceiveMessage(struct Connection*, struct MessageProtocol, struct ConsoleState&, struct ClientSettings); //Function for receiving and displaying message from server
+void ProcessInbox(struct Connection*, struct ConsoleState&, struct ClientSettings);    //Function for splitting received data into frames
+void ProcessFrame(struct Connection*, struct FrameHeader, const char*, struct ConsoleState&, struct ClientSettings);  //Function for handling frame by type
+void ReceiveFileFrame(struct Connection*, struct FrameHeader, const char*);    //Function for handling frames on file channel
+void QueuePacket(struct Connection*, struct MessageProtocol);   //Function for placing packet in send queue
+void QueueFrame(struct Connection*, const std::string&);        //Function for placing frame in send queue
+void QueueRoom(struct Connection*, int, std::string, std::string);  //Function for placing room frame in send queue
+void ReceiveRoomMessage(struct Connection*, struct FrameHeader, const char*);  //Function for displaying room message
+unsigned int RoomSender(const char*);       //Function for reading ID of client that sent room message
+void QueueEvent(struct Connection*, const std::string&, const std::string&);    //Function for writing received message as JSON line
+void FileEvent(struct Connection*, int, const char*, const std::string&);       //Function for writing end of file transfer as JSON line
+std::string JSONText(const std::string&);   //Function for escaping text placed in JSON string
+size_t UTF8Length(const std::string&, size_t);  //Function for finding length of valid UTF-8 character
+void QueueTraced(struct Connection*, const std::string&);   //Function for placing frame in send queue inside trace frame
+void ReceiveTraced(struct Connection*, struct FrameHeader, const char*, struct ConsoleState&, struct ClientSettings);   //Function for handling traced frame
+void QueuePing(struct Connection*);         //Function for placing PING in send queue
+void ReceivePing(struct Connection*, struct FrameHeader, const char*, struct ConsoleState&);  //Function for measuring round trip of PING
+void PutStamp(char*, long long);            //Function for writing time into trace fields
+long long GetStamp(const char*);            //Function for reading time from trace fields
+void WriteTrace(struct Display*, struct Trace*);    //Function for recording stages of traced message in trace file
+void TraceEvent(struct Display*, const char*, const std::string&, const std::string&, int, long long);  //Function for writing trace file event
+int QueueFile(struct Connection*);          //Function for queueing next chunks of file being sent
+void SetupBucket(struct TokenBucket*, double);  //Function for setting up token bucket
+void RefillBucket(struct TokenBucket*, long long);  //Function for adding tokens to bucket
+int BucketWait(struct TokenBucket*);        //Function for finding time until bucket has tokens
+long long MonotonicTime();                  //Function for reading monotonic clock
+void StartDisplay(struct Display*);     //Function for starting console threads
+void StopDisplay(struct Display*);      //Function for writing remaining output and stopping console threads
+void RenderLoop(struct Display*);       //Function run by renderer thread
+void ReadLoop(struct Display*);         //Function run by input thread
+void SetupQueue(struct LineQueue*, size_t);     //Function for setting up line queue
+bool PushLine(struct LineQueue*, std::string&, struct Trace*);  //Function for handing line to other thread
+bool PopLine(struct LineQueue*, struct Line&);  //Function for taking line from other thread
+bool QueueIdle(struct LineQueue*);      //Function for marking consumer as sleeping
+int LatencyBucket(long long);           //Function for finding histogram bucket of latency
+long long LatencyBound(int);            //Function for finding largest latency of bucket
+void PrintLatency(struct Display*);     //Function for displaying display latency
+struct Capture* OpenCapture(const char*, int);  //Function for creating capture file
+void CaptureFrame(struct Capture*, int, int, const char*, size_t);   //Function for recording frame in capture
+double ParseRate(const char*);              //Function for converting rate given on command line
+bool FlushQueue(struct Connection*);        //Function for writing send queue to socket
+std::string CreateFrame(int, int, int, const char*, unsigned int);  //Function for creating frame to be sent
 struct MessageProtocol CreateHeader(int, int, char[]);      //Function for creating header for packet to be sent
-void Exit(int, struct MessageProtocol);     //Function for sending exit signal to Server and ending chat
-void Chat(int);                             //Function for performing chat functions
+void Exit(struct Connection*);              //Function for sending exit signal to Server and ending chat
+void Chat(int, struct ClientSettings);      //Function for performing chat functions
 
 int main(int argc, char *argv[]){
 
     //Initialize the variables to be used
     int BaseSocketFD, PortNum;  //Socket file descriptor for communicating with client and port number being used
     struct sockaddr_in ServerAddress;        //Internet address of server and client
-    const char*ServerIP;
+    const char*ServerIP = "127.0.0.1";      //Server on same machine used if no IP address is given
+    struct ClientSettings Settings;         //Settings used for chat
+    Settings.Accept = ACCEPT_ASK;
+    Settings.FileRate = 0;
+    Settings.TotalRate = 0;
+    Settings.Capture = NULL;
+    Settings.TLSMode = TLS_NONE;
+    Settings.Pin = NULL;
+    Settings.TLS = NULL;
+    Settings.UDP = false;
+    Settings.Local = LOCAL_NONE;
+    Settings.BatchFD = -1;
+    Settings.Trace = NULL;
 
     //Check to see if port number and desired IP address are given, otherwise default is used
     if(argc == 1){
         PortNum = DEFAULT_PORT;     //Use default port number since none is given
     }else{
         /***********************************************************
-            atoi() throws no exception and instead will return 0 if 
-            invalid input or failure in conversion is given, end 
+            atoi() throws no exception and instead will return 0 if
+            invalid input or failure in conversion is given, end
             program if this happens
         ************************************************************/
         PortNum = atoi(argv[1]);    //Converts the first argument into int (inputted port number)
@@ -160,7 +967,88 @@ int main(int argc, char *argv[]){
             std::cerr << "Invalid port number given, program terminated" << std::endl;
             exit(-1);   //End program on invalid entry
         }
-        ServerIP = argv[2];
+        if(argc > 2) ServerIP = argv[2];
+    }
+
+    //Check for options after port number and IP address
+    for(int i = 3; i < argc; i++){
+        std::string Arg = argv[i];
+        if(Arg == "-accept" && i + 1 < argc){
+            std::string Accept = argv[++i];
+            if(Accept == "ASK"){
+                Settings.Accept = ACCEPT_ASK;
+            }else if(Accept == "ALL"){
+                Settings.Accept = ACCEPT_ALL;
+            }else if(Accept == "NONE"){
+                Settings.Accept = ACCEPT_NONE;
+            }else{
+                std::cerr << "Invalid accept policy given (ASK, ALL or NONE), program terminated" << std::endl;
+                exit(-1);
+            }
+        }else if(Arg == "-file-rate" && i + 1 < argc){
+            Settings.FileRate = ParseRate(argv[++i]);
+        }else if(Arg == "-total-rate" && i + 1 < argc){
+            Settings.TotalRate = ParseRate(argv[++i]);
+        }else if(Arg == "-capture" && i + 1 < argc){
+            Settings.Capture = OpenCapture(argv[++i], CAPTURE_CLIENT);
+        }else if(Arg == "-tls" && i + 1 < argc){
+            std::string Mode = argv[++i];
+            if(Mode == "KERNEL"){
+                Settings.TLSMode = TLS_KERNEL;
+            }else if(Mode == "USER"){
+                Settings.TLSMode = TLS_USER;
+            }else{
+                std::cerr << "Invalid TLS mode given (KERNEL or USER), program terminated" << std::endl;
+                exit(-1);
+            }
+        }else if(Arg == "-tls-pin" && i + 1 < argc){
+            Settings.Pin = argv[++i];
+        }else if(Arg == "-udp"){
+            Settings.UDP = true;
+        }else if(Arg == "-local" && i + 1 < argc){
+            std::string Mode = argv[++i];
+            if(Mode == "UNIX"){
+                Settings.Local = LOCAL_UNIX;
+            }else if(Mode == "SHM"){
+                Settings.Local = LOCAL_SHM;
+            }else{
+                std::cerr << "Invalid local transport given (UNIX or SHM), program terminated" << std::endl;
+                exit(-1);
+            }
+        }else if(Arg == "-trace" && i + 1 < argc){
+            Settings.Trace = fopen(argv[++i], "w");
+            if(Settings.Trace == NULL){
+                std::cerr << "Trace file " << argv[i] << " couldn't be created, program terminated" << std::endl;
+                exit(-1);
+            }
+            fputs("[", Settings.Trace);
+        }else if(Arg == "-batch" && i + 1 < argc){
+            std::string Path = argv[++i];
+            Settings.BatchFD = Path == "-" ? 0 : open(Path.c_str(), O_RDONLY);
+            if(Settings.BatchFD < 0){
+                std::cerr << "Commands file " << Path << " couldn't be opened, program terminated" << std::endl;
+                exit(-1);
+            }
+        }else{
+            std::cerr << "Invalid option " << Arg << " given, program terminated" << std::endl;
+            exit(-1);
+        }
+    }
+
+    //Datagrams are not encrypted, encrypted chat must stay on TCP
+    if(Settings.UDP && Settings.TLSMode != TLS_NONE){
+        std::cerr << "-udp can't be used with -tls, chat datagrams are not encrypted, program terminated" << std::endl;
+        exit(-1);
+    }
+    if(Settings.Local != LOCAL_NONE && (Settings.TLSMode != TLS_NONE || Settings.UDP)){
+        std::cerr << "-local can't be used with -tls or -udp, program terminated" << std::endl;
+        exit(-1);
+    }
+
+    //Nobody is there to answer prompts of a commands file, standard output only carries received messages
+    if(Settings.BatchFD >= 0){
+        if(Settings.Accept == ACCEPT_ASK) Settings.Accept = ACCEPT_NONE;
+        std::cout.rdbuf(std::cerr.rdbuf());
     }
 
     //If on windows OS
@@ -174,24 +1062,69 @@ int main(int argc, char *argv[]){
     ServerAddress.sin_addr.s_addr = inet_addr(ServerIP);     //Avoids binding socket to specific IP address
     ServerAddress.sin_port = htons(PortNum);    //Port number to be used, given by user or the default value
 
-    //Create the socket to communicate with the client
-    BaseSocketFD = socket(AF_INET, SOCK_STREAM, 0);     //Creates socket for IPv4, TCP, and default protocol
-    if(BaseSocketFD < 0){
-        std::cerr << "Socket creation for client failed, program terminated" << std::endl;  //Check if socket is properly created
-        exit(0);
+    //Server on this host is connected to through its Unix domain socket, named by port number
+    if(Settings.Local != LOCAL_NONE){
+        struct sockaddr_un LocalAddress;
+        memset(&LocalAddress, '\0', sizeof(LocalAddress));
+        LocalAddress.sun_family = AF_UNIX;
+        snprintf(LocalAddress.sun_path, sizeof(LocalAddress.sun_path), LOCAL_PATH, PortNum);
+        BaseSocketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(BaseSocketFD < 0){
+            std::cerr << "Socket creation for client failed, program terminated" << std::endl;
+            exit(0);
+        }
+        if(connect(BaseSocketFD, (sockaddr*)&LocalAddress, sizeof(LocalAddress)) < 0){
+            std::cout << "Connection to Server at " << LocalAddress.sun_path << " couldn't be made (server started with -local?), program terminated" << std::endl;
+            exit(-2);
+        }
+    }else{
+        //Create the socket to communicate with the client
+        BaseSocketFD = socket(AF_INET, SOCK_STREAM, 0);     //Creates socket for IPv4, TCP, and default protocol
+        if(BaseSocketFD < 0){
+            std::cerr << "Socket creation for client failed, program terminated" << std::endl;  //Check if socket is properly created
+            exit(0);
+        }
+
+        //Connect socket to Server socket
+        if(connect(BaseSocketFD, (sockaddr*)&ServerAddress, sizeof(ServerAddress)) < 0){
+            std::cout << "Connection to Server couldn't be made, program terminated" << std::endl;
+            exit(-2);
+        }
+
+        //Send chat frames right away and keep little file data waiting in socket buffer ahead of them
+        int Option = 1;
+        setsockopt(BaseSocketFD, IPPROTO_TCP, TCP_NODELAY, (char *)&Option, sizeof(Option));
+        #ifdef TCP_NOTSENT_LOWAT
+            Option = UNSENT_LIMIT;
+            setsockopt(BaseSocketFD, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (char *)&Option, sizeof(Option));
+        #endif
     }
 
-    //Connect socket to Server socket
-    if(connect(BaseSocketFD, (sockaddr*)&ServerAddress, sizeof(ServerAddress)) < 0){
-        std::cout << "Connection to Server couldn't be made, program terminated" << std::endl;
-        exit(-2);
+    //Encrypted connection starts with TLS handshake, connection request is made through it
+    if(Settings.TLSMode != TLS_NONE){
+        Settings.TLS = StartTLS(BaseSocketFD, Settings);
+        if(Settings.TLS == NULL){
+            std::cout << "TLS connection to Server couldn't be made, program terminated" << std::endl;
+            exit(-2);
+        }
+        //OpenSSL writes socket without MSG_NOSIGNAL, server leaving must not end client
+        #ifndef _WIN32
+            signal(SIGPIPE, SIG_IGN);
+        #endif
     }
 
     //Display basic info and set format of chat
-    std::cout << "\nChat is in session (EXIT to exit chat, FILE to request sending a file)" << std::endl;
+    std::cout << "\nChat is in session (EXIT to exit chat, FILE to request sending a file," << std::endl;
+    std::cout << "JOIN/LEAVE room to join/leave a room, @room message to send to a room, STATS to display latency," << std::endl;
+    std::cout << "PING to measure round trip to server)" << std::endl;
 
     //Once connection is made, enter endless loop until Client or Server choose to exit
-    Chat(BaseSocketFD);
+    Chat(BaseSocketFD, Settings);
+    if(Settings.Capture != NULL) fclose(Settings.Capture->File);
+    if(Settings.Trace != NULL){
+        fputs("\n]\n", Settings.Trace);
+        fclose(Settings.Trace);
+    }
 
     //If on windows OS
     #ifdef _WIN32
@@ -199,7 +1132,7 @@ int main(int argc, char *argv[]){
     #endif
 
     //Chat has been ended, close all sockets
-    int status; 
+    int status;
     #ifdef _WIN32
         status = shutdown(BaseSocketFD, SD_BOTH);
         if (status == 0) { status = closesocket(BaseSocketFD); }
@@ -209,72 +1142,302 @@ int main(int argc, char *argv[]){
     #endif
 }
 
-void Chat(int NewSocketFD){
+void Chat(int NewSocketFD, struct ClientSettings Settings){
     struct MessageProtocol Packet;      //Create header packet to be used for sending data
-    bool connected, End[1] = {false};
+    bool connected;
+    unsigned int Token = 0;             //UDP token given by server, 0 if it did not offer UDP
+
+    //Shared memory rings for server on this host are passed with connection request
+    struct Local* Local = NULL;
+    if(Settings.Local != LOCAL_NONE){
+        Local = new struct Local();
+        SetupLocal(Local);
+        if(Settings.Local == LOCAL_SHM && !CreateRings(Local)){
+            std::cout << "Shared memory rings could not be created, chat is sent on Unix domain socket" << std::endl;
+        }
+    }
 
     //Check connection with client first
     do{
-        connected = CheckConnection(NewSocketFD, Packet);
+        connected = CheckConnection(NewSocketFD, Settings, Packet, Token, Local);
         //If connection is unsuccessful, end program
         if(!connected)std::cout << "Connection could not be established, trying again" << std::endl;
     }while(!connected);
 
-    //Send intial message to begin
-    if(!SendMessage(NewSocketFD, Packet, End)){
-        return; //End program
+    //Socket never blocks once connected so messages can be sent and received at the same time
+    #ifdef _WIN32
+        u_long Mode = 1;
+        ioctlsocket(NewSocketFD, FIONBIO, &Mode);
+    #else
+        fcntl(NewSocketFD, F_SETFL, fcntl(NewSocketFD, F_GETFL, 0) | O_NONBLOCK);
+    #endif
+
+    struct Connection Server;           //State of connection to server
+    Server.SocketFD = NewSocketFD;
+    Server.Closed = false;
+    Server.Offset = 0;
+    Server.Splicing.Length = 0;
+    Server.QueuedBytes = 0;
+    Server.NextTransfer = 0;
+    SetupBucket(&Server.Bucket, Settings.TotalRate);
+    SetupPacing(NewSocketFD, &Server.Pace);
+    Server.Capture = Settings.Capture;
+    Server.TLS = Settings.TLS;
+    Server.DatagramFD = -1;
+    Server.UDP = NULL;
+    Server.Local = Local;
+    Server.Tracing = Settings.Trace != NULL;
+    Server.NextTrace = 0;
+    Server.ClockOffset = 0;
+    Server.Pending = NULL;
+    if(Token != 0){
+        //Server takes chat as datagrams on the address and port number of the connection, hello tells it
+        //the client's address
+        Server.DatagramFD = socket(AF_INET, SOCK_DGRAM, 0);
+        if(Server.DatagramFD >= 0){
+            #ifdef _WIN32
+                ioctlsocket(Server.DatagramFD, FIONBIO, &Mode);
+            #else
+                fcntl(Server.DatagramFD, F_SETFL, fcntl(Server.DatagramFD, F_GETFL, 0) | O_NONBLOCK);
+            #endif
+            Server.UDP = new struct Datagram();
+            SetupDatagram(Server.UDP, Token);
+            socklen_t AddressSize = sizeof(Server.UDP->Address);
+            getpeername(NewSocketFD, (struct sockaddr *)&Server.UDP->Address, &AddressSize);
+            Server.UDP->Known = true;
+            Server.UDP->Hello = 1;      //First hello is due right away
+        }
+    }else if(Settings.UDP){
+        std::cout << "Server did not offer UDP, chat is sent on TCP" << std::endl;
     }
-        
+    struct ConsoleState Console;        //Client console input state
+    Console.Mode = CONSOLE_CHAT;
+    Console.Exiting = false;
+    Console.Display = new struct Display();     //Not deleted, input thread may still be reading console when program ends
+    Console.Display->Batch = Settings.BatchFD >= 0;
+    Console.Display->InputFD = Console.Display->Batch ? Settings.BatchFD : 0;
+    Console.Display->TraceFile = Settings.Trace;
+    StartDisplay(Console.Display);
+    Server.Events = Console.Display->Batch ? &Console.Display->Output : NULL;
+    //Clock of server on another host is measured before traced messages are compared with its times
+    if(Server.Tracing) QueuePing(&Server);
+    bool Waiting = false;               //Input lines were left waiting while much was queued for server
+    bool Running = true;
+    int Timeout = -1;                   //Time until a rate limited transfer can continue (ms), -1 if none are waiting
+
     //Enter endless loop for sending and receiving messages
-    while(true){
-        //Wait for response or request
-        if(ReceiveMessage(NewSocketFD, Packet, End)){
-            //Check if server has exited the chat
-            if(End[0]){
-                break; //End program
+    while(Running && !Server.Closed){
+        //Watch console, server, UDP socket and eventfd of rings
+        struct pollfd Watch[4];
+        bool Rings = Server.Local != NULL && Server.Local->Out != NULL;
+        Watch[0].fd = Console.Display->Input.WakeFD[0];     //Lines typed on client console
+        Watch[0].events = POLLIN;
+        Watch[1].fd = NewSocketFD;      //Server
+        Watch[1].events = POLLIN;
+        //Only wait on socket accepting data if data is queued, with rings socket only takes file descriptors
+        //and eventfd tells once ring has room
+        if(Server.QueuedBytes > 0 && (!Rings || !Server.Local->Outgoing.empty())){
+            Watch[1].events |= POLLOUT;
+        }
+        Watch[2].fd = Server.DatagramFD;    //Chat datagrams, ignored by poll() if server did not offer UDP
+        Watch[2].events = POLLIN;
+        Watch[3].fd = Rings ? Server.Local->WakeFD : -1;    //Ring has data or room, ignored by poll() without rings
+        Watch[3].events = POLLIN;
+        if(poll(Watch, 4, Timeout) < 0){
+            if(errno == EINTR) continue;
+            std::cerr << "Polling socket failed, program terminated" << std::endl;
+            break;
+        }
+
+        //Receive everything server has sent so far, server on this host may also pass file descriptors
+        if((Watch[1].revents & (POLLIN | POLLHUP | POLLERR)) || (Watch[3].revents & POLLIN)){
+            char Buffer[MAX_SIZE];      //Will hold data received from server
+            int bytes;
+            while((bytes = Server.Local != NULL ? LocalReceive(NewSocketFD, Server.Local, Buffer, sizeof(Buffer))
+                                                : SocketReceive(NewSocketFD, Server.TLS, Buffer, sizeof(Buffer), 0)) > 0){
+                Server.Inbox.append(Buffer, bytes);
+            }
+            int Error = errno;  //Files written while processing frames may set errno
+            ProcessInbox(&Server, Console, Settings);
+            //Receive buffer follows link while files are received
+            if(!Server.Receives.empty() && Server.Local == NULL) TunePacing(NewSocketFD, &Server.Pace);
+            if(bytes == 0 || (bytes < 0 && Error != EAGAIN && Error != EWOULDBLOCK)){
+                //Server closed connection without exit message
+                if(!Server.Closed){
+                    std::cout << "Server has disconnected..." << std::endl;
+                }
+                Server.Closed = true;
+            }
+        }
+
+        //Chat frames received as datagrams are handled like frames read from socket
+        if(Watch[2].revents & POLLIN){
+            std::vector<std::string> Frames;
+            ReadDatagrams(&Server, true, Frames);
+            for(size_t i = 0; i < Frames.size() && !Server.Closed; i++){
+                struct FrameHeader Header;
+                memcpy(&Header, Frames[i].data(), sizeof(Header));
+                Header.Channel = ntohs(Header.Channel);
+                Header.Length = ntohl(Header.Length);
+                CaptureFrame(Server.Capture, CAPTURE_RECEIVED, 0, Frames[i].data(), Frames[i].size());
+                ProcessFrame(&Server, Header, Frames[i].data() + sizeof(Header), Console, Settings);
+            }
+        }
+
+        //Handle lines typed on client console (or read from commands file), handed over by input thread, lines are
+        //only taken while little is queued for server so a fast commands file waits in its queue instead of memory
+        if((Watch[0].revents & POLLIN) || Waiting){
+            char Wake[64];
+            while(read(Watch[0].fd, Wake, sizeof(Wake)) > 0);
+            struct Line Input;
+            Waiting = false;
+            while(Running && !Console.Exiting){
+                if(Server.QueuedBytes >= INPUT_BACKLOG){
+                    Waiting = true;
+                    break;
+                }
+                if(PopLine(&Console.Display->Input, Input)){
+                    Running = SendMessage(&Server, Console, Input.Text, Settings);
+                }else if(QueueIdle(&Console.Display->Input)){
+                    break;
+                }
+            }
+        }
+
+        //Send again datagrams not ACK'd in time, chat moves back to TCP once server stopped answering
+        Timeout = -1;
+        if(Server.UDP != NULL){
+            int Wait = DatagramTimer(Server.DatagramFD, Server.UDP);
+            if(Server.UDP->Failed && DatagramBusy(Server.UDP)){
+                std::vector<std::string> Frames;
+                DatagramFallback(Server.UDP, Frames);
+                for(size_t i = 0; i < Frames.size(); i++){
+                    QueueFrame(&Server, Frames[i]);
+                }
+                std::cout << "Server stopped answering datagrams, chat moved to TCP" << std::endl;
+            }
+            Timeout = Wait;
+        }
+
+        //Files passed by server are copied a chunk at a time, check again right away while any are left
+        if(CopyFiles(&Server)) Timeout = 0;
+
+        //Send as much as server socket accepts, refilling file data while socket takes everything queued
+        //and transfers have tokens
+        while(!Server.Closed){
+            int Wait = QueueFile(&Server);
+            if(!FlushQueue(&Server)){
+                Server.Closed = true;
             }
-            //Send response to Server message/file. If false, Client has exited
-            if(!SendMessage(NewSocketFD, Packet, End)){
-                break; //End program
+            if(Wait >= 0){
+                //Wake up once rate limited transfers can continue
+                if(Timeout < 0 || Wait < Timeout) Timeout = Wait;
+                break;
             }
+            if(Server.QueuedBytes > 0 || Server.Sends.empty()) break;
+        }
+
+        //Take waiting input lines again right away once socket has taken enough
+        if(Waiting && Server.QueuedBytes < INPUT_BACKLOG) Timeout = 0;
+
+        //Commands file has ended, exit once files requested by it (or by server) are done
+        if(Console.Exiting && Server.Sends.empty() && Server.Receives.empty() && !Server.Closed){
+            Exit(&Server);
+            Running = false;
         }
     }
+
+    //Try to deliver exit message before closing, after chat sent as datagrams has been ACK'd, file transfers are abandoned
+    if(!Server.Closed){
+        DrainDatagrams(&Server);
+        Server.FileQueue.clear();
+        #ifndef _WIN32
+            fcntl(NewSocketFD, F_SETFL, fcntl(NewSocketFD, F_GETFL, 0) & ~O_NONBLOCK);
+        #endif
+        FlushQueue(&Server);
+    }
+    CloseSplices(Server.Splices, &Server.Splicing);
+    CloseTransfers(&Server);
+    CloseTLS(Server.TLS);
+    if(Server.Local != NULL){
+        CloseLocal(Server.Local);
+        delete Server.Local;
+    }
+    if(Server.DatagramFD >= 0){
+        #ifdef _WIN32
+            closesocket(Server.DatagramFD);
+        #else
+            close(Server.DatagramFD);
+        #endif
+    }
+    delete Server.UDP;
+    StopDisplay(Console.Display);
 }
 
 struct MessageProtocol CreateHeader(int Type, int Flags, char Message[]){
     //Create temp header to be loaded with info and sent to Server
     struct MessageProtocol Packet;
-    Packet.Type = Type;                         //Set Type depending on Client's request 
+    Packet.Type = Type;                         //Set Type depending on Client's request
     Packet.Flags = Flags;                       //Set flag based on Client's request
     strcpy(Packet.Message, Message);            //Set Checksum for message being sent
     Packet.Length = strlen(Packet.Message);     //Attach message being sent
+    Packet.Channel = CHAT_CHANNEL;              //Messages are sent on chat channel
     //Return packet to be sent to Server
     return Packet;
 }
 
-bool CheckConnection(int NewSocketFD, struct MessageProtocol Packet){
-    //Send server connection request and receive response with appropriate flag and type
-    Packet = CreateHeader(0,7," ");
-    #ifdef _WIN32
-        send(NewSocketFD, (char*)&Packet, sizeof(Packet), 0);
-        //Wait for Server to send back ACK
-        recv(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-    #else
-        send(NewSocketFD, &Packet, sizeof(Packet), 0);
-        //Wait for Server to send back ACK
-        recv(NewSocketFD, &Packet, sizeof(Packet), 0);
-    #endif
+std::string CreateFrame(int Type, int Flags, int Channel, const char* Data, unsigned int Length){
+    //Place header in front of data, multi-byte fields in network byte order
+    struct FrameHeader Header;
+    Header.Type = Type;
+    Header.Flags = Flags;
+    Header.Channel = htons(Channel);
+    Header.Length = htonl(Length);
+    std::string Frame((char *)&Header, sizeof(Header));
+    if(Length > 0) Frame.append(Data, Length);
+    return Frame;
+}
+
+bool CheckConnection(int NewSocketFD, struct ClientSettings Settings, struct MessageProtocol Packet, unsigned int& Token, struct Local* Local){
+    //Send server connection request and receive response with appropriate flag and type, asking for UDP if wanted,
+    //or passing shared memory rings to server on this host
+    SSL* TLS = Settings.TLS;
+    bool Rings = Local != NULL && Local->Memory != NULL;
+    Packet = CreateHeader(0,7,(char *)(Settings.UDP ? "UDP" : Rings ? "SHM" : " "));
+    std::string Frame = CreateFrame(Packet.Type, Packet.Flags, CHAT_CHANNEL, Packet.Message, Packet.Length);
+    struct FrameHeader Header;
+    if(Local != NULL){
+        LocalSend(NewSocketFD, Local, Frame.data(), Frame.size());
+    }else{
+        SocketSend(NewSocketFD, TLS, Frame.data(), Frame.size(), 0);
+    }
+    //Wait for Server to send back ACK
+    if(SocketReceive(NewSocketFD, TLS, (char *)&Header, sizeof(Header), MSG_WAITALL) != sizeof(Header)) return false;
+    Header.Length = ntohl(Header.Length);
+    if(Header.Length > MAX_FRAME) return false;
+
+    //Data of ACK only matters if UDP was asked for, server gives token if it takes UDP
+    std::string Data(Header.Length, '\0');
+    if(Header.Length > 0 && SocketReceive(NewSocketFD, TLS, &Data[0], Header.Length, MSG_WAITALL) != (int)Header.Length) return false;
+    Token = 0;
+    if(Settings.UDP && sscanf(Data.c_str(), "UDP %u", &Token) != 1) Token = 0;
 
     //Check Flag
-    if(Packet.Flags == 6){
+    if(Header.Flags == 6){
         //Send ACK of connection request and then wait for ACK ACK from client
-        Packet.Flags = 4;   //ACK connection request
-        
-        #ifdef _WIN32
-            send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-        #else
-            send(NewSocketFD, &Packet, sizeof(Packet), 0);
-        #endif
+        Packet = CreateHeader(0,4,(char *)" ");     //ACK connection request
+        Frame = CreateFrame(Packet.Type, Packet.Flags, CHAT_CHANNEL, Packet.Message, Packet.Length);
+        SocketSend(NewSocketFD, TLS, Frame.data(), Frame.size(), 0);
+
+        //Everything after ACK ACK is sent through rings if server took them
+        if(Rings && Data.compare(0, 3, "SHM") == 0){
+            UseRings(Local, true);
+            std::cout << "Connected on this host through shared memory" << std::endl;
+        }else if(Rings){
+            std::cout << "Server did not take shared memory, chat is sent on Unix domain socket" << std::endl;
+            CloseLocal(Local);
+            SetupLocal(Local);
+        }
 
         return true;    //Successfully connected to server
     }else{
@@ -282,251 +1445,2223 @@ bool CheckConnection(int NewSocketFD, struct MessageProtocol Packet){
     }
 }
 
-bool FileSend(int NewSocketFD, struct MessageProtocol Packet, bool End[]){
-    //Server is requesting file, select whether to send or not
-    std::string input = "";
-    std::cout << "Server is requesting " << Packet.Message << ". Send (Y/N) : " << std::endl;
-    //Loop until valid input is given
-    getline(std::cin, input);
-    while(input != "Y" && input != "N"){
-        std::cout << "Invalid input, try again : " << std::endl;
-        getline(std::cin, input);
+void ProcessInbox(struct Connection* Server, struct ConsoleState& Console, struct ClientSettings Settings){
+    size_t Used = 0;    //Bytes of inbox already processed
+    //Keep processing until a whole frame has not been received
+    while(!Server->Closed && Server->Inbox.size() - Used >= sizeof(struct FrameHeader)){
+        struct FrameHeader Header;
+        memcpy(&Header, Server->Inbox.data() + Used, sizeof(Header));
+        Header.Channel = ntohs(Header.Channel);
+        Header.Length = ntohl(Header.Length);
+
+        //Frame is larger than any valid frame, rest of data can't be trusted
+        if(Header.Length > MAX_FRAME){
+            std::cout << "Server sent a corrupted frame, chat ended..." << std::endl;
+            Server->Closed = true;
+            break;
+        }
+        if(Server->Inbox.size() - Used < sizeof(Header) + Header.Length) break;
+        const char* Data = Server->Inbox.data() + Used + sizeof(Header);
+        CaptureFrame(Server->Capture, CAPTURE_RECEIVED, 0, Server->Inbox.data() + Used, sizeof(Header) + Header.Length);
+        Used += sizeof(Header) + Header.Length;
+        ProcessFrame(Server, Header, Data, Console, Settings);
     }
+    Server->Inbox.erase(0, Used);
+}
 
-    //Either send rejection signal or ACK signal
-    if(input == "N"){
-        //Send file transfer rejection packet adn wait for response back from server
-        Packet = CreateHeader(3,1,strcpy(Packet.Message, "Reject File Request"));
-        #ifdef _WIN32
-            send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-        #else
-            send(NewSocketFD, &Packet, sizeof(Packet), 0);
-        #endif
-        return true;
+void ProcessFrame(struct Connection* Server, struct FrameHeader Header, const char* Data, struct ConsoleState& Console, struct ClientSettings Settings){
+    if(Header.Type <= 3){
+        //Rebuild packet from frame, channel is transfer ID for file request/ACK/ignored
+        struct MessageProtocol Packet;
+        size_t Length = Header.Length < MAX_LENGTH ? Header.Length : MAX_LENGTH - 1;
+        Packet.Type = Header.Type;
+        Packet.Flags = Header.Flags;
+        Packet.Channel = Header.Channel;
+        Packet.Length = Header.Length;
+        memcpy(Packet.Message, Data, Length);
+        Packet.Message[Length] = '\0';
+        ReceiveMessage(Server, Packet, Console, Settings);
+    }else if(Header.Type <= 6 || Header.Type == 10 || Header.Type == 11){
+        ReceiveFileFrame(Server, Header, Data);
+    }else if(Header.Type == 9){
+        ReceiveRoomMessage(Server, Header, Data);
+    }else if(Header.Type == 12){
+        ReceiveTraced(Server, Header, Data, Console, Settings);
+    }else if(Header.Type == 13){
+        ReceivePing(Server, Header, Data, Console);
     }else{
-        //Send file ACK to server and begin preparing transfer
-        Packet = CreateHeader(2,1,strcpy(Packet.Message, "Accepted File Request"));
-        #ifdef _WIN32
-            send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-        #else
-            send(NewSocketFD, &Packet, sizeof(Packet), 0);
-        #endif
+        //Invalid type provided, ask for request to be sent again
+        QueuePacket(Server, CreateHeader(0,1,(char *)"Error, last request corrupted. Please try again"));
     }
+}
 
-    //Open desired file to be sent and calculate file size to send to Server
-    std::string filename;
-    std::cout << "Enter filename (include path if in different folder) : " << std::endl;
-    getline(std::cin, filename);
-    const char* Filename = filename.c_str();
-    
-    /*
-        IF INPUTTED FILE IS WRONG OR EMPTY, EMPTY FILE WILL BE TRANSFERRED TO SERVER
-        AND FILE REQUEST WILL BE NEEDED AGAIN
-    */
+void ReceiveRoomMessage(struct Connection* Server, struct FrameHeader Header, const char* Data){
+    //ID of client that sent message leads the data, then room name up to first null byte, rest is message
+    if(Header.Length < sizeof(unsigned int)) return;
+    unsigned int From = RoomSender(Data);
+    Data += sizeof(unsigned int);
+    Header.Length -= sizeof(unsigned int);
+    size_t End = 0;
+    while(End < Header.Length && Data[End] != '\0') End++;
+    std::string Name(Data, End);
+    std::string Message(Data + End + (End < Header.Length ? 1 : 0), Data + Header.Length);
+    if(Server->Events != NULL){
+        QueueEvent(Server, "\"type\":\"room\",\"from\":" + std::to_string(From) + ",\"room\":\"" + JSONText(Name) + "\"", Message);
+        return;
+    }
+    if(From == 0){
+        std::cout<<"- - SERVER @ "<<Name<<" - -"<<std::endl;
+    }else{
+        std::cout<<"- - CLIENT "<<From<<" @ "<<Name<<" - -"<<std::endl;
+    }
+    std::cout<<Message<<std::endl<<std::endl;
+}
 
-    //open file in binary to allow transfer of any file type
-    FILE* File = fopen(Filename, "rb"); 
+unsigned int RoomSender(const char* Data){
+    //Data of a room frame from the server is not aligned in the inbox
+    unsigned int From;
+    memcpy(&From, Data, sizeof(From));
+    return ntohl(From);
+}
 
-    //Send size of file to client for knowing when to stop
-    fseek(File, 0L, SEEK_END);
-    long int Size = ftell(File);
-    #ifdef _WIN32
-        send(NewSocketFD, (char *)&Size, sizeof(Size), 0);
-    #else
-        send(NewSocketFD, &Size, sizeof(Size), 0);
-    #endif
-    fclose(File);   //Close file to reset pointer to begining
+void QueueEvent(struct Connection* Server, const std::string& Fields, const std::string& Text){
+    //One JSON object per line, handed straight to renderer which writes it to standard output
+    std::string Line = "{" + Fields + ",\"text\":\"" + JSONText(Text) + "\"}\n";
+    while(!PushLine(Server->Events, Line, Server->Pending)) std::this_thread::yield();
+    Server->Pending = NULL;
+}
 
-    fopen(Filename, "rb");
-    int bytes, total = 0;   //Track total bytes written and total bytes received at a time to send full file completely
-    char Buffer[MAX_SIZE];  //Will hold data from file to be placed in socket and transfered
-    //Loop till all bytes are read from file
-    while(true){
-        bytes = fread(Buffer, 1, MAX_SIZE, File);
-        total += bytes;
-        if(bytes > 0){
-            //Send buffer if data is contained inside
-            send(NewSocketFD, Buffer, bytes, 0);
+void FileEvent(struct Connection* Server, int ID, const char* Status, const std::string& Name){
+    //Scripts learn when a requested file can be used (or was not sent), human readable line still goes to standard error
+    if(Server->Events == NULL) return;
+    QueueEvent(Server, "\"type\":\"file\",\"id\":" + std::to_string(ID) + ",\"status\":\"" + Status + "\"", Name);
+}
+
+std::string JSONText(const std::string& Text){
+    //Quotes, backslashes and control characters (DEL too) are escaped, valid UTF-8 is copied as it is and every
+    //byte that doesn't start one becomes U+FFFD, so a malformed message can't break the JSON line
+    std::string Escaped;
+    Escaped.reserve(Text.size() + 8);
+    for(size_t i = 0; i < Text.size(); i++){
+        unsigned char Char = Text[i];
+        if(Char == '"' || Char == '\\'){
+            Escaped += '\\';
+            Escaped += Char;
+        }else if(Char == '\n'){
+            Escaped += "\\n";
+        }else if(Char == '\t'){
+            Escaped += "\\t";
+        }else if(Char < 0x20 || Char == 0x7f){
+            char Code[8];
+            snprintf(Code, sizeof(Code), "\\u%04x", Char);
+            Escaped += Code;
+        }else if(Char < 0x80){
+            Escaped += Char;
         }else{
-            //End loop if complete file has been sent
-            if(total >= Size){
-                break;
+            size_t Length = UTF8Length(Text, i);
+            if(Length == 0){
+                Escaped += "\\ufffd";
+            }else{
+                Escaped.append(Text, i, Length);
+                i += Length - 1;
             }
         }
-        //Clear buffer after each send to allow more data to be placed in
-        #ifdef _WIN32
-            memset(Buffer, '\0', MAX_SIZE);
-        #else
-            bzero(Buffer, MAX_SIZE);
-        #endif
     }
-    
-    //Close output file
-    fclose(File);
-    std::cout<<"File Transfer complete! Server is replying"<<std::endl<<std::endl;
-    return false;
+    return Escaped;
 }
 
-bool FileReceive(int NewSocketFD, struct MessageProtocol Packet, bool End[]){
-    //Send a request for desired file from Server
-    std::string filename;
-    std::cout << "Enter filename (include path if in different folder) : " << std::endl;
-    getline(std::cin, filename);
-    const char* Filename = filename.c_str();
-
-    //Send filename to client, requesting transfer
-    Packet = CreateHeader(1,1,strcpy(Packet.Message, Filename));
-    #ifdef _WIN32
-        send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-    #else
-        send(NewSocketFD, &Packet, sizeof(Packet), 0);
-    #endif
-    
-    //Check response from client concerning file transfer
-    if(ReceiveMessage(NewSocketFD, Packet, End)){
-        long int FileSize;  //Store filesize to track if all data is received
-        FILE *File;
-        char Buffer[MAX_SIZE];  //Buffer for placing data into to allow file insertion
-
-        //Receive file size
-        #ifdef _WIN32
-            recv(NewSocketFD, (char *)&FileSize, sizeof(FileSize), 0);
-        #else
-            recv(NewSocketFD, &FileSize, sizeof(FileSize), 0);
-        #endif 
-
-        File = fopen(Filename, "wb");   //Open output file as binary as data is given as binary
-        int bytes;  //Track bytes receive for knowing when file is complete
-        while((bytes = recv(NewSocketFD, Buffer, sizeof(Buffer), 0)) > 0){
-            fwrite(&Buffer, 1, bytes, File);    //Wrtie data into file
-            fflush(File);
-            //Check if file is complete
-            if(ftell(File) < FileSize){    
-                break;
-                return true;
-            }
-            //Clear buffer before inputting additional data
-            #ifdef _WIN32
-                memset(Buffer, '\0', MAX_SIZE);
-            #else
-                bzero(Buffer, MAX_SIZE);
-            #endif
-        }
-        //Close file and signal to client of its completion
-        fclose(File);
-        std::cout<<"File Transfer complete! Server waiting on reply"<<std::endl<<std::endl;
+size_t UTF8Length(const std::string& Text, size_t Start){
+    //Lead byte gives length and lowest code point allowed (no overlong forms), surrogates and code points past
+    //U+10FFFF are not characters
+    unsigned char Lead = Text[Start];
+    size_t Length;
+    unsigned int Point;
+    if(Lead >= 0xC2 && Lead <= 0xDF){
+        Length = 2;
+        Point = Lead & 0x1F;
+    }else if(Lead >= 0xE0 && Lead <= 0xEF){
+        Length = 3;
+        Point = Lead & 0x0F;
+    }else if(Lead >= 0xF0 && Lead <= 0xF4){
+        Length = 4;
+        Point = Lead & 0x07;
+    }else{
+        return 0;
+    }
+    if(Text.size() - Start < Length) return 0;
+    for(size_t i = 1; i < Length; i++){
+        unsigned char Next = Text[Start + i];
+        if((Next & 0xC0) != 0x80) return 0;
+        Point = (Point << 6) | (Next & 0x3F);
+    }
+    if((Length == 3 && Point < 0x800) || (Length == 4 && Point < 0x10000) || Point > 0x10FFFF) return 0;
+    if(Point >= 0xD800 && Point <= 0xDFFF) return 0;
+    return Length;
+}
+
+void QueueTraced(struct Connection* Server, const std::string& Frame){
+    //Trace fields go in front of the whole frame, time it was sent is given on server's clock so every stage
+    //can be compared, server fills in its own times
+    std::string Data(TRACE_SIZE, '\0');
+    PutStamp(&Data[0], ++Server->NextTrace);
+    PutStamp(&Data[8], MonotonicTime() + Server->ClockOffset);
+    Data += Frame;
+    QueueFrame(Server, CreateFrame(12, 1, CHAT_CHANNEL, Data.data(), Data.size()));
+}
+
+void ReceiveTraced(struct Connection* Server, struct FrameHeader Header, const char* Data, struct ConsoleState& Console, struct ClientSettings Settings){
+    //Traced frame holds trace fields and then a whole chat frame, which is handled as if it came alone
+    struct FrameHeader Inner;
+    if(Header.Length < TRACE_SIZE + sizeof(Inner)) return;
+    memcpy(&Inner, Data + TRACE_SIZE, sizeof(Inner));
+    Inner.Channel = ntohs(Inner.Channel);
+    Inner.Length = ntohl(Inner.Length);
+    if(Inner.Length != Header.Length - TRACE_SIZE - sizeof(Inner) || (Inner.Type != 0 && Inner.Type != 9)) return;
+    if(Console.Display->TraceFile == NULL){
+        ProcessFrame(Server, Inner, Data + TRACE_SIZE + sizeof(Inner), Console, Settings);
+        return;
+    }
+
+    //Times of other stages are on server's clock, trace rides with the message's output to the renderer
+    struct Trace* Trace = new struct Trace();
+    Trace->ID = GetStamp(Data);
+    Trace->From = Inner.Type == 9 && Inner.Length >= sizeof(unsigned int) ? RoomSender(Data + TRACE_SIZE + sizeof(Inner)) : 0;
+    Trace->Sent = GetStamp(Data + 8) - Server->ClockOffset;
+    Trace->ServerReceived = GetStamp(Data + 16) - Server->ClockOffset;
+    Trace->ServerForwarded = GetStamp(Data + 24) - Server->ClockOffset;
+    Trace->Received = MonotonicTime();
+    if(Server->Events != NULL){
+        Server->Pending = Trace;
+    }else{
+        Console.Display->Buffer.Trace = Trace;
+    }
+    ProcessFrame(Server, Inner, Data + TRACE_SIZE + sizeof(Inner), Console, Settings);
+
+    //Frame that was not displayed leaves its trace behind
+    if(Server->Pending == Trace || Console.Display->Buffer.Trace == Trace){
+        Server->Pending = NULL;
+        Console.Display->Buffer.Trace = NULL;
+        delete Trace;
+    }
+}
+
+void QueuePing(struct Connection* Server){
+    //Server answers right away with the times it read and answered it
+    char Data[8];
+    PutStamp(Data, MonotonicTime());
+    QueueFrame(Server, CreateFrame(13, 1, CHAT_CHANNEL, Data, sizeof(Data)));
+}
+
+void ReceivePing(struct Connection* Server, struct FrameHeader Header, const char* Data, struct ConsoleState& Console){
+    //Answer holds time PING was sent, then times server read and answered it on server's clock
+    if(Header.Length != 24) return;
+    long long Now = MonotonicTime();
+    long long Sent = GetStamp(Data), Read = GetStamp(Data + 8), Answered = GetStamp(Data + 16);
+    long long Held = Answered - Read;
+    long long RoundTrip = Now - Sent - Held;
+    //Server's clock is taken to be halfway through each direction of the round trip, an offset within half the
+    //round trip can't be told apart from both clocks agreeing (same host) and is taken as none
+    Server->ClockOffset = ((Read - Sent) + (Answered - Now)) / 2;
+    if(Server->ClockOffset < RoundTrip / 2 && Server->ClockOffset > -RoundTrip / 2) Server->ClockOffset = 0;
+
+    struct Trace* Trace = NULL;
+    if(Console.Display->TraceFile != NULL){
+        Trace = new struct Trace();
+        Trace->ID = ++Server->NextTrace;
+        Trace->From = -1;
+        Trace->Sent = Sent;
+        Trace->ServerReceived = Read - Server->ClockOffset;
+        Trace->ServerForwarded = Answered - Server->ClockOffset;
+        Trace->Received = Now;
+    }
+    std::string Text = "Round trip " + std::to_string(RoundTrip / 1000) + " us, server held it " + std::to_string(Held / 1000) +
+                       " us, server clock " + std::to_string(Server->ClockOffset / 1000) + " us ahead";
+    if(Server->Events != NULL){
+        Server->Pending = Trace;
+        QueueEvent(Server, "\"type\":\"ping\",\"rtt\":" + std::to_string(RoundTrip / 1000), Text);
+    }else{
+        Console.Display->Buffer.Trace = Trace;
+        std::cout << "PING : " << Text << std::endl << std::endl;
+    }
+}
+
+void PutStamp(char* Data, long long Time){
+    //Times are 64 bits in network byte order
+    for(int i = 7; i >= 0; i--){
+        Data[i] = (char)(Time & 0xFF);
+        Time >>= 8;
+    }
+}
+
+long long GetStamp(const char* Data){
+    unsigned long long Time = 0;
+    for(int i = 0; i < 8; i++) Time = (Time << 8) | (unsigned char)Data[i];
+    return (long long)Time;
+}
+
+void ReceiveFileFrame(struct Connection* Server, struct FrameHeader Header, const char* Data){
+    //Only frames for files requested from server are accepted
+    std::map<int, struct Transfer*>::iterator Found = Server->Receives.find(Header.Channel);
+    if(Found == Server->Receives.end()) return;
+    struct Transfer* Receive = Found->second;
+
+    switch(Header.Type){
+        case 4:     //File start, open output file for file that was requested, data is checked if checksum was sent
+            if(Receive->Started || (Header.Length != 8 && Header.Length != 16)) return;
+            Receive->Started = true;
+            Receive->Remaining = 0;
+            Receive->Verify = Header.Length == 16;
+            Receive->Checksum = 0;
+            Receive->Hash = CHECKSUM_START;
+            for(int i = 0; i < 8; i++){
+                Receive->Remaining = (Receive->Remaining << 8) | (unsigned char)Data[i];
+                if(Receive->Verify) Receive->Checksum = (Receive->Checksum << 8) | (unsigned char)Data[i + 8];
+            }
+            Receive->File = fopen(Receive->Name.c_str(), "wb");   //Open output file as binary as data is given as binary
+            return;
+        case 5:     //File data, write into file (or files of directory)
+            if(!Receive->Started) return;
+            if(Receive->Directory){
+                WriteDirectory(Receive, Data, Header.Length);
+            }else if(Receive->File != NULL){
+                fwrite(Data, 1, Header.Length, Receive->File);
+            }
+            if(Receive->Verify) Receive->Hash = FileChecksum(Data, Header.Length, Receive->Hash);
+            Receive->Remaining -= Header.Length;
+            return;
+        case 6:     //File end, close file and signal its completion
+            if(!Receive->Started) return;
+            if(Receive->Directory) WriteDirectory(Receive, NULL, 0);   //Creates empty files listed last
+            if(Receive->File != NULL) fclose(Receive->File);
+            if(Receive->Remaining != 0 || Receive->Left != 0 || Receive->Next != Receive->Entries.size() || (Receive->Verify && Receive->Hash != Receive->Checksum)){
+                std::cout<<"File Transfer "<<Receive->ID<<" ("<<Receive->Name<<") incomplete! File may be corrupted"<<std::endl<<std::endl;
+                FileEvent(Server, Receive->ID, "incomplete", Receive->Name);
+            }else if(Receive->Directory){
+                std::cout<<"File Transfer "<<Receive->ID<<" ("<<Receive->Name<<", "<<Receive->Entries.size()<<" files) complete!"<<std::endl<<std::endl;
+                FileEvent(Server, Receive->ID, "complete", Receive->Name);
+            }else{
+                std::cout<<"File Transfer "<<Receive->ID<<" ("<<Receive->Name<<") complete!"<<std::endl<<std::endl;
+                FileEvent(Server, Receive->ID, "complete", Receive->Name);
+            }
+            Server->Receives.erase(Found);
+            delete Receive;
+            return;
+        case 10:    //File handle, copy file passed by server into output file
+            if(Receive->Started || Header.Length != 8) return;
+            Receive->Started = true;
+            Receive->Remaining = 0;
+            for(int i = 0; i < 8; i++){
+                Receive->Remaining = (Receive->Remaining << 8) | (unsigned char)Data[i];
+            }
+            Receive->File = fopen(Receive->Name.c_str(), "wb");
+            Receive->Source = TakeHandle(Server->SocketFD, Server->Local);
+            //Only a regular file holding at least the length server claims is copied, a device passed in its place
+            //(/dev/zero) would otherwise fill the disk
+            if(Receive->Source >= 0 && !PassedFile(Receive->Source, Receive->Remaining)){
+                close(Receive->Source);
+                Receive->Source = -1;
+            }
+            //Passed file shares its offset with sender's copy, which stdio may have left anywhere, so copy starts from beginning
+            if(Receive->Source >= 0) lseek(Receive->Source, 0, SEEK_SET);
+            if(Receive->Source < 0){
+                //Frame came without its file descriptor (not on this host, or replayed capture) or with something else
+                if(Receive->File != NULL) fclose(Receive->File);
+                std::cout<<"File Transfer "<<Receive->ID<<" ("<<Receive->Name<<") incomplete! File may be corrupted"<<std::endl<<std::endl;
+                FileEvent(Server, Receive->ID, "incomplete", Receive->Name);
+                Server->Receives.erase(Found);
+                delete Receive;
+            }
+            return;
+        case 11:    //Directory manifest, create directory and add files listed to it
+            if(Receive->Started && !Receive->Directory) return;
+            if(!Receive->Started){
+                Receive->Started = true;
+                Receive->Directory = true;
+                Receive->Remaining = 0;
+                MakePath(Receive->Name + "/");
+            }
+            if(!ReadManifest(Receive, Data, Header.Length)){
+                std::cout<<"File Transfer "<<Receive->ID<<" ("<<Receive->Name<<") has a corrupted manifest, later files are dropped"<<std::endl<<std::endl;
+            }
+            return;
+    }
+}
+
+bool FileSend(struct Connection* Server, int ID, const char* Filename, struct ClientSettings Settings){
+    //Limit number of files sent at once, and never reuse an ID still being sent
+    bool InUse = false;
+    for(size_t i = 0; i < Server->Sends.size(); i++){
+        if(Server->Sends[i]->ID == ID) InUse = true;
+    }
+    if(InUse || Server->Sends.size() >= MAX_TRANSFERS){
+        struct MessageProtocol Packet = CreateHeader(3,1,(char *)"Reject File Request");
+        Packet.Channel = ID;
+        QueuePacket(Server, Packet);
+        std::cout << "Too many files being sent, request rejected" << std::endl << std::endl;
+        return false;
+    }
+
+    /*
+        IF INPUTTED FILE IS WRONG OR EMPTY, EMPTY FILE WILL BE TRANSFERRED TO SERVER
+        AND FILE REQUEST WILL BE NEEDED AGAIN
+    */
+
+    //open file in binary to allow transfer of any file type
+    struct Transfer* Send = new struct Transfer();
+    Send->ID = ID;
+    Send->Name = Filename;
+    Send->File = fopen(Filename, "rb");
+    Send->Started = true;
+    Send->Source = -1;
+    SetupBucket(&Send->Bucket, Settings.FileRate);
+
+    //Directory is sent as a manifest of every file below it followed by their data
+    struct stat Info;
+    if(stat(Filename, &Info) == 0 && S_ISDIR(Info.st_mode)){
+        if(Send->File != NULL) fclose(Send->File);
+        Send->File = NULL;
+        Send->Directory = ListDirectory(Send->Name, "", Send->Entries);
+    }
+
+    //Send file ACK to server and begin preparing transfer
+    struct MessageProtocol Packet = CreateHeader(2,1,(char *)"Accepted File Request");
+    Packet.Channel = ID;
+    QueuePacket(Server, Packet);
+
+    //Send size of file to server in start frame for knowing when to stop
+    long int Size = 0;
+    if(Send->File != NULL){
+        fseek(Send->File, 0L, SEEK_END);
+        Size = ftell(Send->File);
+        fseek(Send->File, 0L, SEEK_SET);  //Reset pointer to begining
+    }
+    char SizeData[8];
+    for(int i = 0; i < 8; i++){
+        SizeData[i] = (char)((unsigned long long)Size >> (56 - 8 * i));
+    }
+    if(Send->Directory){
+        Send->Remaining = 0;
+        for(size_t i = 0; i < Send->Entries.size(); i++) Send->Remaining += Send->Entries[i].Size;
+        Server->QueuedBytes += QueueManifest(Send, Server->FileQueue);
+        Server->Sends.push_back(Send);
+        return true;
+    }
+
+    //Server on this host is passed the file itself and copies it, nothing is read or sent
+    int Handle = (Server->Local != NULL && Send->File != NULL) ? dup(fileno(Send->File)) : -1;
+    if(Handle >= 0){
+        Server->Local->Outgoing.push_back(Handle);
+        Server->Local->Passed++;
+        Server->FileQueue.push_back(CreateFrame(10, 1, ID, SizeData, sizeof(SizeData)));
+        Server->QueuedBytes += Server->FileQueue.back().size();
+        fclose(Send->File);
+        std::cout<<"File Transfer "<<Send->ID<<" ("<<Send->Name<<") passed!"<<std::endl<<std::endl;
+        delete Send;
+        return true;
+    }
+    Server->FileQueue.push_back(CreateFrame(4, 1, ID, SizeData, sizeof(SizeData)));
+    Server->QueuedBytes += Server->FileQueue.back().size();
+
+    //File data is queued by QueueFile() as socket drains the queue
+    Send->Remaining = Size;
+    Server->Sends.push_back(Send);
+    return true;
+}
+
+int QueueFile(struct Connection* Server){
+    //Nothing to do if no file is being sent
+    if(Server->Sends.empty()) return -1;
+
+    //Add tokens for time passed since last chunks were queued
+    long long Now = MonotonicTime();
+    RefillBucket(&Server->Bucket, Now);
+
+    //Size chunks to link
+    if(Server->Local == NULL) TunePacing(Server->SocketFD, &Server->Pace);
+    int Chunk = Server->Pace.Chunk;
+
+    //Read one chunk from each file in turn so every transfer gets an equal share of the connection
+    char Buffer[MAX_CHUNK]; //Will hold data from file to be placed in socket and transfered
+    int Wait = -1;          //Time until a rate limited transfer can continue (ms)
+    int Soonest = -1;       //Shortest wait of transfers skipped for being out of tokens
+    size_t Skipped = 0;     //Transfers in a row skipped for being out of tokens
+    while(!Server->Sends.empty() && Server->QueuedBytes < FILE_QUEUE_SIZE){
+        //Client limit holds up every transfer
+        int Limit = BucketWait(&Server->Bucket);
+        if(Limit > 0){
+            Wait = Limit;
+            break;
+        }
+
+        struct Transfer* Send = Server->Sends.front();
+        Server->Sends.pop_front();
+        if(Send->Remaining > 0){
+            //Transfer is over its own limit, give its turn to the next transfer
+            RefillBucket(&Send->Bucket, Now);
+            Limit = BucketWait(&Send->Bucket);
+            if(Limit > 0){
+                Server->Sends.push_back(Send);
+                if(Soonest < 0 || Limit < Soonest) Soonest = Limit;
+                if(++Skipped >= Server->Sends.size()){
+                    Wait = Soonest;
+                    break;
+                }
+                continue;
+            }
+            Skipped = 0;
+
+            int bytes = 0;
+            if(Send->Directory){
+                //Directory chunk may pack several files, or be a frame written straight from a large file
+                bytes = DirectoryChunk(Send, Chunk, CanSplice(Server->TLS, Server->Local, Server->Capture), Server->FileQueue, Server->Splices);
+                Server->QueuedBytes += sizeof(struct FrameHeader) + bytes;
+            }else{
+                if(Send->File != NULL){
+                    bytes = fread(Buffer, 1, Chunk, Send->File);
+                }
+                if(bytes <= 0){
+                    //File shrunk while sending, fill in rest so server is not left waiting
+                    bytes = Send->Remaining < Chunk ? Send->Remaining : Chunk;
+                    memset(Buffer, '\0', bytes);
+                }
+                if(bytes > Send->Remaining) bytes = Send->Remaining;
+                Server->FileQueue.push_back(CreateFrame(5, 1, Send->ID, Buffer, bytes));
+                Server->QueuedBytes += Server->FileQueue.back().size();
+                Send->Remaining -= bytes;
+            }
+
+            //Take tokens for chunk from every limit it passed
+            if(Send->Bucket.Rate > 0) Send->Bucket.Tokens -= bytes;
+            if(Server->Bucket.Rate > 0) Server->Bucket.Tokens -= bytes;
+        }
+
+        //Once whole file is queued, end transfer
+        if(Send->Remaining == 0){
+            Server->FileQueue.push_back(CreateFrame(6, 1, Send->ID, NULL, 0));
+            Server->QueuedBytes += Server->FileQueue.back().size();
+            if(Send->File != NULL) fclose(Send->File);
+            if(Send->Directory){
+                std::cout<<"File Transfer "<<Send->ID<<" ("<<Send->Name<<", "<<Send->Entries.size()<<" files) queued!"<<std::endl<<std::endl;
+            }else{
+                std::cout<<"File Transfer "<<Send->ID<<" ("<<Send->Name<<") queued!"<<std::endl<<std::endl;
+            }
+            delete Send;
+        }else{
+            Server->Sends.push_back(Send);
+        }
+    }
+    return Wait;
+}
+
+void SetupBucket(struct TokenBucket* Bucket, double Rate){
+    //Bucket holds enough tokens for a short burst, but never less than one chunk
+    Bucket->Rate = Rate;
+    Bucket->Burst = Rate * RATE_BURST / 1000;
+    if(Bucket->Burst < MAX_SIZE) Bucket->Burst = MAX_SIZE;
+    Bucket->Tokens = Bucket->Burst;
+    Bucket->Last = MonotonicTime();
+}
+
+void RefillBucket(struct TokenBucket* Bucket, long long Now){
+    //Unlimited buckets never run out of tokens
+    if(Bucket->Rate <= 0) return;
+    Bucket->Tokens += Bucket->Rate * (Now - Bucket->Last) / 1000000000.0;
+    if(Bucket->Tokens > Bucket->Burst) Bucket->Tokens = Bucket->Burst;
+    Bucket->Last = Now;
+}
+
+int BucketWait(struct TokenBucket* Bucket){
+    //Chunk may be taken as long as any tokens are left, tokens it goes over by are paid back before next chunk
+    if(Bucket->Rate <= 0 || Bucket->Tokens > 0) return 0;
+    return (int)(-Bucket->Tokens * 1000 / Bucket->Rate) + 1;
+}
+
+long long MonotonicTime(){
+    //Clock is never set back so refills are never negative
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Capture* OpenCapture(const char* Filename, int Role){
+    //Capture is written through a large buffer so recording frames costs little on the I/O thread
+    struct Capture* Capture = new struct Capture();
+    Capture->File = fopen(Filename, "wb");
+    if(Capture->File == NULL){
+        std::cerr << "Capture file could not be created, program terminated" << std::endl;
+        exit(-1);
+    }
+    setvbuf(Capture->File, NULL, _IOFBF, CAPTURE_BUFFER);
+    Capture->Last = MonotonicTime();
+
+    struct CaptureHeader Header;
+    memcpy(Header.Magic, CAPTURE_MAGIC, sizeof(Header.Magic));
+    Header.Version = CAPTURE_VERSION;
+    Header.Role = Role;
+    Header.Reserved = 0;
+    fwrite(&Header, sizeof(Header), 1, Capture->File);
+    return Capture;
+}
+
+void CaptureFrame(struct Capture* Capture, int Direction, int Connection, const char* Frame, size_t Length){
+    //Nothing to do if not capturing
+    if(Capture == NULL) return;
+
+    //Time is kept as whole microseconds since last record, so rounding never adds up over a capture
+    long long Delta = (MonotonicTime() - Capture->Last) / 1000;
+    if(Delta > 0xFFFFFFFFLL) Delta = 0xFFFFFFFFLL;     //Idle for over an hour, replay waits for less
+    Capture->Last += Delta * 1000;
+
+    struct CaptureRecord Record;
+    Record.Time = htonl((unsigned int)Delta);
+    Record.Direction = Direction;
+    memset(Record.Reserved, 0, sizeof(Record.Reserved));
+    Record.Connection = htonl(Connection);
+    fwrite(&Record, sizeof(Record), 1, Capture->File);
+    fwrite(Frame, 1, Length, Capture->File);
+}
+
+double ParseRate(const char* Rate){
+    //Rate is in bytes per second with optional K, M or G multiplier
+    char* End;
+    double Value = strtod(Rate, &End);
+    if(*End == 'K' || *End == 'k'){
+        Value *= 1024;
+        End++;
+    }else if(*End == 'M' || *End == 'm'){
+        Value *= 1024 * 1024;
+        End++;
+    }else if(*End == 'G' || *End == 'g'){
+        Value *= 1024.0 * 1024 * 1024;
+        End++;
+    }
+    if(End == Rate || *End != '\0' || Value < 0){
+        std::cerr << "Invalid rate given (bytes per second, K, M or G may follow), program terminated" << std::endl;
+        exit(-1);
+    }
+    return Value;
+}
+
+void CloseTransfers(struct Connection* Server){
+    //Close every file still being sent to or received from server
+    for(size_t i = 0; i < Server->Sends.size(); i++){
+        if(Server->Sends[i]->File != NULL) fclose(Server->Sends[i]->File);
+        delete Server->Sends[i];
+    }
+    Server->Sends.clear();
+    for(std::map<int, struct Transfer*>::iterator It = Server->Receives.begin(); It != Server->Receives.end(); It++){
+        if(It->second->File != NULL) fclose(It->second->File);
+        if(It->second->Source >= 0) close(It->second->Source);
+        delete It->second;
+    }
+    Server->Receives.clear();
+}
+
+void SetupPacing(int SocketFD, struct Pacing* Pace){
+    //Files are sent in small chunks until link is measured, socket keeps buffers the kernel gave it until the link needs more
+    Pace->Chunk = MAX_SIZE;
+    Pace->Checked = 0;
+    Pace->RTT = 0;
+    Pace->Rate = 0;
+    Pace->BDP = 0;
+    Pace->ReceiveBDP = 0;
+    Pace->Raised = 0;
+    socklen_t Length = sizeof(int);
+    if(getsockopt(SocketFD, SOL_SOCKET, SO_SNDBUF, (char *)&Pace->SendBuffer, &Length) != 0) Pace->SendBuffer = 0;
+    Length = sizeof(int);
+    if(getsockopt(SocketFD, SOL_SOCKET, SO_RCVBUF, (char *)&Pace->ReceiveBuffer, &Length) != 0) Pace->ReceiveBuffer = 0;
+
+    //Kernel doubles buffer sizes asked for up to twice its max, buffers are never set where max can't be read
+    const char* Paths[2] = {"/proc/sys/net/core/wmem_max", "/proc/sys/net/core/rmem_max"};
+    int* Limits[2] = {&Pace->SendLimit, &Pace->ReceiveLimit};
+    for(int i = 0; i < 2; i++){
+        long long Max = 0;
+        FILE* Setting = fopen(Paths[i], "r");
+        if(Setting != NULL){
+            if(fscanf(Setting, "%lld", &Max) != 1) Max = 0;
+            fclose(Setting);
+        }
+        *Limits[i] = 2 * Max < MAX_SOCKET_BUFFER ? 2 * Max : MAX_SOCKET_BUFFER;
+    }
+}
+
+void TunePacing(int SocketFD, struct Pacing* Pace){
+    //Link is measured at most every TUNE_INTERVAL, sockets without TCP_INFO keep their first chunk size and buffers
+    #ifdef TCP_INFO
+        long long Now = MonotonicTime();
+        if(Now - Pace->Checked < TUNE_INTERVAL * 1000000LL) return;
+        Pace->Checked = Now;
+        struct LinkInfo Info;
+        memset(&Info, 0, sizeof(Info));
+        socklen_t Length = sizeof(Info);
+        if(getsockopt(SocketFD, IPPROTO_TCP, TCP_INFO, (char *)&Info, &Length) != 0) return;
+
+        //Delivery rate of data sent over smoothed round trip, kernels without delivery rate give congestion window per round trip.
+        //Largest product is kept as rate measured while little is queued (application limited) underestimates link
+        if(Info.Base.tcpi_rtt > 0){
+            Pace->RTT = Info.Base.tcpi_rtt;
+            if(Length >= offsetof(struct LinkInfo, DeliveryRate) + sizeof(Info.DeliveryRate) && Info.DeliveryRate > 0){
+                Pace->Rate = Info.DeliveryRate;
+            }else{
+                Pace->Rate = (unsigned long long)Info.Base.tcpi_snd_cwnd * Info.Base.tcpi_snd_mss * 1000000 / Pace->RTT;
+            }
+            size_t BDP = Pace->Rate * Pace->RTT / 1000000;
+            if(BDP > Pace->BDP) Pace->BDP = BDP;
+        }
+        //Receiving end has kernel's measure of data read in a round trip
+        if(Info.Base.tcpi_rcv_rtt > 0 && Info.Base.tcpi_rcv_space > Pace->ReceiveBDP) Pace->ReceiveBDP = Info.Base.tcpi_rcv_space;
+
+        //Chunk is a sixteenth of product, so a chat frame never waits behind more than a sixteenth of a round trip of file data
+        long long Chunk = Pace->BDP / CHUNKS_PER_BDP;
+        if(Chunk > MAX_CHUNK) Chunk = MAX_CHUNK;
+        Pace->Chunk = Chunk > MAX_SIZE ? Chunk : MAX_SIZE;
+
+        //Buffers are raised to twice the product, a link held back by its buffer then measures larger each time until it
+        //is not. Setting a buffer stops the kernel growing it on its own, so it is only set once kernel max allows more
+        //than the kernel has already given the socket
+        int Options[2] = {SO_SNDBUF, SO_RCVBUF};
+        size_t Products[2] = {Pace->BDP, Pace->ReceiveBDP};
+        int* Buffers[2] = {&Pace->SendBuffer, &Pace->ReceiveBuffer};
+        int Limits[2] = {Pace->SendLimit, Pace->ReceiveLimit};
+        for(int i = 0; i < 2; i++){
+            long long Want = 2 * (long long)Products[i];
+            if(Want > Limits[i]) Want = Limits[i];
+            Length = sizeof(int);
+            if(getsockopt(SocketFD, SOL_SOCKET, Options[i], (char *)Buffers[i], &Length) != 0 || Want <= *Buffers[i]) continue;
+            int Size = Want / 2;    //Kernel doubles size asked for to make room for its bookkeeping
+            if(setsockopt(SocketFD, SOL_SOCKET, Options[i], (char *)&Size, sizeof(Size)) != 0) continue;
+            Pace->Raised++;
+            Length = sizeof(int);
+            getsockopt(SocketFD, SOL_SOCKET, Options[i], (char *)Buffers[i], &Length);
+        }
+    #endif
+}
+
+std::string PacingStats(struct Pacing* Pace){
+    //Link measurements of one connection, round trip in ms and rate in Mbit/s
+    char Line[256];
+    snprintf(Line, sizeof(Line), "chunk %d bytes, round trip %.2f ms, delivery rate %.1f Mbit/s, send buffer %d KB, receive buffer %d KB (raised %u times)",
+             Pace->Chunk, Pace->RTT / 1000.0, Pace->Rate * 8 / 1000000.0, Pace->SendBuffer / 1024, Pace->ReceiveBuffer / 1024, Pace->Raised);
+    return Line;
+}
+
+void QueueRoom(struct Connection* Server, int Type, std::string Name, std::string Message){
+    //Room name is followed by a null byte and message for room messages, server checks name and membership
+    std::string Data = Name;
+    if(Type == 9){
+        Data += '\0';
+        Data += Message.size() < MAX_LENGTH ? Message : Message.substr(0, MAX_LENGTH - 1);
+    }
+    if(Type == 9 && Server->Tracing){
+        QueueTraced(Server, CreateFrame(Type, 1, CHAT_CHANNEL, Data.data(), Data.size()));
+    }else{
+        QueueFrame(Server, CreateFrame(Type, 1, CHAT_CHANNEL, Data.data(), Data.size()));
+    }
+}
+
+void QueuePacket(struct Connection* Server, struct MessageProtocol Packet){
+    QueueFrame(Server, CreateFrame(Packet.Type, Packet.Flags, Packet.Channel, Packet.Message, Packet.Length));
+}
+
+void QueueFrame(struct Connection* Server, const std::string& Frame){
+    //Small chat frames are sent as datagrams if server takes UDP, frames go on TCP once too many are waiting
+    if(Server->UDP != NULL && !Server->UDP->Failed && DatagramFrame(Frame) && QueueDatagram(Server->DatagramFD, Server->UDP, Frame)){
+        CaptureFrame(Server->Capture, CAPTURE_SENT, 0, Frame.data(), Frame.size());
+        return;
+    }
+    //Chat frames are never dropped on client, only one server is sent to
+    Server->ChatQueue.push_back(Frame);
+    Server->QueuedBytes += Frame.size();
+}
+
+bool FlushQueue(struct Connection* Server){
+    //Write frames until socket stops accepting them
+    while(true){
+        //Data of a frame queued without it is written from its file once the frame's header is written
+        if(Server->Offset == Server->Current.size() && Server->Splicing.Length > 0){
+            int bytes = SpliceSend(Server->SocketFD, Server->TLS, &Server->Splicing);
+            if(bytes < 0 && errno == ENODATA){
+                //File shrunk since frame was queued, rest of frame is sent as zeros so the stream stays whole
+                close(Server->Splicing.FD);
+                Server->QueuedBytes -= Server->Current.size();
+                Server->Current.assign(Server->Splicing.Length, '\0');
+                Server->Offset = 0;
+                Server->Splicing.Length = 0;
+                continue;
+            }
+            if(bytes < 0){
+                if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return true;
+                return false;
+            }
+            Server->QueuedBytes -= bytes;
+            if(Server->Splicing.Length == 0) close(Server->Splicing.FD);
+            continue;
+        }
+
+        //Pick next frame once current one is written, chat frames always go first
+        if(Server->Offset == Server->Current.size()){
+            Server->QueuedBytes -= Server->Current.size();
+            Server->Current.clear();
+            Server->Offset = 0;
+            if(!Server->ChatQueue.empty()){
+                //Back to back chat frames are written together, a stream of short messages takes few system calls
+                Server->Current.swap(Server->ChatQueue.front());
+                Server->ChatQueue.pop_front();
+                CaptureFrame(Server->Capture, CAPTURE_SENT, 0, Server->Current.data(), Server->Current.size());
+                while(!Server->ChatQueue.empty() && Server->Current.size() + Server->ChatQueue.front().size() <= CHAT_WRITE){
+                    CaptureFrame(Server->Capture, CAPTURE_SENT, 0, Server->ChatQueue.front().data(), Server->ChatQueue.front().size());
+                    Server->Current += Server->ChatQueue.front();
+                    Server->ChatQueue.pop_front();
+                }
+            }else if(!Server->FileQueue.empty()){
+                Server->Current.swap(Server->FileQueue.front());
+                Server->FileQueue.pop_front();
+                //Only header of frame is queued when its data is written from a file
+                if(Server->Current.size() == sizeof(struct FrameHeader) && ((struct FrameHeader*)Server->Current.data())->Length != 0){
+                    Server->Splicing = Server->Splices.front();
+                    Server->Splices.pop_front();
+                }
+                CaptureFrame(Server->Capture, CAPTURE_SENT, 0, Server->Current.data(), Server->Current.size());
+            }else{
+                return true;    //Nothing left to send
+            }
+        }
+        #ifdef _WIN32
+            int bytes = SocketSend(Server->SocketFD, Server->TLS, Server->Current.data() + Server->Offset, Server->Current.size() - Server->Offset, 0);
+        #else
+            int bytes = Server->Local != NULL ? LocalSend(Server->SocketFD, Server->Local, Server->Current.data() + Server->Offset, Server->Current.size() - Server->Offset)
+                                              : SocketSend(Server->SocketFD, Server->TLS, Server->Current.data() + Server->Offset, Server->Current.size() - Server->Offset, MSG_NOSIGNAL);
+        #endif
+        if(bytes < 0){
+            //Socket buffer (or ring) is full, wait for poll() to report room
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return true;
+            return false;   //Connection has failed
+        }
+        Server->Offset += bytes;
+    }
+}
+
+SSL* StartTLS(int SocketFD, struct ClientSettings Settings){
+    #ifdef USE_TLS
+        SSL_CTX* Context = SSL_CTX_new(TLS_client_method());
+        if(Context == NULL) return NULL;
+        SSL_CTX_set_min_proto_version(Context, TLS1_2_VERSION);
+        //Frames are written in pieces as socket takes them
+        SSL_CTX_set_mode(Context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        //OpenSSL hands keys to kernel once handshake is done where kernel takes them, and keeps them where it doesn't
+        #ifdef SSL_OP_ENABLE_KTLS
+            if(Settings.TLSMode == TLS_KERNEL) SSL_CTX_set_options(Context, SSL_OP_ENABLE_KTLS);
+        #endif
+        SSL* TLS = SSL_new(Context);
+        SSL_CTX_free(Context);      //Connection keeps its own reference
+        SSL_set_fd(TLS, SocketFD);
+        if(SSL_connect(TLS) != 1){
+            ERR_clear_error();
+            SSL_free(TLS);
+            return NULL;
+        }
+
+        //Certificate is self-signed, so it is checked by its fingerprint instead of a certificate authority
+        X509* Certificate = SSL_get1_peer_certificate(TLS);
+        unsigned char Digest[EVP_MAX_MD_SIZE];
+        unsigned int Length = 0;
+        if(Certificate != NULL) X509_digest(Certificate, EVP_sha256(), Digest, &Length);
+        X509_free(Certificate);
+        char Fingerprint[3 * EVP_MAX_MD_SIZE + 1] = "";
+        for(unsigned int i = 0; i < Length; i++){
+            sprintf(Fingerprint + 3 * i, i + 1 < Length ? "%02X:" : "%02X", Digest[i]);
+        }
+        std::cout << "Server certificate fingerprint (SHA-256) : " << Fingerprint << std::endl;
+        if(Settings.Pin != NULL && strcasecmp(Settings.Pin, Fingerprint) != 0){
+            std::cout << "Server certificate does not match fingerprint given with -tls-pin" << std::endl;
+            SSL_free(TLS);
+            return NULL;
+        }
+        std::cout << "Encrypted with " << SSL_get_version(TLS) << " " << SSL_get_cipher(TLS)
+                  << (KernelTLS(TLS) ? " (kernel TLS)" : " (user TLS)") << std::endl;
+        return TLS;
+    #else
+        (void)SocketFD;
+        (void)Settings;
+        std::cerr << "Client was built without TLS (build with -DUSE_TLS -lssl -lcrypto)" << std::endl;
+        return NULL;
+    #endif
+}
+
+bool KernelTLS(SSL* TLS){
+    //Kernel holds the keys for sending once OpenSSL has handed them over
+    #if defined(USE_TLS) && defined(BIO_get_ktls_send)
+        return TLS != NULL && BIO_get_ktls_send(SSL_get_wbio(TLS));
+    #else
+        (void)TLS;
+        return false;
+    #endif
+}
+
+int SocketSend(int SocketFD, SSL* TLS, const char* Data, size_t Length, int Flags){
+    #ifdef USE_TLS
+        if(TLS != NULL){
+            int Result = SSL_write(TLS, Data, Length);
+            if(Result > 0) return Result;
+            int Error = SSL_get_error(TLS, Result);
+            errno = (Error == SSL_ERROR_WANT_WRITE || Error == SSL_ERROR_WANT_READ) ? EAGAIN : EPIPE;
+            ERR_clear_error();
+            return -1;
+        }
+    #else
+        (void)TLS;
+    #endif
+    return send(SocketFD, Data, Length, Flags);
+}
+
+int SocketReceive(int SocketFD, SSL* TLS, char* Data, size_t Length, int Flags){
+    #ifdef USE_TLS
+        //Records are read through OpenSSL, which takes them already decrypted where kernel holds the receive
+        //keys as well (-tls KERNEL)
+        if(TLS != NULL){
+            size_t Received = 0;
+            do{
+                int Result = SSL_read(TLS, Data + Received, Length - Received);
+                if(Result > 0){
+                    Received += Result;
+                    continue;
+                }
+                int Error = SSL_get_error(TLS, Result);
+                ERR_clear_error();
+                if(Received > 0) break;
+                if(Error == SSL_ERROR_WANT_READ || Error == SSL_ERROR_WANT_WRITE){
+                    errno = EAGAIN;
+                    return -1;
+                }
+                if(Error == SSL_ERROR_ZERO_RETURN || (Error == SSL_ERROR_SYSCALL && errno == 0)) return 0;
+                errno = ECONNRESET;
+                return -1;
+            }while((Flags & MSG_WAITALL) && Received < Length);     //Socket blocks while waiting for all of it
+            return Received;
+        }
+    #else
+        (void)TLS;
+    #endif
+    return recv(SocketFD, Data, Length, Flags);
+}
+
+void CloseTLS(SSL* TLS){
+    #ifdef USE_TLS
+        //Close message is only sent if socket has room, connection is closed either way
+        if(TLS == NULL) return;
+        SSL_shutdown(TLS);
+        SSL_free(TLS);
+        ERR_clear_error();
+    #else
+        (void)TLS;
+    #endif
+}
+
+void SetupDatagram(struct Datagram* UDP, unsigned int Token){
+    //Sequence numbers start at 1 so an ACK of 0 means nothing has been received
+    UDP->Token = Token;
+    memset(&UDP->Address, '\0', sizeof(UDP->Address));
+    UDP->Known = false;
+    UDP->Failed = false;
+    UDP->Hello = 0;
+    UDP->Asked = 0;
+    UDP->Waiting = 0;
+    UDP->NextSequence = 1;
+    UDP->Expected = 1;
+    UDP->RTT = 0;
+    UDP->Variance = 0;
+    UDP->Timeout = (long long)UDP_FIRST_TIMEOUT * 1000000;
+    UDP->Sent = 0;
+    UDP->Retransmits = 0;
+    UDP->Received = 0;
+    UDP->Duplicates = 0;
+}
+
+bool DatagramFrame(const std::string& Frame){
+    //Only small messages, errors and room frames are sent as datagrams, exit, handshake and file frames stay on TCP
+    if(Frame.size() < sizeof(struct FrameHeader) || Frame.size() > UDP_MAX_FRAME) return false;
+    unsigned char Type = Frame[0], Flags = Frame[1];
+    return (Type == 0 && Flags >= 1 && Flags <= 3) || (Type >= 7 && Type <= 9);
+}
+
+bool DatagramBusy(struct Datagram* UDP){
+    //Frames still waiting on ACK or on room in window
+    return UDP != NULL && (!UDP->Unacked.empty() || !UDP->Pending.empty());
+}
+
+void SendDatagram(int SocketFD, struct Datagram* UDP, int Kind, unsigned int Sequence, const std::string* Frame){
+    //Every datagram carries ACK of every frame received so far
+    struct DatagramHeader Header;
+    memset(&Header, '\0', sizeof(Header));
+    Header.Token = htonl(UDP->Token);
+    Header.Kind = Kind;
+    Header.Sequence = htonl(Sequence);
+    Header.Ack = htonl(UDP->Expected - 1);
+    unsigned int Selective = 0;
+    for(std::map<unsigned int, std::string>::iterator It = UDP->Early.begin(); It != UDP->Early.end(); It++){
+        unsigned int Bit = It->first - UDP->Expected - 1;
+        if(Bit < 32) Selective |= 1u << Bit;
+    }
+    Header.Selective = htonl(Selective);
+
+    char Buffer[sizeof(struct DatagramHeader) + UDP_MAX_FRAME];
+    size_t Length = sizeof(Header);
+    memcpy(Buffer, &Header, sizeof(Header));
+    if(Frame != NULL){
+        memcpy(Buffer + Length, Frame->data(), Frame->size());
+        Length += Frame->size();
+    }
+    //Datagram lost here is sent again by retransmit timer like one lost on the way
+    sendto(SocketFD, Buffer, Length, 0, (struct sockaddr *)&UDP->Address, sizeof(UDP->Address));
+}
+
+bool QueueDatagram(int SocketFD, struct Datagram* UDP, const std::string& Frame){
+    //Frames wait for room in window, a peer that stopped reading makes the timer move them to TCP
+    if(UDP->Pending.size() >= UDP_PENDING) return false;
+    if(!UDP->Known && UDP->Pending.empty()) UDP->Waiting = MonotonicTime();
+    UDP->Pending.push_back(Frame);
+    FillWindow(SocketFD, UDP);
+    return true;
+}
+
+void FillWindow(int SocketFD, struct Datagram* UDP){
+    //Frames are only sent once peer's address is known and while receiver can hold them in its selective ACK range
+    while(UDP->Known && !UDP->Failed && !UDP->Pending.empty()){
+        unsigned int Oldest = UDP->Unacked.empty() ? UDP->NextSequence : UDP->Unacked.begin()->first;
+        if(UDP->NextSequence - Oldest >= UDP_WINDOW) break;
+        struct SentDatagram& Sent = UDP->Unacked[UDP->NextSequence];
+        Sent.Frame.swap(UDP->Pending.front());
+        UDP->Pending.pop_front();
+        Sent.Time = MonotonicTime();
+        Sent.First = Sent.Time;
+        Sent.Tries = 1;
+        Sent.Missed = 0;
+        SendDatagram(SocketFD, UDP, DATAGRAM_DATA, UDP->NextSequence, &Sent.Frame);
+        UDP->NextSequence++;
+        UDP->Sent++;
+    }
+}
+
+void ReceiveDatagram(int SocketFD, struct Datagram* UDP, const char* Data, size_t Length, bool Accept, std::vector<std::string>& Ready){
+    struct DatagramHeader Header;
+    memcpy(&Header, Data, sizeof(Header));
+    unsigned int Sequence = ntohl(Header.Sequence);
+    unsigned int Ack = ntohl(Header.Ack);
+    unsigned int Selective = ntohl(Header.Selective);
+    long long Now = MonotonicTime();
+    long long Sample = -1;      //Round trip of newest frame ACK'd, only frames sent once are measured
+    UDP->Hello = 0;             //Peer has answered
+
+    //Frames ACK'd in order or selectively leave window
+    while(!UDP->Unacked.empty() && UDP->Unacked.begin()->first <= Ack){
+        if(UDP->Unacked.begin()->second.Tries == 1) Sample = Now - UDP->Unacked.begin()->second.Time;
+        UDP->Unacked.erase(UDP->Unacked.begin());
+    }
+    unsigned int Highest = 0;   //Newest frame ACK'd selectively
+    for(int Bit = 0; Bit < 32 && Selective != 0; Bit++){
+        if(!(Selective & (1u << Bit))) continue;
+        std::map<unsigned int, struct SentDatagram>::iterator Found = UDP->Unacked.find(Ack + 2 + Bit);
+        if(Found != UDP->Unacked.end()){
+            if(Found->second.Tries == 1) Sample = Now - Found->second.Time;
+            UDP->Unacked.erase(Found);
+        }
+        Highest = Ack + 2 + Bit;
+    }
+
+    //Smoothed round trip and its variation give retransmit timeout (as TCP does)
+    if(Sample >= 0){
+        if(UDP->RTT == 0){
+            UDP->RTT = Sample;
+            UDP->Variance = Sample / 2;
+        }else{
+            long long Difference = UDP->RTT > Sample ? UDP->RTT - Sample : Sample - UDP->RTT;
+            UDP->Variance = (3 * UDP->Variance + Difference) / 4;
+            UDP->RTT = (7 * UDP->RTT + Sample) / 8;
+        }
+        UDP->Timeout = UDP->RTT + 4 * UDP->Variance;
+        if(UDP->Timeout < (long long)UDP_MIN_TIMEOUT * 1000000) UDP->Timeout = (long long)UDP_MIN_TIMEOUT * 1000000;
+        if(UDP->Timeout > (long long)UDP_MAX_TIMEOUT * 1000000) UDP->Timeout = (long long)UDP_MAX_TIMEOUT * 1000000;
+    }
+
+    //Frames that later frames have been ACK'd ahead of several times are lost, send them again without waiting on timer
+    for(std::map<unsigned int, struct SentDatagram>::iterator It = UDP->Unacked.begin(); It != UDP->Unacked.end() && It->first < Highest; It++){
+        if(++It->second.Missed == UDP_FAST_RETRANSMIT){
+            SendDatagram(SocketFD, UDP, DATAGRAM_DATA, It->first, &It->second.Frame);
+            It->second.Time = Now;
+            It->second.Tries++;
+            It->second.Missed = 0;
+            UDP->Retransmits++;
+        }
+    }
+
+    if(Header.Kind == DATAGRAM_HELLO){
+        SendDatagram(SocketFD, UDP, DATAGRAM_ACK, 0, NULL);
+    }else if(Header.Kind == DATAGRAM_DATA && Length > sizeof(Header) && Accept){
+        //Frame not accepted yet (peer not connected) is not ACK'd, peer sends it again
+        UDP->Received++;
+        if(Sequence < UDP->Expected || UDP->Early.count(Sequence) > 0){
+            UDP->Duplicates++;
+        }else if(Sequence - UDP->Expected <= UDP_WINDOW){
+            UDP->Early[Sequence].assign(Data + sizeof(Header), Length - sizeof(Header));
+        }
+        //Hand on every frame now in order, frames that are not whole chat frames are skipped
+        while(!UDP->Early.empty() && UDP->Early.begin()->first == UDP->Expected){
+            std::string& Frame = UDP->Early.begin()->second;
+            struct FrameHeader Inner;
+            if(DatagramFrame(Frame)){
+                memcpy(&Inner, Frame.data(), sizeof(Inner));
+                if(ntohl(Inner.Length) == Frame.size() - sizeof(Inner)){
+                    Ready.push_back(std::string());
+                    Ready.back().swap(Frame);
+                }
+            }
+            UDP->Early.erase(UDP->Early.begin());
+            UDP->Expected++;
+        }
+        //Every data datagram is ACK'd right away
+        SendDatagram(SocketFD, UDP, DATAGRAM_ACK, 0, NULL);
+    }
+    FillWindow(SocketFD, UDP);
+}
+
+int DatagramTimer(int SocketFD, struct Datagram* UDP){
+    //Sends again every datagram not ACK'd in time, doubling its timeout each time, returns time until next one
+    //is due (ms), -1 if none are waiting
+    if(UDP->Failed || (UDP->Unacked.empty() && UDP->Hello == 0 && (UDP->Known || UDP->Pending.empty()))) return -1;
+    long long Now = MonotonicTime();
+    long long Next = -1;
+
+    //Client keeps telling server its address until server answers
+    if(UDP->Hello != 0){
+        if(Now - UDP->Hello >= UDP->Timeout){
+            if(UDP->Asked == 0) UDP->Asked = Now;
+            if(Now - UDP->Asked >= (long long)UDP_GIVE_UP * 1000000){
+                UDP->Failed = true;
+                return -1;
+            }
+            SendDatagram(SocketFD, UDP, DATAGRAM_HELLO, 0, NULL);
+            UDP->Hello = Now;
+        }
+        Next = UDP->Hello + UDP->Timeout;
+    }
+
+    //Server gives up on frames waiting for a client that never sent a datagram
+    if(!UDP->Known && !UDP->Pending.empty()){
+        if(Now - UDP->Waiting >= (long long)UDP_ADDRESS_WAIT * 1000000){
+            UDP->Failed = true;
+            return -1;
+        }
+        long long Due = UDP->Waiting + (long long)UDP_ADDRESS_WAIT * 1000000;
+        if(Next < 0 || Due < Next) Next = Due;
+    }
+
+    for(std::map<unsigned int, struct SentDatagram>::iterator It = UDP->Unacked.begin(); It != UDP->Unacked.end(); It++){
+        struct SentDatagram& Sent = It->second;
+        long long Wait = UDP->Timeout << (Sent.Tries - 1);
+        if(Wait > (long long)UDP_MAX_TIMEOUT * 1000000) Wait = (long long)UDP_MAX_TIMEOUT * 1000000;
+        if(Now - Sent.Time >= Wait){
+            //Peer is unreachable, chat moves back to TCP
+            if(Now - Sent.First >= (long long)UDP_GIVE_UP * 1000000){
+                UDP->Failed = true;
+                return -1;
+            }
+            SendDatagram(SocketFD, UDP, DATAGRAM_DATA, It->first, &Sent.Frame);
+            Sent.Time = Now;
+            Sent.Tries++;
+            Sent.Missed = 0;
+            UDP->Retransmits++;
+            Wait = UDP->Timeout << (Sent.Tries - 1);
+            if(Wait > (long long)UDP_MAX_TIMEOUT * 1000000) Wait = (long long)UDP_MAX_TIMEOUT * 1000000;
+        }
+        if(Next < 0 || Sent.Time + Wait < Next) Next = Sent.Time + Wait;
+    }
+    if(Next < 0) return -1;
+    return (int)((Next - Now + 999999) / 1000000);
+}
+
+void DatagramFallback(struct Datagram* UDP, std::vector<std::string>& Frames){
+    //Frames not known to be received are handed back in order to be sent on TCP, peer may see some of them twice
+    for(std::map<unsigned int, struct SentDatagram>::iterator It = UDP->Unacked.begin(); It != UDP->Unacked.end(); It++){
+        Frames.push_back(std::string());
+        Frames.back().swap(It->second.Frame);
+    }
+    UDP->Unacked.clear();
+    for(size_t i = 0; i < UDP->Pending.size(); i++){
+        Frames.push_back(std::string());
+        Frames.back().swap(UDP->Pending[i]);
+    }
+    UDP->Pending.clear();
+}
+
+std::string DatagramStats(struct Datagram* UDP){
+    //Counters of one UDP connection, round trip in ms
+    char Line[256];
+    snprintf(Line, sizeof(Line), "sent %u frames (%u sent again), received %u (%u duplicates), round trip %.2f ms, timeout %lld ms%s",
+             UDP->Sent, UDP->Retransmits, UDP->Received, UDP->Duplicates, UDP->RTT / 1000000.0, UDP->Timeout / 1000000,
+             UDP->Failed ? ", moved to TCP" : "");
+    return Line;
+}
+
+void ReadDatagrams(struct Connection* Server, bool Deliver, std::vector<std::string>& Frames){
+    //Read every datagram waiting, only datagrams from server's address with connection's token are taken
+    char Buffer[sizeof(struct DatagramHeader) + UDP_MAX_FRAME];
+    struct sockaddr_in Address;
+    socklen_t AddressSize = sizeof(Address);
+    int bytes;
+    while((bytes = recvfrom(Server->DatagramFD, Buffer, sizeof(Buffer), 0, (struct sockaddr *)&Address, &AddressSize)) >= 0){
+        AddressSize = sizeof(Address);
+        if(bytes < (int)sizeof(struct DatagramHeader)) continue;
+        if(Address.sin_addr.s_addr != Server->UDP->Address.sin_addr.s_addr || Address.sin_port != Server->UDP->Address.sin_port) continue;
+        struct DatagramHeader Header;
+        memcpy(&Header, Buffer, sizeof(Header));
+        if(ntohl(Header.Token) != Server->UDP->Token) continue;
+        ReceiveDatagram(Server->DatagramFD, Server->UDP, Buffer, bytes, Deliver, Frames);
+    }
+}
+
+void DrainDatagrams(struct Connection* Server){
+    //Keep answering ACKs and sending datagrams again until server has ACK'd everything or time is up
+    if(Server->UDP == NULL) return;
+    long long End = MonotonicTime() + (long long)UDP_DRAIN * 1000000;
+    while(!Server->UDP->Failed && DatagramBusy(Server->UDP)){
+        int Timeout = DatagramTimer(Server->DatagramFD, Server->UDP);
+        long long Left = (End - MonotonicTime()) / 1000000;
+        if(Left <= 0) return;
+        if(Timeout < 0 || Timeout > Left) Timeout = Left;
+
+        struct pollfd Watch;
+        Watch.fd = Server->DatagramFD;
+        Watch.events = POLLIN;
+        if(poll(&Watch, 1, Timeout) > 0){
+            std::vector<std::string> Frames;    //Frames received while exiting are not handled
+            ReadDatagrams(Server, false, Frames);
+        }
+    }
+}
+
+void SetupLocal(struct Local* Local){
+    //Rings are only used once both ends have them, until then everything goes through the socket
+    Local->Memory = NULL;
+    Local->In = NULL;
+    Local->Out = NULL;
+    Local->WakeFD = -1;
+    Local->PeerFD = -1;
+    Local->Passed = 0;
+}
+
+bool CreateRings(struct Local* Local){
+    //Shared memory and both eventfds are passed to peer with connection request, peer's copies of
+    //eventfds are duplicates so ours stay open once they are sent. Size of memory is sealed, server
+    //maps nothing it could lose pages of
+    int Memory = memfd_create("chat-rings", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(Memory < 0) return false;
+    if(ftruncate(Memory, 2 * (sizeof(struct RingHeader) + LOCAL_RING_SIZE)) < 0 ||
+       fcntl(Memory, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0){
+        close(Memory);
+        return false;
+    }
+    Local->Memory = mmap(NULL, 2 * (sizeof(struct RingHeader) + LOCAL_RING_SIZE), PROT_READ | PROT_WRITE, MAP_SHARED, Memory, 0);
+    if(Local->Memory == MAP_FAILED){
+        Local->Memory = NULL;
+        close(Memory);
+        return false;
+    }
+    Local->WakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    Local->PeerFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int PeerWake = Local->PeerFD >= 0 ? dup(Local->PeerFD) : -1;    //Eventfd peer sleeps on
+    int PeerSignal = Local->WakeFD >= 0 ? dup(Local->WakeFD) : -1;  //Eventfd peer wakes us with
+    if(PeerWake < 0 || PeerSignal < 0){
+        if(PeerWake >= 0) close(PeerWake);
+        if(PeerSignal >= 0) close(PeerSignal);
+        close(Memory);
+        CloseLocal(Local);
+        SetupLocal(Local);
+        return false;
+    }
+
+    //Readers start out asleep, so the first bytes written to either ring wake them
+    for(int i = 0; i < 2; i++){
+        struct RingHeader* Ring = (struct RingHeader*)((char*)Local->Memory + i * (sizeof(struct RingHeader) + LOCAL_RING_SIZE));
+        Ring->Head.store(0);
+        Ring->Tail.store(0);
+        Ring->Sleeping.store(true);
+        Ring->Full.store(false);
+    }
+    Local->Outgoing.push_back(Memory);
+    Local->Outgoing.push_back(PeerWake);
+    Local->Outgoing.push_back(PeerSignal);
+    return true;
+}
+
+void UseRings(struct Local* Local, bool Creator){
+    //Ring 0 is written by end that created the memory, ring 1 by the other end
+    struct RingHeader* First = (struct RingHeader*)Local->Memory;
+    struct RingHeader* Second = (struct RingHeader*)((char*)Local->Memory + sizeof(struct RingHeader) + LOCAL_RING_SIZE);
+    Local->Out = Creator ? First : Second;
+    Local->In = Creator ? Second : First;
+}
+
+int SendHandles(int SocketFD, struct Local* Local, const char* Data, size_t Length){
+    //File descriptors waiting to be passed go with these bytes, peer receives them no later than the bytes
+    struct iovec Part;
+    Part.iov_base = (void*)Data;
+    Part.iov_len = Length;
+    struct msghdr Message;
+    memset(&Message, '\0', sizeof(Message));
+    Message.msg_iov = &Part;
+    Message.msg_iovlen = 1;
+    char Control[CMSG_SPACE(LOCAL_MAX_HANDLES * sizeof(int))];
+    size_t Count = Local->Outgoing.size() < LOCAL_MAX_HANDLES ? Local->Outgoing.size() : LOCAL_MAX_HANDLES;
+    if(Count > 0){
+        memset(Control, '\0', sizeof(Control));
+        Message.msg_control = Control;
+        Message.msg_controllen = CMSG_SPACE(Count * sizeof(int));
+        struct cmsghdr* Header = CMSG_FIRSTHDR(&Message);
+        Header->cmsg_level = SOL_SOCKET;
+        Header->cmsg_type = SCM_RIGHTS;
+        Header->cmsg_len = CMSG_LEN(Count * sizeof(int));
+        for(size_t i = 0; i < Count; i++){
+            memcpy(CMSG_DATA(Header) + i * sizeof(int), &Local->Outgoing[i], sizeof(int));
+        }
+    }
+    int bytes = sendmsg(SocketFD, &Message, MSG_NOSIGNAL);
+    if(bytes < 0) return -1;
+
+    //Peer holds its own copies once they are sent
+    for(size_t i = 0; i < Count; i++){
+        close(Local->Outgoing.front());
+        Local->Outgoing.pop_front();
+    }
+    return bytes;
+}
+
+int ReadHandles(int SocketFD, struct Local* Local, char* Data, size_t Length){
+    //Reads socket like recv(), keeping every file descriptor passed with the bytes in the order they were sent
+    struct iovec Part;
+    Part.iov_base = Data;
+    Part.iov_len = Length;
+    struct msghdr Message;
+    memset(&Message, '\0', sizeof(Message));
+    Message.msg_iov = &Part;
+    Message.msg_iovlen = 1;
+    char Control[CMSG_SPACE(LOCAL_MAX_HANDLES * sizeof(int))];
+    Message.msg_control = Control;
+    Message.msg_controllen = sizeof(Control);
+    int bytes = recvmsg(SocketFD, &Message, MSG_CMSG_CLOEXEC);
+    if(bytes < 0) return -1;
+    for(struct cmsghdr* Header = CMSG_FIRSTHDR(&Message); Header != NULL; Header = CMSG_NXTHDR(&Message, Header)){
+        if(Header->cmsg_level != SOL_SOCKET || Header->cmsg_type != SCM_RIGHTS) continue;
+        size_t Count = (Header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(size_t i = 0; i < Count; i++){
+            int Handle;
+            memcpy(&Handle, CMSG_DATA(Header) + i * sizeof(int), sizeof(int));
+            Local->Incoming.push_back(Handle);
+        }
+    }
+    return bytes;
+}
+
+int LocalSend(int SocketFD, struct Local* Local, const char* Data, size_t Length){
+    //Without rings bytes are written to socket, carrying any file descriptors waiting to be passed
+    if(Local->Out == NULL) return SendHandles(SocketFD, Local, Data, Length);
+
+    //File descriptors go ahead of ring data on socket with one marker byte, so they are there before the frame using them
+    char Marker = 0;
+    while(!Local->Outgoing.empty()){
+        if(SendHandles(SocketFD, Local, &Marker, 1) < 0) return -1;
+    }
+
+    //Ring is full once writer is a whole ring ahead of reader, reader wakes writer once it makes room
+    struct RingHeader* Ring = Local->Out;
+    unsigned long long Tail = Ring->Tail.load(std::memory_order_relaxed);
+    size_t Room = LOCAL_RING_SIZE - (Tail - Ring->Head.load(std::memory_order_acquire));
+    if(Room == 0){
+        Ring->Full.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        Room = LOCAL_RING_SIZE - (Tail - Ring->Head.load(std::memory_order_acquire));
+        if(Room == 0){
+            errno = EAGAIN;
+            return -1;
+        }
+        Ring->Full.store(false);
+    }
+    if(Length > Room) Length = Room;
+
+    //Copy in at most two pieces as data wraps around end of ring
+    char* Buffer = (char*)(Ring + 1);
+    size_t Offset = Tail % LOCAL_RING_SIZE;
+    size_t First = Length < LOCAL_RING_SIZE - Offset ? Length : LOCAL_RING_SIZE - Offset;
+    memcpy(Buffer + Offset, Data, First);
+    memcpy(Buffer, Data + First, Length - First);
+    Ring->Tail.store(Tail + Length, std::memory_order_release);
+
+    //Wake reader if it has gone to sleep, fence keeps data from being missed by a reader going to sleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(Ring->Sleeping.load(std::memory_order_relaxed) && Ring->Sleeping.exchange(false)){
+        uint64_t Wake = 1;
+        if(write(Local->PeerFD, &Wake, sizeof(Wake)) < 0){}
+    }
+    return Length;
+}
+
+int LocalReceive(int SocketFD, struct Local* Local, char* Data, size_t Length){
+    //Without rings bytes are read from socket, keeping file descriptors passed with them
+    if(Local->In == NULL) return ReadHandles(SocketFD, Local, Data, Length);
+
+    struct RingHeader* Ring = Local->In;
+    unsigned long long Head = Ring->Head.load(std::memory_order_relaxed);
+    size_t Waiting = Ring->Tail.load(std::memory_order_acquire) - Head;
+    if(Waiting == 0){
+        //Socket only carries file descriptors once rings are used, and tells once peer has closed
+        char Markers[64];
+        int bytes;
+        while((bytes = ReadHandles(SocketFD, Local, Markers, sizeof(Markers))) > 0);
+        if(bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+
+        //Go to sleep on eventfd, then check nothing was written before writer could see it
+        uint64_t Wake;
+        if(read(Local->WakeFD, &Wake, sizeof(Wake)) < 0){}
+        Ring->Sleeping.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        Waiting = Ring->Tail.load(std::memory_order_acquire) - Head;
+        if(Waiting == 0){
+            //Peer wrote everything it had before closing socket
+            if(bytes == 0) return 0;
+            errno = EAGAIN;
+            return -1;
+        }
+        Ring->Sleeping.store(false);
+    }
+    if(Length > Waiting) Length = Waiting;
+
+    //Copy out in at most two pieces as data wraps around end of ring
+    const char* Buffer = (const char*)(Ring + 1);
+    size_t Offset = Head % LOCAL_RING_SIZE;
+    size_t First = Length < LOCAL_RING_SIZE - Offset ? Length : LOCAL_RING_SIZE - Offset;
+    memcpy(Data, Buffer + Offset, First);
+    memcpy(Data + First, Buffer, Length - First);
+    Ring->Head.store(Head + Length, std::memory_order_release);
+
+    //Wake writer if it is waiting for room
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(Ring->Full.load(std::memory_order_relaxed) && Ring->Full.exchange(false)){
+        uint64_t Wake = 1;
+        if(write(Local->PeerFD, &Wake, sizeof(Wake)) < 0){}
+    }
+    return Length;
+}
+
+int TakeHandle(int SocketFD, struct Local* Local){
+    //With rings, file descriptor was written to socket before its frame was written to ring, so it is waiting there
+    if(Local == NULL) return -1;
+    if(Local->Incoming.empty() && Local->In != NULL){
+        char Markers[64];
+        while(ReadHandles(SocketFD, Local, Markers, sizeof(Markers)) > 0);
+    }
+    if(Local->Incoming.empty()) return -1;
+    int Handle = Local->Incoming.front();
+    Local->Incoming.pop_front();
+    return Handle;
+}
+
+bool PassedFile(int Source, long int Length){
+    //Regular file is copied up to its size at most, so copying stops where the file ends
+    struct stat Info;
+    return fstat(Source, &Info) == 0 && S_ISREG(Info.st_mode) && Length >= 0 && Length <= Info.st_size;
+}
+
+long int CopyHandle(int Source, FILE* File, long int Length){
+    //Output file could not be opened, passed file is skipped
+    if(File == NULL) return Length;
+
+    //Kernel copies between the files without the data passing through the program, falling back to
+    //sendfile() where the files can't be copied between directly (different file systems on older kernels)
+    ssize_t bytes = copy_file_range(Source, NULL, fileno(File), NULL, Length, 0);
+    if(bytes < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)){
+        bytes = sendfile(fileno(File), Source, NULL, Length);
+    }
+    return bytes;
+}
+
+bool CopyFiles(struct Connection* Server){
+    //Nothing to copy unless server has passed files
+    if(Server->Local == NULL) return false;
+    bool Copying = false;
+    std::map<int, struct Transfer*>::iterator It = Server->Receives.begin();
+    while(It != Server->Receives.end()){
+        struct Transfer* Receive = It->second;
+        if(Receive->Source < 0){
+            It++;
+            continue;
+        }
+
+        //Copy one chunk of each file in turn, file is done once all of it is copied or it can't be copied further
+        long int bytes = CopyHandle(Receive->Source, Receive->File, Receive->Remaining < FILE_COPY_CHUNK ? Receive->Remaining : FILE_COPY_CHUNK);
+        if(bytes > 0) Receive->Remaining -= bytes;
+        if(bytes > 0 && Receive->Remaining > 0){
+            Copying = true;
+            It++;
+            continue;
+        }
+        close(Receive->Source);
+        if(Receive->File != NULL) fclose(Receive->File);
+        if(Receive->Remaining != 0){
+            std::cout<<"File Transfer "<<Receive->ID<<" ("<<Receive->Name<<") incomplete! File may be corrupted"<<std::endl<<std::endl;
+            FileEvent(Server, Receive->ID, "incomplete", Receive->Name);
+        }else{
+            std::cout<<"File Transfer "<<Receive->ID<<" ("<<Receive->Name<<") complete!"<<std::endl<<std::endl;
+            FileEvent(Server, Receive->ID, "complete", Receive->Name);
+        }
+        Server->Receives.erase(It++);
+        delete Receive;
+    }
+    return Copying;
+}
+
+void CloseLocal(struct Local* Local){
+    //Unmaps rings and closes eventfds and every file descriptor not yet passed on or taken
+    if(Local->Memory != NULL) munmap(Local->Memory, 2 * (sizeof(struct RingHeader) + LOCAL_RING_SIZE));
+    if(Local->WakeFD >= 0) close(Local->WakeFD);
+    if(Local->PeerFD >= 0) close(Local->PeerFD);
+    for(size_t i = 0; i < Local->Outgoing.size(); i++) close(Local->Outgoing[i]);
+    for(size_t i = 0; i < Local->Incoming.size(); i++) close(Local->Incoming[i]);
+    Local->Outgoing.clear();
+    Local->Incoming.clear();
+}
+
+bool ListDirectory(const std::string& Root, const std::string& Prefix, std::vector<struct DirectoryFile>& Entries){
+    //Every regular file below directory is listed with its path from the directory, links are skipped so
+    //nothing outside of it is sent and the walk can't loop
+    DIR* Folder = opendir((Root + "/" + Prefix).c_str());
+    if(Folder == NULL) return false;
+    std::vector<std::string> Names;
+    struct dirent* Item;
+    while((Item = readdir(Folder)) != NULL){
+        if(strcmp(Item->d_name, ".") != 0 && strcmp(Item->d_name, "..") != 0) Names.push_back(Item->d_name);
+    }
+    closedir(Folder);
+    std::sort(Names.begin(), Names.end());
+
+    for(size_t i = 0; i < Names.size() && Entries.size() < DIRECTORY_MAX_FILES; i++){
+        std::string Name = Prefix.empty() ? Names[i] : Prefix + "/" + Names[i];
+        struct stat Info;
+        if(lstat((Root + "/" + Name).c_str(), &Info) != 0 || Name.size() > DIRECTORY_MAX_NAME) continue;
+        if(S_ISDIR(Info.st_mode)){
+            ListDirectory(Root, Name, Entries);
+        }else if(S_ISREG(Info.st_mode)){
+            struct DirectoryFile Entry;
+            Entry.Name = Name;
+            Entry.Size = Info.st_size;
+            Entries.push_back(Entry);
+        }
     }
     return true;
 }
 
-bool ReceiveMessage(int NewSocketFD, struct MessageProtocol Packet, bool End[]){
-    //Get information sent from Server, message, file request, or control message
+size_t QueueManifest(struct Transfer* Send, std::deque<std::string>& Queue){
+    //Entries are packed into as few frames as fit, an entry is never split between frames
+    size_t Queued = 0;
+    std::string Data;
+    for(size_t i = 0; i <= Send->Entries.size(); i++){
+        std::string Entry;
+        if(i < Send->Entries.size()){
+            char Fixed[10];
+            for(int j = 0; j < 8; j++){
+                Fixed[j] = (char)((unsigned long long)Send->Entries[i].Size >> (56 - 8 * j));
+            }
+            Fixed[8] = (char)(Send->Entries[i].Name.size() >> 8);
+            Fixed[9] = (char)Send->Entries[i].Name.size();
+            Entry.assign(Fixed, sizeof(Fixed));
+            Entry += Send->Entries[i].Name;
+        }
+        //Frame is full (or every entry is in), an empty directory still sends one manifest frame
+        if((i == Send->Entries.size() && (Queued == 0 || !Data.empty())) || Data.size() + Entry.size() > MAX_FRAME){
+            Queue.push_back(CreateFrame(11, 1, Send->ID, Data.data(), Data.size()));
+            Queued += Queue.back().size();
+            Data.clear();
+        }
+        Data += Entry;
+    }
+    return Queued;
+}
+
+int DirectoryChunk(struct Transfer* Send, int Chunk, bool Splice, std::deque<std::string>& Queue, std::deque<struct Splice>& Splices){
+    //Data of every file follows the previous file's, small files are packed together into one chunk
+    char Buffer[MAX_CHUNK];
+    int Length = 0;
+    while(Length < Chunk && Send->Remaining > 0){
+        //Move on to next file with data once current one has been read
+        if(Send->Left == 0){
+            if(Send->File != NULL) fclose(Send->File);
+            Send->File = NULL;
+            while(Send->Left == 0 && Send->Next < Send->Entries.size()){
+                Send->Left = Send->Entries[Send->Next++].Size;
+            }
+            Send->File = fopen((Send->Name + "/" + Send->Entries[Send->Next - 1].Name).c_str(), "rb");
+            Send->Offset = 0;
+        }
+
+        //Large files are written from file straight into socket (sendfile()) a frame at a time, never packed
+        bool Large = Splice && Send->File != NULL && Send->Entries[Send->Next - 1].Size >= DIRECTORY_SPLICE_SIZE;
+        if(Large && Length > 0) break;
+        if(Large){
+            long int Slice = Send->Left < MAX_FRAME ? Send->Left : MAX_FRAME;
+            struct stat Info;
+            struct Splice Data;
+            Data.FD = -1;
+            if(fstat(fileno(Send->File), &Info) == 0 && Info.st_size >= Send->Offset + Slice) Data.FD = dup(fileno(Send->File));
+            if(Data.FD >= 0){
+                //Frame is queued without its data, which is sent from the file once the header is written
+                struct FrameHeader Header;
+                Header.Type = 5;
+                Header.Flags = 1;
+                Header.Channel = htons(Send->ID);
+                Header.Length = htonl(Slice);
+                Data.Offset = Send->Offset;
+                Data.Length = Slice;
+                Queue.push_back(std::string((char *)&Header, sizeof(Header)));
+                Splices.push_back(Data);
+            }else{
+                //File shrunk while sending, fill in rest so receiver is not left waiting
+                std::string Zeros(Slice, '\0');
+                Queue.push_back(CreateFrame(5, 1, Send->ID, Zeros.data(), Slice));
+            }
+            Send->Offset += Slice;
+            Send->Left -= Slice;
+            Send->Remaining -= Slice;
+            return Slice;
+        }
+
+        //Read what fits of current file into chunk
+        int Part = Send->Left < Chunk - Length ? Send->Left : Chunk - Length;
+        int bytes = Send->File != NULL ? fread(Buffer + Length, 1, Part, Send->File) : 0;
+        if(bytes < Part){
+            //File shrunk while sending or could not be opened, fill in rest so receiver is not left waiting
+            memset(Buffer + Length + (bytes > 0 ? bytes : 0), '\0', Part - (bytes > 0 ? bytes : 0));
+        }
+        Length += Part;
+        Send->Left -= Part;
+        Send->Remaining -= Part;
+    }
+    Queue.push_back(CreateFrame(5, 1, Send->ID, Buffer, Length));
+    return Length;
+}
+
+bool ReadManifest(struct Transfer* Receive, const char* Data, size_t Length){
+    //Every entry is file size (64 bits), name length (16 bits) and name
+    size_t Position = 0;
+    while(Position + 10 <= Length){
+        struct DirectoryFile Entry;
+        Entry.Size = 0;
+        for(int i = 0; i < 8; i++){
+            Entry.Size = (Entry.Size << 8) | (unsigned char)Data[Position + i];
+        }
+        size_t NameLength = ((unsigned char)Data[Position + 8] << 8) | (unsigned char)Data[Position + 9];
+        Position += 10;
+        if(Position + NameLength > Length || Entry.Size < 0 || Receive->Entries.size() >= DIRECTORY_MAX_FILES) return false;
+        Entry.Name.assign(Data + Position, NameLength);
+        Position += NameLength;
+        Receive->Entries.push_back(Entry);
+        Receive->Remaining += Entry.Size;
+    }
+    return Position == Length;
+}
+
+void WriteDirectory(struct Transfer* Receive, const char* Data, size_t Length){
+    //Data is split between files in manifest order, files without data are created as they are passed
+    size_t Used = 0;
+    while(true){
+        if(Receive->Left == 0){
+            if(Receive->File != NULL) fclose(Receive->File);
+            Receive->File = NULL;
+            if(Receive->Next >= Receive->Entries.size()) break;
+            if(Used == Length && Receive->Entries[Receive->Next].Size > 0) break;   //Wait for data of next file
+
+            //Only paths below directory are written, anything else is read and dropped
+            struct DirectoryFile& Entry = Receive->Entries[Receive->Next++];
+            Receive->Left = Entry.Size;
+            if(ValidEntry(Entry.Name)){
+                //Directories of a path are only created when it is in a different directory than the file before
+                std::string Path = Receive->Name + "/" + Entry.Name;
+                size_t Slash = Entry.Name.rfind('/');
+                if(Slash != std::string::npos && (Receive->Next < 2 || Receive->Entries[Receive->Next - 2].Name.compare(0, Slash + 1, Entry.Name, 0, Slash + 1) != 0)){
+                    MakePath(Path);
+                }
+                Receive->File = fopen(Path.c_str(), "wb");
+            }else{
+                std::cout << "File Transfer " << Receive->ID << " (" << Receive->Name << ") skipped unsafe path " << Entry.Name << std::endl << std::endl;
+            }
+            continue;
+        }
+        if(Used == Length) break;
+        size_t Part = Length - Used < (size_t)Receive->Left ? Length - Used : Receive->Left;
+        if(Receive->File != NULL) fwrite(Data + Used, 1, Part, Receive->File);
+        Used += Part;
+        Receive->Left -= Part;
+    }
+}
+
+bool BelowFolder(const char* Path){
+    //Symlinks are resolved before comparing, so a link inside the folder can't hand out a file outside it
+    char Folder[PATH_MAX], Resolved[PATH_MAX];
+    if(getcwd(Folder, sizeof(Folder)) == NULL || realpath(Path, Resolved) == NULL) return false;
+    size_t Length = strlen(Folder);
+    if(Length == 1) return true;    //Working folder is root
+    return strncmp(Resolved, Folder, Length) == 0 && (Resolved[Length] == '/' || Resolved[Length] == '\0');
+}
+
+bool ValidEntry(const std::string& Name){
+    //Path must stay below directory, no absolute paths, empty parts or parent directories
+    if(Name.empty() || Name[0] == '/' || Name.find('\\') != std::string::npos) return false;
+    size_t Start = 0;
+    while(Start <= Name.size()){
+        size_t End = Name.find('/', Start);
+        if(End == std::string::npos) End = Name.size();
+        std::string Part = Name.substr(Start, End - Start);
+        if(Part.empty() || Part == "." || Part == "..") return false;
+        Start = End + 1;
+    }
+    return true;
+}
+
+void MakePath(const std::string& Path){
+    //Creates every directory up to last '/' of path, directories that already exist are left as they are
+    for(size_t Slash = Path.find('/', 1); Slash != std::string::npos; Slash = Path.find('/', Slash + 1)){
+        mkdir(Path.substr(0, Slash).c_str(), 0777);
+    }
+}
+
+bool CanSplice(SSL* TLS, struct Local* Local, struct Capture* Capture){
+    //Data written with sendfile() skips capture and is only encrypted if kernel holds the keys, and rings are
+    //not a socket
     #ifdef _WIN32
-        recv(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
+        (void)TLS;
+        (void)Local;
+        (void)Capture;
+        return false;
     #else
-        recv(NewSocketFD, &Packet, sizeof(Packet), 0);
+        if(Capture != NULL || (Local != NULL && Local->In != NULL)) return false;
+        return TLS == NULL || KernelTLS(TLS);
     #endif
+}
 
+int SpliceSend(int SocketFD, SSL* TLS, struct Splice* Data){
+    //Kernel writes file data into socket without it passing through the program, encrypting it on a kernel
+    //TLS connection (OpenSSL sends through sendfile() so it can flush anything it still holds first)
+    #ifdef _WIN32
+        (void)SocketFD;
+        (void)TLS;
+        (void)Data;
+        errno = EINVAL;
+        return -1;
+    #else
+        off_t Offset = Data->Offset;
+        ssize_t bytes;
+        #ifdef USE_TLS
+            if(TLS != NULL){
+                bytes = SSL_sendfile(TLS, Data->FD, Offset, Data->Length, 0);
+                if(bytes < 0){
+                    int Error = SSL_get_error(TLS, bytes);
+                    errno = (Error == SSL_ERROR_WANT_WRITE || Error == SSL_ERROR_WANT_READ) ? EAGAIN : EPIPE;
+                    ERR_clear_error();
+                    return -1;
+                }
+            }else{
+                bytes = sendfile(SocketFD, Data->FD, &Offset, Data->Length);
+            }
+        #else
+            (void)TLS;
+            bytes = sendfile(SocketFD, Data->FD, &Offset, Data->Length);
+        #endif
+        if(bytes == 0){
+            //File shrunk since frame was queued
+            errno = ENODATA;
+            return -1;
+        }
+        if(bytes > 0){
+            Data->Offset += bytes;
+            Data->Length -= bytes;
+        }
+        return bytes;
+    #endif
+}
+
+void CloseSplices(std::deque<struct Splice>& Splices, struct Splice* Splicing){
+    //Frames still queued will never be written, their files are closed
+    for(size_t i = 0; i < Splices.size(); i++) close(Splices[i].FD);
+    Splices.clear();
+    if(Splicing->Length > 0) close(Splicing->FD);
+    Splicing->Length = 0;
+}
+
+unsigned long long FileChecksum(const char* Data, size_t Length, unsigned long long Checksum){
+    //FNV-1a, continues from checksum of data before it so a file can be checked a frame at a time
+    for(size_t i = 0; i < Length; i++){
+        Checksum ^= (unsigned char)Data[i];
+        Checksum *= CHECKSUM_PRIME;
+    }
+    return Checksum;
+}
+
+bool FileReceive(struct Connection* Server, const char* Filename){
+    //Limit number of files requested at once
+    if(Server->Receives.size() >= MAX_TRANSFERS){
+        std::cout << "Too many files requested, wait for some to complete" << std::endl << std::endl;
+        return false;
+    }
+
+    //Give request next unused transfer ID, frames of the file will be sent on that channel
+    do{
+        Server->NextTransfer = Server->NextTransfer % 65535 + 1;
+    }while(Server->Receives.count(Server->NextTransfer) > 0);
+    struct Transfer* Receive = new struct Transfer();
+    Receive->ID = Server->NextTransfer;
+    Receive->Name = Filename;
+    Receive->File = NULL;
+    Receive->Remaining = 0;
+    Receive->Started = false;
+    Receive->Source = -1;
+    Server->Receives[Receive->ID] = Receive;
+
+    //Send filename to server, requesting transfer
+    struct MessageProtocol Packet = CreateHeader(1,1,(char *)Filename);
+    Packet.Channel = Receive->ID;
+    QueuePacket(Server, Packet);
+    std::cout << "File Transfer " << Receive->ID << " (" << Filename << ") requested" << std::endl << std::endl;
+    return true;
+}
+
+bool ReceiveMessage(struct Connection* Server, struct MessageProtocol Packet, struct ConsoleState& Console, struct ClientSettings Settings){
     //Check type for deciding correct process to proceed with
     switch(Packet.Type){
         case 0:     //Message has been sent, check if it is complete
             //Check if checksum is equal
             if(Packet.Length != strlen(Packet.Message)){
                 //Packet corrupt, send error message
-                Packet = CreateHeader(0,2,strcpy(Packet.Message, "Error, last message corrupted. Please try again"));
-                #ifdef _WIN32
-                    send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-                #else
-                    send(NewSocketFD, &Packet, sizeof(Packet), 0);
-                #endif
+                QueuePacket(Server, CreateHeader(0,2,(char *)"Error, last message corrupted. Please try again"));
                 return false;
             }
             //Simple message sent, check if message is error to be handled
             switch (Packet.Flags){
                 case 2:
                     //Packet corrupt, send error message
-                    Packet = CreateHeader(0,2,strcpy(Packet.Message, "Error, last message corrupted. Please try again"));
-                    #ifdef _WIN32
-                        send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-                    #else
-                        send(NewSocketFD, &Packet, sizeof(Packet), 0);
-                    #endif
+                    QueuePacket(Server, CreateHeader(0,2,(char *)"Error, last message corrupted. Please try again"));
                     return false;
                 case 3:
                     //File corrupt, send error message
-                    Packet = CreateHeader(0,3,strcpy(Packet.Message, "Error, last message corrupted. Please try again"));
-                    #ifdef _WIN32
-                        send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-                    #else
-                        send(NewSocketFD, &Packet, sizeof(Packet), 0);
-                    #endif
+                    QueuePacket(Server, CreateHeader(0,3,(char *)"Error, last message corrupted. Please try again"));
                     return false;
                 default:
                     //Display exit message from client and end chat
-                    std::cout<<"- - SERVER - -"<<std::endl;
-                    std::cout<<Packet.Message<<std::endl << std::endl;
-                    if(Packet.Flags == 0){End[0] = true;}
+                    if(Server->Events != NULL){
+                        QueueEvent(Server, Packet.Flags == 0 ? "\"type\":\"exit\",\"from\":0" : "\"type\":\"message\",\"from\":0", Packet.Message);
+                    }else{
+                        std::cout<<"- - SERVER - -"<<std::endl;
+                        std::cout<<Packet.Message<<std::endl << std::endl;
+                    }
+                    if(Packet.Flags == 0){Server->Closed = true;}
                     return true;
             }
         case 1:     //File request message
-            //Server is requesting to send file, accept or ignore then wait for server's reply
-            return FileSend(NewSocketFD, Packet, End);
+            //Server is requesting to send file, answer right away if policy allows it
+            if(Settings.Accept == ACCEPT_NONE ||
+               (Settings.Accept == ACCEPT_ALL && (Packet.Message[0] == '/' || strstr(Packet.Message, "..") != NULL || !BelowFolder(Packet.Message)))){
+                //Only files below client's folder are sent without asking
+                int ID = Packet.Channel;
+                Packet = CreateHeader(3,1,(char *)"Reject File Request");
+                Packet.Channel = ID;
+                QueuePacket(Server, Packet);
+                std::cout << "Server file request rejected by policy" << std::endl << std::endl;
+                return false;
+            }
+            if(Settings.Accept == ACCEPT_ALL){
+                return FileSend(Server, Packet.Channel, Packet.Message, Settings);
+            }
+            //Otherwise ask client to accept or ignore
+            {
+                struct FileRequest Request;
+                Request.ID = Packet.Channel;
+                Request.Name = Packet.Message;
+                Console.Requests.push_back(Request);
+            }
+            if(Console.Mode == CONSOLE_CHAT){
+                Console.Mode = CONSOLE_FILE_ANSWER;
+                std::cout << "Server is requesting " << Console.Requests.front().Name << ". Send (Y/N) : " << std::endl;
+            }
+            return true;
         case 2:     //File request approved
             //Server has ACK request to send file, display approval
             std::cout<<"- - SERVER - -"<<std::endl;
-            std::cout<<Packet.Message<<std::endl << std::endl;
+            std::cout<<Packet.Message<<" (File Transfer "<<Packet.Channel<<")"<<std::endl << std::endl;
             return true;
         case 3:     //File request ignored message
             //Server has ignored request to send file, display denial
             std::cout<<"- - SERVER - -"<<std::endl;
-            std::cout<<Packet.Message<<std::endl << std::endl;
-            std::cout<<"File Transfer Rejected... Server waiting on reply"<<std::endl<<std::endl;
+            std::cout<<Packet.Message<<" (File Transfer "<<Packet.Channel<<")"<<std::endl << std::endl;
+            std::cout<<"File Transfer Rejected..."<<std::endl<<std::endl;
+            if(Server->Receives.count(Packet.Channel) > 0){
+                struct Transfer* Receive = Server->Receives[Packet.Channel];
+                FileEvent(Server, Receive->ID, "rejected", Receive->Name);
+                if(Receive->File != NULL) fclose(Receive->File);
+                delete Receive;
+                Server->Receives.erase(Packet.Channel);
+            }
             return false;
         default:
             //Corruption in packet, invalid type provided
-            Packet = CreateHeader(0,1,strcpy(Packet.Message, "Error, last request corrupted. Please try again"));
             //Send error message to server, asking for request to be sent again
-            #ifdef _WIN32
-                send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-            #else
-                send(NewSocketFD, &Packet, sizeof(Packet), 0);
-            #endif  
+            QueuePacket(Server, CreateHeader(0,1,(char *)"Error, last request corrupted. Please try again"));
             return false;   //Perform receive loop again in chat funtion
     }
 }
 
-bool SendMessage(int NewSocketFD, struct MessageProtocol Packet, bool End[]){
-    //Get user input first (check if input is message or attempt to send file)
+bool SendMessage(struct Connection* Server, struct ConsoleState& Console, std::string Input, struct ClientSettings Settings){
+    switch(Console.Mode){
+        case CONSOLE_FILE_ANSWER:
+            //Loop until valid input is given
+            if(Input != "Y" && Input != "N"){
+                std::cout << "Invalid input, try again : " << std::endl;
+                return true;
+            }
+            if(Input == "N"){
+                //Send file transfer rejection packet
+                struct MessageProtocol Packet = CreateHeader(3,1,(char *)"Reject File Request");
+                Packet.Channel = Console.Requests.front().ID;
+                QueuePacket(Server, Packet);
+                Console.Requests.pop_front();
+                Console.Mode = CONSOLE_CHAT;
+            }else{
+                //Open desired file to be sent
+                std::cout << "Enter filename (include path if in different folder) : " << std::endl;
+                Console.Mode = CONSOLE_FILE_SEND;
+            }
+            break;
+        case CONSOLE_FILE_SEND:
+            //Send file to server
+            FileSend(Server, Console.Requests.front().ID, Input.c_str(), Settings);
+            Console.Requests.pop_front();
+            Console.Mode = CONSOLE_CHAT;
+            break;
+        case CONSOLE_FILE_REQUEST:
+            //Send a request for desired file from server
+            FileReceive(Server, Input.c_str());
+            Console.Mode = CONSOLE_CHAT;
+            break;
+        default:
+            if(Input == "FILE" && Console.Display->Batch){
+                //Commands file can't be prompted for a filename
+                std::cout << "Enter filenames after FILE in commands file (FILE name ...)" << std::endl << std::endl;
+            }else if(Input == "FILE"){
+                //Client is requesting for file
+                std::cout << "Enter filename (include path if in different folder) : " << std::endl;
+                Console.Mode = CONSOLE_FILE_REQUEST;
+            }else if(Input.compare(0, 5, "FILE ") == 0){
+                //Every filename given after FILE is requested at once without waiting on each other
+                size_t Start = 4, End;
+                while((Start = Input.find_first_not_of(' ', Start)) != std::string::npos){
+                    End = Input.find(' ', Start);
+                    FileReceive(Server, Input.substr(Start, End - Start).c_str());
+                    Start = End;
+                }
+            }else if(Input.compare(0, 5, "JOIN ") == 0){
+                //Join room, server replies once it has been joined
+                QueueRoom(Server, 7, Input.substr(5), "");
+            }else if(Input.compare(0, 6, "LEAVE ") == 0){
+                QueueRoom(Server, 8, Input.substr(6), "");
+            }else if(Input.size() > 1 && Input[0] == '@'){
+                //Send message to every member of room
+                size_t Space = Input.find(' ');
+                if(Space == std::string::npos){
+                    std::cout << "Enter message after room name (@room message)" << std::endl << std::endl;
+                }else{
+                    QueueRoom(Server, 9, Input.substr(1, Space - 1), Input.substr(Space + 1));
+                }
+            }else if(Input == "PING"){
+                //Round trip is displayed once server answers
+                QueuePing(Server);
+            }else if(Input == "STATS"){
+                PrintLatency(Console.Display);
+                if(Server->UDP != NULL) std::cout << "UDP : " << DatagramStats(Server->UDP) << std::endl << std::endl;
+                if(Server->Pace.Checked != 0) std::cout << "Link : " << PacingStats(&Server->Pace) << std::endl << std::endl;
+                if(Server->Local != NULL){
+                    std::cout << "Local : " << (Server->Local->In != NULL ? "shared memory rings" : "Unix domain socket") << ", "
+                              << Server->Local->Passed << " files passed" << std::endl << std::endl;
+                }
+            }else if(Input == "EXIT" && Console.Display->Batch){
+                //Commands file exits once its file transfers are done, chat loop sends exit code
+                Console.Exiting = true;
+            }else if(Input == "EXIT"){
+                //Client is exiting the program, send exit code to server to follow suit
+                Exit(Server);
+                return false;
+            }else{
+                //Send corresponding flags/type and message, never traced since only server user reads it
+                struct MessageProtocol Packet = CreateHeader(0,1,(char *)Input.c_str());
+                QueuePacket(Server, Packet);
+            }
+            break;
+    }
+
+    //Prompt for next waiting file request once nothing else is being asked
+    if(Console.Mode == CONSOLE_CHAT && !Console.Requests.empty()){
+        Console.Mode = CONSOLE_FILE_ANSWER;
+        std::cout << "Server is requesting " << Console.Requests.front().Name << ". Send (Y/N) : " << std::endl;
+    }
+    return true;
+}
+
+void Exit(struct Connection* Server){
+    //Exiting program is represented by all 000, send exit code and exit chat
+    QueuePacket(Server, CreateHeader(0,0,(char *)"Client has exited the chat..."));
+}
+
+void StartDisplay(struct Display* Display){
+    SetupQueue(&Display->Output, OUTPUT_QUEUE_SIZE);
+    SetupQueue(&Display->Input, Display->Batch ? BATCH_QUEUE_SIZE : INPUT_QUEUE_SIZE);
+    for(int i = 0; i < LATENCY_BUCKETS; i++) Display->Latency[i].store(0);
+
+    //Everything written to std::cout from now on is handed to renderer thread, with -batch it stays on standard
+    //error and renderer only writes events
+    std::cout.flush();
+    Display->Buffer.Output = &Display->Output;
+    Display->Buffer.Trace = NULL;
+    Display->TraceWritten = false;
+    Display->Terminal = Display->Batch ? std::cout.rdbuf() : std::cout.rdbuf(&Display->Buffer);
+    Display->Renderer = std::thread(RenderLoop, Display);
+    Display->Reader = std::thread(ReadLoop, Display);
+}
+
+void StopDisplay(struct Display* Display){
+    //Hand over last output and wait for renderer to write everything
+    std::cout.flush();
+    std::cout.rdbuf(Display->Terminal);
+    Display->Output.Closed.store(true);
+    char Wake = 0;
+    if(write(Display->Output.WakeFD[1], &Wake, 1) < 0){}
+    Display->Renderer.join();
+
+    //Input thread may be blocked reading console, it ends with the program
+    Display->Reader.detach();
+}
+
+void RenderLoop(struct Display* Display){
+    std::string Batch;                  //Lines written to terminal at once
+    std::vector<long long> Times;       //Time each line in batch was pushed
+    std::vector<struct Trace*> Traces;  //Traces of lines in batch
+    struct Line Output;
+    while(true){
+        bool Closed = Display->Output.Closed.load();
+
+        //Take every waiting line so a fast conversation is written with few system calls
+        while(Batch.size() < RENDER_BATCH && PopLine(&Display->Output, Output)){
+            Batch += Output.Text;
+            Times.push_back(Output.Time);
+            if(Output.Trace != NULL) Traces.push_back(Output.Trace);
+        }
+        if(!Batch.empty()){
+            size_t Written = 0;
+            while(Written < Batch.size()){
+                int bytes = write(1, Batch.data() + Written, Batch.size() - Written);
+                if(bytes < 0 && errno == EINTR) continue;
+                if(bytes <= 0) break;   //Terminal is gone, output is lost
+                Written += bytes;
+            }
+            long long Now = MonotonicTime();
+            for(size_t i = 0; i < Times.size(); i++){
+                Display->Latency[LatencyBucket((Now - Times[i]) / 1000)].fetch_add(1, std::memory_order_relaxed);
+            }
+            //Traced messages are on screen, their stages are recorded here so I/O thread never writes trace file
+            for(size_t i = 0; i < Traces.size(); i++){
+                Traces[i]->Displayed = Now;
+                WriteTrace(Display, Traces[i]);
+                delete Traces[i];
+            }
+            Traces.clear();
+            Batch.clear();
+            Times.clear();
+            continue;
+        }
+        if(Closed) return;
+
+        //Nothing to write, sleep until I/O thread pushes more
+        if(QueueIdle(&Display->Output)){
+            struct pollfd Wake;
+            Wake.fd = Display->Output.WakeFD[0];
+            Wake.events = POLLIN;
+            poll(&Wake, 1, -1);
+        }
+        char Wake[64];
+        while(read(Display->Output.WakeFD[0], Wake, sizeof(Wake)) > 0);
+    }
+}
+
+void ReadLoop(struct Display* Display){
+    std::string Buffer;                 //Console input not yet ending in newline
+    std::vector<char> Data(Display->Batch ? BATCH_READ : MAX_LENGTH);     //Commands file is read in large chunks
     std::string Input;
-    getline(std::cin, Input);
-
-    if(Input == "FILE"){
-        //Server is requesting for file
-        FileReceive(NewSocketFD, Packet, End);
-        //Client will reply to server after transfer
-        SendMessage(NewSocketFD, Packet, End);
-    }else if(Input == "EXIT"){
-        //Client is exiting the program, send exit code to server to follow suit
-        Exit(NewSocketFD, Packet);
+    while(true){
+        int bytes = read(Display->InputFD, Data.data(), Data.size());
+        if(bytes < 0 && errno == EINTR) continue;
+        if(bytes <= 0){
+            //Console (or commands file) closed, treat as exit
+            Buffer += "EXIT\n";
+        }else{
+            Buffer.append(Data.data(), bytes);
+        }
+
+        //Hand every whole line to I/O thread, lines longer than a message are cut, buffer is only moved once per read
+        size_t Start = 0, End;
+        while((End = Buffer.find('\n', Start)) != std::string::npos){
+            size_t Length = End - Start;
+            if(Length > 0 && Buffer[End - 1] == '\r') Length--;
+            Input.assign(Buffer, Start, Length < MAX_LENGTH ? Length : MAX_LENGTH - 1);
+            Start = End + 1;
+            while(!PushLine(&Display->Input, Input, NULL)) std::this_thread::yield();
+        }
+        Buffer.erase(0, Start);
+        if(bytes <= 0) return;
+    }
+}
+
+void SetupQueue(struct LineQueue* Queue, size_t Size){
+    Queue->Slots.resize(Size);
+    Queue->Mask = Size - 1;
+    Queue->Head.store(0);
+    Queue->Tail.store(0);
+    Queue->Sleeping.store(true);
+    Queue->Closed.store(false);
+
+    //Wake pipe never blocks, a byte already waiting in it wakes consumer just as well
+    if(pipe(Queue->WakeFD) < 0){
+        std::cerr << "Creating console pipe failed, program terminated" << std::endl;
+        exit(-1);
+    }
+    fcntl(Queue->WakeFD[0], F_SETFL, fcntl(Queue->WakeFD[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(Queue->WakeFD[1], F_SETFL, fcntl(Queue->WakeFD[1], F_GETFL, 0) | O_NONBLOCK);
+}
+
+bool PushLine(struct LineQueue* Queue, std::string& Text, struct Trace* Trace){
+    //Queue is full once producer is a whole ring ahead of consumer
+    size_t Tail = Queue->Tail.load(std::memory_order_relaxed);
+    if(Tail - Queue->Head.load(std::memory_order_acquire) == Queue->Slots.size()) return false;
+
+    //Line is swapped in, leaving Text with the emptied string of an earlier line
+    struct Line& Slot = Queue->Slots[Tail & Queue->Mask];
+    Slot.Text.swap(Text);
+    Slot.Time = MonotonicTime();
+    Slot.Trace = Trace;
+    if(Trace != NULL) Trace->Queued = Slot.Time;
+    Queue->Tail.store(Tail + 1, std::memory_order_release);
+
+    //Wake consumer if it has gone to sleep, fence keeps line from being missed by a consumer going to sleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(Queue->Sleeping.load(std::memory_order_relaxed) && Queue->Sleeping.exchange(false)){
+        char Wake = 0;
+        if(write(Queue->WakeFD[1], &Wake, 1) < 0){}
+    }
+    return true;
+}
+
+bool PopLine(struct LineQueue* Queue, struct Line& Line){
+    size_t Head = Queue->Head.load(std::memory_order_relaxed);
+    if(Head == Queue->Tail.load(std::memory_order_acquire)) return false;
+
+    //Swap line out, slot keeps emptied string for reuse by producer
+    struct Line& Slot = Queue->Slots[Head & Queue->Mask];
+    Line.Text.clear();
+    Line.Text.swap(Slot.Text);
+    Line.Time = Slot.Time;
+    Line.Trace = Slot.Trace;
+    Queue->Head.store(Head + 1, std::memory_order_release);
+    return true;
+}
+
+bool QueueIdle(struct LineQueue* Queue){
+    //Mark consumer as sleeping, then check no line was pushed before producer could see it
+    Queue->Sleeping.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(Queue->Head.load(std::memory_order_relaxed) != Queue->Tail.load(std::memory_order_acquire)){
+        Queue->Sleeping.store(false);
         return false;
-    }else{
-        //Send corresponding flags/type and message and then wait for response
-        Packet = CreateHeader(0,1,strcpy(Packet.Message, Input.c_str()));
-        #ifdef _WIN32
-            send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-        #else
-            send(NewSocketFD, &Packet, sizeof(Packet), 0);
-        #endif
     }
     return true;
 }
 
-void Exit(int NewSocketFD, struct MessageProtocol Packet){
-    //Exiting program is represented by all 000, send exit code and exit chat
-    Packet = CreateHeader(0,0,strcpy(Packet.Message, "Client has exited the chat..."));
-    #ifdef _WIN32
-        send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-    #else
-        send(NewSocketFD, &Packet, sizeof(Packet), 0);
-    #endif
-}
\ No newline at end of file
+int LatencyBucket(long long Micros){
+    //Every power of 2 is split into 4 buckets, so bucket bounds are within 25% of each other
+    if(Micros < 4) return Micros < 0 ? 0 : (int)Micros;
+    int Power = 2;
+    while((Micros >> (Power + 1)) != 0) Power++;
+    int Bucket = 4 * (Power - 1) + (int)((Micros >> (Power - 2)) & 3);
+    return Bucket < LATENCY_BUCKETS ? Bucket : LATENCY_BUCKETS - 1;
+}
+
+long long LatencyBound(int Bucket){
+    //Largest latency placed in bucket (microseconds)
+    if(Bucket < 4) return Bucket;
+    int Power = Bucket / 4 + 1;
+    return ((long long)(5 + Bucket % 4) << (Power - 2)) - 1;
+}
+
+void PrintLatency(struct Display* Display){
+    //Find buckets holding median and 99th percentile of lines written so far
+    unsigned long Counts[LATENCY_BUCKETS], Total = 0;
+    for(int i = 0; i < LATENCY_BUCKETS; i++){
+        Counts[i] = Display->Latency[i].load(std::memory_order_relaxed);
+        Total += Counts[i];
+    }
+    long long Median = -1, P99 = -1, Max = 0;
+    unsigned long Seen = 0;
+    if(Total == 0) Median = P99 = 0;
+    for(int i = 0; i < LATENCY_BUCKETS; i++){
+        if(Counts[i] == 0) continue;
+        Seen += Counts[i];
+        if(Median < 0 && Seen * 2 >= Total) Median = LatencyBound(i);
+        if(P99 < 0 && Seen * 100 >= Total * 99) P99 = LatencyBound(i);
+        Max = LatencyBound(i);
+    }
+    std::cout << "Display latency : " << Total << " lines, p50 <= " << Median << " us, p99 <= " << P99
+              << " us, max <= " << Max << " us" << std::endl << std::endl;
+}
+
+void WriteTrace(struct Display* Display, struct Trace* Trace){
+    //Message is an async track of the client that sent it (process), every stage a slice nested in it, PINGs are
+    //under process 0 (Chrome trace JSON, opens in Perfetto)
+    const char* Message[] = {"to server", "server", "to client", "client", "render"};
+    const char* Ping[] = {"to server", "server", "from server", "client", "render"};
+    const char** Stages = Trace->From < 0 ? Ping : Message;
+    long long Times[6] = {Trace->Sent, Trace->ServerReceived, Trace->ServerForwarded, Trace->Received, Trace->Queued, Trace->Displayed};
+    int Process = Trace->From < 0 ? 0 : Trace->From;
+    std::string ID = std::to_string(Trace->From) + "-" + std::to_string(Trace->ID);
+    std::string Name = Trace->From < 0 ? "PING " + std::to_string(Trace->ID) : "message " + std::to_string(Trace->ID);
+    TraceEvent(Display, "b", Name, ID, Process, Times[0]);
+    for(int i = 0; i < 5; i++){
+        TraceEvent(Display, "b", Stages[i], ID, Process, Times[i]);
+        TraceEvent(Display, "e", Stages[i], ID, Process, Times[i + 1]);
+    }
+    TraceEvent(Display, "e", Name, ID, Process, Times[5]);
+}
+
+void TraceEvent(struct Display* Display, const char* Phase, const std::string& Name, const std::string& ID, int Process, long long Time){
+    //Times are microseconds of client's monotonic clock
+    fprintf(Display->TraceFile, "%s\n{\"name\":\"%s\",\"cat\":\"chat\",\"ph\":\"%s\",\"id\":\"%s\",\"pid\":%d,\"tid\":0,\"ts\":%lld.%03lld}",
+            Display->TraceWritten ? "," : "", Name.c_str(), Phase, ID.c_str(), Process, Time / 1000, Time % 1000);
+    Display->TraceWritten = true;
+}
+
+int DisplayBuffer::overflow(int Char){
+    if(Char != EOF) Pending += (char)Char;
+    return Char;
+}
+
+std::streamsize DisplayBuffer::xsputn(const char* Data, std::streamsize Length){
+    Pending.append(Data, Length);
+    return Length;
+}
+
+int DisplayBuffer::sync(){
+    //Flush (std::endl) hands output to renderer instead of writing to terminal, waiting only if renderer is a whole ring behind
+    if(Pending.empty()) return 0;
+    while(!PushLine(Output, Pending, Trace)) std::this_thread::yield();
+    Pending.clear();
+    Trace = NULL;
+    return 0;
+}
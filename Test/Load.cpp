@@ -0,0 +1,362 @@
+/*
+File : Load program in basic chat system with custom protocol
+Author : Connor Allred (cpa180001)
+Modified : November 28, 2021 @ The Uniersity of Texas at Dallas
+Description :
+        - Program opens many idle connections to a running server and measures what they cost it, so the
+          memory kept per client and the time taken to serve one client among many idle ones can be compared
+          between builds of Server.cpp
+        - Every connection makes the connection handshake and then stays idle, connections are opened in
+          batches (-batch) with their handshakes in flight together
+        - Resident memory of the server (VmRSS of -pid) is read before the first connection and once every
+          connection is idle, the difference is displayed per connection. Memory the kernel keeps for the
+          sockets is not part of it
+        - With -ping count, one connection then sends PING frames one at a time while every other connection
+          stays idle, and the round trips are displayed (p50, p99, max)
+        - Connections are held open for -hold seconds (STATS can be read on the server meanwhile) and closed
+        - Ports of one source address run out past about 28000 connections, -sources count spreads connections
+          over 127.0.0.1 to 127.0.0.count when loading a server on this host
+
+Usage : Load [port] [IP] [-clients count] [-pid server PID] [-batch count] [-ping count] [-hold seconds]
+             [-sources count]
+
+main()
+    - Opens every connection, reads server memory before and after, sends PINGs and displays results
+
+OpenBatch()
+    - Connects a batch of connections and makes their handshakes together, keeping the ones that finished
+
+ResidentMemory()
+    - Returns resident memory of a process (VmRSS) in KB, -1 if it can't be read
+
+Ping()
+    - Sends PING frames one at a time on a connection and returns the round trip of each
+
+MonotonicTime()
+    - Returns current time of clock that is never set back
+*/
+
+#include <iostream>
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+
+#ifdef _WIN32
+  #ifndef _WIN32_WINNT
+    #define _WIN32_WINNT 0x0501  /* Windows XP. */
+  #endif
+  #include <winsock2.h>
+  #include <Ws2tcpip.h>
+#else
+  /* Assume that any non-Windows platform uses POSIX-style sockets instead. */
+  #include <sys/socket.h>
+  #include <arpa/inet.h>
+  #include <netdb.h>  /* Needed for getaddrinfo() and freeaddrinfo() */
+  #include <unistd.h> /* Needed for close() */
+  #include <poll.h>   /* Needed for poll() */
+  #include <netinet/tcp.h>    /* Needed for TCP_NODELAY */
+  #include <sys/resource.h>   /* Needed for setrlimit() */
+#endif
+
+//List of predefined and global variables for easy scalability
+#define DEFAULT_PORT 12345      //Default port number used if one is not entered
+#define DEFAULT_CLIENTS 1000    //Connections opened if -clients is not given
+#define DEFAULT_BATCH 256       //Connections with handshakes in flight at once if -batch is not given
+#define MAX_FRAME 65536         //Max length of data in a single frame, larger frames are treated as corrupted
+#define CHAT_CHANNEL 0          //Channel for messages and control packets
+#define LOAD_TIMEOUT 5000       //Time a batch waits on its handshakes before giving up on the rest (ms)
+#define LOAD_SETTLE 1000        //Time waited once every connection is idle before reading server memory (ms)
+
+//Header placed in front of every frame sent through sockets
+struct FrameHeader{
+    unsigned char Type;         //Type of frame (see Types in Server.cpp)
+    unsigned char Flags;        //Delivers requests/errors/success messages
+    unsigned short Channel;     //Logical channel frame belongs to
+    unsigned int Length;        //Length of data following header
+};
+
+//Connection being opened
+struct Opening{
+    int SocketFD;               //Socket file descriptor
+    bool Connected;             //Set once connect() has finished and connection request was sent
+    std::string Inbox;          //Data received not yet split into frames
+};
+
+//Function Prototypes
+size_t OpenBatch(struct sockaddr_in, size_t, int, int, std::vector<int>&);  //Function for opening a batch of connections
+long ResidentMemory(int);                                   //Function for reading resident memory of a process
+std::vector<long long> Ping(int, int);                      //Function for timing PING round trips
+long long MonotonicTime();                                  //Function for reading monotonic clock
+
+int main(int argc, char *argv[]){
+
+    //Initialize the variables to be used
+    int PortNum = DEFAULT_PORT;                 //Port number of server
+    const char* IP = "127.0.0.1";              //IP address of server
+    size_t Count = DEFAULT_CLIENTS;             //Connections to open
+    size_t Batch = DEFAULT_BATCH;               //Connections with handshakes in flight at once
+    int PID = -1;                               //Process of server, memory is not read without it
+    int Pings = 0;                              //PING frames sent once every connection is idle
+    int Hold = 0;                               //Seconds connections are held open before closing
+    int Sources = 1;                            //Source addresses connections are spread over
+    std::vector<int> Connections;               //Connections opened
+
+    int Positional = 0;     //Port and IP given so far
+    for(int i = 1; i < argc; i++){
+        std::string Arg = argv[i];
+        if(Arg == "-clients" && i + 1 < argc){
+            Count = strtoul(argv[++i], NULL, 10);
+        }else if(Arg == "-pid" && i + 1 < argc){
+            PID = atoi(argv[++i]);
+        }else if(Arg == "-batch" && i + 1 < argc){
+            Batch = strtoul(argv[++i], NULL, 10);
+            if(Batch == 0) Batch = 1;
+        }else if(Arg == "-ping" && i + 1 < argc){
+            Pings = atoi(argv[++i]);
+        }else if(Arg == "-hold" && i + 1 < argc){
+            Hold = atoi(argv[++i]);
+        }else if(Arg == "-sources" && i + 1 < argc){
+            Sources = atoi(argv[++i]);
+            if(Sources < 1 || Sources > 254){
+                std::cerr << "Invalid source count given (1 to 254), program terminated" << std::endl;
+                exit(-1);
+            }
+        }else if(Positional == 0){
+            PortNum = atoi(argv[i]);
+            if(PortNum == 0){
+                std::cerr << "Invalid port number given, program terminated" << std::endl;
+                exit(-1);
+            }
+            Positional++;
+        }else if(Positional == 1){
+            IP = argv[i];
+            Positional++;
+        }else{
+            std::cerr << "Invalid option " << Arg << " given, program terminated" << std::endl;
+            std::cerr << "Usage : Load [port] [IP] [-clients count] [-pid server PID] [-batch count] [-ping count] [-hold seconds] [-sources count]" << std::endl;
+            exit(-1);
+        }
+    }
+
+    //Every connection is a file descriptor, raise limit as far as allowed
+    #ifndef _WIN32
+        struct rlimit Limit;
+        if(getrlimit(RLIMIT_NOFILE, &Limit) == 0 && Limit.rlim_cur < Limit.rlim_max){
+            Limit.rlim_cur = Limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &Limit);
+        }
+    #endif
+
+    struct sockaddr_in Address;
+    memset(&Address, '\0', sizeof(Address));
+    Address.sin_family = AF_INET;
+    Address.sin_addr.s_addr = inet_addr(IP);
+    Address.sin_port = htons(PortNum);
+
+    //Memory server holds before any connection, then open connections a batch at a time
+    long Before = PID > 0 ? ResidentMemory(PID) : -1;
+    long long Start = MonotonicTime();
+    size_t Failed = 0;
+    while(Connections.size() + Failed < Count){
+        size_t Wanted = Count - Connections.size() - Failed < Batch ? Count - Connections.size() - Failed : Batch;
+        size_t Opened = OpenBatch(Address, Wanted, Sources, Connections.size() + Failed, Connections);
+        Failed += Wanted - Opened;
+        if(Opened == 0){
+            std::cerr << "Server stopped taking connections after " << Connections.size() << std::endl;
+            break;
+        }
+    }
+    double Seconds = (MonotonicTime() - Start) / 1000000000.0;
+    std::cout << "Opened " << Connections.size() << " idle connections in " << Seconds << " s";
+    if(Failed > 0) std::cout << " (" << Failed << " failed)";
+    std::cout << std::endl;
+
+    //Server has handled every handshake, its memory now holds every idle client
+    if(PID > 0){
+        std::this_thread::sleep_for(std::chrono::milliseconds(LOAD_SETTLE));
+        long After = ResidentMemory(PID);
+        if(Before < 0 || After < 0){
+            std::cout << "Resident memory of process " << PID << " could not be read" << std::endl;
+        }else{
+            std::cout << "Server resident memory " << Before << " KB before, " << After << " KB with every connection";
+            if(!Connections.empty()) std::cout << ", " << (After - Before) * 1024 / (long)Connections.size() << " bytes per connection";
+            std::cout << std::endl;
+        }
+    }
+
+    //Round trips of one client while every other client stays idle
+    if(Pings > 0 && !Connections.empty()){
+        std::vector<long long> Trips = Ping(Connections[0], Pings);
+        if(Trips.empty()){
+            std::cout << "PING was not answered" << std::endl;
+        }else{
+            std::sort(Trips.begin(), Trips.end());
+            size_t Total = Trips.size();
+            std::cout << "PING round trips : " << Total << ", p50 " << Trips[(Total - 1) / 2] / 1000 << " us, p99 "
+                      << Trips[(Total - 1) * 99 / 100] / 1000 << " us, max " << Trips[Total - 1] / 1000 << " us" << std::endl;
+        }
+    }
+
+    if(Hold > 0){
+        std::cout << "Holding connections for " << Hold << " s" << std::endl;
+        std::this_thread::sleep_for(std::chrono::seconds(Hold));
+    }
+
+    //Connections leave without exit message, server sees them disconnect
+    for(size_t i = 0; i < Connections.size(); i++){
+        close(Connections[i]);
+    }
+}
+
+size_t OpenBatch(struct sockaddr_in Address, size_t Wanted, int Sources, int First, std::vector<int>& Connections){
+    //Every connection of batch connects without blocking, then sends its connection request once connected
+    std::vector<struct Opening> Batch;
+    for(size_t i = 0; i < Wanted; i++){
+        struct Opening New;
+        New.SocketFD = socket(AF_INET, SOCK_STREAM, 0);
+        New.Connected = false;
+        if(New.SocketFD < 0) break;
+        if(Sources > 1){
+            //Spread over 127.0.0.1 to 127.0.0.Sources, each source address has its own ports
+            struct sockaddr_in Source;
+            memset(&Source, '\0', sizeof(Source));
+            Source.sin_family = AF_INET;
+            Source.sin_addr.s_addr = htonl(0x7F000001 + (First + i) % Sources);
+            bind(New.SocketFD, (struct sockaddr *) &Source, sizeof(Source));
+        }
+        fcntl(New.SocketFD, F_SETFL, fcntl(New.SocketFD, F_GETFL, 0) | O_NONBLOCK);
+        if(connect(New.SocketFD, (struct sockaddr *) &Address, sizeof(Address)) < 0 && errno != EINPROGRESS){
+            close(New.SocketFD);
+            continue;
+        }
+        Batch.push_back(New);
+    }
+
+    //Wait for connections to be made and connection requests to be ACK'd, ACK ACK finishes the handshake
+    size_t Had = Connections.size();
+    long long Deadline = MonotonicTime() + LOAD_TIMEOUT * 1000000LL;
+    size_t Done = 0;
+    while(Done < Batch.size() && MonotonicTime() < Deadline){
+        std::vector<struct pollfd> Watch(Batch.size());
+        for(size_t i = 0; i < Batch.size(); i++){
+            Watch[i].fd = Batch[i].SocketFD;
+            Watch[i].events = Batch[i].Connected ? POLLIN : POLLOUT;
+        }
+        if(poll(&Watch[0], Watch.size(), 100) <= 0) continue;
+        for(size_t i = 0; i < Batch.size(); i++){
+            struct Opening& Open = Batch[i];
+            if(Open.SocketFD < 0 || Watch[i].revents == 0) continue;
+            struct FrameHeader Header;
+            memset(&Header, '\0', sizeof(Header));
+            if(!Open.Connected){
+                int Error = 0;
+                socklen_t Length = sizeof(Error);
+                getsockopt(Open.SocketFD, SOL_SOCKET, SO_ERROR, (char *)&Error, &Length);
+                Header.Flags = 7;
+                if(Error != 0 || send(Open.SocketFD, (char *)&Header, sizeof(Header), MSG_NOSIGNAL) != sizeof(Header)){
+                    close(Open.SocketFD);
+                    Open.SocketFD = -1;
+                    Done++;
+                    continue;
+                }
+                Open.Connected = true;
+                continue;
+            }
+
+            //Connection request ACK may come with data, which is skipped
+            char Buffer[MAX_FRAME];
+            int bytes = recv(Open.SocketFD, Buffer, sizeof(Buffer), 0);
+            if(bytes <= 0){
+                if(bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+                close(Open.SocketFD);
+                Open.SocketFD = -1;
+                Done++;
+                continue;
+            }
+            Open.Inbox.append(Buffer, bytes);
+            if(Open.Inbox.size() < sizeof(Header)) continue;
+            struct FrameHeader Answer;
+            memcpy(&Answer, Open.Inbox.data(), sizeof(Answer));
+            if(Open.Inbox.size() < sizeof(Answer) + ntohl(Answer.Length)) continue;
+            Header.Flags = 4;
+            if(Answer.Flags != 6 || send(Open.SocketFD, (char *)&Header, sizeof(Header), MSG_NOSIGNAL) != sizeof(Header)){
+                close(Open.SocketFD);
+                Open.SocketFD = -1;
+                Done++;
+                continue;
+            }
+            Connections.push_back(Open.SocketFD);
+            Open.SocketFD = -1;
+            Done++;
+        }
+    }
+
+    //Handshakes that did not finish in time are given up on
+    for(size_t i = 0; i < Batch.size(); i++){
+        if(Batch[i].SocketFD >= 0) close(Batch[i].SocketFD);
+    }
+    return Connections.size() - Had;
+}
+
+long ResidentMemory(int PID){
+    //VmRSS line of process status is in KB
+    char Path[64];
+    snprintf(Path, sizeof(Path), "/proc/%d/status", PID);
+    FILE* Status = fopen(Path, "r");
+    if(Status == NULL) return -1;
+    char Line[256];
+    long Resident = -1;
+    while(fgets(Line, sizeof(Line), Status) != NULL){
+        if(strncmp(Line, "VmRSS:", 6) == 0){
+            Resident = atol(Line + 6);
+            break;
+        }
+    }
+    fclose(Status);
+    return Resident;
+}
+
+std::vector<long long> Ping(int SocketFD, int Count){
+    //PING carries time it was sent, answer is found by its type and every other frame is skipped
+    std::vector<long long> Trips;
+    fcntl(SocketFD, F_SETFL, fcntl(SocketFD, F_GETFL, 0) & ~O_NONBLOCK);
+    int Option = 1;
+    setsockopt(SocketFD, IPPROTO_TCP, TCP_NODELAY, (char *)&Option, sizeof(Option));
+    for(int i = 0; i < Count; i++){
+        char Frame[sizeof(struct FrameHeader) + 8];
+        struct FrameHeader Header;
+        memset(&Header, '\0', sizeof(Header));
+        Header.Type = 13;
+        Header.Flags = 1;
+        Header.Channel = htons(CHAT_CHANNEL);
+        Header.Length = htonl(8);
+        memcpy(Frame, &Header, sizeof(Header));
+        long long Sent = MonotonicTime();
+        memcpy(Frame + sizeof(Header), &Sent, 8);
+        if(send(SocketFD, Frame, sizeof(Frame), MSG_NOSIGNAL) != sizeof(Frame)) break;
+        bool Answered = false;
+        while(!Answered){
+            struct FrameHeader Answer;
+            char Data[MAX_FRAME];
+            if(recv(SocketFD, (char *)&Answer, sizeof(Answer), MSG_WAITALL) != sizeof(Answer)) return Trips;
+            unsigned int Length = ntohl(Answer.Length);
+            if(Length > MAX_FRAME || (Length > 0 && recv(SocketFD, Data, Length, MSG_WAITALL) != (int)Length)) return Trips;
+            Answered = Answer.Type == 13;
+        }
+        Trips.push_back(MonotonicTime() - Sent);
+    }
+    return Trips;
+}
+
+long long MonotonicTime(){
+    //Clock is never set back so times are never negative
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,615 @@
+/*
+File : Replay program in basic chat system with custom protocol
+Author : Connor Allred (cpa180001)
+Modified : November 28, 2021 @ The Uniersity of Texas at Dallas
+Description :
+        - Program feeds a capture file recorded by the server or client (-capture) back into a running
+          server or client, so a recorded load pattern can be reproduced locally and the throughput
+          and latency of different builds of Server.cpp/Client.cpp compared
+        - Only frames that were sent toward the program being replayed into are sent, frames sent back
+          by it are read and counted but otherwise ignored
+        - Replaying into a SERVER connects once for every client in the capture, replaying into a CLIENT
+          waits for the client to connect and replays one connection of the capture (the first one
+          unless -connection is given)
+        - Replay makes its own handshake on every connection, handshake frames in the capture are skipped
+        - Frames are sent at the time they were recorded, or as fast as the socket takes them with -fast
+          (exit messages are then held back until everything else has been answered)
+        - File frames are replayed as recorded, they are only saved by the program being replayed into
+          if it requested the same transfer ID (file requests in the capture are replayed too, so a
+          server with -accept ALL sends the files requested in a client capture again)
+
+        - Once every frame is sent and nothing has been received for a second, the number of frames and
+          bytes sent and received, throughput, and the time taken to answer file requests are displayed
+        - Room messages replayed into a server are timed until the server has relayed them to every other
+          connection in the room, a relayed message is matched with the oldest one sent with the same room
+          and text that its member has not received yet (plain messages only reach the server user, and a
+          client being replayed into relays nothing, so neither is timed)
+
+Usage : Replay [capture file] [port] [IP] [-into SERVER|CLIENT] [-fast] [-connection ID]
+
+main()
+    - Loads the capture, connects to (or accepts) the program being replayed into and displays results
+
+LoadCapture()
+    - Reads the frames of the capture sent toward the program being replayed into
+
+Handshake()
+    - Makes connection handshake as a client (connection request) or as a server (connection request ACK)
+
+Replay()
+    - Sends frames at their recorded times (or right away), reading everything sent back until the
+      program being replayed into has gone quiet
+
+ReadFrames()
+    - Splits bytes received back into frames, timing the answers to file requests and room messages
+      relayed by the server
+
+RoomMessage()
+    - Returns room name and text of a room message frame (traced or not), empty for other frames
+
+PrintResults() / PrintLatency()
+    - Displays frames and bytes sent/received, throughput, file request answer latency and room message
+      relay latency
+
+MonotonicTime()
+    - Returns current time of clock that is never set back
+*/
+
+#include <iostream>
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+
+
+#ifdef _WIN32
+  #ifndef _WIN32_WINNT
+    #define _WIN32_WINNT 0x0501  /* Windows XP. */
+  #endif
+  #include <winsock2.h>
+  #include <Ws2tcpip.h>
+#else
+  /* Assume that any non-Windows platform uses POSIX-style sockets instead. */
+  #include <sys/socket.h>
+  #include <arpa/inet.h>
+  #include <netdb.h>  /* Needed for getaddrinfo() and freeaddrinfo() */
+  #include <unistd.h> /* Needed for close() */
+  #include <poll.h>   /* Needed for poll() */
+  #include <netinet/tcp.h>    /* Needed for TCP_NODELAY */
+#endif
+
+//List of predefined and global variables for easy scalability
+#define DEFAULT_PORT 12345      //Default port number used if one is not entered
+#define MAX_SIZE 65536          //Max size of buffer for receiving data
+#define MAX_FRAME 65536         //Max length of data in a single frame, larger frames are treated as corrupted
+#define CHAT_CHANNEL 0          //Channel for messages and control packets
+#define REPLAY_WINDOW 262144    //Max bytes waiting to be sent on a connection with -fast
+#define REPLAY_QUIET 1000       //Milliseconds without receiving anything before replay ends
+#define TRACE_SIZE 32           //Bytes of trace fields in front of a traced frame
+
+//Capture file values
+#define CAPTURE_MAGIC "CCAP"        //First bytes of every capture file
+#define CAPTURE_VERSION 2           //Version of capture file layout
+#define CAPTURE_SERVER 0            //Capture recorded by server
+#define CAPTURE_CLIENT 1            //Capture recorded by client
+#define CAPTURE_SENT 0              //Frame was sent
+#define CAPTURE_RECEIVED 1          //Frame was received
+
+//Program being replayed into
+#define INTO_SERVER 0
+#define INTO_CLIENT 1
+
+//Header placed in front of every frame sent through sockets
+struct FrameHeader{
+    unsigned char Type;         //Type of frame (see Types in Server.cpp)
+    unsigned char Flags;        //Delivers requests/errors/success messages
+    unsigned short Channel;     //Logical channel frame belongs to
+    unsigned int Length;        //Length of data following header
+};
+
+//Header at start of capture file
+struct CaptureHeader{
+    char Magic[4];              //CAPTURE_MAGIC
+    unsigned char Version;      //CAPTURE_VERSION
+    unsigned char Role;         //Program that recorded capture (CAPTURE_SERVER or CAPTURE_CLIENT)
+    unsigned short Reserved;
+};
+
+//Header placed in front of every frame in capture file
+struct CaptureRecord{
+    unsigned int Time;          //Microseconds since previous frame
+    unsigned char Direction;    //CAPTURE_SENT or CAPTURE_RECEIVED
+    unsigned char Reserved[3];
+    unsigned int Connection;    //Client ID frame was sent to/received from, 0 on client
+};
+
+//Frame of capture to be replayed
+struct ReplayFrame{
+    long long Time;             //Microseconds since start of capture
+    int Connection;             //Connection of capture frame was recorded on
+    std::string Frame;          //Whole frame as sent through socket
+};
+
+//Room message sent, timed until every other member of room has received it
+struct RoomSend{
+    long long Time;             //Time message was sent (nanoseconds)
+    int Connection;             //Connection of capture it was sent on, which is not sent it back
+};
+
+//Connection to program being replayed into
+struct Peer{
+    int SocketFD;               //Socket file descriptor
+    int Connection;             //Connection of capture replayed on it
+    bool Closed;                //Set once connection has been closed
+    std::string Outbox;         //Frames waiting to be sent
+    size_t Offset;              //Bytes of outbox already sent
+    std::string Inbox;          //Data received not yet split into frames
+    std::string Exit;           //Exit message held back with -fast until replay goes quiet
+    std::map<int, long long> Requests;  //Time file requests were sent (nanoseconds), by transfer ID
+    std::map<std::string, size_t> Relayed;  //Room messages received, by room and text, as next send to match
+};
+
+//Results of replay
+struct ReplayResults{
+    unsigned long FramesSent;           //Frames sent
+    unsigned long long BytesSent;       //Bytes sent
+    unsigned long FramesReceived;       //Frames received back
+    unsigned long long BytesReceived;   //Bytes received back
+    long long Elapsed;                  //Time from first frame to last frame being sent (nanoseconds)
+    std::vector<long long> Answers;     //Time taken to answer each file request (nanoseconds)
+    std::map<std::string, std::vector<struct RoomSend> > Rooms;  //Room messages sent, by room and text
+    unsigned long RoomMessages;         //Room messages sent
+    std::vector<long long> Deliveries;  //Time taken for a room message to reach each other member (nanoseconds)
+};
+
+//Function Prototypes
+bool LoadCapture(const char*, int, int&, std::vector<struct ReplayFrame>&);   //Function for reading capture file
+bool Handshake(int, bool);                                  //Function for making connection handshake
+void Replay(std::map<int, struct Peer>&, std::vector<struct ReplayFrame>&, bool, struct ReplayResults&);  //Function for sending frames
+void ReadFrames(struct Peer&, struct ReplayResults&);       //Function for splitting received data into frames
+std::string RoomMessage(const char*, size_t, bool);         //Function for reading room and text of room message
+void PrintResults(struct ReplayResults&, size_t);           //Function for displaying results
+void PrintLatency(const char*, std::vector<long long>&);    //Function for displaying percentiles of times
+long long MonotonicTime();                                  //Function for reading monotonic clock
+
+int main(int argc, char *argv[]){
+
+    //Initialize the variables to be used
+    int PortNum = DEFAULT_PORT;                 //Port number of program being replayed into
+    const char* IP = "127.0.0.1";              //IP address of server being replayed into
+    int Into = INTO_SERVER;                     //Program being replayed into
+    bool Fast = false;                          //Send frames without waiting for their recorded time
+    int Connection = -1;                        //Connection of capture replayed into client, -1 for first one
+    std::vector<struct ReplayFrame> Frames;     //Frames to be replayed
+
+    if(argc < 2){
+        std::cerr << "Usage : Replay [capture file] [port] [IP] [-into SERVER|CLIENT] [-fast] [-connection ID]" << std::endl;
+        exit(-1);
+    }
+    int Positional = 0;     //Port and IP given so far
+    for(int i = 2; i < argc; i++){
+        std::string Arg = argv[i];
+        if(Arg == "-into" && i + 1 < argc){
+            std::string Target = argv[++i];
+            if(Target == "SERVER"){
+                Into = INTO_SERVER;
+            }else if(Target == "CLIENT"){
+                Into = INTO_CLIENT;
+            }else{
+                std::cerr << "Invalid program given (SERVER or CLIENT), program terminated" << std::endl;
+                exit(-1);
+            }
+        }else if(Arg == "-fast"){
+            Fast = true;
+        }else if(Arg == "-connection" && i + 1 < argc){
+            Connection = atoi(argv[++i]);
+        }else if(Positional == 0){
+            PortNum = atoi(argv[i]);
+            if(PortNum == 0){
+                std::cerr << "Invalid port number given, program terminated" << std::endl;
+                exit(-1);
+            }
+            Positional++;
+        }else if(Positional == 1){
+            IP = argv[i];
+            Positional++;
+        }else{
+            std::cerr << "Invalid option " << Arg << " given, program terminated" << std::endl;
+            exit(-1);
+        }
+    }
+
+    if(!LoadCapture(argv[1], Into, Connection, Frames)){
+        exit(-1);
+    }
+    std::cout << "Loaded " << Frames.size() << " frames to replay into " << (Into == INTO_SERVER ? "server" : "client") << std::endl;
+
+    //If on windows OS
+    #ifdef _WIN32
+        WSADATA wsa_data;
+        WSAStartup(MAKEWORD(1,1), &wsa_data);
+    #endif
+
+    //Open a connection for every connection of capture
+    std::map<int, struct Peer> Peers;
+    int ListenFD = -1;
+    if(Into == INTO_CLIENT){
+        //Wait for client to connect as server would
+        struct sockaddr_in Address;
+        memset(&Address, '\0', sizeof(Address));
+        Address.sin_family = AF_INET;
+        Address.sin_addr.s_addr = INADDR_ANY;
+        Address.sin_port = htons(PortNum);
+        ListenFD = socket(AF_INET, SOCK_STREAM, 0);
+        int Option = 1;
+        setsockopt(ListenFD, SOL_SOCKET, SO_REUSEADDR, (char *)&Option, sizeof(Option));
+        if(ListenFD < 0 || bind(ListenFD, (struct sockaddr *) &Address, sizeof(Address)) || listen(ListenFD, 1)){
+            std::cerr << "Socket binding for replay failed, program terminated" << std::endl;
+            exit(-2);
+        }
+        std::cout << "Waiting for client to connect... " << std::endl;
+    }
+    for(size_t i = 0; i < Frames.size(); i++){
+        if(Peers.count(Frames[i].Connection) > 0) continue;
+        int SocketFD;
+        if(Into == INTO_CLIENT){
+            SocketFD = accept(ListenFD, NULL, NULL);
+        }else{
+            struct sockaddr_in Address;
+            memset(&Address, '\0', sizeof(Address));
+            Address.sin_family = AF_INET;
+            Address.sin_addr.s_addr = inet_addr(IP);
+            Address.sin_port = htons(PortNum);
+            SocketFD = socket(AF_INET, SOCK_STREAM, 0);
+            if(SocketFD >= 0 && connect(SocketFD, (struct sockaddr *) &Address, sizeof(Address)) < 0){
+                close(SocketFD);
+                SocketFD = -1;
+            }
+        }
+        if(SocketFD < 0 || !Handshake(SocketFD, Into == INTO_SERVER)){
+            std::cerr << "Connection could not be established for connection " << Frames[i].Connection << ", program terminated" << std::endl;
+            exit(-2);
+        }
+        int Option = 1;
+        setsockopt(SocketFD, IPPROTO_TCP, TCP_NODELAY, (char *)&Option, sizeof(Option));
+        fcntl(SocketFD, F_SETFL, fcntl(SocketFD, F_GETFL, 0) | O_NONBLOCK);
+        struct Peer& New = Peers[Frames[i].Connection];
+        New.SocketFD = SocketFD;
+        New.Connection = Frames[i].Connection;
+        New.Closed = false;
+        New.Offset = 0;
+    }
+    if(ListenFD >= 0) close(ListenFD);
+
+    //Replay every frame and display how the program kept up
+    struct ReplayResults Results;
+    Results.FramesSent = 0;
+    Results.BytesSent = 0;
+    Results.FramesReceived = 0;
+    Results.BytesReceived = 0;
+    Results.Elapsed = 0;
+    Results.RoomMessages = 0;
+    Replay(Peers, Frames, Fast, Results);
+    PrintResults(Results, Peers.size());
+
+    //Replay has ended, close every connection
+    for(std::map<int, struct Peer>::iterator It = Peers.begin(); It != Peers.end(); It++){
+        #ifdef _WIN32
+            shutdown(It->second.SocketFD, SD_BOTH);
+            closesocket(It->second.SocketFD);
+        #else
+            shutdown(It->second.SocketFD, SHUT_RDWR);
+            close(It->second.SocketFD);
+        #endif
+    }
+
+    //If on windows OS
+    #ifdef _WIN32
+        WSACleanup();
+    #endif
+}
+
+bool LoadCapture(const char* Filename, int Into, int& Connection, std::vector<struct ReplayFrame>& Frames){
+    FILE* File = fopen(Filename, "rb");
+    if(File == NULL){
+        std::cerr << "Capture file could not be opened, program terminated" << std::endl;
+        return false;
+    }
+    struct CaptureHeader Header;
+    if(fread(&Header, sizeof(Header), 1, File) != 1 || memcmp(Header.Magic, CAPTURE_MAGIC, sizeof(Header.Magic)) != 0 ||
+       Header.Version != CAPTURE_VERSION){
+        std::cerr << "File is not a capture file, program terminated" << std::endl;
+        fclose(File);
+        return false;
+    }
+
+    //Frames sent toward program being replayed into were received by a server capture's server, or sent by
+    //a client capture's client, when replaying into a server (and the other way around into a client)
+    int Wanted;
+    if(Into == INTO_SERVER){
+        Wanted = Header.Role == CAPTURE_SERVER ? CAPTURE_RECEIVED : CAPTURE_SENT;
+    }else{
+        Wanted = Header.Role == CAPTURE_SERVER ? CAPTURE_SENT : CAPTURE_RECEIVED;
+    }
+
+    long long Time = 0;     //Microseconds since start of capture
+    struct CaptureRecord Record;
+    while(fread(&Record, sizeof(Record), 1, File) == 1){
+        struct FrameHeader Frame;
+        if(fread(&Frame, sizeof(Frame), 1, File) != 1) break;
+        unsigned int Length = ntohl(Frame.Length);
+        if(Length > MAX_FRAME){
+            std::cerr << "Capture file is corrupted, replaying frames before corruption" << std::endl;
+            break;
+        }
+        struct ReplayFrame Replayed;
+        Replayed.Frame.assign((char *)&Frame, sizeof(Frame));
+        Replayed.Frame.resize(sizeof(Frame) + Length);
+        if(Length > 0 && fread(&Replayed.Frame[sizeof(Frame)], 1, Length, File) != Length) break;
+        Time += ntohl(Record.Time);
+
+        //Skip frames sent away from program, and handshakes since replay makes its own
+        Replayed.Time = Time;
+        Replayed.Connection = ntohl(Record.Connection);
+        if(Record.Direction != Wanted) continue;
+        if(Frame.Type == 0 && ntohs(Frame.Channel) == CHAT_CHANNEL && (Frame.Flags == 7 || Frame.Flags == 6 || Frame.Flags == 4)) continue;
+
+        //Only one connection can be replayed into a client
+        if(Into == INTO_CLIENT){
+            if(Connection < 0) Connection = Replayed.Connection;
+            if(Replayed.Connection != Connection) continue;
+        }
+        Frames.push_back(Replayed);
+    }
+    fclose(File);
+    if(Frames.empty()){
+        std::cerr << "Capture has no frames to replay, program terminated" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Handshake(int SocketFD, bool AsClient){
+    //Handshake frames are header only, with type 0 and flags 7 (request), 6 (ACK) and 4 (ACK ACK)
+    struct FrameHeader Header;
+    memset(&Header, '\0', sizeof(Header));
+    char Buffer[MAX_FRAME];
+    if(AsClient){
+        Header.Flags = 7;
+        send(SocketFD, (char *)&Header, sizeof(Header), 0);
+    }
+
+    //Wait for connection request (as server) or its ACK (as client), skipping its data
+    struct FrameHeader Answer;
+    if(recv(SocketFD, (char *)&Answer, sizeof(Answer), MSG_WAITALL) != sizeof(Answer)) return false;
+    unsigned int Length = ntohl(Answer.Length);
+    if(Length > MAX_FRAME || (Length > 0 && recv(SocketFD, Buffer, Length, MSG_WAITALL) != (int)Length)) return false;
+    if(Answer.Flags != (AsClient ? 6 : 7)) return false;
+
+    Header.Flags = AsClient ? 4 : 6;
+    send(SocketFD, (char *)&Header, sizeof(Header), 0);
+    if(AsClient) return true;
+
+    //Server waits for ACK ACK
+    if(recv(SocketFD, (char *)&Answer, sizeof(Answer), MSG_WAITALL) != sizeof(Answer)) return false;
+    Length = ntohl(Answer.Length);
+    if(Length > MAX_FRAME || (Length > 0 && recv(SocketFD, Buffer, Length, MSG_WAITALL) != (int)Length)) return false;
+    return Answer.Flags == 4;
+}
+
+void Replay(std::map<int, struct Peer>& Peers, std::vector<struct ReplayFrame>& Frames, bool Fast, struct ReplayResults& Results){
+    size_t Next = 0;                    //Next frame to be sent
+    long long Start = MonotonicTime();  //Time replay started, frame times are counted from it
+    long long Quiet = 0;                //Time from which nothing has been received since all frames were sent
+
+    while(true){
+        //Place every frame that is due in its connection's outbox, with -fast only while outbox has room
+        long long Now = MonotonicTime();
+        while(Next < Frames.size()){
+            struct Peer& Peer = Peers[Frames[Next].Connection];
+            if(!Fast && Start + Frames[Next].Time * 1000 > Now) break;
+            if(Fast && Peer.Outbox.size() - Peer.Offset > REPLAY_WINDOW) break;
+            struct FrameHeader Header;
+            memcpy(&Header, Frames[Next].Frame.data(), sizeof(Header));
+            if(Fast && Header.Type == 0 && Header.Flags == 0 && ntohs(Header.Channel) == CHAT_CHANNEL){
+                //Exit message would close connection before frames sent ahead of it are answered
+                Peer.Exit = Frames[Next].Frame;
+            }else if(!Peer.Closed){
+                //Time file requests so their answer can be timed
+                if(Header.Type == 1) Peer.Requests[ntohs(Header.Channel)] = Now;
+                //Time room messages so the server relaying them to every other member can be timed
+                std::string Key = RoomMessage(Frames[Next].Frame.data(), Frames[Next].Frame.size(), false);
+                if(!Key.empty()){
+                    struct RoomSend Send;
+                    Send.Time = Now;
+                    Send.Connection = Frames[Next].Connection;
+                    Results.Rooms[Key].push_back(Send);
+                    Results.RoomMessages++;
+                }
+                Peer.Outbox += Frames[Next].Frame;
+                Results.FramesSent++;
+                Results.BytesSent += Frames[Next].Frame.size();
+            }
+            Next++;
+        }
+
+        //Send as much as every connection takes
+        bool Waiting = false;   //Set if a connection still has data to send
+        for(std::map<int, struct Peer>::iterator It = Peers.begin(); It != Peers.end(); It++){
+            struct Peer& Peer = It->second;
+            while(!Peer.Closed && Peer.Offset < Peer.Outbox.size()){
+                int bytes = send(Peer.SocketFD, Peer.Outbox.data() + Peer.Offset, Peer.Outbox.size() - Peer.Offset, MSG_NOSIGNAL);
+                if(bytes < 0){
+                    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) Peer.Closed = true;
+                    break;
+                }
+                Peer.Offset += bytes;
+            }
+            if(Peer.Offset == Peer.Outbox.size()){
+                Peer.Outbox.clear();
+                Peer.Offset = 0;
+            }else if(!Peer.Closed){
+                Waiting = true;
+                //Drop sent data once it is most of outbox
+                if(Peer.Offset > Peer.Outbox.size() / 2){
+                    Peer.Outbox.erase(0, Peer.Offset);
+                    Peer.Offset = 0;
+                }
+            }
+        }
+        Now = MonotonicTime();
+        if(Next == Frames.size() && !Waiting && Results.Elapsed == 0){
+            //Every frame has been sent, wait for program to go quiet
+            Results.Elapsed = Now - Start;
+            Quiet = Now;
+        }
+
+        //Wait until next frame is due, a connection has room or data arrives
+        std::vector<struct pollfd> Watch;
+        std::vector<struct Peer*> Watched;
+        for(std::map<int, struct Peer>::iterator It = Peers.begin(); It != Peers.end(); It++){
+            if(It->second.Closed) continue;
+            struct pollfd Entry;
+            Entry.fd = It->second.SocketFD;
+            Entry.events = POLLIN;
+            if(It->second.Offset < It->second.Outbox.size()) Entry.events |= POLLOUT;
+            Entry.revents = 0;
+            Watch.push_back(Entry);
+            Watched.push_back(&It->second);
+        }
+        if(Watch.empty()) break;    //Every connection has been closed
+        int Timeout = -1;
+        if(Results.Elapsed != 0){
+            Timeout = (int)((Quiet + (long long)REPLAY_QUIET * 1000000 - Now) / 1000000);
+            if(Timeout <= 0) break;
+        }else if(Next < Frames.size() && !Fast){
+            Timeout = (int)((Start + Frames[Next].Time * 1000 - Now) / 1000000);
+            if(Timeout < 0) Timeout = 0;
+        }else if(Next < Frames.size() && !Waiting){
+            Timeout = 0;
+        }
+        if(poll(&Watch[0], Watch.size(), Timeout) < 0 && errno != EINTR) break;
+
+        //Read everything sent back
+        for(size_t i = 0; i < Watch.size(); i++){
+            if(!(Watch[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            char Buffer[MAX_SIZE];
+            int bytes;
+            while((bytes = recv(Watch[i].fd, Buffer, sizeof(Buffer), 0)) > 0){
+                Watched[i]->Inbox.append(Buffer, bytes);
+                Results.BytesReceived += bytes;
+                Quiet = MonotonicTime();
+            }
+            if(bytes == 0 || (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) Watched[i]->Closed = true;
+            ReadFrames(*Watched[i], Results);
+        }
+    }
+    if(Results.Elapsed == 0) Results.Elapsed = MonotonicTime() - Start;
+
+    //Everything has been answered, send exit messages held back
+    for(std::map<int, struct Peer>::iterator It = Peers.begin(); It != Peers.end(); It++){
+        struct Peer& Peer = It->second;
+        if(Peer.Closed || Peer.Exit.empty()) continue;
+        if(send(Peer.SocketFD, Peer.Exit.data(), Peer.Exit.size(), MSG_NOSIGNAL) == (int)Peer.Exit.size()){
+            Results.FramesSent++;
+            Results.BytesSent += Peer.Exit.size();
+        }
+    }
+}
+
+void ReadFrames(struct Peer& Peer, struct ReplayResults& Results){
+    size_t Used = 0;    //Bytes of inbox already processed
+    while(Peer.Inbox.size() - Used >= sizeof(struct FrameHeader)){
+        struct FrameHeader Header;
+        memcpy(&Header, Peer.Inbox.data() + Used, sizeof(Header));
+        unsigned int Length = ntohl(Header.Length);
+        if(Length > MAX_FRAME){
+            //Rest of data can't be trusted
+            Peer.Closed = true;
+            break;
+        }
+        if(Peer.Inbox.size() - Used < sizeof(Header) + Length) break;
+        const char* Frame = Peer.Inbox.data() + Used;
+        Used += sizeof(Header) + Length;
+        Results.FramesReceived++;
+
+        //File request ACK/ignored answers request with same transfer ID
+        if(Header.Type == 2 || Header.Type == 3){
+            std::map<int, long long>::iterator Found = Peer.Requests.find(ntohs(Header.Channel));
+            if(Found != Peer.Requests.end()){
+                Results.Answers.push_back(MonotonicTime() - Found->second);
+                Peer.Requests.erase(Found);
+            }
+        }
+
+        //Relayed room message answers oldest send of same room and text this member has not received, skipping
+        //those it sent itself as server does not send them back
+        std::string Key = RoomMessage(Frame, sizeof(Header) + Length, true);
+        std::map<std::string, std::vector<struct RoomSend> >::iterator Sent = Results.Rooms.find(Key);
+        if(!Key.empty() && Sent != Results.Rooms.end()){
+            size_t& Next = Peer.Relayed[Key];
+            while(Next < Sent->second.size() && Sent->second[Next].Connection == Peer.Connection) Next++;
+            if(Next < Sent->second.size()){
+                Results.Deliveries.push_back(MonotonicTime() - Sent->second[Next].Time);
+                Next++;
+            }
+        }
+    }
+    Peer.Inbox.erase(0, Used);
+}
+
+std::string RoomMessage(const char* Frame, size_t Size, bool Relayed){
+    //Traced frame holds trace fields and then the whole room message frame
+    struct FrameHeader Header;
+    memcpy(&Header, Frame, sizeof(Header));
+    size_t Start = sizeof(Header);
+    if(Header.Type == 12 && ntohs(Header.Channel) == CHAT_CHANNEL && Size >= 2 * sizeof(Header) + TRACE_SIZE){
+        memcpy(&Header, Frame + sizeof(Header) + TRACE_SIZE, sizeof(Header));
+        Start = 2 * sizeof(Header) + TRACE_SIZE;
+    }
+    if(Header.Type != 9 || ntohs(Header.Channel) != CHAT_CHANNEL) return "";
+
+    //Server puts ID of client that sent it in front, which is not the ID it had in capture
+    if(Relayed) Start += 4;
+    if(Start > Size) return "";
+    return std::string(Frame + Start, Size - Start);
+}
+
+void PrintResults(struct ReplayResults& Results, size_t Connections){
+    double Seconds = Results.Elapsed / 1000000000.0;
+    std::cout << "Replayed " << Results.FramesSent << " frames (" << Results.BytesSent << " bytes) on " << Connections
+              << " connections in " << Results.Elapsed / 1000000.0 << " ms" << std::endl;
+    if(Seconds > 0){
+        std::cout << "Throughput : " << (long long)(Results.FramesSent / Seconds) << " frames/s, "
+                  << Results.BytesSent / Seconds / 1048576 << " MB/s" << std::endl;
+    }
+    std::cout << "Received " << Results.FramesReceived << " frames (" << Results.BytesReceived << " bytes)" << std::endl;
+
+    PrintLatency("File request answers", Results.Answers);
+    if(Results.RoomMessages > 0){
+        std::cout << "Room messages : " << Results.RoomMessages << " sent, " << Results.Deliveries.size()
+                  << " relayed to other members" << std::endl;
+        PrintLatency("Room message relays", Results.Deliveries);
+    }
+}
+
+void PrintLatency(const char* Name, std::vector<long long>& Times){
+    //Times are sorted to find percentiles
+    if(Times.empty()) return;
+    std::sort(Times.begin(), Times.end());
+    size_t Count = Times.size();
+    std::cout << Name << " : " << Count << ", p50 " << Times[(Count - 1) / 2] / 1000
+              << " us, p99 " << Times[(Count - 1) * 99 / 100] / 1000 << " us, max "
+              << Times[Count - 1] / 1000 << " us" << std::endl;
+}
+
+long long MonotonicTime(){
+    //Clock is never set back so times are never negative
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
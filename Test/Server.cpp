@@ -6,11 +6,13 @@ Description :
         - Program is a basic chat system that operates on the Linux OS
         - Program will consist of a server and client, with the server creating the socket
           and the client making a connection request and starting the chat
-        - The chat will facilitate a "ping-pong" communication style with the client first
-          sending a message and the server responding
+        - The server accepts up to MAX_CLIENTS clients at once (or -max-clients), messages typed on
+          the server are sent to every connected client
+        - Messages, control packets and file data are all sent as frames on logical channels of the
+          same connection, so either user can send messages at any time, even during a file transfer
         - Either the server or client can request a file to be transferred by sending FILE
           as a message and stating the file desired
-        - The inputted file by the server/client will be used to create a new file in the 
+        - The inputted file by the server/client will be used to create a new file in the
           respective system and store the transferred data
 
         - As a result, THE FULL PATH OF THE DESIRED FILENAME WHEN REQUESTING IS NEEDED FOR THE
@@ -22,10 +24,127 @@ Description :
           to send the full file, otherwise an empty file of the same name will be sent after
           a message acknowledging the file transfer acceptance and declaring when the file transfer
           is complete
-        - The user that sends the file will wait for the other's response after a complete transfer
+        - File data is split into frames on its own channel, frames on the chat channel are always
+          sent ahead of file frames so a large transfer does not hold up the chat
         - If N is inputted, the user that requested the file will be sent the rejection message
           and will be set to send another message
 
+        - Every client has its own bounded send queue so a client on a slow link can not block
+          the server or the other clients. Once a queue passes the high watermark the slow
+          consumer policy is applied :
+              DROP       - oldest queued chat messages are dropped until the low watermark is reached
+              PAUSE      - file transfers to the client are paused until the low watermark is reached
+              DISCONNECT - the client is disconnected
+        - STATS typed on the server displays the queue depth metrics of every client
+
+        - Every file request has its own transfer ID, the file is sent on the channel matching
+          that ID so many requests can be made back to back and are served at the same time,
+          each file being sent one chunk in turn so they share the connection equally
+        - FILE followed by filenames (FILE a.txt b.png) requests every file at once without prompts
+        - A directory is requested like a file (FILE Test), the sender lists every file below it and sends a
+          manifest of paths and sizes followed by the data of every file back to back on the transfer's channel,
+          small files are packed together into the same frames and large files are written from the file
+          straight into the socket (sendfile()), the requester recreates the directory with the same layout
+        - File requests from clients are answered depending on the -accept policy :
+              ASK  - server user is asked Y/N and the filename to send (default)
+              ALL  - requested file is sent without asking, only for paths below the server's folder
+                     (symlinks are resolved first, so a link can't point outside it)
+              NONE - every file request is rejected
+
+        - File data sent can be limited with token buckets, a chunk is only queued once the transfer,
+          the client it is sent to and the server as a whole all have tokens for it :
+              -file-rate   - limit of every single file transfer
+              -client-rate - limit of all file transfers to one client
+              -total-rate  - limit of all file transfers of the server
+          Rates are in bytes per second, a K, M or G after the number multiplies it by 1024, 1024^2 or 1024^3
+
+        - Clients can JOIN and LEAVE named rooms and send a message to every member of a room with
+          @room message, the server relays room messages only to the room's members
+        - The server user can also JOIN/LEAVE rooms to see their messages, send to any room with @room
+          and list every room with ROOMS
+
+        - Sockets are handled by one I/O thread that never writes to the terminal itself, output is handed
+          through a lock-free queue to a renderer thread that writes it in batches, and typed lines are
+          read by an input thread and handed back through another queue, so a slow terminal can't hold
+          up the chat (built with -pthread on Linux)
+        - STATS also displays how long output waits before being written to the terminal (p50/p99)
+
+        - -capture file records every frame sent and received, with its time and file data, in a compact
+          binary capture file (see Capture File) that Replay can feed back into a client for comparing builds
+
+        - An idle client only keeps a small connection state, buffers and send queues are taken from a
+          pool shared by every client while data is being received or sent and given back once the client
+          is idle again, and file transfer state only exists while files are being transferred, so the
+          server can hold a very large number of mostly idle clients (-max-clients). Sockets are watched with
+          epoll, and each pass only visits clients that have events or still have data to process or send, so
+          idle clients cost nothing while others are served. Load opens many idle connections and displays the
+          server memory each one takes and PING round trips among them
+        - STATS also displays how many clients are idle, the buffers in use and memory each client added since
+          server started
+
+        - -tls encrypts every connection with TLS, the handshake is made with a self-signed certificate
+          created when the server starts (its SHA-256 fingerprint is displayed so clients can check it) :
+              KERNEL - once the handshake is done OpenSSL hands the keys to the kernel (kTLS) where the
+                       kernel has the tls ULP, frames are then encrypted by the kernel as they are written and
+                       large files of directories go out with sendfile(), otherwise falls back to USER (the
+                       handshake line displays which one a client got)
+              USER   - every frame is encrypted by OpenSSL before being written
+          TLS needs the program built with -DUSE_TLS and linked with -lssl -lcrypto
+
+        - -udp lets clients that ask for it during the connection request send and receive small chat
+          frames (messages, errors and room frames) as datagrams on the same port number, so a lost
+          packet only holds up the message it carried and not the file data queued behind it on TCP.
+          Datagrams have sequence numbers and selective ACKs, lost datagrams are sent again by a timer
+          set from the measured round trip and every sender's frames are delivered in order. File
+          transfers, handshake and exit frames stay on TCP, and chat moves back to TCP for good if a
+          client stops answering datagrams (see Datagram Header). Not offered with -tls
+        - STATS also displays datagrams sent, sent again and received
+
+        - -local also listens on a Unix domain socket (/tmp/chat-port.sock) for clients on the same host,
+          which skips the TCP/IP stack. Such a client may also hand the server shared memory holding a
+          ring for each direction with its connection request, chat and file frames are then copied
+          through the rings and the peer is woken with an eventfd only while it sleeps (see Shared Memory
+          Rings). Files sent to these clients are passed as file descriptors (SCM_RIGHTS) instead of being
+          read and sent, the receiving end copies them itself (copy_file_range()) a chunk at a time, so
+          rate limits do not apply to them. Not offered with -tls
+        - STATS also displays clients on this host and files passed to them
+
+        - Files sent are kept in memory (-cache bytes, 64M by default, 0 turns it off), a file requested again
+          is served from memory without being opened, checked or read. Every cached file is watched with
+          inotify and dropped once it is changed, replaced or removed, the least recently sent files are
+          dropped once the cache is over its size. The File Start frame of a cached file also carries its
+          checksum, which the receiver checks the data it wrote against
+        - STATS also displays files cached and cache hits and misses
+
+        - While files are sent or received over TCP the link is measured through TCP_INFO (round trip and
+          delivery rate) every 100 ms, and the chunk of file data put in each frame and the socket buffers
+          follow its bandwidth-delay product. Chunks start at 1 KB and grow to a sixteenth of the product,
+          up to half the room between the low and high watermarks. Socket buffers are only ever raised, to
+          twice the product, and only past what the kernel has already given the socket on its own
+        - STATS also displays chunk size, round trip, delivery rate and socket buffers of clients sending
+          or receiving files
+
+        - -upgrade starts a new build in place of the server running on the port without dropping anyone. A server
+          started with -upgradable listens on /tmp/chat-port.upgrade (owner only), the new server connects to it and
+          once it has sent the state layout it reads (the old server keeps serving until then) the old server
+          stops serving and passes its listening sockets and the sockets of its TCP clients (SCM_RIGHTS) with their
+          state : queued frames, transfers and their files, rooms, UDP state and waiting file requests (see Upgrade
+          State). The new server serves them from where the old one stopped once it has let go of them, clients
+          see no disconnect, only a pause of about a millisecond which both servers display. Listening sockets are
+          kept as they were (-udp, -local), other options of the new server apply from then on. Clients over TLS
+          or on this host can't be handed over, they stay on the old server, which accepts nobody new and exits once
+          they have all left. An old server that gets no answer within 5 seconds keeps serving every client. The new
+          server only takes upgrades itself if it is also given -upgradable
+
+        - Room messages from a client started with -trace come inside trace frames, the server stamps the time it
+          read them from the socket and the time it started writing them to each member (after any wait in that
+          member's queue), so the receiving client can split a message's delay into stages. PING frames from
+          clients are answered right away with the times they were read from the socket and answered
+
+Usage : Server [port] [-policy DROP|PAUSE|DISCONNECT] [-high bytes] [-low bytes] [-accept ASK|ALL|NONE]
+               [-file-rate rate] [-client-rate rate] [-total-rate rate] [-capture file] [-max-clients count]
+               [-tls KERNEL|USER] [-udp] [-local] [-cache bytes] [-upgradable] [-upgrade]
+
 main()
     - Creates socket to performs communications
     - Intialzes all variables to be used in between functions and sockets other then temp variables
@@ -35,20 +154,80 @@ main()
 
 FileSend()
     - Function for initiating the sending of files
-    - Obtains filename and desired approach after receiving request
+    - Opens the file and places the ACK and file start frame in the client's send queue, file data
+      frames are then queued by QueueFile() as the client drains its queue
     - Sends files of any type
 
 FileReceive()
-    - Function for receiving file data from other user after sending request from SendMessage()
-    - Returns back to sending a message if other user rejects request, otherwise file receiving 
-      begins and saves in inputted file name/path
+    - Function for requesting a file from a client under a new transfer ID, the file data is saved
+      in inputted file name/path by ReceiveFileFrame() as it arrives
+
+ListDirectory() / QueueManifest()
+    - Lists every regular file below a directory being sent, and queues the manifest frames of its files
+
+DirectoryChunk()
+    - Queues next chunk of a directory's data, packing small files together and queueing large files as
+      frames whose data is written straight from the file
+
+ReadManifest() / WriteDirectory()
+    - Adds files listed in a manifest frame to a directory being received, and splits received data between
+      its files, creating them (and their directories) in manifest order
+
+BelowFolder()
+    - Checks a requested path, with its symlinks resolved, is below the working folder (-accept ALL)
+
+ValidEntry() / MakePath()
+    - Checks a path received in a manifest stays below the directory, and creates every directory of a path
+
+CanSplice() / SpliceSend() / CloseSplices()
+    - Checks file data may be written to a connection with sendfile() (unencrypted or kernel TLS), writes
+      data of a queued file frame from its file, and closes files of queued frames not yet written
+
+SetupCache() / CloseCache()
+    - Sets up the file cache and its inotify watches, and frees every cached file
+
+CacheFile() / ReleaseFile()
+    - Finds a file in the cache or reads it in (dropping least recently sent files past the cache size),
+      and gives it back once a transfer is done with it
+
+DropFile() / ForgetWatch() / ReadNotify()
+    - Removes a file from the cache, freeing it once no transfer is sending it, removes its inotify watch
+      once no cached path uses it, and drops every file inotify reports as changed (every file once
+      inotify's queue overflowed)
+
+FileTime() / FileChecksum()
+    - Returns modification time of a file, and the checksum (FNV-1a) of file data
+
+CloseTransfers()
+    - Closes every file being sent to or received from a client and frees its transfer state
+
+AttachTransfers()
+    - Gives a client transfer state once a file is sent to or requested from it
+
+SetupPacing() / TunePacing() / PacingStats()
+    - Sets up link measurements of a connection, measures the link through TCP_INFO and sizes file chunks
+      and socket buffers from its bandwidth-delay product, and formats the measurements for STATS
+
+AttachBuffers() / ReleaseBuffers()
+    - Takes buffers and send queues for a client from the buffer pool, and gives them back once the
+      client has nothing left to process or send
+
+ListClient()
+    - Adds a client that was given buffers or transfer state to the clients visited every pass
+
+WatchClient() / WatchSocket()
+    - Watches a client's socket (and eventfd of its rings) with epoll for what the client waits on, and
+      watches a socket that is not a client under its tag
+
+ReceiveFileFrame()
+    - Handles frames received on a file channel (start, data and end of file)
 
 CheckConnection()
     - Checks connection with client before starting chat
 
 SendMessage()
     - Function for initiating the sending of messages, file requests/refusals, and control messages
-      to the other user (server in this case)
+      to the other users (clients in this case)
     - Also controls exit function of both users by sending exit messsage/flag to both connections (server and client)
 
 ReceiveMessage()
@@ -56,22 +235,196 @@ ReceiveMessage()
       display of client's messages
     - Displays error messages if any
 
+ProcessInbox()
+    - Splits bytes received from a client into frames and passes them on to ProcessFrame()
+
+ProcessFrame()
+    - Passes a frame received from a client (on TCP or as a datagram) on by type
+
+ReceiveRoomFrame()
+    - Handles room join, leave and message frames from a client
+
+SendRoom()
+    - Relays a room message to every member of the room except its sender, inside a trace frame if it came in one
+
+ReceiveTraced() / AnswerPing()
+    - Stamps a traced frame with the time it was read from the socket and handles the frame inside it, and
+      answers a PING
+
+PutStamp() / StampForwarded()
+    - Writes a time into trace fields in network byte order, and stamps a trace frame with the time it starts
+      being written to a client
+
+AddMember() / RemoveMember()
+    - Gives a client (or the server user) a member number in the room index, and removes it from
+      every room once it leaves
+
+JoinRoom() / LeaveRoom()
+    - Adds/removes a member to/from a room, rooms are created on first join and removed once empty
+
+InRoom() / FindRoom() / ValidRoom()
+    - Checks room membership, finds room number of room name, and checks room name is allowed
+
+PrintRooms()
+    - Displays every room and its number of members
+
+QueuePacket()
+    - Places a packet in a client's chat queue
+
+QueueFrame()
+    - Places a frame in a client's chat queue and applies the slow consumer policy if needed, small chat
+      frames to clients using UDP are handed to QueueDatagram() instead
+
+QueueFile()
+    - Reads the next chunk of each file being sent in turn into the client's file queue while the
+      queue is below the low watermark and the transfers are not paused
+    - Transfers without tokens are skipped, returns time until a rate limited transfer can continue
+
+SetupBucket()
+    - Sets up token bucket for a rate limit, starting full
+
+RefillBucket()
+    - Adds tokens to bucket for time passed since it was last refilled
+
+BucketWait()
+    - Returns time until bucket has tokens again, 0 if it has tokens now
+
+MonotonicTime()
+    - Returns current time of clock that is never set back, used for refilling token buckets
+
+ParseRate()
+    - Converts rate given on command line into bytes per second
+
+FlushQueue()
+    - Priority scheduler, writes frames from the chat queue first and from the file queue only
+      when no chat frames are waiting, as much as the socket accepts without blocking
+
+CreateFrame()
+    - Places frame header in front of data to be sent through socket
+
+CreateTLS()
+    - Creates self-signed certificate and key and the TLS settings every client connection is made with
+
+ContinueHandshake() / KernelTLS()
+    - Moves a client's TLS handshake on as far as the socket allows, and checks the kernel encrypts what is
+      written to a connection
+
+SocketSend() / SocketReceive()
+    - Writes/reads a socket like send()/recv(), going through TLS when the connection is encrypted
+
+CloseTLS()
+    - Sends TLS close message and frees connection's TLS state
+
+SetupDatagram() / DatagramFrame() / DatagramBusy()
+    - Sets up UDP state of a connection, checks a frame may be sent as a datagram, and checks frames
+      are still waiting on ACK
+
+SendDatagram() / QueueDatagram() / FillWindow()
+    - Sends one datagram with ACK of everything received, queues a chat frame to be sent as a datagram,
+      and sends queued frames while the window has room
+
+ReceiveDatagram()
+    - Handles ACKs of a datagram received (round trip, fast retransmit) and hands on its frame once every
+      earlier frame has been received, ACK'ing it right away
+
+DatagramTimer() / DatagramFallback()
+    - Sends again datagrams not ACK'd in time and finds when the next one is due, and hands every frame
+      not known to be received back to be sent on TCP once the peer stopped answering
+
+ReadDatagrams() / DrainDatagrams()
+    - Reads every datagram waiting on the server's UDP socket and finds its client by token, and waits
+      a short time for datagrams to be ACK'd before exit messages are sent
+
+DatagramStats()
+    - Formats counters of a UDP connection for STATS
+
+SetupLocal() / CloseLocal()
+    - Sets up state of a client on this host, and unmaps its rings and closes every file descriptor it holds
+
+TakeRings() / UseRings()
+    - Maps shared memory rings and eventfds passed by client with connection request, and moves everything
+      sent and received onto the rings
+
+SendHandles() / ReadHandles()
+    - Writes/reads Unix domain socket, passing file descriptors waiting to be passed with the bytes written
+      and keeping file descriptors received in the order they were sent
+
+LocalSend() / LocalReceive()
+    - Writes/reads a client on this host like send()/recv(), through the rings once they are used
+
+TakeHandle() / PassedFile() / CopyHandle() / CopyFiles()
+    - Takes next file descriptor passed by client, checks it is a regular file holding the length claimed for
+      it, copies a chunk of a passed file into its output file, and copies a chunk of every file client has passed, returning true while more is left
+
+OpenUpgrade() / CheckUpgrade()
+    - Creates the Unix domain socket a new build connects to for taking over the server (-upgradable), and
+      reads the state layout a connected new build asks for without waiting on it
+
+HandOver() / SaveClient() / SaveTransfer()
+    - Passes listening sockets, clients and their state to a new build that asked for a layout this server writes
+      and lets go of them once it has read everything, and saves the state of a client and of a file transfer (with its own open file)
+
+FillSplices() / ReadSplice()
+    - Reads in file data of frames queued without it, so queued frames can be handed over whole
+
+TakeOver() / TakeClients() / LoadClient() / LoadTransfer()
+    - Takes listening sockets and state from the server being upgraded, and restores its clients and transfers,
+      serving them once the old server has let go of them
+
+PutNumber() / PutText() / PutHandle() / GetNumber() / GetText() / GetHandle()
+    - Writes/reads values of the upgrade state, file descriptors are kept as their position among those passed
+
+SendBatch() / ReceiveBatch()
+    - Writes/reads one packet of the upgrade socket with the file descriptors passed with it
+
+PrintStats()
+    - Displays the queue depth metrics of every busy client, and memory used per client
+
+ResidentMemory()
+    - Returns resident memory of server in bytes, -1 if it can't be read
+
 CreateHeader()
     - Creates the packet header to be sent through sockets
 
 Exit()
     - Performs exit functions and ends program
 
+StartDisplay() / StopDisplay()
+    - Starts the renderer and input threads and points std::cout at the renderer's queue, and waits
+      for all output to be written once chat ends
+
+RenderLoop()
+    - Renderer thread, writes every line waiting in the output queue to the terminal with one write
+
+ReadLoop()
+    - Input thread, reads the console and hands every whole line to the I/O thread
+
+SetupQueue() / PushLine() / PopLine() / QueueIdle()
+    - Bounded single producer, single consumer lock-free ring of lines, the consumer sleeps on a
+      pipe that the producer only writes to once the consumer has marked itself idle
+
+LatencyBucket() / LatencyBound() / PrintLatency()
+    - Histogram of time from output being handed over to being written, and display of its percentiles
+
+OpenCapture() / CaptureFrame()
+    - Creates capture file, and records a frame in it with its direction and time
+
 Chat()
-    - Endless loop that performs SendMessage() and ReceiveMessage until server or client chooses to leave
-    - Also closes all file descriptors created in main
+    - Endless loop that accepts clients and performs SendMessage() and ReceiveMessage until server chooses to leave
+    - Also closes all client file descriptors
+
+Frame Header Fields :
+Type (8 bits), Flags (8 bits), Channel (16 bits), Length (32 bits), followed by Length bytes of data
 
-Header Fields :
-Flags - 
+Channel -
+        0 : Chat channel (messages and control messages)
+        1 - 65535 : Transfer ID, used by file request/ACK/ignored packets and the frames of that file
+
+Flags -
         0 - 000 : EXIT code
         1 - 001 : (NONE - Simple Message/File sent)
         2 - 010 : Message Corruption/Error
-        3 - 011 : File Corruption/Error 
+        3 - 011 : File Corruption/Error
         4 - 100 : ACK ACK
         6 - 110 : Connection Request ACK
         7 - 111 : Connection Request
@@ -81,10 +434,62 @@ Types -
         1 - 01 : File Request
         2 - 10 : File Request ACK
         3 - 11 : File Request IGNORED
+        4 - 100 : File Start (file channel, data is 8 byte file size, optionally followed by 8 byte checksum of the
+                  file's data, FNV-1a)
+        5 - 101 : File Data (file channel)
+        6 - 110 : File End (file channel)
+        7 - 111 : Room Join (data is room name)
+        8 - 1000 : Room Leave (data is room name)
+        9 - 1001 : Room Message (data is room name, a null byte, then message, server puts ID of client that sent
+                   it in front, 32 bits, 0 for server)
+        10 - 1010 : File Handle (file channel, data is 8 byte file size, file itself is passed as a file
+                    descriptor on the Unix domain socket, clients on same host only)
+        11 - 1011 : Directory Manifest (file channel, sent in place of File Start when a directory is requested,
+                    data is entries of file size (64 bits), path length (16 bits) and path below directory, a
+                    large directory takes several manifest frames, File Data frames then hold the data of every
+                    file in manifest order and File End follows the last file)
+        12 - 1100 : Traced Frame (data is trace fields, then a whole message or room message frame)
+        13 - 1101 : PING (client sends its time, 64 bits, server answers with that time followed by the times it
+                    read and answered it)
 
 Message Length
 
 Message{ .................... }
+
+Trace Fields :
+Message number (64 bits, given by sender), Sent (64 bits), Server Received (64 bits), Server Forwarded (64 bits), times
+are monotonic clock of server's host in nanoseconds (sender converts its own time with clock offset measured by PING),
+0 until stamped. Client reading a traced frame converts them to its own clock
+
+Capture File :
+Magic "CCAP" (4 bytes), Version (8 bits), Role (8 bits, 0 server, 1 client), Reserved (16 bits), then for every frame
+Time (32 bits, microseconds since previous frame), Direction (8 bits, 0 sent, 1 received), Reserved (24 bits),
+Connection (32 bits, client ID on server, 0 on client), followed by the whole frame as sent through the socket
+
+Datagram Header :
+Token (32 bits, given to client in connection request ACK), Kind (8 bits, 0 hello, 1 data, 2 ACK), Reserved (24 bits),
+Sequence (32 bits, of frame in data datagram), Ack (32 bits, every frame up to it has been received),
+Selective (32 bits, bit n set if frame Ack + 2 + n has been received), followed by one whole frame for data datagrams
+Client asks for UDP with "UDP" as data of its connection request, server answers with "UDP token" in the ACK
+
+Shared Memory Rings :
+Client on same host passes shared memory, its own eventfd and the server's eventfd (SCM_RIGHTS) with "SHM" as data of its
+connection request, server answers with "SHM" in the ACK once it has mapped them, everything after ACK ACK is sent through
+the rings. Memory holds ring 0 (client to server) then ring 1 (server to client), each is Head (64 bits, bytes read), padding,
+Tail (64 bits, bytes written), padding, Sleeping (reader waits on its eventfd), Full (writer waits for room), followed by
+LOCAL_RING_SIZE bytes of data. Memory is a memfd sealed against shrinking, growing and further seals, unsealed memory is
+refused. File descriptors passed once rings are used are sent on the socket with one byte each, ahead of the frame that uses
+them
+
+Upgrade State :
+New server sends Version (32 bits) on the upgrade socket (SOCK_SEQPACKET), old server keeps serving until it arrives, then answers with Version (32 bits) and Count
+(32 bits) of file descriptors it passes, UPGRADE_BATCH at a time with that packet and with one byte packets after it. The first
+is a memfd holding the state, the state names every later one by its position (-1 for none). New server answers "A" once it has
+read the state and old server answers "G" once it has let go of every client handed over. State is numbers (64 bits, host byte
+order) and texts (length, then bytes) : stop time, next client ID, folder, TCP, Unix domain and UDP listening sockets, rooms of
+server user, then for every client its socket, ID, receive state, queue counters, rooms, buffers (inbox, chat and file queues,
+current frame and bytes of it written), transfers (fields, file and position in it) and UDP state, then file requests waiting
+on an answer
 */
 
 #include <iostream>
@@ -92,6 +497,18 @@ Message{ .................... }
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <streambuf>
+#include <random>
+#include <algorithm>
+#include <stddef.h>
 
 
 #ifdef _WIN32
@@ -106,439 +523,4779 @@ Message{ .................... }
   #include <arpa/inet.h>
   #include <netdb.h>  /* Needed for getaddrinfo() and freeaddrinfo() */
   #include <unistd.h> /* Needed for close() */
+  #include <poll.h>   /* Needed for poll() */
+  #include <netinet/tcp.h>    /* Needed for TCP_NODELAY and TCP_INFO */
+  #include <sys/resource.h>   /* Needed for setrlimit() */
+  #include <signal.h> /* Needed for signal() */
+  #include <sys/un.h>     /* Needed for Unix domain sockets (-local) */
+  #include <sys/mman.h>   /* Needed for mmap() of shared memory rings and memfd */
+  #include <sys/stat.h>   /* Needed for fstat() */
+  #include <sys/sendfile.h>   /* Needed for sendfile() */
+  #include <dirent.h>     /* Needed for opendir() of directory transfers */
+  #include <limits.h>     /* Needed for PATH_MAX of realpath() */
+  #include <sys/inotify.h>    /* Needed for inotify watches of cached files */
+  #include <sys/epoll.h>  /* Needed for epoll watching every socket */
+#endif
+
+#ifdef USE_TLS
+  #include <openssl/ssl.h>    /* Needed for TLS connections (-tls) */
+  #include <openssl/err.h>
+  #include <openssl/x509.h>
+#else
+  typedef struct ssl_st SSL;          /* Connections are never encrypted, TLS state is always NULL */
+  typedef struct ssl_ctx_st SSL_CTX;
 #endif
 
 //List of predefined and global variables for easy scalability
 #define DEFAULT_PORT 12345  //Default port number used if one is not entered
 #define MAX_LENGTH 1024     //Max length of message that can be sent or received
-#define MAX_CLIENTS 2       //Max number of clients that can connect to server
-#define MAX_SIZE 1024       //Max size of buffer for transferring files
+#define MAX_CLIENTS 16      //Max number of clients that can connect to server if -max-clients is not given
+#define MAX_SIZE 1024       //Size of file chunks before link is measured, smallest chunk used
+#define MAX_CHUNK 65536     //Largest chunk of file data put in one frame
+
+#define DEFAULT_HIGH_WATERMARK 65536    //Bytes queued for a client before slow consumer policy is applied
+#define DEFAULT_LOW_WATERMARK 16384     //Bytes queued for a client before paused file transfers resume
+#define MAX_QUEUE_SIZE 1048576          //Hard limit of bytes queued for a client, newer chat messages are dropped past it
+
+#define CHAT_CHANNEL 0          //Channel for messages and control packets
+#define TRACE_SIZE 32           //Bytes of trace fields in front of a traced frame
+#define MAX_TRANSFERS 32        //Max files being sent to or requested from a client at once
+#define MAX_FRAME 65536         //Max length of data in a single frame, larger frames are treated as corrupted
+#define UNSENT_LIMIT 32768      //Max bytes left unsent in socket buffer, keeps file data from building up ahead of chat
+#define RATE_BURST 50           //Milliseconds of data a rate limit lets through at once after being idle
+#define OUTPUT_QUEUE_SIZE 8192  //Output lines that can wait for renderer thread (power of 2)
+#define INPUT_QUEUE_SIZE 256    //Typed lines that can wait for I/O thread (power of 2)
+#define RENDER_BATCH 65536      //Max bytes written to terminal at once
+#define LATENCY_BUCKETS 128     //Buckets of display latency histogram
+
+//Capture file values
+#define CAPTURE_MAGIC "CCAP"        //First bytes of every capture file
+#define CAPTURE_VERSION 2           //Version of capture file layout
+#define CAPTURE_SERVER 0            //Capture recorded by server
+#define CAPTURE_CLIENT 1            //Capture recorded by client
+#define CAPTURE_SENT 0              //Frame was sent
+#define CAPTURE_RECEIVED 1          //Frame was received
+#define CAPTURE_BUFFER 1048576      //Bytes of capture buffered before being written to disk
+#define MAX_ROOMS 64            //Max rooms a client can be in at once
+#define MAX_ROOM_NAME 64        //Max length of room name
+#define POOL_SIZE 256           //Buffers kept in pool for reuse once clients are idle
+#define POOL_BUFFER 131072      //Buffers that grew larger are shrunk before going back in pool
+#define UDP_MAX_FRAME 1200      //Largest frame sent as a datagram, larger chat frames stay on TCP
+#define UDP_WINDOW 32           //Max datagrams sent and not yet ACK'd (bits of selective ACK)
+#define UDP_PENDING 1024        //Max chat frames waiting for room in window, newer frames are dropped past it
+#define UDP_FIRST_TIMEOUT 200   //Retransmit timeout before first round trip is measured (ms)
+#define UDP_MIN_TIMEOUT 20      //Lowest retransmit timeout (ms)
+#define UDP_MAX_TIMEOUT 1000    //Highest retransmit timeout (ms)
+#define UDP_GIVE_UP 3000        //Time a datagram (or hello) goes without ACK before chat moves back to TCP (ms)
+#define UDP_FAST_RETRANSMIT 3   //ACKs of later datagrams before a missing datagram is sent again
+#define UDP_ADDRESS_WAIT 2000   //Time frames wait for a client's first datagram before chat moves back to TCP (ms)
+#define UDP_DRAIN 500           //Max time waiting for datagrams to be ACK'd before exiting (ms)
+#define LOCAL_PATH "/tmp/chat-%d.sock"  //Unix domain socket clients on same host connect to, by port number
+#define LOCAL_RING_SIZE 1048576 //Bytes of data in each shared memory ring
+#define LOCAL_MAX_HANDLES 16    //Max file descriptors passed with one write
+#define FILE_COPY_CHUNK 4194304 //Max bytes of a passed file copied at once, keeps chat moving during large copies
+#define DIRECTORY_MAX_FILES 100000  //Max files sent/received in one directory transfer
+#define DIRECTORY_MAX_NAME 4096     //Max length of a path in a directory transfer
+#define DIRECTORY_SPLICE_SIZE 262144    //Files of a directory at least this large are written with sendfile() instead of being packed
+#define DEFAULT_CACHE_SIZE 67108864     //Bytes of files kept in memory if -cache is not given
+#define CACHE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF)  //Changes that drop a cached file
+#define CHECKSUM_START 14695981039346656037ULL  //FNV-1a offset basis, checksum of no data
+#define CHECKSUM_PRIME 1099511628211ULL         //FNV-1a prime
+#define TUNE_INTERVAL 100       //Time between link measurements while files are sent or received (ms)
+#define CHUNKS_PER_BDP 16       //File chunks that fit in bandwidth-delay product of link
+#define MAX_SOCKET_BUFFER 67108864  //Largest socket buffer asked for
+#define UPGRADE_PATH "/tmp/chat-%d.upgrade"   //Unix domain socket a new build connects to for taking over, by port number
+#define UPGRADE_VERSION 1       //Version of upgrade state layout
+#define UPGRADE_BATCH 200       //Max file descriptors passed in one upgrade packet (kernel allows 253)
+#define UPGRADE_TIMEOUT 5000    //Time old server waits on new server at each step before keeping its clients (ms)
+#define WATCH_EVENTS 1024       //Max events taken from epoll in one pass, the rest are taken next pass
+
+//Slow consumer policies
+#define POLICY_DROP_OLDEST 0    //Drop oldest queued chat messages
+#define POLICY_PAUSE_FILE 1     //Pause file transfers to client
+#define POLICY_DISCONNECT 2     //Disconnect client
+
+//File request policies
+#define ACCEPT_ASK 0            //Ask server user to answer every file request
+#define ACCEPT_ALL 1            //Send requested files without asking
+#define ACCEPT_NONE 2           //Reject every file request
+
+//Receive states of a client
+#define RECV_CONNECT 0      //Waiting for connection request
+#define RECV_CONNECT_ACK 1  //Waiting for ACK ACK of connection request
+#define RECV_PACKET 2       //Connected, receiving frames
+#define RECV_TLS 3          //TLS handshake waiting on data from client
+#define RECV_TLS_WRITE 4    //TLS handshake waiting on room in socket
+
+//TLS modes
+#define TLS_NONE 0              //Connections are not encrypted
+#define TLS_KERNEL 1            //Kernel encrypts once handshake is done, OpenSSL if kernel can't
+#define TLS_USER 2              //OpenSSL encrypts everything
+
+//Datagram kinds
+#define DATAGRAM_HELLO 0        //Client telling server its address, answered with an ACK
+#define DATAGRAM_DATA 1         //Chat frame
+#define DATAGRAM_ACK 2          //ACK only
+
+//Sockets watched with epoll that are not clients, clients are watched with a pointer to their connection
+#define WATCH_CONSOLE 1         //Lines typed on server console
+#define WATCH_LISTEN 2          //New clients
+#define WATCH_LOCAL 3           //New clients on this host (-local)
+#define WATCH_DATAGRAM 4        //Chat datagrams (-udp)
+#define WATCH_NOTIFY 5          //Changes to cached files
+#define WATCH_UPGRADE 6         //New build connecting (-upgradable)
+#define WATCH_PEER 7            //New build connected, sends state layout it reads
+#define WATCH_LAST 7            //Largest tag, pointers to connections are always larger
+
+//Console input states of the server
+#define CONSOLE_CHAT 0          //Input is message/command
+#define CONSOLE_FILE_ANSWER 1   //Input is Y/N answer to file request from client
+#define CONSOLE_FILE_SEND 2     //Input is filename of file being sent to client
+#define CONSOLE_FILE_CLIENT 3   //Input is client file request is sent to
+#define CONSOLE_FILE_REQUEST 4  //Input is filename being requested from client
 
 //Protocol header structure for sending messages/files/and error/control signals
 struct MessageProtocol{
     unsigned int Type : 2;       //Specifies whether it is file or message base (2 bits)
     unsigned int Flags : 3;      //Delivers requests/errors/success messages (3 bits)
     unsigned int Length;         //Specifies length of message being sent
+    unsigned short Channel;      //Transfer ID for file request/ACK/ignored, CHAT_CHANNEL otherwise
     char Message[MAX_LENGTH];    //Message or file being sent
 };
 
-//Function Prototypes for file transfer and 
-bool FileSend(int, struct MessageProtocol, bool[]);        //Function for requesting to send file from server side
-bool FileReceive(int, struct MessageProtocol, bool[]);     //Function for receiving file from client side
-bool CheckConnection(int, struct MessageProtocol);         //Function for checking connection to client
-bool SendMessage(int, struct MessageProtocol, bool[]);     //Function for sending message to client
-bool ReceiveMessage(int, struct MessageProtocol, bool[]);   //Function for receiving and displaying message from client
+//Header placed in front of every frame sent through sockets
+struct FrameHeader{
+    unsigned char Type;         //Type of frame (see Types)
+    unsigned char Flags;        //Delivers requests/errors/success messages
+    unsigned short Channel;     //Logical channel frame belongs to
+    unsigned int Length;        //Length of data following header
+};
+
+//Header at start of capture file
+struct CaptureHeader{
+    char Magic[4];              //CAPTURE_MAGIC
+    unsigned char Version;      //CAPTURE_VERSION
+    unsigned char Role;         //Program that recorded capture (CAPTURE_SERVER or CAPTURE_CLIENT)
+    unsigned short Reserved;
+};
+
+//Header placed in front of every frame in capture file
+struct CaptureRecord{
+    unsigned int Time;          //Microseconds since previous frame
+    unsigned char Direction;    //CAPTURE_SENT or CAPTURE_RECEIVED
+    unsigned char Reserved[3];
+    unsigned int Connection;    //Client ID frame was sent to/received from, 0 on client
+};
+
+//Header placed in front of every datagram, followed by one chat frame for data datagrams
+struct DatagramHeader{
+    unsigned int Token;         //Token given to client in connection request ACK
+    unsigned char Kind;         //DATAGRAM_ kind
+    unsigned char Reserved[3];
+    unsigned int Sequence;      //Sequence number of frame, 0 if datagram holds no frame
+    unsigned int Ack;           //Every frame up to this sequence number has been received
+    unsigned int Selective;     //Bit n set if frame Ack + 2 + n has been received
+};
+
+//Capture file being recorded
+struct Capture{
+    FILE* File;                 //Capture file
+    long long Last;             //Time of last frame recorded (nanoseconds)
+};
+
+//Settings given on command line
+struct ServerSettings{
+    int Policy;                 //Slow consumer policy applied once a client passes the high watermark
+    size_t HighWatermark;       //Queue depth where policy is applied
+    size_t LowWatermark;        //Queue depth where paused transfers resume
+    int Accept;                 //Policy for answering file requests (ACCEPT_ values)
+    double FileRate;            //Bytes per second limit of every file transfer, 0 for no limit
+    double ClientRate;          //Bytes per second limit of file transfers to a client, 0 for no limit
+    double TotalRate;           //Bytes per second limit of every file transfer together, 0 for no limit
+    struct Capture* Capture;    //Capture frames are recorded in, NULL if not capturing
+    size_t MaxClients;          //Max number of clients connected at once
+    struct BufferPool* Pool;    //Buffers shared by every client
+    int TLSMode;                //Encryption of connections (TLS_ values)
+    SSL_CTX* TLS;               //TLS settings and certificate of every connection, NULL if not encrypting
+    int DatagramFD;             //UDP socket chat datagrams are sent and received on, -1 without -udp
+    std::map<unsigned int, struct Connection*>* Tokens;     //Client of every UDP token, NULL without -udp
+    int LocalFD;                //Unix domain socket clients on this host connect to, -1 without -local
+    size_t CacheSize;           //Bytes of files kept in memory, 0 turns cache off
+    struct FileCache* Cache;    //Files kept in memory for every client
+    int Port;                   //Port number listened on, also names Unix domain sockets
+    bool Upgradable;            //New build may take over server (-upgradable)
+    int UpgradeFD;              //Unix domain socket a new build connects to for taking over, -1 without -upgradable
+    int WatchFD;                //Epoll instance every socket is watched with
+    long long Received;         //Time frames being handled were read from socket (nanoseconds)
+    long long Resident;         //Resident memory of server before first client connected (bytes), -1 until then
+};
+
+//Token bucket for limiting rate of file data, tokens are bytes that may be queued
+struct TokenBucket{
+    double Rate;                //Tokens added every second, 0 for no limit
+    double Burst;               //Max tokens bucket can hold
+    double Tokens;              //Tokens in bucket, may fall below 0 after a whole chunk is taken
+    long long Last;             //Time of last refill (nanoseconds)
+};
+
+//File of a directory being sent/received
+struct DirectoryFile{
+    std::string Name;           //Path below directory
+    long int Size;              //Bytes of file
+};
+
+//File data of a queued frame that is written with sendfile() once the frame's header is written
+struct Splice{
+    int FD;                     //Duplicate of file, closed once its data is written
+    long long Offset;           //Position of data in file
+    size_t Length;              //Bytes of data not yet written
+};
+
+//File kept in memory, freed once it is dropped from cache and no transfer is sending it
+struct CachedFile{
+    std::string Path;           //Path file was requested by
+    std::string Data;           //Whole file
+    long long MTime;            //Modification time when file was read (nanoseconds)
+    unsigned long long Checksum;    //FNV-1a checksum of data, sent in File Start frame
+    int Watch;                  //inotify watch of file, -1 if file is checked with stat() on every request
+    unsigned long long Used;    //Cache tick file was last requested at, least recently used files are dropped first
+    unsigned int Users;         //Transfers sending file
+    bool Stale;                 //Set once file is dropped from cache
+};
+
+//Files kept in memory so a file requested by many clients is only read once
+struct FileCache{
+    std::map<std::string, struct CachedFile*> Files;    //Cached files by path
+    size_t Budget;              //Max bytes of files kept
+    size_t Bytes;               //Bytes of files kept
+    int NotifyFD;               //inotify instance watching every cached file, -1 if not available
+    unsigned long long Tick;    //Requests made to cache
+    unsigned int Hits;          //Requests served from memory
+    unsigned int Misses;        //Requests that read file in
+    unsigned int Dropped;       //Files dropped for being changed
+};
+
+//Link of a connection measured through TCP_INFO, file chunk and socket buffer sizes follow its bandwidth-delay product
+struct Pacing{
+    int Chunk;                  //Bytes of file data put in each frame
+    long long Checked;          //Time link was last measured (nanoseconds), 0 if never measured
+    unsigned int RTT;           //Smoothed round trip (microseconds)
+    unsigned long long Rate;    //Delivery rate (bytes per second)
+    size_t BDP;                 //Largest bandwidth-delay product measured sending (bytes)
+    size_t ReceiveBDP;          //Largest data received in a round trip measured by kernel (bytes)
+    int SendBuffer;             //Size of socket send buffer (bytes)
+    int ReceiveBuffer;          //Size of socket receive buffer (bytes)
+    int SendLimit;              //Largest send buffer the kernel allows (bytes, twice net.core.wmem_max)
+    int ReceiveLimit;           //Largest receive buffer the kernel allows (bytes, twice net.core.rmem_max)
+    unsigned int Raised;        //Times a socket buffer was raised
+};
+
+#ifdef TCP_INFO
+//tcp_info as filled in by newer kernels, glibc's tcp_info ends before the delivery rate
+struct LinkInfo{
+    struct tcp_info Base;
+    unsigned long long PacingRate;
+    unsigned long long MaxPacingRate;
+    unsigned long long BytesAcked;
+    unsigned long long BytesReceived;
+    unsigned int SegsOut;
+    unsigned int SegsIn;
+    unsigned int NotSentBytes;
+    unsigned int MinRTT;
+    unsigned int DataSegsIn;
+    unsigned int DataSegsOut;
+    unsigned long long DeliveryRate;    //Bytes per second (Linux 4.9)
+};
+#endif
+
+//State of a single file transfer, frames of the file are sent on the channel matching its ID
+struct Transfer{
+    int ID;                     //Transfer ID given by user that requested the file
+    FILE* File;                 //File being sent/received, NULL if it couldn't be opened
+    std::string Name;           //Filename being sent/saved
+    long int Remaining;         //Bytes of file not yet queued/received
+    bool Started;               //True once start frame has been queued/received
+    struct TokenBucket Bucket;  //Rate limit of file being sent
+    int Source;                 //File descriptor passed by client that file is copied from, -1 if data comes in frames
+    bool Directory;             //True if a whole directory is being sent/received, Name is the directory
+    std::vector<struct DirectoryFile> Entries;  //Files of directory, their data is sent in this order
+    size_t Next;                //Entry after the one being read/written
+    long int Left;              //Bytes of current entry not yet read/written
+    long long Offset;           //Bytes of current entry already read (sender only)
+    struct CachedFile* Cached;  //File data in cache, NULL if file is read from File (sender only)
+    bool Verify;                //True if start frame carried a checksum of file (receiver only)
+    unsigned long long Checksum;    //Checksum of file sent in start frame (receiver only)
+    unsigned long long Hash;    //Checksum of data received so far (receiver only)
+};
+
+//File request from a client waiting on server user's answer
+struct FileRequest{
+    int ClientID;               //Client that made request
+    int ID;                     //Transfer ID of request
+    std::string Name;           //File requested
+};
+
+//Chat frame waiting in a client's send queue
+struct QueuedData{
+    std::string Data;           //Frame to be sent
+    bool Keep;                  //True if frame is a control packet and can't be dropped
+};
+
+//Buffers and send queues of a client, only attached while data is being received or sent
+struct Buffers{
+    std::string Inbox;              //Data received from client not yet processed
+    std::deque<struct QueuedData> ChatQueue;    //Chat frames, always sent ahead of file frames
+    std::deque<std::string> FileQueue;  //File frames, only sent when no chat frames are waiting
+    std::string Current;            //Frame currently being written to socket
+    size_t Offset;                  //Bytes of current frame already written
+    std::deque<struct Splice> Splices;  //File data of file frames queued without it, in queue order
+    struct Splice Splicing;         //File data of current frame, written once its header is
+};
+
+//File transfers of a client, only attached while files are being sent to or requested from it
+struct Transfers{
+    std::deque<struct Transfer*> Sends;         //Files being sent to client, served in turn
+    std::map<int, struct Transfer*> Receives;   //Files requested from client by transfer ID
+    struct TokenBucket Bucket;      //Rate limit of every file sent to client
+    struct Pacing Pace;             //Link measurements, chunk and socket buffer sizes of client
+};
+
+//Datagram sent and not yet ACK'd
+struct SentDatagram{
+    std::string Frame;              //Chat frame sent
+    long long Time;                 //Time it was last sent (nanoseconds)
+    long long First;                //Time it was first sent (nanoseconds)
+    int Tries;                      //Times it has been sent
+    int Missed;                     //ACKs of later datagrams received since it was last sent
+};
+
+//Chat frames sent as datagrams to/received as datagrams from one peer, frames are delivered in the order they were sent
+struct Datagram{
+    unsigned int Token;             //Token of connection, sent in every datagram
+    struct sockaddr_in Address;     //Address datagrams are sent to
+    bool Known;                     //Set once peer's address is known
+    bool Failed;                    //Set once peer stopped answering, chat is sent on TCP from then on
+    long long Hello;                //Time hello was last sent, 0 once server has answered (client only)
+    long long Asked;                //Time first hello was sent (client only)
+    long long Waiting;              //Time frames started waiting for peer's address (server only)
+    unsigned int NextSequence;      //Sequence number of next frame sent
+    std::map<unsigned int, struct SentDatagram> Unacked;    //Frames sent and not ACK'd by sequence number
+    std::deque<std::string> Pending;    //Frames waiting for room in window
+    unsigned int Expected;          //Sequence number of next frame to be delivered
+    std::map<unsigned int, std::string> Early;  //Frames received ahead of a missing frame
+    long long RTT;                  //Smoothed round trip time (nanoseconds), 0 until measured
+    long long Variance;             //Round trip time variation (nanoseconds)
+    long long Timeout;              //Retransmit timeout (nanoseconds)
+
+    unsigned int Sent;              //Frames sent (first time)
+    unsigned int Retransmits;       //Frames sent again
+    unsigned int Received;          //Data datagrams received
+    unsigned int Duplicates;        //Data datagrams received more than once
+};
+
+//One direction of shared memory rings, followed by LOCAL_RING_SIZE bytes of data, positions only grow and are
+//wrapped into the data when used
+struct RingHeader{
+    std::atomic<unsigned long long> Head;   //Bytes read, only moved by reader
+    char HeadPad[56];                       //Keeps positions on separate cache lines
+    std::atomic<unsigned long long> Tail;   //Bytes written, only moved by writer
+    char TailPad[56];
+    std::atomic<bool> Sleeping;             //Set while reader is waiting on its eventfd
+    std::atomic<bool> Full;                 //Set while writer is waiting for room
+};
+
+//Connection to a peer on the same host over a Unix domain socket, and the shared memory rings once both ends use them
+struct Local{
+    void* Memory;                   //Shared memory holding both rings, NULL if rings are not used
+    struct RingHeader* In;          //Ring data is read from, NULL until rings are used
+    struct RingHeader* Out;         //Ring data is written to, NULL until rings are used
+    int WakeFD;                     //Eventfd peer signals once In has data or Out has room, -1 without rings
+    int PeerFD;                     //Eventfd signalled to wake peer, -1 without rings
+    std::deque<int> Outgoing;       //File descriptors waiting to be passed, sent with next bytes written
+    std::deque<int> Incoming;       //File descriptors passed by peer, in the order they were sent
+    unsigned int Passed;            //Files passed to peer as file descriptors
+};
+
+//Buffers shared by every client, buffers given back by idle clients are kept for the next busy one
+struct BufferPool{
+    std::vector<struct Buffers*> Free;  //Buffers not attached to a client, at most POOL_SIZE
+    size_t Attached;                //Buffers attached to clients
+    std::vector<struct Connection*> Busy;   //Clients with buffers or transfers attached, visited every pass
+};
+
+//State of a single client connection, kept small as most clients are idle most of the time
+struct Connection{
+    int SocketFD;                   //Socket file descriptor for communicating with client
+    int ID;                         //Number identifying client in chat
+    int Member;                     //Member number of client in room index
+    unsigned char State;            //Receive state of client (RECV_ values)
+    bool Closed;                    //Set once client has exited or been disconnected
+    bool Paused;                    //File transfers paused by slow consumer policy
+    bool Listed;                    //Set while client is in pool's list of busy clients
+    bool Visited;                   //Set while client is in list of clients visited this pass
+    bool RingsWatched;              //Set once eventfd of client's rings is watched
+    unsigned short Ready;           //Events epoll reported for client this pass
+    unsigned int Events;            //Events client's socket is watched for, 0 until it is watched
+    size_t Position;                //Position of client in list of clients
+    unsigned short NextTransfer;    //Last transfer ID given to file requested from client
+    size_t QueuedBytes;             //Current queue depth (every queued frame and current frame)
+    struct Buffers* IO;             //Buffers and send queues, NULL while client is idle
+    struct Transfers* Files;        //File transfers, NULL while no files are being transferred
+    struct Capture* Capture;        //Capture frames are recorded in, NULL if not capturing
+    SSL* TLS;                       //TLS state of connection, NULL if not encrypted
+    struct Datagram* UDP;           //State of chat sent as datagrams, NULL if client did not ask for UDP
+    struct Local* Local;            //State of client on this host, NULL if client connected over TCP
+
+    unsigned int PeakBytes;         //Largest queue depth seen
+    unsigned int Dropped;           //Chat messages dropped by slow consumer policy
+    unsigned int Pauses;            //Times file transfer has been paused
+};
+
+//Entry of room subscription index, each entry points at its matching entry in the other direction
+//so a membership can be removed from both lists without searching them
+struct Subscription{
+    int Target;                     //Room number in a member's list, member number in a room's list
+    int Slot;                       //Position of matching entry in target's list
+};
+
+//Subscription index of chat rooms, kept in both directions (room to members and member to rooms)
+//as packed lists, numbers of removed rooms and members are reused
+struct RoomIndex{
+    std::map<std::string, int> Numbers;         //Room name to room number
+    std::vector<std::string> Names;             //Room number to room name
+    std::vector<std::vector<struct Subscription> > Members;   //Members of each room
+    std::vector<std::vector<struct Subscription> > Rooms;     //Rooms of each member
+    std::vector<struct Connection*> Users;      //Client of each member, NULL for server user
+    std::vector<int> FreeRooms;                 //Room numbers no longer used
+    std::vector<int> FreeMembers;               //Member numbers no longer used
+};
+
+//Line handed between threads, with time it was handed over
+struct Line{
+    std::string Text;               //Line of text (output may hold several lines)
+    long long Time;                 //Time line was pushed (nanoseconds)
+};
+
+//Bounded lock-free ring of lines between two threads, only one thread pushes and only one thread pops
+struct LineQueue{
+    std::vector<struct Line> Slots;     //Ring of lines, size is a power of 2
+    size_t Mask;                        //Slots.size() - 1, wraps positions into ring
+    std::atomic<size_t> Head;           //Next position to pop, only moved by consumer
+    char HeadPad[64];                   //Keeps positions on separate cache lines
+    std::atomic<size_t> Tail;           //Next position to push, only moved by producer
+    char TailPad[64];
+    std::atomic<bool> Sleeping;         //Set while consumer is waiting on wake pipe
+    std::atomic<bool> Closed;           //Set once producer will push no more lines
+    int WakeFD[2];                      //Pipe written by producer to wake consumer
+};
+
+//Stream buffer placed under std::cout, collects output of I/O thread and hands every flushed
+//message to the renderer thread instead of writing to the terminal
+class DisplayBuffer : public std::streambuf{
+public:
+    struct LineQueue* Output;           //Queue read by renderer thread
+    std::string Pending;                //Output not yet flushed
+protected:
+    int overflow(int);
+    std::streamsize xsputn(const char*, std::streamsize);
+    int sync();
+};
+
+//Console threads, the I/O thread only hands lines to them so a slow terminal never holds up sockets
+struct Display{
+    struct LineQueue Output;            //Lines waiting to be written to terminal, pushed by I/O thread
+    struct LineQueue Input;             //Lines typed on console, pushed by input thread
+    std::atomic<unsigned long> Latency[LATENCY_BUCKETS];   //Lines written by time from being pushed to being on screen
+    DisplayBuffer Buffer;               //Buffer std::cout writes into while display is running
+    std::streambuf* Terminal;           //Buffer std::cout had before, restored once display stops
+    std::thread Renderer;               //Writes output to terminal in batches
+    std::thread Reader;                 //Reads typed lines from console
+};
+
+//State of server's console input, used since input is read between socket events
+struct ConsoleState{
+    int Mode;                       //What the next inputted line is used for (CONSOLE_ values)
+    int Member;                     //Member number of server user in room index
+    int ClientID;                   //Client the current file prompt is for
+    struct Display* Display;        //Threads writing and reading console
+    std::deque<struct FileRequest> Requests;    //File requests waiting on answer
+    std::vector<std::string> Pending;   //Files given with FILE waiting for client to be chosen
+};
+
+//State handed over by the server being upgraded (-upgrade), read before the new server serves anyone
+struct Upgrade{
+    int SocketFD;                   //Unix domain socket to old server, -1 if not upgrading
+    std::vector<int> Handles;       //File descriptors passed, -1 once taken
+    std::string State;              //Serialized state (see Upgrade State)
+    size_t Position;                //Bytes of state already read
+    bool Failed;                    //Set once state was cut short or named a missing file descriptor
+    long long Stopped;              //Time old server stopped serving (nanoseconds)
+    int NextID;                     //Number given to next client that connects
+    int BaseSocketFD;               //TCP listening socket
+    int LocalFD;                    //Unix domain listening socket, -1 if old server had no -local
+    int DatagramFD;                 //UDP socket, -1 if old server had no -udp
+};
+
+//Function Prototypes for file transfer and
+bool FileSend(struct Connection*, int, const char*, struct ServerSettings);  //Function for sending file to client
+bool FileReceive(struct Connection*, const char*, struct ServerSettings);    //Function for requesting file from client
+void SetupCache(struct FileCache*, size_t);     //Function for setting up file cache
+struct CachedFile* CacheFile(struct FileCache*, const std::string&);   //Function for finding or reading in a cached file
+void ReleaseFile(struct CachedFile*);       //Function for giving back cached file once its transfer is done
+void DropFile(struct FileCache*, std::map<std::string, struct CachedFile*>::iterator);  //Function for removing file from cache
+void ForgetWatch(struct FileCache*, int);   //Function for removing inotify watch no cached file uses
+void ReadNotify(struct FileCache*);         //Function for dropping cached files inotify reports as changed
+void CloseCache(struct FileCache*);         //Function for freeing every cached file
+long long FileTime(struct stat&);           //Function for getting modification time of file
+unsigned long long FileChecksum(const char*, size_t, unsigned long long);  //Function for checksum of file data
+void CloseTransfers(struct Connection*);    //Function for closing files of every transfer with client
+struct Transfers* AttachTransfers(struct Connection*, struct ServerSettings);   //Function for giving client transfer state
+struct Buffers* AttachBuffers(struct Connection*, struct BufferPool*);  //Function for giving client buffers from pool
+void ListClient(struct Connection*, struct BufferPool*);                //Function for visiting client every pass while busy
+void WatchClient(struct Connection*, int);                              //Function for watching client's socket with epoll
+void WatchSocket(int, int, unsigned long long);                         //Function for watching socket that is not a client
+void SetupPacing(int, struct Pacing*);      //Function for setting up link measurements of connection
+void TunePacing(int, struct Pacing*);       //Function for sizing file chunks and socket buffers from link
+std::string PacingStats(struct Pacing*);    //Function for formatting link measurements
+void ReleaseBuffers(struct Connection*, struct BufferPool*);            //Function for giving client's buffers back to pool
+bool CheckConnection(struct Connection*, struct MessageProtocol, struct ServerSettings);   //Function for checking connection to client
+bool SendMessage(std::vector<struct Connection*>&, struct ConsoleState&, std::string, struct RoomIndex&, struct ServerSettings);  //Function for handling server input
+bool ReceiveMessage(struct Connection*, struct MessageProtocol, struct ConsoleState&, struct ServerSettings);  //Function for receiving and displaying message from client
+void ProcessInbox(struct Connection*, struct ConsoleState&, struct RoomIndex&, struct ServerSettings);  //Function for splitting received data into frames
+void ProcessFrame(struct Connection*, struct FrameHeader, const char*, struct ConsoleState&, struct RoomIndex&, struct ServerSettings);   //Function for handling frame by type
+void ReceiveRoomFrame(struct Connection*, struct FrameHeader, const char*, struct RoomIndex&, struct ServerSettings, const char*);  //Function for handling room frames
+void SendRoom(struct RoomIndex&, int, int, int, std::string, struct ServerSettings, const char*);    //Function for relaying message to room
+void ReceiveTraced(struct Connection*, struct FrameHeader, const char*, struct ConsoleState&, struct RoomIndex&, struct ServerSettings);  //Function for handling traced frame
+void AnswerPing(struct Connection*, struct FrameHeader, const char*, struct ServerSettings);   //Function for answering PING
+void PutStamp(char*, long long);            //Function for writing time into trace fields
+void StampForwarded(char*, size_t);         //Function for stamping trace frame with time it is written to client
+int AddMember(struct RoomIndex&, struct Connection*);  //Function for adding member to room index
+void RemoveMember(struct RoomIndex&, int);              //Function for removing member from every room
+bool JoinRoom(struct RoomIndex&, int, std::string);     //Function for adding member to room
+bool LeaveRoom(struct RoomIndex&, int, int);            //Function for removing member from room
+bool InRoom(struct RoomIndex&, int, int);               //Function for checking room membership
+int FindRoom(struct RoomIndex&, std::string);           //Function for finding room number
+bool ValidRoom(std::string);                            //Function for checking room name
+void PrintRooms(struct RoomIndex&, int);                //Function for displaying rooms
+void ReceiveFileFrame(struct Connection*, struct FrameHeader, const char*);        //Function for handling frames on file channel
+bool QueuePacket(struct Connection*, struct MessageProtocol, bool, struct ServerSettings);  //Function for placing packet in client's send queue
+bool QueueFrame(struct Connection*, const std::string&, bool, struct ServerSettings);     //Function for placing frame in client's send queue
+int QueueFile(struct Connection*, struct TokenBucket*, struct ServerSettings);   //Function for queueing next chunks of file being sent
+void SetupBucket(struct TokenBucket*, double);  //Function for setting up token bucket
+void RefillBucket(struct TokenBucket*, long long);  //Function for adding tokens to bucket
+int BucketWait(struct TokenBucket*);    //Function for finding time until bucket has tokens
+long long MonotonicTime();              //Function for reading monotonic clock
+void StartDisplay(struct Display*);     //Function for starting console threads
+void StopDisplay(struct Display*);      //Function for writing remaining output and stopping console threads
+void RenderLoop(struct Display*);       //Function run by renderer thread
+void ReadLoop(struct Display*);         //Function run by input thread
+void SetupQueue(struct LineQueue*, size_t);     //Function for setting up line queue
+bool PushLine(struct LineQueue*, std::string&); //Function for handing line to other thread
+bool PopLine(struct LineQueue*, struct Line&);  //Function for taking line from other thread
+bool QueueIdle(struct LineQueue*);      //Function for marking consumer as sleeping
+int LatencyBucket(long long);           //Function for finding histogram bucket of latency
+long long LatencyBound(int);            //Function for finding largest latency of bucket
+void PrintLatency(struct Display*);     //Function for displaying display latency
+struct Capture* OpenCapture(const char*, int);  //Function for creating capture file
+void CaptureFrame(struct Capture*, int, int, const char*, size_t);   //Function for recording frame in capture
+double ParseRate(const char*);          //Function for converting rate given on command line
+bool FlushQueue(struct Connection*);    //Function for writing send queue to socket
+std::string CreateFrame(int, int, int, const char*, unsigned int);  //Function for creating frame to be sent
+SSL_CTX* CreateTLS(int);                //Function for creating certificate and TLS settings
+bool ContinueHandshake(struct Connection*);     //Function for moving TLS handshake on
+bool KernelTLS(SSL*);                   //Function for checking kernel encrypts what is written to connection
+int SocketSend(int, SSL*, const char*, size_t, int);    //Function for writing socket, through TLS if encrypted
+int SocketReceive(int, SSL*, char*, size_t, int);       //Function for reading socket, through TLS if encrypted
+void CloseTLS(SSL*);                    //Function for ending TLS on connection
+void SetupDatagram(struct Datagram*, unsigned int);     //Function for setting up UDP state
+bool DatagramFrame(const std::string&);                 //Function for checking frame may be sent as datagram
+bool DatagramBusy(struct Datagram*);                    //Function for checking frames are waiting on ACK
+void SendDatagram(int, struct Datagram*, int, unsigned int, const std::string*);   //Function for sending one datagram
+bool QueueDatagram(int, struct Datagram*, const std::string&);  //Function for queueing frame to be sent as datagram
+void FillWindow(int, struct Datagram*);                 //Function for sending queued frames while window has room
+void ReceiveDatagram(int, struct Datagram*, const char*, size_t, bool, std::vector<std::string>&);  //Function for handling datagram received
+int DatagramTimer(int, struct Datagram*);               //Function for sending again datagrams not ACK'd in time
+void DatagramFallback(struct Datagram*, std::vector<std::string>&);    //Function for taking back frames to be sent on TCP
+void ReadDatagrams(int, std::map<unsigned int, struct Connection*>&, bool, std::vector<std::pair<struct Connection*, std::string> >&);   //Function for reading datagrams from clients
+void DrainDatagrams(int, std::vector<struct Connection*>&, std::map<unsigned int, struct Connection*>&);   //Function for waiting on datagram ACKs before exiting
+std::string DatagramStats(struct Datagram*);            //Function for formatting UDP counters
+void SetupLocal(struct Local*);                         //Function for setting up state of client on this host
+bool TakeRings(struct Local*);                          //Function for mapping shared memory rings passed by client
+void UseRings(struct Local*, bool);                     //Function for moving data onto shared memory rings
+int SendHandles(int, struct Local*, const char*, size_t);   //Function for writing socket, passing waiting file descriptors
+int ReadHandles(int, struct Local*, char*, size_t);     //Function for reading socket, keeping passed file descriptors
+int LocalSend(int, struct Local*, const char*, size_t);     //Function for writing to client on this host
+int LocalReceive(int, struct Local*, char*, size_t);    //Function for reading from client on this host
+int TakeHandle(int, struct Local*);                     //Function for taking next passed file descriptor
+long int CopyHandle(int, FILE*, long int);              //Function for copying chunk of passed file
+bool PassedFile(int, long int);                         //Function for checking passed file may be copied
+bool CopyFiles(struct Connection*);                     //Function for copying chunk of every file passed by client
+void CloseLocal(struct Local*);                         //Function for unmapping rings and closing passed file descriptors
+bool ListDirectory(const std::string&, const std::string&, std::vector<struct DirectoryFile>&);    //Function for listing files below directory
+size_t QueueManifest(struct Transfer*, std::deque<std::string>&);   //Function for queueing manifest of directory
+int DirectoryChunk(struct Transfer*, int, bool, std::deque<std::string>&, std::deque<struct Splice>&);   //Function for queueing next chunk of directory
+bool ReadManifest(struct Transfer*, const char*, size_t);           //Function for adding files of manifest to directory
+void WriteDirectory(struct Transfer*, const char*, size_t);         //Function for writing data of directory into its files
+bool ValidEntry(const std::string&);                    //Function for checking path of directory file
+bool BelowFolder(const char*);                          //Function for checking path resolves below working folder
+void MakePath(const std::string&);                      //Function for creating directories of path
+bool CanSplice(SSL*, struct Local*, struct Capture*);   //Function for checking file data may be written with sendfile()
+int SpliceSend(int, SSL*, struct Splice*);              //Function for writing file data of frame from its file
+void CloseSplices(std::deque<struct Splice>&, struct Splice*);  //Function for closing files of frames not yet written
+int OpenUpgrade(int);                                   //Function for creating socket new build takes over server through
+int CheckUpgrade(int);                                  //Function for reading state layout new build asks for
+bool HandOver(int, int, std::vector<struct Connection*>&, struct ConsoleState&, struct RoomIndex&, std::map<unsigned int, struct Connection*>&, int, struct ServerSettings);   //Function for handing clients over to new build
+void SaveClient(std::string&, std::vector<int>&, std::vector<int>&, struct Connection*, struct RoomIndex&);    //Function for saving state of client
+void SaveTransfer(std::string&, std::vector<int>&, std::vector<int>&, struct Transfer*, bool);   //Function for saving state of file transfer
+void FillSplices(struct Buffers*);                      //Function for reading in file data of frames queued without it
+void ReadSplice(struct Splice*, std::string&);          //Function for reading file data of one frame
+bool TakeOver(int, struct Upgrade*);                    //Function for taking listening sockets and state from old server
+bool TakeClients(struct Upgrade*, std::vector<struct Connection*>&, struct ConsoleState&, struct RoomIndex&, std::map<unsigned int, struct Connection*>&, struct ServerSettings);   //Function for serving clients of old server
+struct Connection* LoadClient(struct Upgrade*, struct RoomIndex&, std::map<unsigned int, struct Connection*>&, struct ServerSettings);   //Function for restoring client
+struct Transfer* LoadTransfer(struct Upgrade*, bool, struct ServerSettings);    //Function for restoring file transfer
+void PutNumber(std::string&, long long);                //Function for adding number to upgrade state
+void PutText(std::string&, const std::string&);         //Function for adding text to upgrade state
+void PutHandle(std::string&, std::vector<int>&, int);   //Function for adding file descriptor to upgrade state
+long long GetNumber(struct Upgrade*);                   //Function for reading number of upgrade state
+std::string GetText(struct Upgrade*);                   //Function for reading text of upgrade state
+int GetHandle(struct Upgrade*);                         //Function for taking file descriptor of upgrade state
+bool SendBatch(int, const char*, size_t, const int*, size_t);   //Function for writing upgrade packet with file descriptors
+int ReceiveBatch(int, char*, size_t, std::vector<int>&);        //Function for reading upgrade packet and its file descriptors
+void PrintStats(std::vector<struct Connection*>&, struct BufferPool*, struct FileCache*, long long);  //Function for displaying queue metrics
+long long ResidentMemory();             //Function for reading resident memory of server
 struct MessageProtocol CreateHeader(int, int, char[]);      //Function for creating header for packet to be sent
-void Exit(int, struct MessageProtocol);     //Function for sending exit signal to Server and ending chat
-void Chat(int);                             //Function for performing chat functions
+void Exit(std::vector<struct Connection*>&, struct ServerSettings);  //Function for sending exit signal to clients and ending chat
+bool Chat(int, struct ServerSettings, struct Upgrade*);      //Function for performing chat functions, true once clients were handed over
 
 int main(int argc, char *argv[]){
-    
+
     //Initialize the variables to be used
-    int BaseSocketFD, NewSocketFD, PortNum;                 //Socket file descriptor for communicating with client and port number being used
-    struct sockaddr_in ServerAddress, ClientAddress;        //Internet address of server and client
-    socklen_t ClientAddressSize = sizeof(ClientAddress);    //Sizze of client struct used for accepting connection
+    int BaseSocketFD, PortNum = DEFAULT_PORT;               //Socket file descriptor for accepting clients and port number being used
+    struct sockaddr_in ServerAddress;                       //Internet address of server
+    struct ServerSettings Settings;                          //Slow consumer settings used for every client
+    Settings.Policy = POLICY_DROP_OLDEST;
+    Settings.HighWatermark = DEFAULT_HIGH_WATERMARK;
+    Settings.LowWatermark = DEFAULT_LOW_WATERMARK;
+    Settings.Accept = ACCEPT_ASK;
+    Settings.FileRate = 0;
+    Settings.ClientRate = 0;
+    Settings.TotalRate = 0;
+    Settings.Capture = NULL;
+    Settings.MaxClients = MAX_CLIENTS;
+    Settings.Pool = NULL;
+    Settings.TLSMode = TLS_NONE;
+    Settings.TLS = NULL;
+    Settings.DatagramFD = -1;
+    Settings.Tokens = NULL;
+    Settings.LocalFD = -1;
+    Settings.CacheSize = DEFAULT_CACHE_SIZE;
+    Settings.Cache = NULL;
+    Settings.Upgradable = false;
+    Settings.UpgradeFD = -1;
+    Settings.WatchFD = -1;
+    Settings.Received = 0;
+    Settings.Resident = -1;
+    bool UDP = false;                                       //Clients may send chat as datagrams (-udp)
+    bool Local = false;                                     //Clients on this host may connect to Unix domain socket (-local)
+    bool Upgrading = false;                                 //Take over clients of server running on port (-upgrade)
 
-    //Check to see if port number is given, otherwise default is used
-    if(argc == 1){
-        PortNum = DEFAULT_PORT;     //Use default port number since none is given
-    }else{
-        /***********************************************************
-            atoi() throws no exception and instead will return 0 if 
-            invalid input or failure in conversion is given, end 
-            program if this happens
-        ************************************************************/
-        PortNum = atoi(argv[1]);    //Converts the first argument into int (inputted port number)
-        if(PortNum == 0){
-            std::cerr << "Invalid port number given, program terminated" << std::endl;
-            exit(-1);   //End program on invalid entry
+    //Check to see if port number and options are given, otherwise default is used
+    for(int i = 1; i < argc; i++){
+        std::string Arg = argv[i];
+        if(Arg == "-policy" && i + 1 < argc){
+            std::string Policy = argv[++i];
+            if(Policy == "DROP"){
+                Settings.Policy = POLICY_DROP_OLDEST;
+            }else if(Policy == "PAUSE"){
+                Settings.Policy = POLICY_PAUSE_FILE;
+            }else if(Policy == "DISCONNECT"){
+                Settings.Policy = POLICY_DISCONNECT;
+            }else{
+                std::cerr << "Invalid policy given (DROP, PAUSE or DISCONNECT), program terminated" << std::endl;
+                exit(-1);
+            }
+        }else if(Arg == "-high" && i + 1 < argc){
+            Settings.HighWatermark = strtoul(argv[++i], NULL, 10);
+        }else if(Arg == "-low" && i + 1 < argc){
+            Settings.LowWatermark = strtoul(argv[++i], NULL, 10);
+        }else if(Arg == "-accept" && i + 1 < argc){
+            std::string Accept = argv[++i];
+            if(Accept == "ASK"){
+                Settings.Accept = ACCEPT_ASK;
+            }else if(Accept == "ALL"){
+                Settings.Accept = ACCEPT_ALL;
+            }else if(Accept == "NONE"){
+                Settings.Accept = ACCEPT_NONE;
+            }else{
+                std::cerr << "Invalid accept policy given (ASK, ALL or NONE), program terminated" << std::endl;
+                exit(-1);
+            }
+        }else if(Arg == "-file-rate" && i + 1 < argc){
+            Settings.FileRate = ParseRate(argv[++i]);
+        }else if(Arg == "-client-rate" && i + 1 < argc){
+            Settings.ClientRate = ParseRate(argv[++i]);
+        }else if(Arg == "-total-rate" && i + 1 < argc){
+            Settings.TotalRate = ParseRate(argv[++i]);
+        }else if(Arg == "-capture" && i + 1 < argc){
+            Settings.Capture = OpenCapture(argv[++i], CAPTURE_SERVER);
+        }else if(Arg == "-max-clients" && i + 1 < argc){
+            Settings.MaxClients = strtoul(argv[++i], NULL, 10);
+            if(Settings.MaxClients == 0){
+                std::cerr << "Invalid max clients given, program terminated" << std::endl;
+                exit(-1);
+            }
+        }else if(Arg == "-tls" && i + 1 < argc){
+            std::string Mode = argv[++i];
+            if(Mode == "KERNEL"){
+                Settings.TLSMode = TLS_KERNEL;
+            }else if(Mode == "USER"){
+                Settings.TLSMode = TLS_USER;
+            }else{
+                std::cerr << "Invalid TLS mode given (KERNEL or USER), program terminated" << std::endl;
+                exit(-1);
+            }
+        }else if(Arg == "-udp"){
+            UDP = true;
+        }else if(Arg == "-local"){
+            Local = true;
+        }else if(Arg == "-cache" && i + 1 < argc){
+            Settings.CacheSize = ParseRate(argv[++i]);     //Same K, M or G multipliers as rates
+        }else if(Arg == "-upgrade"){
+            Upgrading = true;
+        }else if(Arg == "-upgradable"){
+            Settings.Upgradable = true;
+        }else{
+            /***********************************************************
+                atoi() throws no exception and instead will return 0 if
+                invalid input or failure in conversion is given, end
+                program if this happens
+            ************************************************************/
+            PortNum = atoi(argv[i]);    //Converts the argument into int (inputted port number)
+            if(PortNum == 0){
+                std::cerr << "Invalid port number given, program terminated" << std::endl;
+                exit(-1);   //End program on invalid entry
+            }
+        }
+    }
+
+    //Low watermark must be below high watermark for paused transfers to resume
+    if(Settings.HighWatermark == 0 || Settings.LowWatermark >= Settings.HighWatermark){
+        std::cerr << "Invalid watermarks given (low must be less than high), program terminated" << std::endl;
+        exit(-1);
+    }
+
+    //Datagrams are not encrypted, encrypted chat must stay on TCP
+    if(UDP && Settings.TLSMode != TLS_NONE){
+        std::cerr << "-udp can't be used with -tls, chat datagrams are not encrypted, program terminated" << std::endl;
+        exit(-1);
+    }
+    if(Local && Settings.TLSMode != TLS_NONE){
+        std::cerr << "-local can't be used with -tls, clients on this host are not encrypted, program terminated" << std::endl;
+        exit(-1);
+    }
+
+    //Certificate is created once and used for every client
+    if(Settings.TLSMode != TLS_NONE){
+        Settings.TLS = CreateTLS(Settings.TLSMode);
+        if(Settings.TLS == NULL){
+            std::cerr << "TLS could not be set up, program terminated" << std::endl;
+            exit(-1);
         }
+        //OpenSSL writes socket without MSG_NOSIGNAL, a client leaving must not end server
+        #ifndef _WIN32
+            signal(SIGPIPE, SIG_IGN);
+        #endif
     }
 
     //If on windows OS
     #ifdef _WIN32
         WSADATA wsa_data;
         WSAStartup(MAKEWORD(1,1), &wsa_data);
+    #else
+        //Every client needs its own file descriptor, raise limit as far as allowed
+        struct rlimit Limit;
+        if(getrlimit(RLIMIT_NOFILE, &Limit) == 0 && Limit.rlim_cur < Limit.rlim_max){
+            Limit.rlim_cur = Limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &Limit);
+        }
     #endif
 
-    //Create the socket to communicate with the client
-    BaseSocketFD = socket(AF_INET, SOCK_STREAM, 0);     //Creates socket for IPv4, TCP, and default protocol
-    if(BaseSocketFD < 0){
-        std::cerr << "Socket creation for server failed, program terminated" << std::endl;   //Check if socket is properly created
-        close(BaseSocketFD);
-        exit(0);    //End program if not created
-    }
+    //A new build started with -upgrade takes its listening sockets from the server running on the port instead of binding
+    Settings.Port = PortNum;
+    struct Upgrade Handoff;                                 //State handed over by old server with -upgrade
+    Handoff.SocketFD = -1;
+    struct sockaddr_un LocalAddress;
+    memset(&LocalAddress, '\0', sizeof(LocalAddress));
+    LocalAddress.sun_family = AF_UNIX;
+    snprintf(LocalAddress.sun_path, sizeof(LocalAddress.sun_path), LOCAL_PATH, PortNum);
+    if(Upgrading){
+        //Listening sockets are taken from old server as they are, it stops serving until this server has read its state
+        if(!TakeOver(PortNum, &Handoff)){
+            std::cerr << "Server on port " << PortNum << " did not hand over its clients (was it started with -upgradable?), program terminated" << std::endl;
+            exit(-2);
+        }
+        BaseSocketFD = Handoff.BaseSocketFD;
+        Settings.LocalFD = Handoff.LocalFD;
+        Settings.DatagramFD = Handoff.DatagramFD;
+        std::cout << "Taking over clients of server on port " << PortNum << "... " << std::endl;
+    }else{
+        //Create the socket to communicate with the client
+        BaseSocketFD = socket(AF_INET, SOCK_STREAM, 0);     //Creates socket for IPv4, TCP, and default protocol
+        if(BaseSocketFD < 0){
+            std::cerr << "Socket creation for server failed, program terminated" << std::endl;   //Check if socket is properly created
+            close(BaseSocketFD);
+            exit(0);    //End program if not created
+        }
 
-    //Set up Socket and format respective server struct socket
-    memset(&ServerAddress, '\0', sizeof(ServerAddress));
-    ServerAddress.sin_family = AF_INET;                    //Set IP address used to IPv4
-    ServerAddress.sin_addr.s_addr = INADDR_ANY;     //Avoids binding socket to specific IP address, accept any address on socket
-    ServerAddress.sin_port = htons(PortNum);               //Port number to be used, given by user or the default value
+        //Set up Socket and format respective server struct socket
+        memset(&ServerAddress, '\0', sizeof(ServerAddress));
+        ServerAddress.sin_family = AF_INET;                    //Set IP address used to IPv4
+        ServerAddress.sin_addr.s_addr = INADDR_ANY;     //Avoids binding socket to specific IP address, accept any address on socket
+        ServerAddress.sin_port = htons(PortNum);               //Port number to be used, given by user or the default value
 
-    //Bind socket to port and begin listening for connection to be made with client
-    if(bind(BaseSocketFD, (struct sockaddr *) &ServerAddress, sizeof(ServerAddress))){
-        std::cerr << "Socket binding for server failed, program terminated" << std::endl;
-        exit(-2);
-    }
+        //Bind socket to port and begin listening for connection to be made with client
+        if(bind(BaseSocketFD, (struct sockaddr *) &ServerAddress, sizeof(ServerAddress))){
+            std::cerr << "Socket binding for server failed, program terminated" << std::endl;
+            exit(-2);
+        }
 
-    //Server will listen for client to make a request before entering endless loop of sending/receiving
-    std::cout << "Waiting for client to connect... " << std::endl;
+        //Server will listen for clients to make a request before entering endless loop of sending/receiving
+        std::cout << "Waiting for clients to connect... " << std::endl;
 
-    listen(BaseSocketFD, MAX_CLIENTS);    //Listen for MAX_CLIENTS for new connection on set socket
-    NewSocketFD = accept(BaseSocketFD, (struct sockaddr *) &ClientAddress, &ClientAddressSize);
+        listen(BaseSocketFD, Settings.MaxClients < SOMAXCONN ? Settings.MaxClients : SOMAXCONN);    //Listen for new connections on set socket
+        //Listening socket never blocks so every waiting client can be accepted at once
+        #ifdef _WIN32
+            u_long Mode = 1;
+            ioctlsocket(BaseSocketFD, FIONBIO, &Mode);
+        #else
+            fcntl(BaseSocketFD, F_SETFL, fcntl(BaseSocketFD, F_GETFL, 0) | O_NONBLOCK);
+        #endif
 
-    //Check if connection was made sucessfully with client and server
-    if(NewSocketFD < 0){
-        std::cerr << "Socket connection for server/client failed, program terminated" << std::endl;
-        exit(0);    
-    }
+        //Chat datagrams of clients using UDP are received on the same port number, without blocking
+        if(UDP){
+            Settings.DatagramFD = socket(AF_INET, SOCK_DGRAM, 0);
+            if(Settings.DatagramFD < 0 || bind(Settings.DatagramFD, (struct sockaddr *) &ServerAddress, sizeof(ServerAddress))){
+                std::cerr << "UDP socket binding for server failed, program terminated" << std::endl;
+                exit(-2);
+            }
+            #ifdef _WIN32
+                ioctlsocket(Settings.DatagramFD, FIONBIO, &Mode);
+            #else
+                fcntl(Settings.DatagramFD, F_SETFL, fcntl(Settings.DatagramFD, F_GETFL, 0) | O_NONBLOCK);
+            #endif
+        }
 
-    //Once request is made by client, client and server are connected and chat may begin
-    std::cout << "Client connected! " << std::endl;
+        //Clients on this host connect to a Unix domain socket named by port number, a socket left behind by a
+        //server that ended without cleanup is replaced (TCP port is already bound, so no other server is using it)
+        if(Local){
+            Settings.LocalFD = socket(AF_UNIX, SOCK_STREAM, 0);
+            unlink(LocalAddress.sun_path);
+            if(Settings.LocalFD < 0 || bind(Settings.LocalFD, (struct sockaddr *) &LocalAddress, sizeof(LocalAddress))){
+                std::cerr << "Unix domain socket binding for server failed, program terminated" << std::endl;
+                exit(-2);
+            }
+            listen(Settings.LocalFD, Settings.MaxClients < SOMAXCONN ? Settings.MaxClients : SOMAXCONN);
+            fcntl(Settings.LocalFD, F_SETFL, fcntl(Settings.LocalFD, F_GETFL, 0) | O_NONBLOCK);
+            std::cout << "Clients on this host can connect to " << LocalAddress.sun_path << std::endl;
+        }
+    }
 
     //Display basic info and set format of chat
-    std::cout << "\nChat is in session (EXIT to exit chat, FILE to request sending a file)" << std::endl;
+    std::cout << "\nChat is in session (EXIT to exit chat, FILE to request sending a file, STATS to display queue metrics," << std::endl;
+    std::cout << "JOIN/LEAVE room to join/leave a room, @room message to send to a room, ROOMS to list rooms)" << std::endl;
+
+    //Enter endless loop until Server chooses to exit
+    bool Handed = Chat(BaseSocketFD, Settings, &Handoff);
+    if(Settings.Capture != NULL) fclose(Settings.Capture->File);
 
-    //Once connection is made, enter endless loop until Client or Server choose to exit
-    Chat(NewSocketFD);
+    //Listening sockets were handed over to a new build, which is still using them and the Unix domain socket's name
+    if(Handed) return 0;
+    if(Settings.DatagramFD >= 0){
+        #ifdef _WIN32
+            closesocket(Settings.DatagramFD);
+        #else
+            close(Settings.DatagramFD);
+        #endif
+    }
+    if(Settings.LocalFD >= 0){
+        close(Settings.LocalFD);
+        unlink(LocalAddress.sun_path);
+    }
 
     //If on windows OS
     #ifdef _WIN32
         WSACleanup();
     #endif
 
-    //Chat has been ended, close all sockets
-    int status; 
+    //Chat has been ended, close listening socket
+    int status;
     #ifdef _WIN32
         status = shutdown(BaseSocketFD, SD_BOTH);
         if (status == 0) { status = closesocket(BaseSocketFD); }
-        status = shutdown(NewSocketFD, SD_BOTH);
-        if (status == 0) { status = close(NewSocketFD); }
     #else
         status = shutdown(BaseSocketFD, SHUT_RDWR);
         if (status == 0) { status = close(BaseSocketFD); }
-        status = shutdown(NewSocketFD, SHUT_RDWR);
-        if (status == 0) { status = close(NewSocketFD); }
     #endif
 }
 
-void Chat(int NewSocketFD){
-    struct MessageProtocol Packet;      //Create header packet to be used for sending data
-    bool connected, End [1] = {false};
+bool Chat(int BaseSocketFD, struct ServerSettings Settings, struct Upgrade* Handoff){
+    std::vector<struct Connection*> Clients;    //Clients currently connected
+    struct ConsoleState Console;                //Server console input state
+    Console.Mode = CONSOLE_CHAT;
+    Console.ClientID = 0;
+    Console.Display = new struct Display();     //Not deleted, input thread may still be reading console when program ends
+    StartDisplay(Console.Display);
+    struct RoomIndex Index;                     //Members of every chat room
+    Console.Member = AddMember(Index, NULL);
+    int NextID = 1;                             //Number given to next client that connects
+    bool Running = true;
+    struct TokenBucket Total;                   //Rate limit of every file sent by server
+    SetupBucket(&Total, Settings.TotalRate);
+    int Timeout = -1;                           //Time until a rate limited transfer can continue (ms), -1 if none are waiting
+    struct BufferPool Pool;                     //Buffers shared by every client
+    Pool.Attached = 0;
+    Settings.Pool = &Pool;
+    struct FileCache Cache;                     //Files kept in memory for every client
+    SetupCache(&Cache, Settings.CacheSize);
+    Settings.Cache = &Cache;
+    std::map<unsigned int, struct Connection*> Tokens;     //Client of every UDP token given out
+    if(Settings.DatagramFD >= 0) Settings.Tokens = &Tokens;
+    bool Handed = false;                        //Set once clients were handed over to a new build
+    std::vector<struct Connection*> Visits;     //Clients visited this pass
 
-    //Check connection with client first
-    do{
-        connected = CheckConnection(NewSocketFD, Packet);
-        //If connection is unsuccessful, try again
-        if(!connected)std::cout << "Connection could not be established, trying again" << std::endl;
-    }while(!connected);
+    //Every socket is watched with epoll, clients with a pointer to their connection and other sockets with a tag
+    Settings.WatchFD = epoll_create1(EPOLL_CLOEXEC);
+    if(Settings.WatchFD < 0){
+        std::cerr << "Sockets could not be watched, program terminated" << std::endl;
+        StopDisplay(Console.Display);
+        exit(-2);
+    }
 
-    //Enter endless loop for sending and receiving messages
-    while(true){
-        //Wait first for client to send first message/file
-        if(ReceiveMessage(NewSocketFD, Packet, End)){
-            //Check if client has exited the chat
-            if(End[0]){
-                break; //End program
-            }
-            //Send response to Clients message/file. If false, Server has exited
-            if(!SendMessage(NewSocketFD, Packet, End)){
-                break; //End program
-            }
+    //Clients of the server being upgraded are served once it has let go of them
+    if(Handoff->SocketFD >= 0){
+        NextID = Handoff->NextID;
+        Settings.Resident = ResidentMemory();
+        if(!TakeClients(Handoff, Clients, Console, Index, Tokens, Settings)){
+            std::cerr << "Server being upgraded did not let go of its clients, program terminated" << std::endl;
+            StopDisplay(Console.Display);
+            exit(-2);
+        }
+        //Clients taken over are all visited on first pass, which runs right away
+        for(size_t i = 0; i < Clients.size(); i++){
+            Clients[i]->Position = i;
+            Clients[i]->Visited = true;
+            Visits.push_back(Clients[i]);
+            if(!Clients[i]->Closed) WatchClient(Clients[i], Settings.WatchFD);
+        }
+        Timeout = 0;
+        char Pause[32];
+        snprintf(Pause, sizeof(Pause), "%.3f", (MonotonicTime() - Handoff->Stopped) / 1000000.0);
+        std::cout << "Took over " << Clients.size() << " clients from old server, service paused " << Pause << " ms" << std::endl << std::endl;
+        if(!Console.Requests.empty()){
+            Console.Mode = CONSOLE_FILE_ANSWER;
+            Console.ClientID = Console.Requests.front().ClientID;
+            std::cout << "Client " << Console.ClientID << " is requesting " << Console.Requests.front().Name << ". Send (Y/N) : " << std::endl;
         }
     }
-}
-
-struct MessageProtocol CreateHeader(int Type, int Flags, char Message[]){
-    //Create temp header to be loaded with info and sent to Client
-    struct MessageProtocol Packet;
-    Packet.Type = Type;                         //Set Type depending on Server's request 
-    Packet.Flags = Flags;                       //Set flag based on Server's request
-    strcpy(Packet.Message, Message);            //Set Checksum for message being sent
-    Packet.Length = strlen(Packet.Message);     //Attach message being sent
-    //Return packet to be sent to Client
-    return Packet;
-}
+    if(Settings.Upgradable){
+        Settings.UpgradeFD = OpenUpgrade(Settings.Port);
+        if(Settings.UpgradeFD < 0) std::cerr << "Upgrade socket could not be created, server can't be taken over with -upgrade" << std::endl;
+    }
+    int PeerFD = -1;                            //New build connected to upgrade socket, -1 if none
+    WatchSocket(Settings.WatchFD, Console.Display->Input.WakeFD[0], WATCH_CONSOLE);
+    WatchSocket(Settings.WatchFD, BaseSocketFD, WATCH_LISTEN);
+    WatchSocket(Settings.WatchFD, Settings.LocalFD, WATCH_LOCAL);
+    WatchSocket(Settings.WatchFD, Settings.DatagramFD, WATCH_DATAGRAM);
+    WatchSocket(Settings.WatchFD, Cache.NotifyFD, WATCH_NOTIFY);
+    WatchSocket(Settings.WatchFD, Settings.UpgradeFD, WATCH_UPGRADE);
 
-bool CheckConnection(int NewSocketFD, struct MessageProtocol Packet){
-    //Wait for client to send connection request
-    #ifdef _WIN32
-        recv(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-    #else
-        recv(NewSocketFD, &Packet, sizeof(Packet), 0);
-    #endif 
+    //Enter endless loop waiting on clients or server input
+    while(Running){
+        //Send again datagrams not ACK'd in time and wake up once the next one is due, chat moves back to TCP
+        //once client stopped answering, only clients using UDP have timers
+        for(std::map<unsigned int, struct Connection*>::iterator It = Tokens.begin(); It != Tokens.end(); It++){
+            struct Connection* Client = It->second;
+            int Wait = DatagramTimer(Settings.DatagramFD, Client->UDP);
+            if(Client->UDP->Failed && DatagramBusy(Client->UDP)){
+                std::vector<std::string> Frames;
+                DatagramFallback(Client->UDP, Frames);
+                for(size_t k = 0; k < Frames.size(); k++){
+                    QueueFrame(Client, Frames[k], false, Settings);
+                }
+                std::cout << "Client " << Client->ID << " stopped answering datagrams, chat moved to TCP" << std::endl << std::endl;
+            }
+            if(Wait >= 0 && (Timeout < 0 || Wait < Timeout)) Timeout = Wait;
+        }
 
-    //Check Flag
-    if(Packet.Flags == 7){  //Connection request
-        //Send ACK of connection request and then wait for ACK ACK from client
-        Packet.Flags = 6;   //ACK connection request
-        #ifdef _WIN32
-            send(NewSocketFD, (char*)&Packet, sizeof(Packet), 0);
-            //Wait for Server to send back ACK
-            recv(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-        #else
-            send(NewSocketFD, &Packet, sizeof(Packet), 0);
-            //Wait for Server to send back ACK
-            recv(NewSocketFD, &Packet, sizeof(Packet), 0);
-        #endif
-        
-        //Check if ACK ACK is sent
-        if(Packet.Flags != 4){
-            return false;       //Connection interrupted, unsucessful, try again
-        }else{
-            return true;
+        //Clients given data to send since they were last visited wait on their socket taking it, a ring only
+        //wakes server once reader makes room, so data given to a client whose ring has room is sent right away
+        for(size_t i = 0; i < Pool.Busy.size(); i++){
+            struct Connection* Client = Pool.Busy[i];
+            WatchClient(Client, Settings.WatchFD);
+            if(Client->QueuedBytes > 0 && Client->Local != NULL && Client->Local->Out != NULL && !Client->Local->Out->Full.load()){
+                Timeout = 0;
+            }
+        }
+        struct epoll_event Events[WATCH_EVENTS];
+        int Count = epoll_wait(Settings.WatchFD, Events, WATCH_EVENTS, Timeout);
+        if(Count < 0){
+            if(errno == EINTR) continue;
+            std::cerr << "Polling sockets failed, program terminated" << std::endl;
+            break;
         }
-    }else{
-       return false;    //Connection interrupted, unsucessful, try again
-    }
-}
 
-bool FileSend(int NewSocketFD, struct MessageProtocol Packet, bool End[]){
-    //Client is requesting file, select whether to send or not
-    std::string input = "";
-    std::cout << "Server is requesting " << Packet.Message << ". Send (Y/N) : " << std::endl;
-    //Loop until valid input is given
-    getline(std::cin, input);
-    while(input != "Y" && input != "N"){
-        std::cout << "Invalid input, try again : " << std::endl;
-        getline(std::cin, input);
-    }
+        //Clients with events are visited this pass, sockets that are not clients are handled below in a fixed order
+        bool Woken[WATCH_LAST + 1] = {false};   //Sockets that are not clients with events, by tag
+        for(int i = 0; i < Count; i++){
+            if(Events[i].data.u64 <= WATCH_LAST){
+                Woken[Events[i].data.u64] = true;
+                continue;
+            }
+            struct Connection* Client = (struct Connection *)Events[i].data.ptr;
+            Client->Ready |= Events[i].events;
+            if(!Client->Visited){
+                Client->Visited = true;
+                Visits.push_back(Client);
+            }
+        }
 
-    //Either send rejection signal or ACK signal
-    if(input == "N"){
-        //Send file transfer rejection packet adn wait for response back from Client
-        Packet = CreateHeader(3,1,strcpy(Packet.Message, "Reject File Request"));
+        //New build connecting is watched until it sends the state layout it reads, clients are served meanwhile,
+        //only the last new build to connect is answered
+        if(Woken[WATCH_UPGRADE]){
+            int NewFD = accept4(Settings.UpgradeFD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if(NewFD >= 0){
+                if(PeerFD >= 0) close(PeerFD);
+                PeerFD = NewFD;
+                WatchSocket(Settings.WatchFD, PeerFD, WATCH_PEER);
+            }
+        }
+
+        //New build takes over before anything more is read or written, clients it can't take stay until they leave
+        int Layout = Woken[WATCH_PEER] && PeerFD >= 0 ? CheckUpgrade(PeerFD) : 0;
+        if(Layout < 0){
+            close(PeerFD);
+            PeerFD = -1;
+        }else if(Layout > 0){
+            for(size_t i = 0; i < Visits.size(); i++){
+                Visits[i]->Visited = false;
+                Visits[i]->Ready = 0;
+            }
+            Visits.clear();
+            bool Done = HandOver(PeerFD, BaseSocketFD, Clients, Console, Index, Tokens, NextID, Settings);
+            PeerFD = -1;
+            if(Done){
+                Handed = true;
+                BaseSocketFD = -1;
+                Settings.LocalFD = -1;
+                Settings.DatagramFD = -1;
+                Settings.UpgradeFD = -1;
+                if(Clients.empty()) Running = false;
+            }
+            continue;
+        }
+
+        //Drop cached files that were changed before any of them is sent again
+        if(Woken[WATCH_NOTIFY]) ReadNotify(&Cache);
+
+        //Memory used before first client is accepted, what clients add on top of it is shown by STATS
+        if(Settings.Resident < 0 && Clients.empty() && (Woken[WATCH_LISTEN] || Woken[WATCH_LOCAL])){
+            Settings.Resident = ResidentMemory();
+        }
+
+        //Accept every new client waiting, on TCP and on this host, clients accepted now are visited once they have events
+        for(int Listener = WATCH_LISTEN; Listener <= WATCH_LOCAL; Listener++){
+            int ListenFD = Listener == WATCH_LISTEN ? BaseSocketFD : Settings.LocalFD;
+            while(Woken[Listener]){
+                struct sockaddr_storage ClientAddress;                  //Address of client
+                socklen_t ClientAddressSize = sizeof(ClientAddress);    //Size of client struct used for accepting connection
+                int NewSocketFD = accept(ListenFD, (struct sockaddr *) &ClientAddress, &ClientAddressSize);
+                if(NewSocketFD < 0){
+                    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                        std::cerr << "Socket connection for server/client failed" << std::endl;
+                    }
+                    break;
+                }else if(Clients.size() >= Settings.MaxClients){
+                    std::cerr << "Client refused, server already has " << Settings.MaxClients << " clients" << std::endl;
+                    close(NewSocketFD);
+                }else{
+                    //Client sockets never block so one slow client can't hold up the server
+                    #ifdef _WIN32
+                        u_long Mode = 1;
+                        ioctlsocket(NewSocketFD, FIONBIO, &Mode);
+                    #else
+                        fcntl(NewSocketFD, F_SETFL, fcntl(NewSocketFD, F_GETFL, 0) | O_NONBLOCK);
+                    #endif
+                    //Send chat frames right away and keep little file data waiting in socket buffer ahead of them
+                    if(Listener == WATCH_LISTEN){
+                        int Option = 1;
+                        setsockopt(NewSocketFD, IPPROTO_TCP, TCP_NODELAY, (char *)&Option, sizeof(Option));
+                        #ifdef TCP_NOTSENT_LOWAT
+                            Option = UNSENT_LIMIT;
+                            setsockopt(NewSocketFD, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (char *)&Option, sizeof(Option));
+                        #endif
+                    }
+                    struct Connection* Client = new struct Connection();
+                    Client->SocketFD = NewSocketFD;
+                    Client->ID = NextID++;
+                    Client->State = RECV_CONNECT;
+                    Client->TLS = NULL;
+                    Client->UDP = NULL;
+                    Client->Local = NULL;
+                    if(Listener == WATCH_LOCAL){
+                        Client->Local = new struct Local();
+                        SetupLocal(Client->Local);
+                    }
+                    #ifdef USE_TLS
+                        //Encrypted connections start with TLS handshake, client makes connection request after it
+                        if(Settings.TLS != NULL){
+                            Client->TLS = SSL_new(Settings.TLS);
+                            SSL_set_fd(Client->TLS, NewSocketFD);
+                            SSL_set_accept_state(Client->TLS);
+                            Client->State = RECV_TLS;
+                        }
+                    #endif
+                    Client->Closed = false;
+                    Client->QueuedBytes = 0;
+                    Client->NextTransfer = 0;
+                    Client->Paused = false;
+                    Client->Listed = false;
+                    Client->Visited = false;
+                    Client->RingsWatched = false;
+                    Client->Ready = 0;
+                    Client->Events = 0;
+                    Client->Member = AddMember(Index, Client);
+                    Client->IO = NULL;
+                    Client->Files = NULL;
+                    Client->Capture = Settings.Capture;
+                    Client->PeakBytes = 0;
+                    Client->Dropped = 0;
+                    Client->Pauses = 0;
+                    Client->Position = Clients.size();
+                    Clients.push_back(Client);
+                    WatchClient(Client, Settings.WatchFD);
+                }
+            }
+        }
+
+        //Chat frames received as datagrams are handled like frames read from client's socket
+        if(Woken[WATCH_DATAGRAM]){
+            std::vector<std::pair<struct Connection*, std::string> > Frames;
+            ReadDatagrams(Settings.DatagramFD, Tokens, true, Frames);
+            Settings.Received = MonotonicTime();
+            for(size_t k = 0; k < Frames.size(); k++){
+                struct Connection* Client = Frames[k].first;
+                const std::string& Frame = Frames[k].second;
+                if(Client->Closed) continue;
+                struct FrameHeader Header;
+                memcpy(&Header, Frame.data(), sizeof(Header));
+                Header.Channel = ntohs(Header.Channel);
+                Header.Length = ntohl(Header.Length);
+                CaptureFrame(Client->Capture, CAPTURE_RECEIVED, Client->ID, Frame.data(), Frame.size());
+                ProcessFrame(Client, Header, Frame.data() + sizeof(Header), Console, Index, Settings);
+                if(!Client->Visited){
+                    Client->Visited = true;
+                    Visits.push_back(Client);
+                }
+            }
+        }
+
+        //Clients that still have data to process or send are visited every pass until they are idle
+        for(size_t i = 0; i < Pool.Busy.size(); i++){
+            if(!Pool.Busy[i]->Visited){
+                Pool.Busy[i]->Visited = true;
+                Visits.push_back(Pool.Busy[i]);
+            }
+        }
+
+        //Receive from and send to every client visited
+        Timeout = -1;
+        for(size_t i = 0; i < Visits.size(); i++){
+            struct Connection* Client = Visits[i];
+            short Ready = Client->Ready;
+            //Idle client with nothing received has nothing to do
+            if(Ready == 0 && Client->IO == NULL && Client->Files == NULL) continue;
+            //Nothing but TLS handshake is sent or received until it is done
+            if(Client->State == RECV_TLS || Client->State == RECV_TLS_WRITE){
+                if(!ContinueHandshake(Client)) continue;
+            }
+            if(Ready & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+                char Buffer[MAX_SIZE];      //Will hold data received from client
+                int bytes;
+                //Read everything client has sent so far, client on this host may also pass file descriptors
+                while((bytes = Client->Local != NULL ? LocalReceive(Client->SocketFD, Client->Local, Buffer, sizeof(Buffer))
+                                                     : SocketReceive(Client->SocketFD, Client->TLS, Buffer, sizeof(Buffer), 0)) > 0){
+                    AttachBuffers(Client, &Pool)->Inbox.append(Buffer, bytes);
+                }
+                //Frames read along with end of connection are handled before client is closed, a fast client's
+                //last messages and exit message may arrive in the same read
+                int Error = errno;
+                Settings.Received = MonotonicTime();
+                if(Client->IO != NULL) ProcessInbox(Client, Console, Index, Settings);
+                if(bytes == 0 || (bytes < 0 && Error != EAGAIN && Error != EWOULDBLOCK)){
+                    //Client closed connection without exit message
+                    if(!Client->Closed){
+                        std::cout << "Client " << Client->ID << " has disconnected..." << std::endl << std::endl;
+                    }
+                    Client->Closed = true;
+                }
+                //Receive buffer follows link while files are received
+                if(Client->Files != NULL && !Client->Files->Receives.empty() && Client->Local == NULL){
+                    TunePacing(Client->SocketFD, &Client->Files->Pace);
+                }
+            }
+            //Files passed by client are copied a chunk at a time, check again right away while any are left
+            if(!Client->Closed && CopyFiles(Client)) Timeout = 0;
+            //Keep refilling file data while socket takes everything queued and transfers have tokens
+            while(!Client->Closed){
+                int Wait = QueueFile(Client, &Total, Settings);
+                if(!FlushQueue(Client)){
+                    Client->Closed = true;
+                }
+                if(Wait >= 0){
+                    //Wake up once rate limited transfers can continue
+                    if(Timeout < 0 || Wait < Timeout) Timeout = Wait;
+                    break;
+                }
+                if(Client->QueuedBytes > 0 || Client->Files == NULL || Client->Files->Sends.empty() || Client->Paused) break;
+            }
+
+            //Client has nothing left to process or send, give its buffers back to pool
+            if(Client->IO != NULL && Client->QueuedBytes == 0 && Client->IO->Inbox.empty()){
+                ReleaseBuffers(Client, &Pool);
+            }
+            if(Client->Files != NULL && Client->Files->Sends.empty() && Client->Files->Receives.empty()){
+                CloseTransfers(Client);
+            }
+        }
+
+        //Handle lines typed on server console, handed over by input thread
+        if(Woken[WATCH_CONSOLE]){
+            char Wake[64];
+            while(read(Console.Display->Input.WakeFD[0], Wake, sizeof(Wake)) > 0);
+            struct Line Input;
+            while(Running){
+                if(PopLine(&Console.Display->Input, Input)){
+                    Running = SendMessage(Clients, Console, Input.Text, Index, Settings);
+                }else if(QueueIdle(&Console.Display->Input)){
+                    break;
+                }
+            }
+        }
+
+        //Clients that have become idle leave list of busy clients, closed ones are removed with clients visited
+        size_t Kept = 0;
+        for(size_t i = 0; i < Pool.Busy.size(); i++){
+            struct Connection* Client = Pool.Busy[i];
+            if(!Client->Closed && (Client->IO != NULL || Client->Files != NULL)){
+                Pool.Busy[Kept++] = Client;
+                continue;
+            }
+            Client->Listed = false;
+            if(Client->Closed && !Client->Visited){
+                Client->Visited = true;
+                Visits.push_back(Client);
+            }
+        }
+        Pool.Busy.resize(Kept);
+
+        //Remove clients that have exited or been disconnected, last client takes the place of each one removed,
+        //clients that stay are watched for what they wait on now
+        for(size_t i = 0; i < Visits.size(); i++){
+            struct Connection* Client = Visits[i];
+            Client->Visited = false;
+            Client->Ready = 0;
+            if(!Client->Closed){
+                WatchClient(Client, Settings.WatchFD);
+            }else{
+                CloseTransfers(Client);
+                ReleaseBuffers(Client, &Pool);
+                RemoveMember(Index, Client->Member);
+                CloseTLS(Client->TLS);
+                if(Client->UDP != NULL){
+                    Tokens.erase(Client->UDP->Token);
+                    delete Client->UDP;
+                }
+                if(Client->Local != NULL){
+                    CloseLocal(Client->Local);
+                    delete Client->Local;
+                }
+                #ifdef _WIN32
+                    shutdown(Client->SocketFD, SD_BOTH);
+                    closesocket(Client->SocketFD);
+                #else
+                    shutdown(Client->SocketFD, SHUT_RDWR);
+                    close(Client->SocketFD);
+                #endif
+                Clients[Client->Position] = Clients.back();
+                Clients[Client->Position]->Position = Client->Position;
+                Clients.pop_back();
+                delete Client;
+            }
+        }
+        Visits.clear();
+
+        //Server that handed over its clients ends once every client that stayed has left
+        if(Handed && Clients.empty()){
+            std::cout << "Every client has left, old server exiting" << std::endl;
+            Running = false;
+        }
+    }
+
+    //Give chat frames sent as datagrams a moment to be ACK'd so exit messages sent on TCP come after them
+    DrainDatagrams(Settings.DatagramFD, Clients, Tokens);
+
+    //Try to deliver exit messages before closing every client, file transfers are abandoned
+    for(size_t i = 0; i < Clients.size(); i++){
+        struct Connection* Client = Clients[i];
+        if(Client->IO != NULL) Client->IO->FileQueue.clear();
+        #ifndef _WIN32
+            fcntl(Client->SocketFD, F_SETFL, fcntl(Client->SocketFD, F_GETFL, 0) & ~O_NONBLOCK);
+        #endif
+        FlushQueue(Client);
+        CloseTransfers(Client);
+        ReleaseBuffers(Client, &Pool);
+        CloseTLS(Client->TLS);
+        delete Client->UDP;
+        if(Client->Local != NULL){
+            CloseLocal(Client->Local);
+            delete Client->Local;
+        }
         #ifdef _WIN32
-            send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
+            shutdown(Client->SocketFD, SD_BOTH);
+            closesocket(Client->SocketFD);
         #else
-            send(NewSocketFD, &Packet, sizeof(Packet), 0);
+            shutdown(Client->SocketFD, SHUT_RDWR);
+            close(Client->SocketFD);
         #endif
+        delete Client;
+    }
+    for(size_t i = 0; i < Pool.Free.size(); i++){
+        delete Pool.Free[i];
+    }
+    CloseCache(&Cache);
+    close(Settings.WatchFD);
+    if(PeerFD >= 0) close(PeerFD);
+    if(Settings.UpgradeFD >= 0){
+        struct sockaddr_un Address;
+        close(Settings.UpgradeFD);
+        snprintf(Address.sun_path, sizeof(Address.sun_path), UPGRADE_PATH, Settings.Port);
+        unlink(Address.sun_path);
+    }
+    StopDisplay(Console.Display);
+    return Handed;
+}
+
+void WatchClient(struct Connection* Client, int WatchFD){
+    //Only wait on socket accepting data if client has data queued or TLS handshake is waiting on it, with rings
+    //socket only takes file descriptors and eventfd tells once ring has room
+    bool Rings = Client->Local != NULL && Client->Local->Out != NULL;
+    unsigned int Events = EPOLLIN;
+    if((Client->QueuedBytes > 0 && (!Rings || !Client->Local->Outgoing.empty())) || Client->State == RECV_TLS_WRITE){
+        Events |= EPOLLOUT;
+    }
+    struct epoll_event Event;
+    memset(&Event, 0, sizeof(Event));
+    Event.data.ptr = Client;
+    if(Events != Client->Events){
+        Event.events = Events;
+        epoll_ctl(WatchFD, Client->Events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, Client->SocketFD, &Event);
+        Client->Events = Events;
+    }
+
+    //Eventfd of client using rings wakes it like data on its socket
+    if(Rings && !Client->RingsWatched){
+        Event.events = EPOLLIN;
+        epoll_ctl(WatchFD, EPOLL_CTL_ADD, Client->Local->WakeFD, &Event);
+        Client->RingsWatched = true;
+    }
+}
+
+void WatchSocket(int WatchFD, int SocketFD, unsigned long long Tag){
+    //Sockets not in use (-1) are left out
+    if(SocketFD < 0) return;
+    struct epoll_event Event;
+    memset(&Event, 0, sizeof(Event));
+    Event.events = EPOLLIN;
+    Event.data.u64 = Tag;
+    epoll_ctl(WatchFD, EPOLL_CTL_ADD, SocketFD, &Event);
+}
+
+struct MessageProtocol CreateHeader(int Type, int Flags, char Message[]){
+    //Create temp header to be loaded with info and sent to Client
+    struct MessageProtocol Packet;
+    Packet.Type = Type;                         //Set Type depending on Server's request
+    Packet.Flags = Flags;                       //Set flag based on Server's request
+    strcpy(Packet.Message, Message);            //Set Checksum for message being sent
+    Packet.Length = strlen(Packet.Message);     //Attach message being sent
+    Packet.Channel = CHAT_CHANNEL;              //Messages are sent on chat channel
+    //Return packet to be sent to Client
+    return Packet;
+}
+
+bool CheckConnection(struct Connection* Client, struct MessageProtocol Packet, struct ServerSettings Settings){
+    //Check Flag
+    if(Client->State == RECV_CONNECT && Packet.Flags == 7){  //Connection request
+        //Send ACK of connection request and then wait for ACK ACK from client
+        Packet.Flags = 6;   //ACK connection request
+        if(Settings.Tokens != NULL && strncmp(Packet.Message, "UDP", 3) == 0){
+            //Client asked for UDP, token given in ACK picks out its datagrams (a new one unless request is made again)
+            if(Client->UDP == NULL){
+                static std::random_device Random;
+                unsigned int Token;
+                do{
+                    Token = Random();
+                }while(Token == 0 || Settings.Tokens->count(Token) > 0);
+                Client->UDP = new struct Datagram();
+                SetupDatagram(Client->UDP, Token);
+                (*Settings.Tokens)[Token] = Client;
+            }
+            Packet.Length = sprintf(Packet.Message, "UDP %u", Client->UDP->Token);
+        }else if(Client->Local != NULL && strncmp(Packet.Message, "SHM", 3) == 0){
+            //Client on this host passed shared memory rings with request, they are used once ACK ACK is received
+            if(Client->Local->Memory != NULL || TakeRings(Client->Local)){
+                Packet.Length = sprintf(Packet.Message, "SHM");
+            }else{
+                Packet.Length = sprintf(Packet.Message, " ");
+            }
+        }
+        QueuePacket(Client, Packet, true, Settings);
+        Client->State = RECV_CONNECT_ACK;
+        return true;
+    }else if(Client->State == RECV_CONNECT_ACK && Packet.Flags == 4){
+        //ACK ACK is sent, client and server are connected and chat may begin
+        Client->State = RECV_PACKET;
+        if(Client->Local != NULL && Client->Local->Memory != NULL){
+            //Everything after ACK ACK is sent through rings, socket only passes file descriptors from now on
+            UseRings(Client->Local, false);
+            std::cout << "Client " << Client->ID << " connected on this host (shared memory)! " << std::endl;
+        }else if(Client->Local != NULL){
+            std::cout << "Client " << Client->ID << " connected on this host! " << std::endl;
+        }else{
+            std::cout << "Client " << Client->ID << " connected! " << std::endl;
+        }
         return true;
     }else{
-        //Send file ACK to Client and begin preparing transfer
-        Packet = CreateHeader(2,1,strcpy(Packet.Message, "Accepted File Request"));
-        #ifdef _WIN32
-            send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-        #else
-            send(NewSocketFD, &Packet, sizeof(Packet), 0);
-        #endif
+        //Connection interrupted, unsucessful, wait for client to try again
+        Client->State = RECV_CONNECT;
+        std::cout << "Connection could not be established with client " << Client->ID << ", waiting for it to try again" << std::endl;
+        return false;
+    }
+}
+
+void ProcessInbox(struct Connection* Client, struct ConsoleState& Console, struct RoomIndex& Index, struct ServerSettings Settings){
+    std::string& Inbox = Client->IO->Inbox;     //Buffers stay attached until inbox is empty
+    size_t Used = 0;    //Bytes of inbox already processed
+    //Keep processing until a whole frame has not been received
+    while(!Client->Closed && Inbox.size() - Used >= sizeof(struct FrameHeader)){
+        struct FrameHeader Header;
+        memcpy(&Header, Inbox.data() + Used, sizeof(Header));
+        Header.Channel = ntohs(Header.Channel);
+        Header.Length = ntohl(Header.Length);
+
+        //Frame is larger than any valid frame, rest of data can't be trusted
+        if(Header.Length > MAX_FRAME){
+            std::cout << "Client " << Client->ID << " sent a corrupted frame and has been disconnected..." << std::endl << std::endl;
+            Client->Closed = true;
+            break;
+        }
+        if(Inbox.size() - Used < sizeof(Header) + Header.Length) break;
+        const char* Data = Inbox.data() + Used + sizeof(Header);
+        CaptureFrame(Client->Capture, CAPTURE_RECEIVED, Client->ID, Inbox.data() + Used, sizeof(Header) + Header.Length);
+        Used += sizeof(Header) + Header.Length;
+        ProcessFrame(Client, Header, Data, Console, Index, Settings);
+    }
+    Inbox.erase(0, Used);
+}
+
+void ProcessFrame(struct Connection* Client, struct FrameHeader Header, const char* Data, struct ConsoleState& Console, struct RoomIndex& Index, struct ServerSettings Settings){
+    if(Header.Type <= 3){
+        //Rebuild packet from frame, channel is transfer ID for file request/ACK/ignored
+        struct MessageProtocol Packet;
+        size_t Length = Header.Length < MAX_LENGTH ? Header.Length : MAX_LENGTH - 1;
+        Packet.Type = Header.Type;
+        Packet.Flags = Header.Flags;
+        Packet.Channel = Header.Channel;
+        Packet.Length = Header.Length;
+        memcpy(Packet.Message, Data, Length);
+        Packet.Message[Length] = '\0';
+        if(Client->State == RECV_CONNECT || Client->State == RECV_CONNECT_ACK){
+            CheckConnection(Client, Packet, Settings);
+        }else{
+            ReceiveMessage(Client, Packet, Console, Settings);
+        }
+    }else if((Header.Type <= 6 || Header.Type == 10 || Header.Type == 11) && Client->State == RECV_PACKET){
+        ReceiveFileFrame(Client, Header, Data);
+    }else if(Header.Type <= 9 && Client->State == RECV_PACKET){
+        ReceiveRoomFrame(Client, Header, Data, Index, Settings, NULL);
+    }else if(Header.Type == 12 && Client->State == RECV_PACKET){
+        ReceiveTraced(Client, Header, Data, Console, Index, Settings);
+    }else if(Header.Type == 13 && Client->State == RECV_PACKET){
+        AnswerPing(Client, Header, Data, Settings);
+    }else{
+        //Invalid type provided, ask for request to be sent again
+        QueuePacket(Client, CreateHeader(0,1,(char *)"Error, last request corrupted. Please try again"), false, Settings);
+    }
+}
+
+void ReceiveFileFrame(struct Connection* Client, struct FrameHeader Header, const char* Data){
+    //Only frames for files requested from client are accepted
+    if(Client->Files == NULL) return;
+    std::map<int, struct Transfer*>::iterator Found = Client->Files->Receives.find(Header.Channel);
+    if(Found == Client->Files->Receives.end()) return;
+    struct Transfer* Receive = Found->second;
+
+    switch(Header.Type){
+        case 4:     //File start, open output file for file that was requested, data is checked if checksum was sent
+            if(Receive->Started || (Header.Length != 8 && Header.Length != 16)) return;
+            Receive->Started = true;
+            Receive->Remaining = 0;
+            Receive->Verify = Header.Length == 16;
+            Receive->Checksum = 0;
+            Receive->Hash = CHECKSUM_START;
+            for(int i = 0; i < 8; i++){
+                Receive->Remaining = (Receive->Remaining << 8) | (unsigned char)Data[i];
+                if(Receive->Verify) Receive->Checksum = (Receive->Checksum << 8) | (unsigned char)Data[i + 8];
+            }
+            Receive->File = fopen(Receive->Name.c_str(), "wb");   //Open output file as binary as data is given as binary
+            return;
+        case 5:     //File data, write into file (or files of directory)
+            if(!Receive->Started) return;
+            if(Receive->Directory){
+                WriteDirectory(Receive, Data, Header.Length);
+            }else if(Receive->File != NULL){
+                fwrite(Data, 1, Header.Length, Receive->File);
+            }
+            if(Receive->Verify) Receive->Hash = FileChecksum(Data, Header.Length, Receive->Hash);
+            Receive->Remaining -= Header.Length;
+            return;
+        case 6:     //File end, close file and signal its completion
+            if(!Receive->Started) return;
+            if(Receive->Directory) WriteDirectory(Receive, NULL, 0);   //Creates empty files listed last
+            if(Receive->File != NULL) fclose(Receive->File);
+            if(Receive->Remaining != 0 || Receive->Left != 0 || Receive->Next != Receive->Entries.size() || (Receive->Verify && Receive->Hash != Receive->Checksum)){
+                std::cout << "File Transfer " << Receive->ID << " (" << Receive->Name << ") from client " << Client->ID << " incomplete! File may be corrupted" << std::endl << std::endl;
+            }else if(Receive->Directory){
+                std::cout << "File Transfer " << Receive->ID << " (" << Receive->Name << ", " << Receive->Entries.size() << " files) from client " << Client->ID << " complete!" << std::endl << std::endl;
+            }else{
+                std::cout << "File Transfer " << Receive->ID << " (" << Receive->Name << ") from client " << Client->ID << " complete!" << std::endl << std::endl;
+            }
+            Client->Files->Receives.erase(Found);
+            delete Receive;
+            return;
+        case 10:    //File handle, copy file passed by client into output file
+            if(Receive->Started || Header.Length != 8) return;
+            Receive->Started = true;
+            Receive->Remaining = 0;
+            for(int i = 0; i < 8; i++){
+                Receive->Remaining = (Receive->Remaining << 8) | (unsigned char)Data[i];
+            }
+            Receive->File = fopen(Receive->Name.c_str(), "wb");
+            Receive->Source = TakeHandle(Client->SocketFD, Client->Local);
+            //Only a regular file holding at least the length client claims is copied, a device passed in its place
+            //(/dev/zero) would otherwise fill the disk
+            if(Receive->Source >= 0 && !PassedFile(Receive->Source, Receive->Remaining)){
+                close(Receive->Source);
+                Receive->Source = -1;
+            }
+            //Passed file shares its offset with sender's copy, which stdio may have left anywhere, so copy starts from beginning
+            if(Receive->Source >= 0) lseek(Receive->Source, 0, SEEK_SET);
+            if(Receive->Source < 0){
+                //Frame came without its file descriptor (not on this host, or replayed capture) or with something else
+                if(Receive->File != NULL) fclose(Receive->File);
+                std::cout << "File Transfer " << Receive->ID << " (" << Receive->Name << ") from client " << Client->ID << " incomplete! File may be corrupted" << std::endl << std::endl;
+                Client->Files->Receives.erase(Found);
+                delete Receive;
+            }
+            return;
+        case 11:    //Directory manifest, create directory and add files listed to it
+            if(Receive->Started && !Receive->Directory) return;
+            if(!Receive->Started){
+                Receive->Started = true;
+                Receive->Directory = true;
+                Receive->Remaining = 0;
+                MakePath(Receive->Name + "/");
+            }
+            if(!ReadManifest(Receive, Data, Header.Length)){
+                std::cout << "File Transfer " << Receive->ID << " (" << Receive->Name << ") from client " << Client->ID << " has a corrupted manifest, later files are dropped" << std::endl << std::endl;
+            }
+            return;
+    }
+}
+
+bool FileSend(struct Connection* Client, int ID, const char* Filename, struct ServerSettings Settings){
+    //Limit number of files sent at once, and never reuse an ID still being sent
+    struct Transfers* Files = AttachTransfers(Client, Settings);
+    bool InUse = false;
+    for(size_t i = 0; i < Files->Sends.size(); i++){
+        if(Files->Sends[i]->ID == ID) InUse = true;
+    }
+    if(InUse || Files->Sends.size() >= MAX_TRANSFERS){
+        struct MessageProtocol Packet = CreateHeader(3,1,(char *)"Reject File Request");
+        Packet.Channel = ID;
+        QueuePacket(Client, Packet, true, Settings);
+        std::cout << "Client " << Client->ID << " has too many file transfers, request rejected" << std::endl << std::endl;
+        return false;
     }
 
-    //Open desired file to be sent and calculate file size to send to Client
-    std::string filename;
-    std::cout << "Enter filename (include path if in different folder) : " << std::endl;
-    getline(std::cin, filename);
-    const char* Filename = filename.c_str();
-    
     /*
         IF INPUTTED FILE IS WRONG OR EMPTY, EMPTY FILE WILL BE TRANSFERRED TO CLIENT
         AND FILE REQUEST WILL BE NEEDED AGAIN
     */
 
+    //File already in cache is sent from memory without being opened or checked, clients on this host
+    //are passed the file itself so it is never cached for them
+    struct Transfer* Send = new struct Transfer();
+    Send->ID = ID;
+    Send->Name = Filename;
+    Send->Cached = Client->Local == NULL ? CacheFile(Settings.Cache, Send->Name) : NULL;
+    Send->Started = true;
+    Send->Source = -1;
+    SetupBucket(&Send->Bucket, Settings.FileRate);
+
     //open file in binary to allow transfer of any file type
-    FILE* File = fopen(Filename, "rb"); 
+    Send->File = Send->Cached == NULL ? fopen(Filename, "rb") : NULL;
 
-    //Send size of file to client for knowing when to stop
-    fseek(File, 0L, SEEK_END);
-    long int Size = ftell(File);
-    #ifdef _WIN32
-        send(NewSocketFD, (char *)&Size, sizeof(Size), 0);
-    #else
-        send(NewSocketFD, &Size, sizeof(Size), 0);
-    #endif
-    fclose(File);   //Close file to reset pointer to begining
+    //Directory is sent as a manifest of every file below it followed by their data
+    struct stat Info;
+    if(Send->Cached == NULL && stat(Filename, &Info) == 0 && S_ISDIR(Info.st_mode)){
+        if(Send->File != NULL) fclose(Send->File);
+        Send->File = NULL;
+        Send->Directory = ListDirectory(Send->Name, "", Send->Entries);
+    }
 
-    fopen(Filename, "rb");
-    int bytes, total = 0;   //Track total bytes written and total bytes received at a time to send full file completely
-    char Buffer[MAX_SIZE];  //Will hold data from file to be placed in socket and transfered
-    //Loop till all bytes are read from file
-    while(true){
-        bytes = fread(Buffer, 1, MAX_SIZE, File);
-        total += bytes;
-        if(bytes > 0){
-            //Send buffer if data is contained inside
-            send(NewSocketFD, Buffer, bytes, 0);
-        }else{
-            //End loop if complete file has been sent
-            if(total >= Size){
-                break;
-            }
-        }
-        //Clear buffer after each send to allow more data to be placed in
-        #ifdef _WIN32
-            memset(Buffer, '\0', MAX_SIZE);
-        #else
-            bzero(Buffer, MAX_SIZE);
-        #endif
+    //Send file ACK to Client and begin preparing transfer
+    struct MessageProtocol Packet = CreateHeader(2,1,(char*)"Accepted File Request");
+    Packet.Channel = ID;
+    QueuePacket(Client, Packet, true, Settings);
+
+    //Send size of file to client in start frame for knowing when to stop, cached file's checksum follows it
+    long int Size = 0;
+    if(Send->Cached != NULL){
+        Size = Send->Cached->Data.size();
+    }else if(Send->File != NULL){
+        fseek(Send->File, 0L, SEEK_END);
+        Size = ftell(Send->File);
+        fseek(Send->File, 0L, SEEK_SET);  //Reset pointer to begining
     }
-    
-    //Close output file
-    fclose(File);
-    std::cout<<"File Transfer complete! Client is replying"<<std::endl<<std::endl;
-    return false;
+    char SizeData[16];
+    for(int i = 0; i < 8; i++){
+        SizeData[i] = (char)((unsigned long long)Size >> (56 - 8 * i));
+        SizeData[i + 8] = Send->Cached != NULL ? (char)(Send->Cached->Checksum >> (56 - 8 * i)) : 0;
+    }
+    struct Buffers* IO = AttachBuffers(Client, Settings.Pool);
+    if(Send->Directory){
+        Send->Remaining = 0;
+        for(size_t i = 0; i < Send->Entries.size(); i++) Send->Remaining += Send->Entries[i].Size;
+        Client->QueuedBytes += QueueManifest(Send, IO->FileQueue);
+        Files->Sends.push_back(Send);
+        return true;
+    }
+
+    //Client on this host is passed the file itself and copies it, nothing is read or sent
+    int Handle = (Client->Local != NULL && Send->File != NULL) ? dup(fileno(Send->File)) : -1;
+    if(Handle >= 0){
+        Client->Local->Outgoing.push_back(Handle);
+        Client->Local->Passed++;
+        IO->FileQueue.push_back(CreateFrame(10, 1, ID, SizeData, 8));
+        Client->QueuedBytes += IO->FileQueue.back().size();
+        fclose(Send->File);
+        std::cout << "File Transfer " << Send->ID << " (" << Send->Name << ") to client " << Client->ID << " passed!" << std::endl << std::endl;
+        delete Send;
+        return true;
+    }
+    IO->FileQueue.push_back(CreateFrame(4, 1, ID, SizeData, Send->Cached != NULL ? 16 : 8));
+    Client->QueuedBytes += IO->FileQueue.back().size();
+
+    //File data is queued by QueueFile() as client drains its queue
+    Send->Remaining = Size;
+    Files->Sends.push_back(Send);
+    return true;
 }
 
-bool FileReceive(int NewSocketFD, struct MessageProtocol Packet, bool End[]){
-    //Send a request for desired file from Server
-    std::string filename;
-    std::cout << "Enter filename (include path if in different folder) : " << std::endl;
-    getline(std::cin, filename);
-    const char* Filename = filename.c_str();
+int QueueFile(struct Connection* Client, struct TokenBucket* Total, struct ServerSettings Settings){
+    //Nothing to do if no file is being sent
+    if(Client->Files == NULL || Client->Files->Sends.empty()) return -1;
+    struct Transfers* Files = Client->Files;
+    struct Buffers* IO = AttachBuffers(Client, Settings.Pool);
 
-    //Send filename to client, requesting transfer
-    Packet = CreateHeader(1,1,strcpy(Packet.Message, Filename));
-    #ifdef _WIN32
-        send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-    #else
-        send(NewSocketFD, &Packet, sizeof(Packet), 0);
-    #endif
-    
-    //Check response from client concerning file transfer
-    if(ReceiveMessage(NewSocketFD, Packet, End)){
-        long int FileSize;  //Store filesize to track if all data is received
-        FILE *File;
-        char Buffer[MAX_SIZE];  //Buffer for placing data into to allow file insertion
-        
-        //Receive file size
-        #ifdef _WIN32
-            recv(NewSocketFD, (char *)&FileSize, sizeof(FileSize), 0);
-        #else
-            recv(NewSocketFD, &FileSize, sizeof(FileSize), 0);
-        #endif   
+    //Resume paused transfers once client has drained to low watermark
+    if(Client->Paused && Client->QueuedBytes <= Settings.LowWatermark){
+        Client->Paused = false;
+    }
+
+    //Add tokens for time passed since last chunks were queued
+    long long Now = MonotonicTime();
+    RefillBucket(Total, Now);
+    RefillBucket(&Files->Bucket, Now);
+
+    //Size chunks to link, up to half the room above low watermark so chat frames still fit below high watermark
+    if(Client->Local == NULL) TunePacing(Client->SocketFD, &Files->Pace);
+    if(Files->Pace.Chunk > (int)(Settings.HighWatermark - Settings.LowWatermark) / 2) Files->Pace.Chunk = (Settings.HighWatermark - Settings.LowWatermark) / 2;
+    if(Files->Pace.Chunk < MAX_SIZE) Files->Pace.Chunk = MAX_SIZE;
+    int Chunk = Files->Pace.Chunk;
+
+    //Read one chunk from each file in turn so every transfer gets an equal share of the connection,
+    //keeping at most low watermark of file data queued
+    char Buffer[MAX_CHUNK]; //Will hold data from file to be placed in socket and transfered
+    int Wait = -1;          //Time until a rate limited transfer can continue (ms)
+    int Soonest = -1;       //Shortest wait of transfers skipped for being out of tokens
+    size_t Skipped = 0;     //Transfers in a row skipped for being out of tokens
+    while(!Client->Paused && !Files->Sends.empty() && Client->QueuedBytes < Settings.LowWatermark){
+        //Server and client limits hold up every transfer to client
+        int Limit = BucketWait(Total);
+        if(BucketWait(&Files->Bucket) > Limit) Limit = BucketWait(&Files->Bucket);
+        if(Limit > 0){
+            Wait = Limit;
+            break;
+        }
 
-        File = fopen(Filename, "wb");   //Open output file as binary as data is given as binary
-        int bytes;  //Track bytes receive for knowing when file is complete
-        while((bytes = recv(NewSocketFD, Buffer, sizeof(Buffer), 0)) > 0){
-            fwrite(&Buffer, 1, bytes, File);    //Wrtie data into file
-            fflush(File);
-            //Check if file is complete
-            if(ftell(File) < FileSize){    
+        struct Transfer* Send = Files->Sends.front();
+        Files->Sends.pop_front();
+        if(Send->Remaining > 0){
+            //Transfer is over its own limit, give its turn to the next transfer
+            RefillBucket(&Send->Bucket, Now);
+            Limit = BucketWait(&Send->Bucket);
+            if(Limit > 0){
+                Files->Sends.push_back(Send);
+                if(Soonest < 0 || Limit < Soonest) Soonest = Limit;
+                if(++Skipped >= Files->Sends.size()){
+                    Wait = Soonest;
+                    break;
+                }
+                continue;
+            }
+            Skipped = 0;
 
+            int bytes = 0;
+            if(Send->Directory){
+                //Directory chunk may pack several files, or be a frame written straight from a large file
+                bytes = DirectoryChunk(Send, Chunk, CanSplice(Client->TLS, Client->Local, Client->Capture), IO->FileQueue, IO->Splices);
+                Client->QueuedBytes += sizeof(struct FrameHeader) + bytes;
+            }else if(Send->Cached != NULL){
+                //Cached file's frames are made straight from memory
+                bytes = Send->Remaining < Chunk ? Send->Remaining : Chunk;
+                IO->FileQueue.push_back(CreateFrame(5, 1, Send->ID, Send->Cached->Data.data() + (Send->Cached->Data.size() - Send->Remaining), bytes));
+                Client->QueuedBytes += IO->FileQueue.back().size();
+                Send->Remaining -= bytes;
             }else{
-                break;
-                return true;
+                if(Send->File != NULL){
+                    bytes = fread(Buffer, 1, Chunk, Send->File);
+                }
+                if(bytes <= 0){
+                    //File shrunk while sending, fill in rest so client is not left waiting
+                    bytes = Send->Remaining < Chunk ? Send->Remaining : Chunk;
+                    memset(Buffer, '\0', bytes);
+                }
+                if(bytes > Send->Remaining) bytes = Send->Remaining;
+                IO->FileQueue.push_back(CreateFrame(5, 1, Send->ID, Buffer, bytes));
+                Client->QueuedBytes += IO->FileQueue.back().size();
+                Send->Remaining -= bytes;
             }
-            //Clear buffer before inputting additional data
-            #ifdef _WIN32
-                memset(Buffer, '\0', MAX_SIZE);
-            #else
-                bzero(Buffer, MAX_SIZE);
-            #endif
+
+            //Take tokens for chunk from every limit it passed
+            if(Send->Bucket.Rate > 0) Send->Bucket.Tokens -= bytes;
+            if(Files->Bucket.Rate > 0) Files->Bucket.Tokens -= bytes;
+            if(Total->Rate > 0) Total->Tokens -= bytes;
+        }
+
+        //Once whole file is queued, end transfer
+        if(Send->Remaining == 0){
+            IO->FileQueue.push_back(CreateFrame(6, 1, Send->ID, NULL, 0));
+            Client->QueuedBytes += IO->FileQueue.back().size();
+            if(Send->File != NULL) fclose(Send->File);
+            ReleaseFile(Send->Cached);
+            if(Send->Directory){
+                std::cout << "File Transfer " << Send->ID << " (" << Send->Name << ", " << Send->Entries.size() << " files) to client " << Client->ID << " queued!" << std::endl << std::endl;
+            }else{
+                std::cout << "File Transfer " << Send->ID << " (" << Send->Name << ") to client " << Client->ID << " queued!" << std::endl << std::endl;
+            }
+            delete Send;
+        }else{
+            Files->Sends.push_back(Send);
         }
-        //Close file and signal to client of its completion
-        fclose(File);
-        std::cout<<"File Transfer complete! Server waiting on reply"<<std::endl<<std::endl;
     }
-    return true;
+    if(Client->QueuedBytes > Client->PeakBytes) Client->PeakBytes = Client->QueuedBytes;
+    return Wait;
 }
 
-bool ReceiveMessage(int NewSocketFD, struct MessageProtocol Packet, bool End[]){
-    //Get information sent from Client, message, file request, or control message
-    #ifdef _WIN32
-        recv(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-    #else
-        recv(NewSocketFD, &Packet, sizeof(Packet), 0);
-    #endif 
+void SetupBucket(struct TokenBucket* Bucket, double Rate){
+    //Bucket holds enough tokens for a short burst, but never less than one chunk
+    Bucket->Rate = Rate;
+    Bucket->Burst = Rate * RATE_BURST / 1000;
+    if(Bucket->Burst < MAX_SIZE) Bucket->Burst = MAX_SIZE;
+    Bucket->Tokens = Bucket->Burst;
+    Bucket->Last = MonotonicTime();
+}
 
-    //Check type for deciding correct process to proceed with
-    switch(Packet.Type){
-        case 0:     //Message has been sent, check if it is complete
-            //Check if checksum is equal
-            if(Packet.Length != strlen(Packet.Message)){
-                //Packet corrupt, send error message
-                Packet = CreateHeader(0,2,strcpy(Packet.Message, "Error, last message corrupted. Please try again"));
-                #ifdef _WIN32
-                    send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-                #else
-                    send(NewSocketFD, &Packet, sizeof(Packet), 0);
-                #endif
-                return false;
-            }
-            //Simple message sent, check if message is error to be handled
-            switch (Packet.Flags){
-                case 2:
-                    //Packet corrupt, send error message
-                    Packet = CreateHeader(0,2,strcpy(Packet.Message, "Error, last message corrupted. Please try again"));
-                    #ifdef _WIN32
-                        send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-                    #else
-                        send(NewSocketFD, &Packet, sizeof(Packet), 0);
-                    #endif
-                    return false;
-                case 3:
-                    //File corrupt, send error message
-                    Packet = CreateHeader(0,3,strcpy(Packet.Message, "Error, last message corrupted. Please try again"));
-                    #ifdef _WIN32
-                        send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-                    #else
-                        send(NewSocketFD, &Packet, sizeof(Packet), 0);
-                    #endif
-                    return false;
-                default:
-                    //Display exit message from client and end chat
-                    std::cout<<"- - CLIENT - -"<<std::endl;
-                    std::cout<<Packet.Message<<std::endl << std::endl;
-                    if(Packet.Flags == 0){End[0] = true;}
-                    return true;
-            }
-        case 1:     //File request message
-            //Client is requesting to send file, accept or ignore then wait for Client's reply
-            return FileSend(NewSocketFD, Packet, End);
-        case 2:     //File request approved
-            //Client has ACK request to send file, display approval
-            std::cout<<"- - CLIENT - -"<<std::endl;
-            std::cout<<Packet.Message<<std::endl << std::endl;
-            return true;
-        case 3:     //File request ignored message
-            //Client has ignored request to send file, display denial
-            std::cout<<"- - CLIENT - -"<<std::endl;
-            std::cout<<Packet.Message<<std::endl << std::endl;
-            std::cout<<"File Transfer Rejected... Server waiting on reply"<<std::endl<<std::endl;
-            return false;
-        default:
-            //Corruption in packet, invalid type provided
-            Packet = CreateHeader(0,1,strcpy(Packet.Message, "Error, last request corrupted. Please try again"));
-            #ifdef _WIN32
-                send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-            #else
-                send(NewSocketFD, &Packet, sizeof(Packet), 0);
-            #endif  //Send error message to client, asking for request to be sent again
-            return false;   //Perform receive loop again in chat funtion
+void RefillBucket(struct TokenBucket* Bucket, long long Now){
+    //Unlimited buckets never run out of tokens
+    if(Bucket->Rate <= 0) return;
+    Bucket->Tokens += Bucket->Rate * (Now - Bucket->Last) / 1000000000.0;
+    if(Bucket->Tokens > Bucket->Burst) Bucket->Tokens = Bucket->Burst;
+    Bucket->Last = Now;
+}
+
+int BucketWait(struct TokenBucket* Bucket){
+    //Chunk may be taken as long as any tokens are left, tokens it goes over by are paid back before next chunk
+    if(Bucket->Rate <= 0 || Bucket->Tokens > 0) return 0;
+    return (int)(-Bucket->Tokens * 1000 / Bucket->Rate) + 1;
+}
+
+long long MonotonicTime(){
+    //Clock is never set back so refills are never negative
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Capture* OpenCapture(const char* Filename, int Role){
+    //Capture is written through a large buffer so recording frames costs little on the I/O thread
+    struct Capture* Capture = new struct Capture();
+    Capture->File = fopen(Filename, "wb");
+    if(Capture->File == NULL){
+        std::cerr << "Capture file could not be created, program terminated" << std::endl;
+        exit(-1);
     }
+    setvbuf(Capture->File, NULL, _IOFBF, CAPTURE_BUFFER);
+    Capture->Last = MonotonicTime();
+
+    struct CaptureHeader Header;
+    memcpy(Header.Magic, CAPTURE_MAGIC, sizeof(Header.Magic));
+    Header.Version = CAPTURE_VERSION;
+    Header.Role = Role;
+    Header.Reserved = 0;
+    fwrite(&Header, sizeof(Header), 1, Capture->File);
+    return Capture;
 }
 
-bool SendMessage(int NewSocketFD, struct MessageProtocol Packet, bool End[]){
-    //Get user input first (check if input is message or attempt to send file)
-    std::string Input;
-    getline(std::cin, Input);
+void CaptureFrame(struct Capture* Capture, int Direction, int Connection, const char* Frame, size_t Length){
+    //Nothing to do if not capturing
+    if(Capture == NULL) return;
 
-    if(Input == "FILE"){
-        //Client is requesting for file
-        FileReceive(NewSocketFD, Packet, End);
-        //Server will reply to client after transfer
-        SendMessage(NewSocketFD, Packet, End);
-    }else if(Input == "EXIT"){
-        //Server is exiting the program, send exit code to server to follow suit
-        Exit(NewSocketFD, Packet);
-        return false;
-    }else{
-        //Send corresponding flags/type and message and then wait for response
-        Packet = CreateHeader(0,1,strcpy(Packet.Message, Input.c_str()));
-        #ifdef _WIN32
-            send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-        #else
-            send(NewSocketFD, &Packet, sizeof(Packet), 0);
-        #endif
+    //Time is kept as whole microseconds since last record, so rounding never adds up over a capture
+    long long Delta = (MonotonicTime() - Capture->Last) / 1000;
+    if(Delta > 0xFFFFFFFFLL) Delta = 0xFFFFFFFFLL;     //Idle for over an hour, replay waits for less
+    Capture->Last += Delta * 1000;
+
+    struct CaptureRecord Record;
+    Record.Time = htonl((unsigned int)Delta);
+    Record.Direction = Direction;
+    memset(Record.Reserved, 0, sizeof(Record.Reserved));
+    Record.Connection = htonl(Connection);
+    fwrite(&Record, sizeof(Record), 1, Capture->File);
+    fwrite(Frame, 1, Length, Capture->File);
+}
+
+double ParseRate(const char* Rate){
+    //Rate is in bytes per second with optional K, M or G multiplier
+    char* End;
+    double Value = strtod(Rate, &End);
+    if(*End == 'K' || *End == 'k'){
+        Value *= 1024;
+        End++;
+    }else if(*End == 'M' || *End == 'm'){
+        Value *= 1024 * 1024;
+        End++;
+    }else if(*End == 'G' || *End == 'g'){
+        Value *= 1024.0 * 1024 * 1024;
+        End++;
     }
-    return true;
+    if(End == Rate || *End != '\0' || Value < 0){
+        std::cerr << "Invalid rate given (bytes per second, K, M or G may follow), program terminated" << std::endl;
+        exit(-1);
+    }
+    return Value;
 }
 
-void Exit(int NewSocketFD, struct MessageProtocol Packet){
-    //Exiting program is represented by all 000, send exit code and exit chat
-    Packet = CreateHeader(0,0,strcpy(Packet.Message, "Server has exited the chat..."));
-    #ifdef _WIN32
-        send(NewSocketFD, (char *)&Packet, sizeof(Packet), 0);
-    #else
-        send(NewSocketFD, &Packet, sizeof(Packet), 0);
-    #endif
-}
\ No newline at end of file
+void SetupCache(struct FileCache* Cache, size_t Budget){
+    //Cached files are watched for changes with inotify, where inotify isn't available every request checks the file's mtime instead
+    Cache->Budget = Budget;
+    Cache->Bytes = 0;
+    Cache->Tick = 0;
+    Cache->Hits = 0;
+    Cache->Misses = 0;
+    Cache->Dropped = 0;
+    Cache->NotifyFD = Budget > 0 ? inotify_init1(IN_NONBLOCK | IN_CLOEXEC) : -1;
+}
+
+struct CachedFile* CacheFile(struct FileCache* Cache, const std::string& Path){
+    //Nothing is cached with -cache 0
+    if(Cache == NULL || Cache->Budget == 0) return NULL;
+    Cache->Tick++;
+
+    //File is served from memory while its watch has reported no change, without inotify it is checked with stat()
+    std::map<std::string, struct CachedFile*>::iterator Found = Cache->Files.find(Path);
+    if(Found != Cache->Files.end()){
+        struct CachedFile* Cached = Found->second;
+        struct stat Info;
+        if(Cached->Watch >= 0 || (stat(Path.c_str(), &Info) == 0 && FileTime(Info) == Cached->MTime && (size_t)Info.st_size == Cached->Data.size())){
+            Cached->Used = Cache->Tick;
+            Cached->Users++;
+            Cache->Hits++;
+            return Cached;
+        }
+        DropFile(Cache, Found);
+        Cache->Dropped++;
+    }
+
+    //Watch is added before file is opened, so any change from then on (even the path being replaced before it
+    //is opened) is reported and drops the file once it is cached
+    int Watch = Cache->NotifyFD >= 0 ? inotify_add_watch(Cache->NotifyFD, Path.c_str(), CACHE_EVENTS) : -1;
+
+    //Only regular files that fit in the budget are cached, anything else is opened as before
+    int FD = open(Path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat Info;
+    if(FD < 0 || fstat(FD, &Info) != 0 || !S_ISREG(Info.st_mode) || (size_t)Info.st_size > Cache->Budget){
+        if(FD >= 0) close(FD);
+        ForgetWatch(Cache, Watch);
+        return NULL;
+    }
+    Cache->Misses++;
+
+    struct CachedFile* Cached = new struct CachedFile();
+    Cached->Path = Path;
+    Cached->MTime = FileTime(Info);
+    Cached->Watch = Watch;
+    Cached->Data.resize(Info.st_size);
+    size_t Read = 0;
+    while(Read < Cached->Data.size()){
+        ssize_t bytes = read(FD, &Cached->Data[Read], Cached->Data.size() - Read);
+        if(bytes <= 0) break;
+        Read += bytes;
+    }
+
+    //File that changed size or was written while being read is not cached, transfer opens it as before
+    struct stat After;
+    bool Whole = Read == (size_t)Info.st_size && fstat(FD, &After) == 0 && After.st_size == Info.st_size && FileTime(After) == Cached->MTime;
+    close(FD);
+    if(!Whole){
+        delete Cached;
+        ForgetWatch(Cache, Watch);
+        return NULL;
+    }
+    Cached->Checksum = FileChecksum(Cached->Data.data(), Cached->Data.size(), CHECKSUM_START);
+    Cached->Used = Cache->Tick;
+    Cached->Users = 1;
+    Cached->Stale = false;
+    Cache->Files[Path] = Cached;
+    Cache->Bytes += Cached->Data.size();
+
+    //Drop least recently used files until cache is back in budget, files being sent are freed once their transfers end
+    while(Cache->Bytes > Cache->Budget){
+        std::map<std::string, struct CachedFile*>::iterator Oldest = Cache->Files.end();
+        for(std::map<std::string, struct CachedFile*>::iterator It = Cache->Files.begin(); It != Cache->Files.end(); It++){
+            if(It->second != Cached && (Oldest == Cache->Files.end() || It->second->Used < Oldest->second->Used)) Oldest = It;
+        }
+        if(Oldest == Cache->Files.end()) break;
+        DropFile(Cache, Oldest);
+    }
+    return Cached;
+}
+
+void ReleaseFile(struct CachedFile* Cached){
+    //File dropped from cache while being sent is freed once its last transfer ends
+    if(Cached == NULL) return;
+    Cached->Users--;
+    if(Cached->Stale && Cached->Users == 0) delete Cached;
+}
+
+void DropFile(struct FileCache* Cache, std::map<std::string, struct CachedFile*>::iterator Found){
+    struct CachedFile* Cached = Found->second;
+    Cache->Files.erase(Found);
+    Cache->Bytes -= Cached->Data.size();
+    ForgetWatch(Cache, Cached->Watch);
+    Cached->Stale = true;
+    if(Cached->Users == 0) delete Cached;
+}
+
+void ForgetWatch(struct FileCache* Cache, int Watch){
+    //Watch is shared by every path of the same file, it is only removed once no cached path uses it
+    if(Watch < 0) return;
+    for(std::map<std::string, struct CachedFile*>::iterator It = Cache->Files.begin(); It != Cache->Files.end(); It++){
+        if(It->second->Watch == Watch) return;
+    }
+    inotify_rm_watch(Cache->NotifyFD, Watch);
+}
+
+void ReadNotify(struct FileCache* Cache){
+    //Every cached path of a file that was changed, replaced or removed is dropped, it is read again on next request
+    char Events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t bytes;
+    while((bytes = read(Cache->NotifyFD, Events, sizeof(Events))) > 0){
+        for(char* Position = Events; Position < Events + bytes; ){
+            struct inotify_event* Event = (struct inotify_event*)Position;
+            Position += sizeof(struct inotify_event) + Event->len;
+            //Events were lost, any cached file may have changed so every one is dropped
+            if(Event->mask & IN_Q_OVERFLOW){
+                Cache->Dropped += Cache->Files.size();
+                while(!Cache->Files.empty()) DropFile(Cache, Cache->Files.begin());
+                continue;
+            }
+            std::map<std::string, struct CachedFile*>::iterator It = Cache->Files.begin();
+            while(It != Cache->Files.end()){
+                if(It->second->Watch != Event->wd){
+                    It++;
+                    continue;
+                }
+                It->second->Watch = -1;     //Watch is gone with IN_IGNORED, and every path using it is dropped below
+                DropFile(Cache, It++);
+                Cache->Dropped++;
+            }
+            if(!(Event->mask & IN_IGNORED)) inotify_rm_watch(Cache->NotifyFD, Event->wd);
+        }
+    }
+}
+
+void CloseCache(struct FileCache* Cache){
+    while(!Cache->Files.empty()) DropFile(Cache, Cache->Files.begin());
+    if(Cache->NotifyFD >= 0) close(Cache->NotifyFD);
+}
+
+long long FileTime(struct stat& Info){
+    //Modification time in nanoseconds
+    return (long long)Info.st_mtim.tv_sec * 1000000000LL + Info.st_mtim.tv_nsec;
+}
+
+unsigned long long FileChecksum(const char* Data, size_t Length, unsigned long long Checksum){
+    //FNV-1a, continues from checksum of data before it so a file can be checked a frame at a time
+    for(size_t i = 0; i < Length; i++){
+        Checksum ^= (unsigned char)Data[i];
+        Checksum *= CHECKSUM_PRIME;
+    }
+    return Checksum;
+}
+
+void CloseTransfers(struct Connection* Client){
+    //Close every file still being sent to or received from client
+    if(Client->Files == NULL) return;
+    for(size_t i = 0; i < Client->Files->Sends.size(); i++){
+        if(Client->Files->Sends[i]->File != NULL) fclose(Client->Files->Sends[i]->File);
+        ReleaseFile(Client->Files->Sends[i]->Cached);
+        delete Client->Files->Sends[i];
+    }
+    for(std::map<int, struct Transfer*>::iterator It = Client->Files->Receives.begin(); It != Client->Files->Receives.end(); It++){
+        if(It->second->File != NULL) fclose(It->second->File);
+        if(It->second->Source >= 0) close(It->second->Source);
+        delete It->second;
+    }
+    delete Client->Files;
+    Client->Files = NULL;
+}
+
+struct Transfers* AttachTransfers(struct Connection* Client, struct ServerSettings Settings){
+    //Client rate limit starts full, as it would be after client has been idle
+    if(Client->Files == NULL){
+        Client->Files = new struct Transfers();
+        SetupBucket(&Client->Files->Bucket, Settings.ClientRate);
+        SetupPacing(Client->SocketFD, &Client->Files->Pace);
+        ListClient(Client, Settings.Pool);
+    }
+    return Client->Files;
+}
+
+void SetupPacing(int SocketFD, struct Pacing* Pace){
+    //Files are sent in small chunks until link is measured, socket keeps buffers the kernel gave it until the link needs more
+    Pace->Chunk = MAX_SIZE;
+    Pace->Checked = 0;
+    Pace->RTT = 0;
+    Pace->Rate = 0;
+    Pace->BDP = 0;
+    Pace->ReceiveBDP = 0;
+    Pace->Raised = 0;
+    socklen_t Length = sizeof(int);
+    if(getsockopt(SocketFD, SOL_SOCKET, SO_SNDBUF, (char *)&Pace->SendBuffer, &Length) != 0) Pace->SendBuffer = 0;
+    Length = sizeof(int);
+    if(getsockopt(SocketFD, SOL_SOCKET, SO_RCVBUF, (char *)&Pace->ReceiveBuffer, &Length) != 0) Pace->ReceiveBuffer = 0;
+
+    //Kernel doubles buffer sizes asked for up to twice its max, buffers are never set where max can't be read
+    const char* Paths[2] = {"/proc/sys/net/core/wmem_max", "/proc/sys/net/core/rmem_max"};
+    int* Limits[2] = {&Pace->SendLimit, &Pace->ReceiveLimit};
+    for(int i = 0; i < 2; i++){
+        long long Max = 0;
+        FILE* Setting = fopen(Paths[i], "r");
+        if(Setting != NULL){
+            if(fscanf(Setting, "%lld", &Max) != 1) Max = 0;
+            fclose(Setting);
+        }
+        *Limits[i] = 2 * Max < MAX_SOCKET_BUFFER ? 2 * Max : MAX_SOCKET_BUFFER;
+    }
+}
+
+void TunePacing(int SocketFD, struct Pacing* Pace){
+    //Link is measured at most every TUNE_INTERVAL, sockets without TCP_INFO keep their first chunk size and buffers
+    #ifdef TCP_INFO
+        long long Now = MonotonicTime();
+        if(Now - Pace->Checked < TUNE_INTERVAL * 1000000LL) return;
+        Pace->Checked = Now;
+        struct LinkInfo Info;
+        memset(&Info, 0, sizeof(Info));
+        socklen_t Length = sizeof(Info);
+        if(getsockopt(SocketFD, IPPROTO_TCP, TCP_INFO, (char *)&Info, &Length) != 0) return;
+
+        //Delivery rate of data sent over smoothed round trip, kernels without delivery rate give congestion window per round trip.
+        //Largest product is kept as rate measured while little is queued (application limited) underestimates link
+        if(Info.Base.tcpi_rtt > 0){
+            Pace->RTT = Info.Base.tcpi_rtt;
+            if(Length >= offsetof(struct LinkInfo, DeliveryRate) + sizeof(Info.DeliveryRate) && Info.DeliveryRate > 0){
+                Pace->Rate = Info.DeliveryRate;
+            }else{
+                Pace->Rate = (unsigned long long)Info.Base.tcpi_snd_cwnd * Info.Base.tcpi_snd_mss * 1000000 / Pace->RTT;
+            }
+            size_t BDP = Pace->Rate * Pace->RTT / 1000000;
+            if(BDP > Pace->BDP) Pace->BDP = BDP;
+        }
+        //Receiving end has kernel's measure of data read in a round trip
+        if(Info.Base.tcpi_rcv_rtt > 0 && Info.Base.tcpi_rcv_space > Pace->ReceiveBDP) Pace->ReceiveBDP = Info.Base.tcpi_rcv_space;
+
+        //Chunk is a sixteenth of product, so a chat frame never waits behind more than a sixteenth of a round trip of file data
+        long long Chunk = Pace->BDP / CHUNKS_PER_BDP;
+        if(Chunk > MAX_CHUNK) Chunk = MAX_CHUNK;
+        Pace->Chunk = Chunk > MAX_SIZE ? Chunk : MAX_SIZE;
+
+        //Buffers are raised to twice the product, a link held back by its buffer then measures larger each time until it
+        //is not. Setting a buffer stops the kernel growing it on its own, so it is only set once kernel max allows more
+        //than the kernel has already given the socket
+        int Options[2] = {SO_SNDBUF, SO_RCVBUF};
+        size_t Products[2] = {Pace->BDP, Pace->ReceiveBDP};
+        int* Buffers[2] = {&Pace->SendBuffer, &Pace->ReceiveBuffer};
+        int Limits[2] = {Pace->SendLimit, Pace->ReceiveLimit};
+        for(int i = 0; i < 2; i++){
+            long long Want = 2 * (long long)Products[i];
+            if(Want > Limits[i]) Want = Limits[i];
+            Length = sizeof(int);
+            if(getsockopt(SocketFD, SOL_SOCKET, Options[i], (char *)Buffers[i], &Length) != 0 || Want <= *Buffers[i]) continue;
+            int Size = Want / 2;    //Kernel doubles size asked for to make room for its bookkeeping
+            if(setsockopt(SocketFD, SOL_SOCKET, Options[i], (char *)&Size, sizeof(Size)) != 0) continue;
+            Pace->Raised++;
+            Length = sizeof(int);
+            getsockopt(SocketFD, SOL_SOCKET, Options[i], (char *)Buffers[i], &Length);
+        }
+    #endif
+}
+
+std::string PacingStats(struct Pacing* Pace){
+    //Link measurements of one connection, round trip in ms and rate in Mbit/s
+    char Line[256];
+    snprintf(Line, sizeof(Line), "chunk %d bytes, round trip %.2f ms, delivery rate %.1f Mbit/s, send buffer %d KB, receive buffer %d KB (raised %u times)",
+             Pace->Chunk, Pace->RTT / 1000.0, Pace->Rate * 8 / 1000000.0, Pace->SendBuffer / 1024, Pace->ReceiveBuffer / 1024, Pace->Raised);
+    return Line;
+}
+
+struct Buffers* AttachBuffers(struct Connection* Client, struct BufferPool* Pool){
+    //Reuse buffers given back by an idle client if there are any
+    if(Client->IO == NULL){
+        if(Pool->Free.empty()){
+            Client->IO = new struct Buffers();
+        }else{
+            Client->IO = Pool->Free.back();
+            Pool->Free.pop_back();
+        }
+        Client->IO->Offset = 0;
+        Client->IO->Splicing.Length = 0;
+        Pool->Attached++;
+        ListClient(Client, Pool);
+    }
+    return Client->IO;
+}
+
+void ListClient(struct Connection* Client, struct BufferPool* Pool){
+    //Client is visited every pass until it has nothing left to process or send
+    if(Client->Listed) return;
+    Client->Listed = true;
+    Pool->Busy.push_back(Client);
+}
+
+void ReleaseBuffers(struct Connection* Client, struct BufferPool* Pool){
+    if(Client->IO == NULL) return;
+    struct Buffers* IO = Client->IO;
+    Client->IO = NULL;
+    Client->QueuedBytes = 0;
+    Pool->Attached--;
+    CloseSplices(IO->Splices, &IO->Splicing);
+    if(Pool->Free.size() >= POOL_SIZE){
+        delete IO;
+        return;
+    }
+
+    //Empty buffers before keeping them, buffers that grew past POOL_BUFFER are shrunk so the pool stays small
+    IO->Inbox.clear();
+    IO->Current.clear();
+    IO->ChatQueue.clear();
+    IO->FileQueue.clear();
+    if(IO->Inbox.capacity() > POOL_BUFFER) std::string().swap(IO->Inbox);
+    if(IO->Current.capacity() > POOL_BUFFER) std::string().swap(IO->Current);
+    Pool->Free.push_back(IO);
+}
+
+bool QueuePacket(struct Connection* Client, struct MessageProtocol Packet, bool Control, struct ServerSettings Settings){
+    return QueueFrame(Client, CreateFrame(Packet.Type, Packet.Flags, Packet.Channel, Packet.Message, Packet.Length), Control, Settings);
+}
+
+bool QueueFrame(struct Connection* Client, const std::string& Frame, bool Control, struct ServerSettings Settings){
+    //Small chat frames to clients using UDP are sent as datagrams, control packets stay on TCP
+    if(!Control && Client->UDP != NULL && !Client->UDP->Failed && DatagramFrame(Frame)){
+        if(!QueueDatagram(Settings.DatagramFD, Client->UDP, Frame)){
+            Client->Dropped++;
+            return false;
+        }
+        CaptureFrame(Client->Capture, CAPTURE_SENT, Client->ID, Frame.data(), Frame.size());
+        return true;
+    }
+
+    //Control packets (handshake, file ACK, exit) are never dropped
+    struct QueuedData Entry;
+    Entry.Data = Frame;
+    Entry.Keep = Control;
+    if(!Control && Client->QueuedBytes + Entry.Data.size() > MAX_QUEUE_SIZE){
+        //Queue is at hard limit, drop the new message
+        Client->Dropped++;
+        return false;
+    }
+    struct Buffers* IO = AttachBuffers(Client, Settings.Pool);
+    IO->ChatQueue.push_back(Entry);
+    Client->QueuedBytes += Entry.Data.size();
+    if(Client->QueuedBytes > Client->PeakBytes) Client->PeakBytes = Client->QueuedBytes;
+
+    //Client has fallen behind, apply slow consumer policy
+    if(Client->QueuedBytes > Settings.HighWatermark){
+        switch(Settings.Policy){
+            case POLICY_DROP_OLDEST:
+                //Drop oldest chat messages until low watermark is reached
+                for(size_t i = 0; i < IO->ChatQueue.size() && Client->QueuedBytes > Settings.LowWatermark; ){
+                    if(!IO->ChatQueue[i].Keep){
+                        Client->QueuedBytes -= IO->ChatQueue[i].Data.size();
+                        IO->ChatQueue.erase(IO->ChatQueue.begin() + i);
+                        Client->Dropped++;
+                    }else{
+                        i++;
+                    }
+                }
+                break;
+            case POLICY_PAUSE_FILE:
+                //Stop reading files until client drains its queue, chat frames keep being sent
+                if(!Client->Paused && Client->Files != NULL && !Client->Files->Sends.empty()){
+                    Client->Paused = true;
+                    Client->Pauses++;
+                }
+                break;
+            case POLICY_DISCONNECT:
+                //Client can't keep up, disconnect it
+                std::cout << "Client " << Client->ID << " is too slow and has been disconnected..." << std::endl << std::endl;
+                Client->Closed = true;
+                return false;
+        }
+    }
+    return true;
+}
+
+bool FlushQueue(struct Connection* Client){
+    //Nothing is queued while client has no buffers
+    struct Buffers* IO = Client->IO;
+    if(IO == NULL) return true;
+
+    //Write frames until socket stops accepting them
+    while(true){
+        //Data of a frame queued without it is written from its file once the frame's header is written
+        if(IO->Offset == IO->Current.size() && IO->Splicing.Length > 0){
+            int bytes = SpliceSend(Client->SocketFD, Client->TLS, &IO->Splicing);
+            if(bytes < 0 && errno == ENODATA){
+                //File shrunk since frame was queued, rest of frame is sent as zeros so the stream stays whole
+                close(IO->Splicing.FD);
+                Client->QueuedBytes -= IO->Current.size();
+                IO->Current.assign(IO->Splicing.Length, '\0');
+                IO->Offset = 0;
+                IO->Splicing.Length = 0;
+                continue;
+            }
+            if(bytes < 0){
+                if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return true;
+                return false;
+            }
+            Client->QueuedBytes -= bytes;
+            if(IO->Splicing.Length == 0) close(IO->Splicing.FD);
+            continue;
+        }
+
+        //Pick next frame once current one is written, chat frames always go first
+        if(IO->Offset == IO->Current.size()){
+            Client->QueuedBytes -= IO->Current.size();
+            IO->Current.clear();
+            IO->Offset = 0;
+            if(!IO->ChatQueue.empty()){
+                IO->Current.swap(IO->ChatQueue.front().Data);
+                IO->ChatQueue.pop_front();
+                StampForwarded(&IO->Current[0], IO->Current.size());
+            }else if(!IO->FileQueue.empty()){
+                IO->Current.swap(IO->FileQueue.front());
+                IO->FileQueue.pop_front();
+                //Only header of frame is queued when its data is written from a file
+                if(IO->Current.size() == sizeof(struct FrameHeader) && ((struct FrameHeader*)IO->Current.data())->Length != 0){
+                    IO->Splicing = IO->Splices.front();
+                    IO->Splices.pop_front();
+                }
+            }else{
+                return true;    //Nothing left to send
+            }
+            CaptureFrame(Client->Capture, CAPTURE_SENT, Client->ID, IO->Current.data(), IO->Current.size());
+        }
+        #ifdef _WIN32
+            int bytes = SocketSend(Client->SocketFD, Client->TLS, IO->Current.data() + IO->Offset, IO->Current.size() - IO->Offset, 0);
+        #else
+            int bytes = Client->Local != NULL ? LocalSend(Client->SocketFD, Client->Local, IO->Current.data() + IO->Offset, IO->Current.size() - IO->Offset)
+                                              : SocketSend(Client->SocketFD, Client->TLS, IO->Current.data() + IO->Offset, IO->Current.size() - IO->Offset, MSG_NOSIGNAL);
+        #endif
+        if(bytes < 0){
+            //Socket buffer (or ring) is full, wait for poll() to report room
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return true;
+            return false;   //Connection has failed
+        }
+        IO->Offset += bytes;
+    }
+}
+
+std::string CreateFrame(int Type, int Flags, int Channel, const char* Data, unsigned int Length){
+    //Place header in front of data, multi-byte fields in network byte order
+    struct FrameHeader Header;
+    Header.Type = Type;
+    Header.Flags = Flags;
+    Header.Channel = htons(Channel);
+    Header.Length = htonl(Length);
+    std::string Frame((char *)&Header, sizeof(Header));
+    if(Length > 0) Frame.append(Data, Length);
+    return Frame;
+}
+
+bool FileReceive(struct Connection* Client, const char* Filename, struct ServerSettings Settings){
+    //Limit number of files requested at once
+    struct Transfers* Files = AttachTransfers(Client, Settings);
+    if(Files->Receives.size() >= MAX_TRANSFERS){
+        std::cout << "Too many files requested from client " << Client->ID << ", wait for some to complete" << std::endl << std::endl;
+        return false;
+    }
+
+    //Give request next unused transfer ID, frames of the file will be sent on that channel
+    do{
+        Client->NextTransfer = Client->NextTransfer % 65535 + 1;
+    }while(Files->Receives.count(Client->NextTransfer) > 0);
+    struct Transfer* Receive = new struct Transfer();
+    Receive->ID = Client->NextTransfer;
+    Receive->Name = Filename;
+    Receive->File = NULL;
+    Receive->Remaining = 0;
+    Receive->Started = false;
+    Receive->Source = -1;
+    Files->Receives[Receive->ID] = Receive;
+
+    //Send filename to client, requesting transfer
+    struct MessageProtocol Packet = CreateHeader(1,1,(char *)Filename);
+    Packet.Channel = Receive->ID;
+    std::cout << "File Transfer " << Receive->ID << " (" << Filename << ") requested from client " << Client->ID << std::endl << std::endl;
+    return QueuePacket(Client, Packet, true, Settings);
+}
+
+bool ReceiveMessage(struct Connection* Client, struct MessageProtocol Packet, struct ConsoleState& Console, struct ServerSettings Settings){
+    //Check type for deciding correct process to proceed with
+    switch(Packet.Type){
+        case 0:     //Message has been sent, check if it is complete
+            //Check if checksum is equal
+            if(Packet.Length != strnlen(Packet.Message, MAX_LENGTH)){
+                //Packet corrupt, send error message
+                Packet = CreateHeader(0,2,strcpy(Packet.Message, "Error, last message corrupted. Please try again"));
+                QueuePacket(Client, Packet, false, Settings);
+                return false;
+            }
+            //Simple message sent, check if message is error to be handled
+            switch (Packet.Flags){
+                case 2:
+                    //Packet corrupt, send error message
+                    Packet = CreateHeader(0,2,strcpy(Packet.Message, "Error, last message corrupted. Please try again"));
+                    QueuePacket(Client, Packet, false, Settings);
+                    return false;
+                case 3:
+                    //File corrupt, send error message
+                    Packet = CreateHeader(0,3,strcpy(Packet.Message, "Error, last message corrupted. Please try again"));
+                    QueuePacket(Client, Packet, false, Settings);
+                    return false;
+                default:
+                    //Display message from client, client has left if it is exit message
+                    std::cout<<"- - CLIENT " << Client->ID << " - -"<<std::endl;
+                    std::cout<<Packet.Message<<std::endl << std::endl;
+                    if(Packet.Flags == 0){Client->Closed = true;}
+                    return true;
+            }
+        case 1:     //File request message
+            //Client is requesting to send file, answer right away if policy allows it
+            if(Settings.Accept == ACCEPT_NONE ||
+               (Settings.Accept == ACCEPT_ALL && (Packet.Message[0] == '/' || strstr(Packet.Message, "..") != NULL || !BelowFolder(Packet.Message)))){
+                //Only files below server's folder are sent without asking
+                int ID = Packet.Channel;
+                Packet = CreateHeader(3,1,(char *)"Reject File Request");
+                Packet.Channel = ID;
+                QueuePacket(Client, Packet, true, Settings);
+                std::cout << "Client " << Client->ID << " file request rejected by policy" << std::endl << std::endl;
+                return false;
+            }
+            if(Settings.Accept == ACCEPT_ALL){
+                return FileSend(Client, Packet.Channel, Packet.Message, Settings);
+            }
+            //Otherwise ask server to accept or ignore
+            {
+                struct FileRequest Request;
+                Request.ClientID = Client->ID;
+                Request.ID = Packet.Channel;
+                Request.Name = Packet.Message;
+                Console.Requests.push_back(Request);
+            }
+            if(Console.Mode == CONSOLE_CHAT){
+                Console.Mode = CONSOLE_FILE_ANSWER;
+                Console.ClientID = Client->ID;
+                std::cout << "Client " << Client->ID << " is requesting " << Console.Requests.front().Name << ". Send (Y/N) : " << std::endl;
+            }
+            return true;
+        case 2:     //File request approved
+            //Client has ACK request to send file, display approval
+            std::cout<<"- - CLIENT " << Client->ID << " - -"<<std::endl;
+            std::cout<<Packet.Message<<" (File Transfer " << Packet.Channel << ")"<<std::endl << std::endl;
+            return true;
+        case 3:     //File request ignored message
+            //Client has ignored request to send file, display denial
+            std::cout<<"- - CLIENT " << Client->ID << " - -"<<std::endl;
+            std::cout<<Packet.Message<<" (File Transfer " << Packet.Channel << ")"<<std::endl << std::endl;
+            std::cout<<"File Transfer Rejected..."<<std::endl<<std::endl;
+            if(Client->Files != NULL && Client->Files->Receives.count(Packet.Channel) > 0){
+                struct Transfer* Receive = Client->Files->Receives[Packet.Channel];
+                if(Receive->File != NULL) fclose(Receive->File);
+                delete Receive;
+                Client->Files->Receives.erase(Packet.Channel);
+            }
+            return false;
+        default:
+            //Corruption in packet, invalid type provided
+            Packet = CreateHeader(0,1,strcpy(Packet.Message, "Error, last request corrupted. Please try again"));
+            QueuePacket(Client, Packet, false, Settings);  //Send error message to client, asking for request to be sent again
+            return false;
+    }
+}
+
+bool SendMessage(std::vector<struct Connection*>& Clients, struct ConsoleState& Console, std::string Input, struct RoomIndex& Index, struct ServerSettings Settings){
+    //Find client current prompt is for
+    struct Connection* Client = NULL;
+    for(size_t i = 0; i < Clients.size(); i++){
+        if(Clients[i]->ID == Console.ClientID && !Clients[i]->Closed) Client = Clients[i];
+    }
+
+    switch(Console.Mode){
+        case CONSOLE_FILE_ANSWER:
+            //Loop until valid input is given
+            if(Input != "Y" && Input != "N"){
+                std::cout << "Invalid input, try again : " << std::endl;
+                return true;
+            }
+            if(Input == "N"){
+                //Send file transfer rejection packet
+                if(Client != NULL){
+                    struct MessageProtocol Packet = CreateHeader(3,1,(char *)"Reject File Request");
+                    Packet.Channel = Console.Requests.front().ID;
+                    QueuePacket(Client, Packet, true, Settings);
+                }
+                Console.Requests.pop_front();
+                Console.Mode = CONSOLE_CHAT;
+            }else{
+                //Open desired file to be sent
+                std::cout << "Enter filename (include path if in different folder) : " << std::endl;
+                Console.Mode = CONSOLE_FILE_SEND;
+            }
+            break;
+        case CONSOLE_FILE_SEND:
+            //Send file to client that requested it
+            if(Client != NULL){
+                FileSend(Client, Console.Requests.front().ID, Input.c_str(), Settings);
+            }else{
+                std::cout << "Client has disconnected, file not sent" << std::endl << std::endl;
+            }
+            Console.Requests.pop_front();
+            Console.Mode = CONSOLE_CHAT;
+            break;
+        case CONSOLE_FILE_CLIENT:
+            //Select client to request file from
+            Console.ClientID = atoi(Input.c_str());
+            Client = NULL;
+            for(size_t i = 0; i < Clients.size(); i++){
+                if(Clients[i]->ID == Console.ClientID && Clients[i]->State == RECV_PACKET) Client = Clients[i];
+            }
+            if(Client == NULL){
+                std::cout << "Invalid client, try again : " << std::endl;
+                return true;
+            }
+            //Request files given with FILE, or ask for filename if none were given
+            if(Console.Pending.empty()){
+                std::cout << "Enter filename (include path if in different folder) : " << std::endl;
+                Console.Mode = CONSOLE_FILE_REQUEST;
+            }else{
+                for(size_t i = 0; i < Console.Pending.size(); i++){
+                    FileReceive(Client, Console.Pending[i].c_str(), Settings);
+                }
+                Console.Pending.clear();
+                Console.Mode = CONSOLE_CHAT;
+            }
+            break;
+        case CONSOLE_FILE_REQUEST:
+            //Send a request for desired file from client
+            if(Client != NULL && Client->State == RECV_PACKET){
+                FileReceive(Client, Input.c_str(), Settings);
+            }else{
+                std::cout << "Client is not available, file not requested" << std::endl << std::endl;
+            }
+            Console.Mode = CONSOLE_CHAT;
+            break;
+        default:
+            if(Input == "FILE" || Input.compare(0, 5, "FILE ") == 0){
+                //Server is requesting files from a client, any filenames given after FILE are all requested at once
+                Console.Pending.clear();
+                size_t Start = 4, End;
+                while((Start = Input.find_first_not_of(' ', Start)) != std::string::npos){
+                    End = Input.find(' ', Start);
+                    Console.Pending.push_back(Input.substr(Start, End - Start));
+                    Start = End;
+                }
+                int Count = 0;
+                for(size_t i = 0; i < Clients.size(); i++){
+                    if(Clients[i]->State == RECV_PACKET && !Clients[i]->Closed){
+                        Console.ClientID = Clients[i]->ID;
+                        Client = Clients[i];
+                        Count++;
+                    }
+                }
+                if(Count == 0){
+                    std::cout << "No clients available to request file from" << std::endl << std::endl;
+                    Console.Pending.clear();
+                }else if(Count > 1){
+                    std::cout << "Enter client number to request file from : " << std::endl;
+                    Console.Mode = CONSOLE_FILE_CLIENT;
+                }else if(Console.Pending.empty()){
+                    std::cout << "Enter filename (include path if in different folder) : " << std::endl;
+                    Console.Mode = CONSOLE_FILE_REQUEST;
+                }else{
+                    for(size_t i = 0; i < Console.Pending.size(); i++){
+                        FileReceive(Client, Console.Pending[i].c_str(), Settings);
+                    }
+                    Console.Pending.clear();
+                }
+            }else if(Input == "EXIT"){
+                //Server is exiting the program, send exit code to clients to follow suit
+                Exit(Clients, Settings);
+                return false;
+            }else if(Input == "STATS"){
+                PrintStats(Clients, Settings.Pool, Settings.Cache, Settings.Resident);
+                PrintLatency(Console.Display);
+            }else if(Input.compare(0, 5, "JOIN ") == 0 || Input.compare(0, 6, "LEAVE ") == 0){
+                //Server user joins/leaves a room to see messages sent to it
+                bool Join = Input[0] == 'J';
+                std::string Name = Input.substr(Join ? 5 : 6);
+                if(!ValidRoom(Name)){
+                    std::cout << "Invalid room name, names are 1 to " << MAX_ROOM_NAME << " characters without spaces" << std::endl << std::endl;
+                }else if(Join){
+                    std::cout << (JoinRoom(Index, Console.Member, Name) ? "Joined room " : "Already in room ") << Name << std::endl << std::endl;
+                }else{
+                    std::cout << (LeaveRoom(Index, Console.Member, FindRoom(Index, Name)) ? "Left room " : "Not in room ") << Name << std::endl << std::endl;
+                }
+            }else if(Input.size() > 1 && Input[0] == '@'){
+                //Send message to every member of a room, server user does not need to be in it
+                size_t Space = Input.find(' ');
+                std::string Name = Input.substr(1, Space == std::string::npos ? std::string::npos : Space - 1);
+                int Room = FindRoom(Index, Name);
+                if(Space == std::string::npos){
+                    std::cout << "Enter message after room name (@room message)" << std::endl << std::endl;
+                }else if(Room < 0){
+                    std::cout << "No room named " << Name << std::endl << std::endl;
+                }else{
+                    SendRoom(Index, Console.Member, 0, Room, Input.substr(Space + 1), Settings, NULL);
+                }
+            }else if(Input == "ROOMS"){
+                PrintRooms(Index, Console.Member);
+            }else{
+                //Send corresponding flags/type and message to every client
+                struct MessageProtocol Packet = CreateHeader(0,1,(char *)Input.c_str());
+                for(size_t i = 0; i < Clients.size(); i++){
+                    if(Clients[i]->State != RECV_CONNECT && Clients[i]->State != RECV_CONNECT_ACK && !Clients[i]->Closed){
+                        QueuePacket(Clients[i], Packet, false, Settings);
+                    }
+                }
+            }
+            break;
+    }
+
+    //Prompt for next waiting file request once nothing else is being asked
+    if(Console.Mode == CONSOLE_CHAT && !Console.Requests.empty()){
+        Console.Mode = CONSOLE_FILE_ANSWER;
+        Console.ClientID = Console.Requests.front().ClientID;
+        std::cout << "Client " << Console.ClientID << " is requesting " << Console.Requests.front().Name << ". Send (Y/N) : " << std::endl;
+    }
+    return true;
+}
+
+void ReceiveRoomFrame(struct Connection* Client, struct FrameHeader Header, const char* Data, struct RoomIndex& Index, struct ServerSettings Settings, const char* Trace){
+    //Room name is data of join/leave frames, and data up to the first null byte of room messages
+    size_t End = 0;
+    while(End < Header.Length && Data[End] != '\0') End++;
+    std::string Name(Data, End);
+    std::string Reply;
+    if(!ValidRoom(Name)){
+        Reply = "Invalid room name, names are 1 to " + std::to_string(MAX_ROOM_NAME) + " characters without spaces";
+        QueuePacket(Client, CreateHeader(0,1,(char *)Reply.c_str()), false, Settings);
+        return;
+    }
+    int Room = FindRoom(Index, Name);
+
+    switch(Header.Type){
+        case 7:     //Room join
+            if(Index.Rooms[Client->Member].size() >= MAX_ROOMS){
+                Reply = "Already in " + std::to_string(MAX_ROOMS) + " rooms, leave one before joining " + Name;
+            }else if(!JoinRoom(Index, Client->Member, Name)){
+                Reply = "Already in room " + Name;
+            }else{
+                Reply = "Joined room " + Name + " (" + std::to_string(Index.Members[FindRoom(Index, Name)].size()) + " members)";
+            }
+            break;
+        case 8:     //Room leave
+            Reply = LeaveRoom(Index, Client->Member, Room) ? "Left room " + Name : "Not in room " + Name;
+            break;
+        case 9:     //Room message, only members may send to a room
+            if(!InRoom(Index, Client->Member, Room)){
+                Reply = "Not in room " + Name + ", JOIN it before sending to it";
+                break;
+            }
+            {
+                std::string Message(Data + End + (End < Header.Length ? 1 : 0), Data + Header.Length);
+                if(Message.size() >= MAX_LENGTH) Message.resize(MAX_LENGTH - 1);
+                SendRoom(Index, Client->Member, Client->ID, Room, Message, Settings, Trace);
+            }
+            return;
+    }
+    QueuePacket(Client, CreateHeader(0,1,(char *)Reply.c_str()), false, Settings);
+}
+
+void ReceiveTraced(struct Connection* Client, struct FrameHeader Header, const char* Data, struct ConsoleState& Console, struct RoomIndex& Index, struct ServerSettings Settings){
+    //Traced frame holds trace fields and then a whole chat frame, which is handled as if it came alone
+    struct FrameHeader Inner;
+    if(Header.Length >= TRACE_SIZE + sizeof(Inner)){
+        memcpy(&Inner, Data + TRACE_SIZE, sizeof(Inner));
+        Inner.Channel = ntohs(Inner.Channel);
+        Inner.Length = ntohl(Inner.Length);
+    }
+    if(Header.Length < TRACE_SIZE + sizeof(Inner) || Inner.Length != Header.Length - TRACE_SIZE - sizeof(Inner) ||
+       (Inner.Type != 0 && Inner.Type != 9)){
+        QueuePacket(Client, CreateHeader(0,1,(char *)"Error, last request corrupted. Please try again"), false, Settings);
+        return;
+    }
+    //Only room messages go on to other clients, they carry trace fields with time server read them. A traced
+    //message to server user has nobody to record its trace, clients only trace room messages
+    if(Inner.Type == 9){
+        char Trace[TRACE_SIZE];
+        memcpy(Trace, Data, TRACE_SIZE);
+        PutStamp(Trace + 16, Settings.Received);
+        ReceiveRoomFrame(Client, Inner, Data + TRACE_SIZE + sizeof(Inner), Index, Settings, Trace);
+    }else{
+        ProcessFrame(Client, Inner, Data + TRACE_SIZE + sizeof(Inner), Console, Index, Settings);
+    }
+}
+
+void AnswerPing(struct Connection* Client, struct FrameHeader Header, const char* Data, struct ServerSettings Settings){
+    //Answer holds client's time PING was sent, then times it was read and answered on server's clock, it is
+    //never dropped so a slow client still measures its round trip
+    if(Header.Length != 8) return;
+    char Answer[24];
+    memcpy(Answer, Data, 8);
+    PutStamp(Answer + 8, Settings.Received);
+    PutStamp(Answer + 16, MonotonicTime());
+    QueueFrame(Client, CreateFrame(13, 1, CHAT_CHANNEL, Answer, sizeof(Answer)), true, Settings);
+}
+
+void StampForwarded(char* Frame, size_t Length){
+    //Trace frame going out to a client carries time server started writing it, so time spent in client's queue is
+    //counted as server's
+    if(Length < sizeof(struct FrameHeader) + TRACE_SIZE || ((struct FrameHeader*)Frame)->Type != 12) return;
+    PutStamp(Frame + sizeof(struct FrameHeader) + 24, MonotonicTime());
+}
+
+void PutStamp(char* Data, long long Time){
+    //Times are 64 bits in network byte order
+    for(int i = 7; i >= 0; i--){
+        Data[i] = (char)(Time & 0xFF);
+        Time >>= 8;
+    }
+}
+
+void SendRoom(struct RoomIndex& Index, int Sender, int SenderID, int Room, std::string Message, struct ServerSettings Settings, const char* Trace){
+    //Frame is created once and copied to every member, ID of client that sent it (0 for server) leads the data
+    //since client IDs do not fit in a 16 bit channel
+    unsigned int From = htonl(SenderID);
+    std::string Data((const char *)&From, sizeof(From));
+    Data += Index.Names[Room];
+    Data += '\0';
+    Data += Message;
+    std::string Frame = CreateFrame(9, 1, CHAT_CHANNEL, Data.data(), Data.size());
+
+    //Traced message is relayed inside a trace frame, so it is queued (and dropped) as one frame, and stamped with
+    //the time it was forwarded as each member's copy starts going out (see StampForwarded())
+    if(Trace != NULL){
+        std::string Traced(Trace, TRACE_SIZE);
+        Traced += Frame;
+        Frame = CreateFrame(12, 1, CHAT_CHANNEL, Traced.data(), Traced.size());
+    }
+
+    //Only members of room are visited, so cost follows number of recipients
+    std::vector<struct Subscription>& Members = Index.Members[Room];
+    for(size_t i = 0; i < Members.size(); i++){
+        if(Members[i].Target == Sender) continue;
+        struct Connection* User = Index.Users[Members[i].Target];
+        if(User == NULL){
+            //Server user is a member, display message
+            std::cout<<"- - CLIENT " << SenderID << " @ " << Index.Names[Room] << " - -"<<std::endl;
+            std::cout<<Message<<std::endl << std::endl;
+        }else if(!User->Closed && User->State == RECV_PACKET){
+            QueueFrame(User, Frame, false, Settings);
+        }
+    }
+}
+
+int AddMember(struct RoomIndex& Index, struct Connection* User){
+    //Reuse number of a member that has left, keeping lists packed
+    int Member;
+    if(!Index.FreeMembers.empty()){
+        Member = Index.FreeMembers.back();
+        Index.FreeMembers.pop_back();
+    }else{
+        Member = Index.Rooms.size();
+        Index.Rooms.push_back(std::vector<struct Subscription>());
+        Index.Users.push_back(NULL);
+    }
+    Index.Users[Member] = User;
+    return Member;
+}
+
+void RemoveMember(struct RoomIndex& Index, int Member){
+    //Leave every room, starting with last so no other entries of member are moved
+    while(!Index.Rooms[Member].empty()){
+        LeaveRoom(Index, Member, Index.Rooms[Member].back().Target);
+    }
+    Index.Users[Member] = NULL;
+    Index.FreeMembers.push_back(Member);
+}
+
+bool JoinRoom(struct RoomIndex& Index, int Member, std::string Name){
+    //Create room if nobody is in it yet
+    int Room = FindRoom(Index, Name);
+    if(Room < 0){
+        if(!Index.FreeRooms.empty()){
+            Room = Index.FreeRooms.back();
+            Index.FreeRooms.pop_back();
+        }else{
+            Room = Index.Names.size();
+            Index.Names.push_back(std::string());
+            Index.Members.push_back(std::vector<struct Subscription>());
+        }
+        Index.Names[Room] = Name;
+        Index.Numbers[Name] = Room;
+    }else if(InRoom(Index, Member, Room)){
+        return false;
+    }
+
+    //Add entry to both lists, each pointing at the other
+    struct Subscription ToRoom, ToMember;
+    ToRoom.Target = Room;
+    ToRoom.Slot = Index.Members[Room].size();
+    ToMember.Target = Member;
+    ToMember.Slot = Index.Rooms[Member].size();
+    Index.Rooms[Member].push_back(ToRoom);
+    Index.Members[Room].push_back(ToMember);
+    return true;
+}
+
+bool LeaveRoom(struct RoomIndex& Index, int Member, int Room){
+    //Find room in member's list, members are only in a few rooms
+    if(Room < 0) return false;
+    std::vector<struct Subscription>& Joined = Index.Rooms[Member];
+    size_t i = 0;
+    while(i < Joined.size() && Joined[i].Target != Room) i++;
+    if(i == Joined.size()) return false;
+
+    //Move last entry of each list into place of removed entry, and point its matching entry at new place
+    std::vector<struct Subscription>& Members = Index.Members[Room];
+    size_t Slot = Joined[i].Slot;
+    if(Slot != Members.size() - 1){
+        Members[Slot] = Members.back();
+        Index.Rooms[Members[Slot].Target][Members[Slot].Slot].Slot = Slot;
+    }
+    Members.pop_back();
+    if(i != Joined.size() - 1){
+        Joined[i] = Joined.back();
+        Index.Members[Joined[i].Target][Joined[i].Slot].Slot = i;
+    }
+    Joined.pop_back();
+
+    //Remove room once everyone has left
+    if(Members.empty()){
+        Index.Numbers.erase(Index.Names[Room]);
+        Index.Names[Room].clear();
+        Index.FreeRooms.push_back(Room);
+    }
+    return true;
+}
+
+bool InRoom(struct RoomIndex& Index, int Member, int Room){
+    //Check member's own list, it is far shorter than room's list
+    if(Room < 0) return false;
+    for(size_t i = 0; i < Index.Rooms[Member].size(); i++){
+        if(Index.Rooms[Member][i].Target == Room) return true;
+    }
+    return false;
+}
+
+int FindRoom(struct RoomIndex& Index, std::string Name){
+    std::map<std::string, int>::iterator Found = Index.Numbers.find(Name);
+    return Found == Index.Numbers.end() ? -1 : Found->second;
+}
+
+bool ValidRoom(std::string Name){
+    //Room names are single words so they can be typed after JOIN/LEAVE/@
+    return !Name.empty() && Name.size() <= MAX_ROOM_NAME && Name.find_first_of(" \t") == std::string::npos;
+}
+
+void PrintRooms(struct RoomIndex& Index, int Member){
+    //Display every room and number of members in it, marking rooms server user is in
+    std::cout << "- - ROOMS - -" << std::endl;
+    for(std::map<std::string, int>::iterator It = Index.Numbers.begin(); It != Index.Numbers.end(); It++){
+        std::cout << It->first << " : " << Index.Members[It->second].size() << " members"
+                  << (InRoom(Index, Member, It->second) ? " (joined)" : "") << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+SSL_CTX* CreateTLS(int Mode){
+    #ifdef USE_TLS
+        //Key and self-signed certificate only live as long as server, clients check fingerprint displayed below
+        EVP_PKEY* Key = EVP_EC_gen("P-256");
+        X509* Certificate = X509_new();
+        SSL_CTX* Context = NULL;
+        if(Key == NULL || Certificate == NULL){
+            X509_free(Certificate);
+            EVP_PKEY_free(Key);
+            return NULL;
+        }
+        ASN1_INTEGER_set(X509_get_serialNumber(Certificate), (long)time(NULL));
+        X509_gmtime_adj(X509_getm_notBefore(Certificate), 0);
+        X509_gmtime_adj(X509_getm_notAfter(Certificate), 30L * 24 * 60 * 60);
+        X509_set_pubkey(Certificate, Key);
+        X509_NAME* Name = X509_get_subject_name(Certificate);
+        X509_NAME_add_entry_by_txt(Name, "CN", MBSTRING_ASC, (const unsigned char *)"CommandLine-Chat", -1, -1, 0);
+        X509_set_issuer_name(Certificate, Name);
+        //Context holds its own references to certificate and key, ours are let go of on every way out
+        if(X509_sign(Certificate, Key, EVP_sha256())) Context = SSL_CTX_new(TLS_server_method());
+        if(Context == NULL || SSL_CTX_use_certificate(Context, Certificate) != 1 || SSL_CTX_use_PrivateKey(Context, Key) != 1){
+            SSL_CTX_free(Context);
+            X509_free(Certificate);
+            EVP_PKEY_free(Key);
+            return NULL;
+        }
+        SSL_CTX_set_min_proto_version(Context, TLS1_2_VERSION);
+        //Frames are written in pieces as socket takes them, and idle connections give back their TLS buffers
+        SSL_CTX_set_mode(Context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+        //OpenSSL hands keys to kernel once handshake is done where kernel takes them, and keeps them where it doesn't
+        #ifdef SSL_OP_ENABLE_KTLS
+            if(Mode == TLS_KERNEL) SSL_CTX_set_options(Context, SSL_OP_ENABLE_KTLS);
+        #else
+            (void)Mode;
+        #endif
+
+        unsigned char Digest[EVP_MAX_MD_SIZE];
+        unsigned int Length = 0;
+        X509_digest(Certificate, EVP_sha256(), Digest, &Length);
+        char Fingerprint[3 * EVP_MAX_MD_SIZE + 1] = "";
+        for(unsigned int i = 0; i < Length; i++){
+            sprintf(Fingerprint + 3 * i, i + 1 < Length ? "%02X:" : "%02X", Digest[i]);
+        }
+        std::cout << "TLS certificate fingerprint (SHA-256) : " << Fingerprint << std::endl;
+        X509_free(Certificate);
+        EVP_PKEY_free(Key);
+        return Context;
+    #else
+        (void)Mode;
+        std::cerr << "Server was built without TLS (build with -DUSE_TLS -lssl -lcrypto)" << std::endl;
+        return NULL;
+    #endif
+}
+
+bool ContinueHandshake(struct Connection* Client){
+    #ifdef USE_TLS
+        int Result = SSL_do_handshake(Client->TLS);
+        if(Result == 1){
+            //Handshake is done, client sends connection request next
+            Client->State = RECV_CONNECT;
+            std::cout << "Client " << Client->ID << " encrypted with " << SSL_get_version(Client->TLS) << " "
+                      << SSL_get_cipher(Client->TLS) << (KernelTLS(Client->TLS) ? " (kernel TLS)" : " (user TLS)") << std::endl;
+            return true;
+        }
+        switch(SSL_get_error(Client->TLS, Result)){
+            case SSL_ERROR_WANT_READ:
+                Client->State = RECV_TLS;
+                return false;
+            case SSL_ERROR_WANT_WRITE:
+                Client->State = RECV_TLS_WRITE;
+                return false;
+            default:
+                std::cout << "TLS handshake with client " << Client->ID << " failed, client has been disconnected..." << std::endl << std::endl;
+                ERR_clear_error();
+                Client->Closed = true;
+                return false;
+        }
+    #else
+        Client->Closed = true;
+        return false;
+    #endif
+}
+
+bool KernelTLS(SSL* TLS){
+    //Kernel holds the keys for sending once OpenSSL has handed them over
+    #if defined(USE_TLS) && defined(BIO_get_ktls_send)
+        return TLS != NULL && BIO_get_ktls_send(SSL_get_wbio(TLS));
+    #else
+        (void)TLS;
+        return false;
+    #endif
+}
+
+int SocketSend(int SocketFD, SSL* TLS, const char* Data, size_t Length, int Flags){
+    #ifdef USE_TLS
+        if(TLS != NULL){
+            int Result = SSL_write(TLS, Data, Length);
+            if(Result > 0) return Result;
+            int Error = SSL_get_error(TLS, Result);
+            errno = (Error == SSL_ERROR_WANT_WRITE || Error == SSL_ERROR_WANT_READ) ? EAGAIN : EPIPE;
+            ERR_clear_error();
+            return -1;
+        }
+    #else
+        (void)TLS;
+    #endif
+    return send(SocketFD, Data, Length, Flags);
+}
+
+int SocketReceive(int SocketFD, SSL* TLS, char* Data, size_t Length, int Flags){
+    #ifdef USE_TLS
+        //Records are read through OpenSSL, which takes them already decrypted where kernel holds the receive
+        //keys as well (-tls KERNEL)
+        if(TLS != NULL){
+            size_t Received = 0;
+            do{
+                int Result = SSL_read(TLS, Data + Received, Length - Received);
+                if(Result > 0){
+                    Received += Result;
+                    continue;
+                }
+                int Error = SSL_get_error(TLS, Result);
+                ERR_clear_error();
+                if(Received > 0) break;
+                if(Error == SSL_ERROR_WANT_READ || Error == SSL_ERROR_WANT_WRITE){
+                    errno = EAGAIN;
+                    return -1;
+                }
+                if(Error == SSL_ERROR_ZERO_RETURN || (Error == SSL_ERROR_SYSCALL && errno == 0)) return 0;
+                errno = ECONNRESET;
+                return -1;
+            }while((Flags & MSG_WAITALL) && Received < Length);     //Socket blocks while waiting for all of it
+            return Received;
+        }
+    #else
+        (void)TLS;
+    #endif
+    return recv(SocketFD, Data, Length, Flags);
+}
+
+void CloseTLS(SSL* TLS){
+    #ifdef USE_TLS
+        //Close message is only sent if socket has room, connection is closed either way
+        if(TLS == NULL) return;
+        SSL_shutdown(TLS);
+        SSL_free(TLS);
+        ERR_clear_error();
+    #else
+        (void)TLS;
+    #endif
+}
+
+void SetupDatagram(struct Datagram* UDP, unsigned int Token){
+    //Sequence numbers start at 1 so an ACK of 0 means nothing has been received
+    UDP->Token = Token;
+    memset(&UDP->Address, '\0', sizeof(UDP->Address));
+    UDP->Known = false;
+    UDP->Failed = false;
+    UDP->Hello = 0;
+    UDP->Asked = 0;
+    UDP->Waiting = 0;
+    UDP->NextSequence = 1;
+    UDP->Expected = 1;
+    UDP->RTT = 0;
+    UDP->Variance = 0;
+    UDP->Timeout = (long long)UDP_FIRST_TIMEOUT * 1000000;
+    UDP->Sent = 0;
+    UDP->Retransmits = 0;
+    UDP->Received = 0;
+    UDP->Duplicates = 0;
+}
+
+bool DatagramFrame(const std::string& Frame){
+    //Only small messages, errors and room frames are sent as datagrams, exit, handshake and file frames stay on TCP
+    if(Frame.size() < sizeof(struct FrameHeader) || Frame.size() > UDP_MAX_FRAME) return false;
+    unsigned char Type = Frame[0], Flags = Frame[1];
+    return (Type == 0 && Flags >= 1 && Flags <= 3) || (Type >= 7 && Type <= 9);
+}
+
+bool DatagramBusy(struct Datagram* UDP){
+    //Frames still waiting on ACK or on room in window
+    return UDP != NULL && (!UDP->Unacked.empty() || !UDP->Pending.empty());
+}
+
+void SendDatagram(int SocketFD, struct Datagram* UDP, int Kind, unsigned int Sequence, const std::string* Frame){
+    //Every datagram carries ACK of every frame received so far
+    struct DatagramHeader Header;
+    memset(&Header, '\0', sizeof(Header));
+    Header.Token = htonl(UDP->Token);
+    Header.Kind = Kind;
+    Header.Sequence = htonl(Sequence);
+    Header.Ack = htonl(UDP->Expected - 1);
+    unsigned int Selective = 0;
+    for(std::map<unsigned int, std::string>::iterator It = UDP->Early.begin(); It != UDP->Early.end(); It++){
+        unsigned int Bit = It->first - UDP->Expected - 1;
+        if(Bit < 32) Selective |= 1u << Bit;
+    }
+    Header.Selective = htonl(Selective);
+
+    char Buffer[sizeof(struct DatagramHeader) + UDP_MAX_FRAME];
+    size_t Length = sizeof(Header);
+    memcpy(Buffer, &Header, sizeof(Header));
+    if(Frame != NULL){
+        memcpy(Buffer + Length, Frame->data(), Frame->size());
+        StampForwarded(Buffer + Length, Frame->size());
+        Length += Frame->size();
+    }
+    //Datagram lost here is sent again by retransmit timer like one lost on the way
+    sendto(SocketFD, Buffer, Length, 0, (struct sockaddr *)&UDP->Address, sizeof(UDP->Address));
+}
+
+bool QueueDatagram(int SocketFD, struct Datagram* UDP, const std::string& Frame){
+    //Frames wait for room in window, a peer that stopped reading makes the timer move them to TCP
+    if(UDP->Pending.size() >= UDP_PENDING) return false;
+    if(!UDP->Known && UDP->Pending.empty()) UDP->Waiting = MonotonicTime();
+    UDP->Pending.push_back(Frame);
+    FillWindow(SocketFD, UDP);
+    return true;
+}
+
+void FillWindow(int SocketFD, struct Datagram* UDP){
+    //Frames are only sent once peer's address is known and while receiver can hold them in its selective ACK range
+    while(UDP->Known && !UDP->Failed && !UDP->Pending.empty()){
+        unsigned int Oldest = UDP->Unacked.empty() ? UDP->NextSequence : UDP->Unacked.begin()->first;
+        if(UDP->NextSequence - Oldest >= UDP_WINDOW) break;
+        struct SentDatagram& Sent = UDP->Unacked[UDP->NextSequence];
+        Sent.Frame.swap(UDP->Pending.front());
+        UDP->Pending.pop_front();
+        Sent.Time = MonotonicTime();
+        Sent.First = Sent.Time;
+        Sent.Tries = 1;
+        Sent.Missed = 0;
+        SendDatagram(SocketFD, UDP, DATAGRAM_DATA, UDP->NextSequence, &Sent.Frame);
+        UDP->NextSequence++;
+        UDP->Sent++;
+    }
+}
+
+void ReceiveDatagram(int SocketFD, struct Datagram* UDP, const char* Data, size_t Length, bool Accept, std::vector<std::string>& Ready){
+    struct DatagramHeader Header;
+    memcpy(&Header, Data, sizeof(Header));
+    unsigned int Sequence = ntohl(Header.Sequence);
+    unsigned int Ack = ntohl(Header.Ack);
+    unsigned int Selective = ntohl(Header.Selective);
+    long long Now = MonotonicTime();
+    long long Sample = -1;      //Round trip of newest frame ACK'd, only frames sent once are measured
+    UDP->Hello = 0;             //Peer has answered
+
+    //Frames ACK'd in order or selectively leave window
+    while(!UDP->Unacked.empty() && UDP->Unacked.begin()->first <= Ack){
+        if(UDP->Unacked.begin()->second.Tries == 1) Sample = Now - UDP->Unacked.begin()->second.Time;
+        UDP->Unacked.erase(UDP->Unacked.begin());
+    }
+    unsigned int Highest = 0;   //Newest frame ACK'd selectively
+    for(int Bit = 0; Bit < 32 && Selective != 0; Bit++){
+        if(!(Selective & (1u << Bit))) continue;
+        std::map<unsigned int, struct SentDatagram>::iterator Found = UDP->Unacked.find(Ack + 2 + Bit);
+        if(Found != UDP->Unacked.end()){
+            if(Found->second.Tries == 1) Sample = Now - Found->second.Time;
+            UDP->Unacked.erase(Found);
+        }
+        Highest = Ack + 2 + Bit;
+    }
+
+    //Smoothed round trip and its variation give retransmit timeout (as TCP does)
+    if(Sample >= 0){
+        if(UDP->RTT == 0){
+            UDP->RTT = Sample;
+            UDP->Variance = Sample / 2;
+        }else{
+            long long Difference = UDP->RTT > Sample ? UDP->RTT - Sample : Sample - UDP->RTT;
+            UDP->Variance = (3 * UDP->Variance + Difference) / 4;
+            UDP->RTT = (7 * UDP->RTT + Sample) / 8;
+        }
+        UDP->Timeout = UDP->RTT + 4 * UDP->Variance;
+        if(UDP->Timeout < (long long)UDP_MIN_TIMEOUT * 1000000) UDP->Timeout = (long long)UDP_MIN_TIMEOUT * 1000000;
+        if(UDP->Timeout > (long long)UDP_MAX_TIMEOUT * 1000000) UDP->Timeout = (long long)UDP_MAX_TIMEOUT * 1000000;
+    }
+
+    //Frames that later frames have been ACK'd ahead of several times are lost, send them again without waiting on timer
+    for(std::map<unsigned int, struct SentDatagram>::iterator It = UDP->Unacked.begin(); It != UDP->Unacked.end() && It->first < Highest; It++){
+        if(++It->second.Missed == UDP_FAST_RETRANSMIT){
+            SendDatagram(SocketFD, UDP, DATAGRAM_DATA, It->first, &It->second.Frame);
+            It->second.Time = Now;
+            It->second.Tries++;
+            It->second.Missed = 0;
+            UDP->Retransmits++;
+        }
+    }
+
+    if(Header.Kind == DATAGRAM_HELLO){
+        SendDatagram(SocketFD, UDP, DATAGRAM_ACK, 0, NULL);
+    }else if(Header.Kind == DATAGRAM_DATA && Length > sizeof(Header) && Accept){
+        //Frame not accepted yet (peer not connected) is not ACK'd, peer sends it again
+        UDP->Received++;
+        if(Sequence < UDP->Expected || UDP->Early.count(Sequence) > 0){
+            UDP->Duplicates++;
+        }else if(Sequence - UDP->Expected <= UDP_WINDOW){
+            UDP->Early[Sequence].assign(Data + sizeof(Header), Length - sizeof(Header));
+        }
+        //Hand on every frame now in order, frames that are not whole chat frames are skipped
+        while(!UDP->Early.empty() && UDP->Early.begin()->first == UDP->Expected){
+            std::string& Frame = UDP->Early.begin()->second;
+            struct FrameHeader Inner;
+            if(DatagramFrame(Frame)){
+                memcpy(&Inner, Frame.data(), sizeof(Inner));
+                if(ntohl(Inner.Length) == Frame.size() - sizeof(Inner)){
+                    Ready.push_back(std::string());
+                    Ready.back().swap(Frame);
+                }
+            }
+            UDP->Early.erase(UDP->Early.begin());
+            UDP->Expected++;
+        }
+        //Every data datagram is ACK'd right away
+        SendDatagram(SocketFD, UDP, DATAGRAM_ACK, 0, NULL);
+    }
+    FillWindow(SocketFD, UDP);
+}
+
+int DatagramTimer(int SocketFD, struct Datagram* UDP){
+    //Sends again every datagram not ACK'd in time, doubling its timeout each time, returns time until next one
+    //is due (ms), -1 if none are waiting
+    if(UDP->Failed || (UDP->Unacked.empty() && UDP->Hello == 0 && (UDP->Known || UDP->Pending.empty()))) return -1;
+    long long Now = MonotonicTime();
+    long long Next = -1;
+
+    //Client keeps telling server its address until server answers
+    if(UDP->Hello != 0){
+        if(Now - UDP->Hello >= UDP->Timeout){
+            if(UDP->Asked == 0) UDP->Asked = Now;
+            if(Now - UDP->Asked >= (long long)UDP_GIVE_UP * 1000000){
+                UDP->Failed = true;
+                return -1;
+            }
+            SendDatagram(SocketFD, UDP, DATAGRAM_HELLO, 0, NULL);
+            UDP->Hello = Now;
+        }
+        Next = UDP->Hello + UDP->Timeout;
+    }
+
+    //Server gives up on frames waiting for a client that never sent a datagram
+    if(!UDP->Known && !UDP->Pending.empty()){
+        if(Now - UDP->Waiting >= (long long)UDP_ADDRESS_WAIT * 1000000){
+            UDP->Failed = true;
+            return -1;
+        }
+        long long Due = UDP->Waiting + (long long)UDP_ADDRESS_WAIT * 1000000;
+        if(Next < 0 || Due < Next) Next = Due;
+    }
+
+    for(std::map<unsigned int, struct SentDatagram>::iterator It = UDP->Unacked.begin(); It != UDP->Unacked.end(); It++){
+        struct SentDatagram& Sent = It->second;
+        long long Wait = UDP->Timeout << (Sent.Tries - 1);
+        if(Wait > (long long)UDP_MAX_TIMEOUT * 1000000) Wait = (long long)UDP_MAX_TIMEOUT * 1000000;
+        if(Now - Sent.Time >= Wait){
+            //Peer is unreachable, chat moves back to TCP
+            if(Now - Sent.First >= (long long)UDP_GIVE_UP * 1000000){
+                UDP->Failed = true;
+                return -1;
+            }
+            SendDatagram(SocketFD, UDP, DATAGRAM_DATA, It->first, &Sent.Frame);
+            Sent.Time = Now;
+            Sent.Tries++;
+            Sent.Missed = 0;
+            UDP->Retransmits++;
+            Wait = UDP->Timeout << (Sent.Tries - 1);
+            if(Wait > (long long)UDP_MAX_TIMEOUT * 1000000) Wait = (long long)UDP_MAX_TIMEOUT * 1000000;
+        }
+        if(Next < 0 || Sent.Time + Wait < Next) Next = Sent.Time + Wait;
+    }
+    if(Next < 0) return -1;
+    return (int)((Next - Now + 999999) / 1000000);
+}
+
+void DatagramFallback(struct Datagram* UDP, std::vector<std::string>& Frames){
+    //Frames not known to be received are handed back in order to be sent on TCP, peer may see some of them twice
+    for(std::map<unsigned int, struct SentDatagram>::iterator It = UDP->Unacked.begin(); It != UDP->Unacked.end(); It++){
+        Frames.push_back(std::string());
+        Frames.back().swap(It->second.Frame);
+    }
+    UDP->Unacked.clear();
+    for(size_t i = 0; i < UDP->Pending.size(); i++){
+        Frames.push_back(std::string());
+        Frames.back().swap(UDP->Pending[i]);
+    }
+    UDP->Pending.clear();
+}
+
+std::string DatagramStats(struct Datagram* UDP){
+    //Counters of one UDP connection, round trip in ms
+    char Line[256];
+    snprintf(Line, sizeof(Line), "sent %u frames (%u sent again), received %u (%u duplicates), round trip %.2f ms, timeout %lld ms%s",
+             UDP->Sent, UDP->Retransmits, UDP->Received, UDP->Duplicates, UDP->RTT / 1000000.0, UDP->Timeout / 1000000,
+             UDP->Failed ? ", moved to TCP" : "");
+    return Line;
+}
+
+void ReadDatagrams(int SocketFD, std::map<unsigned int, struct Connection*>& Tokens, bool Deliver, std::vector<std::pair<struct Connection*, std::string> >& Frames){
+    //Read every datagram waiting, token picks client it came from
+    char Buffer[sizeof(struct DatagramHeader) + UDP_MAX_FRAME];
+    struct sockaddr_in Address;
+    socklen_t AddressSize = sizeof(Address);
+    int bytes;
+    while((bytes = recvfrom(SocketFD, Buffer, sizeof(Buffer), 0, (struct sockaddr *)&Address, &AddressSize)) >= 0){
+        AddressSize = sizeof(Address);
+        if(bytes < (int)sizeof(struct DatagramHeader)) continue;
+        struct DatagramHeader Header;
+        memcpy(&Header, Buffer, sizeof(Header));
+        std::map<unsigned int, struct Connection*>::iterator Found = Tokens.find(ntohl(Header.Token));
+        if(Found == Tokens.end()) continue;
+        struct Connection* Client = Found->second;
+
+        //Client's address is learned from its datagrams and followed if it changes
+        Client->UDP->Address = Address;
+        Client->UDP->Known = true;
+        std::vector<std::string> Ready;
+        ReceiveDatagram(SocketFD, Client->UDP, Buffer, bytes, Deliver && !Client->Closed && Client->State == RECV_PACKET, Ready);
+        for(size_t i = 0; i < Ready.size(); i++){
+            Frames.push_back(std::make_pair(Client, std::string()));
+            Frames.back().second.swap(Ready[i]);
+        }
+    }
+}
+
+void DrainDatagrams(int SocketFD, std::vector<struct Connection*>& Clients, std::map<unsigned int, struct Connection*>& Tokens){
+    //Nothing to wait on without -udp
+    if(SocketFD < 0) return;
+    long long End = MonotonicTime() + (long long)UDP_DRAIN * 1000000;
+    while(true){
+        //Keep answering ACKs and sending datagrams again until every client has ACK'd or time is up
+        int Timeout = -1;
+        bool Busy = false;
+        for(size_t i = 0; i < Clients.size(); i++){
+            struct Datagram* UDP = Clients[i]->UDP;
+            if(UDP == NULL || UDP->Failed || !UDP->Known || !DatagramBusy(UDP)) continue;
+            Busy = true;
+            int Wait = DatagramTimer(SocketFD, UDP);
+            if(Wait >= 0 && (Timeout < 0 || Wait < Timeout)) Timeout = Wait;
+        }
+        long long Left = (End - MonotonicTime()) / 1000000;
+        if(!Busy || Left <= 0) return;
+        if(Timeout < 0 || Timeout > Left) Timeout = Left;
+
+        struct pollfd Watch;
+        Watch.fd = SocketFD;
+        Watch.events = POLLIN;
+        if(poll(&Watch, 1, Timeout) > 0){
+            std::vector<std::pair<struct Connection*, std::string> > Frames;   //Frames received while exiting are not handled
+            ReadDatagrams(SocketFD, Tokens, false, Frames);
+        }
+    }
+}
+
+void SetupLocal(struct Local* Local){
+    //Rings are only used once both ends have them, until then everything goes through the socket
+    Local->Memory = NULL;
+    Local->In = NULL;
+    Local->Out = NULL;
+    Local->WakeFD = -1;
+    Local->PeerFD = -1;
+    Local->Passed = 0;
+}
+
+bool TakeRings(struct Local* Local){
+    //Shared memory and eventfds are the first file descriptors passed by peer, they are never taken for a file
+    if(Local->Incoming.size() < 3) return false;
+    int Memory = Local->Incoming[0];
+    int Wake = Local->Incoming[1];
+    int Peer = Local->Incoming[2];
+    Local->Incoming.erase(Local->Incoming.begin(), Local->Incoming.begin() + 3);
+
+    //Memory must be as large as both rings and sealed so the client can't shrink it under the server's mapping,
+    //which would end the server on its next ring access
+    struct stat Info;
+    void* Shared = MAP_FAILED;
+    int Seals = fcntl(Memory, F_GET_SEALS);
+    int Needed = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+    if(Seals >= 0 && (Seals & Needed) == Needed &&
+       fstat(Memory, &Info) == 0 && (size_t)Info.st_size == 2 * (sizeof(struct RingHeader) + LOCAL_RING_SIZE)){
+        Shared = mmap(NULL, Info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, Memory, 0);
+    }
+    close(Memory);
+    if(Shared == MAP_FAILED){
+        close(Wake);
+        close(Peer);
+        return false;
+    }
+    Local->Memory = Shared;
+    Local->WakeFD = Wake;
+    Local->PeerFD = Peer;
+    return true;
+}
+
+void UseRings(struct Local* Local, bool Creator){
+    //Ring 0 is written by end that created the memory, ring 1 by the other end
+    struct RingHeader* First = (struct RingHeader*)Local->Memory;
+    struct RingHeader* Second = (struct RingHeader*)((char*)Local->Memory + sizeof(struct RingHeader) + LOCAL_RING_SIZE);
+    Local->Out = Creator ? First : Second;
+    Local->In = Creator ? Second : First;
+}
+
+int SendHandles(int SocketFD, struct Local* Local, const char* Data, size_t Length){
+    //File descriptors waiting to be passed go with these bytes, peer receives them no later than the bytes
+    struct iovec Part;
+    Part.iov_base = (void*)Data;
+    Part.iov_len = Length;
+    struct msghdr Message;
+    memset(&Message, '\0', sizeof(Message));
+    Message.msg_iov = &Part;
+    Message.msg_iovlen = 1;
+    char Control[CMSG_SPACE(LOCAL_MAX_HANDLES * sizeof(int))];
+    size_t Count = Local->Outgoing.size() < LOCAL_MAX_HANDLES ? Local->Outgoing.size() : LOCAL_MAX_HANDLES;
+    if(Count > 0){
+        memset(Control, '\0', sizeof(Control));
+        Message.msg_control = Control;
+        Message.msg_controllen = CMSG_SPACE(Count * sizeof(int));
+        struct cmsghdr* Header = CMSG_FIRSTHDR(&Message);
+        Header->cmsg_level = SOL_SOCKET;
+        Header->cmsg_type = SCM_RIGHTS;
+        Header->cmsg_len = CMSG_LEN(Count * sizeof(int));
+        for(size_t i = 0; i < Count; i++){
+            memcpy(CMSG_DATA(Header) + i * sizeof(int), &Local->Outgoing[i], sizeof(int));
+        }
+    }
+    int bytes = sendmsg(SocketFD, &Message, MSG_NOSIGNAL);
+    if(bytes < 0) return -1;
+
+    //Peer holds its own copies once they are sent
+    for(size_t i = 0; i < Count; i++){
+        close(Local->Outgoing.front());
+        Local->Outgoing.pop_front();
+    }
+    return bytes;
+}
+
+int ReadHandles(int SocketFD, struct Local* Local, char* Data, size_t Length){
+    //Reads socket like recv(), keeping every file descriptor passed with the bytes in the order they were sent
+    struct iovec Part;
+    Part.iov_base = Data;
+    Part.iov_len = Length;
+    struct msghdr Message;
+    memset(&Message, '\0', sizeof(Message));
+    Message.msg_iov = &Part;
+    Message.msg_iovlen = 1;
+    char Control[CMSG_SPACE(LOCAL_MAX_HANDLES * sizeof(int))];
+    Message.msg_control = Control;
+    Message.msg_controllen = sizeof(Control);
+    int bytes = recvmsg(SocketFD, &Message, MSG_CMSG_CLOEXEC);
+    if(bytes < 0) return -1;
+    for(struct cmsghdr* Header = CMSG_FIRSTHDR(&Message); Header != NULL; Header = CMSG_NXTHDR(&Message, Header)){
+        if(Header->cmsg_level != SOL_SOCKET || Header->cmsg_type != SCM_RIGHTS) continue;
+        size_t Count = (Header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(size_t i = 0; i < Count; i++){
+            int Handle;
+            memcpy(&Handle, CMSG_DATA(Header) + i * sizeof(int), sizeof(int));
+            Local->Incoming.push_back(Handle);
+        }
+    }
+    return bytes;
+}
+
+int LocalSend(int SocketFD, struct Local* Local, const char* Data, size_t Length){
+    //Without rings bytes are written to socket, carrying any file descriptors waiting to be passed
+    if(Local->Out == NULL) return SendHandles(SocketFD, Local, Data, Length);
+
+    //File descriptors go ahead of ring data on socket with one marker byte, so they are there before the frame using them
+    char Marker = 0;
+    while(!Local->Outgoing.empty()){
+        if(SendHandles(SocketFD, Local, &Marker, 1) < 0) return -1;
+    }
+
+    //Ring is full once writer is a whole ring ahead of reader, reader wakes writer once it makes room
+    struct RingHeader* Ring = Local->Out;
+    unsigned long long Tail = Ring->Tail.load(std::memory_order_relaxed);
+    size_t Room = LOCAL_RING_SIZE - (Tail - Ring->Head.load(std::memory_order_acquire));
+    if(Room == 0){
+        Ring->Full.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        Room = LOCAL_RING_SIZE - (Tail - Ring->Head.load(std::memory_order_acquire));
+        if(Room == 0){
+            errno = EAGAIN;
+            return -1;
+        }
+        Ring->Full.store(false);
+    }
+    if(Length > Room) Length = Room;
+
+    //Copy in at most two pieces as data wraps around end of ring
+    char* Buffer = (char*)(Ring + 1);
+    size_t Offset = Tail % LOCAL_RING_SIZE;
+    size_t First = Length < LOCAL_RING_SIZE - Offset ? Length : LOCAL_RING_SIZE - Offset;
+    memcpy(Buffer + Offset, Data, First);
+    memcpy(Buffer, Data + First, Length - First);
+    Ring->Tail.store(Tail + Length, std::memory_order_release);
+
+    //Wake reader if it has gone to sleep, fence keeps data from being missed by a reader going to sleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(Ring->Sleeping.load(std::memory_order_relaxed) && Ring->Sleeping.exchange(false)){
+        uint64_t Wake = 1;
+        if(write(Local->PeerFD, &Wake, sizeof(Wake)) < 0){}
+    }
+    return Length;
+}
+
+int LocalReceive(int SocketFD, struct Local* Local, char* Data, size_t Length){
+    //Without rings bytes are read from socket, keeping file descriptors passed with them
+    if(Local->In == NULL) return ReadHandles(SocketFD, Local, Data, Length);
+
+    struct RingHeader* Ring = Local->In;
+    unsigned long long Head = Ring->Head.load(std::memory_order_relaxed);
+    size_t Waiting = Ring->Tail.load(std::memory_order_acquire) - Head;
+    if(Waiting == 0){
+        //Socket only carries file descriptors once rings are used, and tells once peer has closed
+        char Markers[64];
+        int bytes;
+        while((bytes = ReadHandles(SocketFD, Local, Markers, sizeof(Markers))) > 0);
+        if(bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+
+        //Go to sleep on eventfd, then check nothing was written before writer could see it
+        uint64_t Wake;
+        if(read(Local->WakeFD, &Wake, sizeof(Wake)) < 0){}
+        Ring->Sleeping.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        Waiting = Ring->Tail.load(std::memory_order_acquire) - Head;
+        if(Waiting == 0){
+            //Peer wrote everything it had before closing socket
+            if(bytes == 0) return 0;
+            errno = EAGAIN;
+            return -1;
+        }
+        Ring->Sleeping.store(false);
+    }
+    if(Length > Waiting) Length = Waiting;
+
+    //Copy out in at most two pieces as data wraps around end of ring
+    const char* Buffer = (const char*)(Ring + 1);
+    size_t Offset = Head % LOCAL_RING_SIZE;
+    size_t First = Length < LOCAL_RING_SIZE - Offset ? Length : LOCAL_RING_SIZE - Offset;
+    memcpy(Data, Buffer + Offset, First);
+    memcpy(Data + First, Buffer, Length - First);
+    Ring->Head.store(Head + Length, std::memory_order_release);
+
+    //Wake writer if it is waiting for room
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(Ring->Full.load(std::memory_order_relaxed) && Ring->Full.exchange(false)){
+        uint64_t Wake = 1;
+        if(write(Local->PeerFD, &Wake, sizeof(Wake)) < 0){}
+    }
+    return Length;
+}
+
+int TakeHandle(int SocketFD, struct Local* Local){
+    //With rings, file descriptor was written to socket before its frame was written to ring, so it is waiting there
+    if(Local == NULL) return -1;
+    if(Local->Incoming.empty() && Local->In != NULL){
+        char Markers[64];
+        while(ReadHandles(SocketFD, Local, Markers, sizeof(Markers)) > 0);
+    }
+    if(Local->Incoming.empty()) return -1;
+    int Handle = Local->Incoming.front();
+    Local->Incoming.pop_front();
+    return Handle;
+}
+
+bool PassedFile(int Source, long int Length){
+    //Regular file is copied up to its size at most, so copying stops where the file ends
+    struct stat Info;
+    return fstat(Source, &Info) == 0 && S_ISREG(Info.st_mode) && Length >= 0 && Length <= Info.st_size;
+}
+
+long int CopyHandle(int Source, FILE* File, long int Length){
+    //Output file could not be opened, passed file is skipped
+    if(File == NULL) return Length;
+
+    //Kernel copies between the files without the data passing through the program, falling back to
+    //sendfile() where the files can't be copied between directly (different file systems on older kernels)
+    ssize_t bytes = copy_file_range(Source, NULL, fileno(File), NULL, Length, 0);
+    if(bytes < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)){
+        bytes = sendfile(fileno(File), Source, NULL, Length);
+    }
+    return bytes;
+}
+
+bool CopyFiles(struct Connection* Client){
+    //Nothing to copy unless client has passed files
+    if(Client->Files == NULL || Client->Local == NULL) return false;
+    bool Copying = false;
+    std::map<int, struct Transfer*>::iterator It = Client->Files->Receives.begin();
+    while(It != Client->Files->Receives.end()){
+        struct Transfer* Receive = It->second;
+        if(Receive->Source < 0){
+            It++;
+            continue;
+        }
+
+        //Copy one chunk of each file in turn, file is done once all of it is copied or it can't be copied further
+        long int bytes = CopyHandle(Receive->Source, Receive->File, Receive->Remaining < FILE_COPY_CHUNK ? Receive->Remaining : FILE_COPY_CHUNK);
+        if(bytes > 0) Receive->Remaining -= bytes;
+        if(bytes > 0 && Receive->Remaining > 0){
+            Copying = true;
+            It++;
+            continue;
+        }
+        close(Receive->Source);
+        if(Receive->File != NULL) fclose(Receive->File);
+        if(Receive->Remaining != 0){
+            std::cout << "File Transfer " << Receive->ID << " (" << Receive->Name << ") from client " << Client->ID << " incomplete! File may be corrupted" << std::endl << std::endl;
+        }else{
+            std::cout << "File Transfer " << Receive->ID << " (" << Receive->Name << ") from client " << Client->ID << " complete!" << std::endl << std::endl;
+        }
+        Client->Files->Receives.erase(It++);
+        delete Receive;
+    }
+    return Copying;
+}
+
+void CloseLocal(struct Local* Local){
+    //Unmaps rings and closes eventfds and every file descriptor not yet passed on or taken
+    if(Local->Memory != NULL) munmap(Local->Memory, 2 * (sizeof(struct RingHeader) + LOCAL_RING_SIZE));
+    if(Local->WakeFD >= 0) close(Local->WakeFD);
+    if(Local->PeerFD >= 0) close(Local->PeerFD);
+    for(size_t i = 0; i < Local->Outgoing.size(); i++) close(Local->Outgoing[i]);
+    for(size_t i = 0; i < Local->Incoming.size(); i++) close(Local->Incoming[i]);
+    Local->Outgoing.clear();
+    Local->Incoming.clear();
+}
+
+bool ListDirectory(const std::string& Root, const std::string& Prefix, std::vector<struct DirectoryFile>& Entries){
+    //Every regular file below directory is listed with its path from the directory, links are skipped so
+    //nothing outside of it is sent and the walk can't loop
+    DIR* Folder = opendir((Root + "/" + Prefix).c_str());
+    if(Folder == NULL) return false;
+    std::vector<std::string> Names;
+    struct dirent* Item;
+    while((Item = readdir(Folder)) != NULL){
+        if(strcmp(Item->d_name, ".") != 0 && strcmp(Item->d_name, "..") != 0) Names.push_back(Item->d_name);
+    }
+    closedir(Folder);
+    std::sort(Names.begin(), Names.end());
+
+    for(size_t i = 0; i < Names.size() && Entries.size() < DIRECTORY_MAX_FILES; i++){
+        std::string Name = Prefix.empty() ? Names[i] : Prefix + "/" + Names[i];
+        struct stat Info;
+        if(lstat((Root + "/" + Name).c_str(), &Info) != 0 || Name.size() > DIRECTORY_MAX_NAME) continue;
+        if(S_ISDIR(Info.st_mode)){
+            ListDirectory(Root, Name, Entries);
+        }else if(S_ISREG(Info.st_mode)){
+            struct DirectoryFile Entry;
+            Entry.Name = Name;
+            Entry.Size = Info.st_size;
+            Entries.push_back(Entry);
+        }
+    }
+    return true;
+}
+
+size_t QueueManifest(struct Transfer* Send, std::deque<std::string>& Queue){
+    //Entries are packed into as few frames as fit, an entry is never split between frames
+    size_t Queued = 0;
+    std::string Data;
+    for(size_t i = 0; i <= Send->Entries.size(); i++){
+        std::string Entry;
+        if(i < Send->Entries.size()){
+            char Fixed[10];
+            for(int j = 0; j < 8; j++){
+                Fixed[j] = (char)((unsigned long long)Send->Entries[i].Size >> (56 - 8 * j));
+            }
+            Fixed[8] = (char)(Send->Entries[i].Name.size() >> 8);
+            Fixed[9] = (char)Send->Entries[i].Name.size();
+            Entry.assign(Fixed, sizeof(Fixed));
+            Entry += Send->Entries[i].Name;
+        }
+        //Frame is full (or every entry is in), an empty directory still sends one manifest frame
+        if((i == Send->Entries.size() && (Queued == 0 || !Data.empty())) || Data.size() + Entry.size() > MAX_FRAME){
+            Queue.push_back(CreateFrame(11, 1, Send->ID, Data.data(), Data.size()));
+            Queued += Queue.back().size();
+            Data.clear();
+        }
+        Data += Entry;
+    }
+    return Queued;
+}
+
+int DirectoryChunk(struct Transfer* Send, int Chunk, bool Splice, std::deque<std::string>& Queue, std::deque<struct Splice>& Splices){
+    //Data of every file follows the previous file's, small files are packed together into one chunk
+    char Buffer[MAX_CHUNK];
+    int Length = 0;
+    while(Length < Chunk && Send->Remaining > 0){
+        //Move on to next file with data once current one has been read
+        if(Send->Left == 0){
+            if(Send->File != NULL) fclose(Send->File);
+            Send->File = NULL;
+            while(Send->Left == 0 && Send->Next < Send->Entries.size()){
+                Send->Left = Send->Entries[Send->Next++].Size;
+            }
+            Send->File = fopen((Send->Name + "/" + Send->Entries[Send->Next - 1].Name).c_str(), "rb");
+            Send->Offset = 0;
+        }
+
+        //Large files are written from file straight into socket (sendfile()) a frame at a time, never packed
+        bool Large = Splice && Send->File != NULL && Send->Entries[Send->Next - 1].Size >= DIRECTORY_SPLICE_SIZE;
+        if(Large && Length > 0) break;
+        if(Large){
+            long int Slice = Send->Left < MAX_FRAME ? Send->Left : MAX_FRAME;
+            struct stat Info;
+            struct Splice Data;
+            Data.FD = -1;
+            if(fstat(fileno(Send->File), &Info) == 0 && Info.st_size >= Send->Offset + Slice) Data.FD = dup(fileno(Send->File));
+            if(Data.FD >= 0){
+                //Frame is queued without its data, which is sent from the file once the header is written
+                struct FrameHeader Header;
+                Header.Type = 5;
+                Header.Flags = 1;
+                Header.Channel = htons(Send->ID);
+                Header.Length = htonl(Slice);
+                Data.Offset = Send->Offset;
+                Data.Length = Slice;
+                Queue.push_back(std::string((char *)&Header, sizeof(Header)));
+                Splices.push_back(Data);
+            }else{
+                //File shrunk while sending, fill in rest so receiver is not left waiting
+                std::string Zeros(Slice, '\0');
+                Queue.push_back(CreateFrame(5, 1, Send->ID, Zeros.data(), Slice));
+            }
+            Send->Offset += Slice;
+            Send->Left -= Slice;
+            Send->Remaining -= Slice;
+            return Slice;
+        }
+
+        //Read what fits of current file into chunk
+        int Part = Send->Left < Chunk - Length ? Send->Left : Chunk - Length;
+        int bytes = Send->File != NULL ? fread(Buffer + Length, 1, Part, Send->File) : 0;
+        if(bytes < Part){
+            //File shrunk while sending or could not be opened, fill in rest so receiver is not left waiting
+            memset(Buffer + Length + (bytes > 0 ? bytes : 0), '\0', Part - (bytes > 0 ? bytes : 0));
+        }
+        Length += Part;
+        Send->Left -= Part;
+        Send->Remaining -= Part;
+    }
+    Queue.push_back(CreateFrame(5, 1, Send->ID, Buffer, Length));
+    return Length;
+}
+
+bool ReadManifest(struct Transfer* Receive, const char* Data, size_t Length){
+    //Every entry is file size (64 bits), name length (16 bits) and name
+    size_t Position = 0;
+    while(Position + 10 <= Length){
+        struct DirectoryFile Entry;
+        Entry.Size = 0;
+        for(int i = 0; i < 8; i++){
+            Entry.Size = (Entry.Size << 8) | (unsigned char)Data[Position + i];
+        }
+        size_t NameLength = ((unsigned char)Data[Position + 8] << 8) | (unsigned char)Data[Position + 9];
+        Position += 10;
+        if(Position + NameLength > Length || Entry.Size < 0 || Receive->Entries.size() >= DIRECTORY_MAX_FILES) return false;
+        Entry.Name.assign(Data + Position, NameLength);
+        Position += NameLength;
+        Receive->Entries.push_back(Entry);
+        Receive->Remaining += Entry.Size;
+    }
+    return Position == Length;
+}
+
+void WriteDirectory(struct Transfer* Receive, const char* Data, size_t Length){
+    //Data is split between files in manifest order, files without data are created as they are passed
+    size_t Used = 0;
+    while(true){
+        if(Receive->Left == 0){
+            if(Receive->File != NULL) fclose(Receive->File);
+            Receive->File = NULL;
+            if(Receive->Next >= Receive->Entries.size()) break;
+            if(Used == Length && Receive->Entries[Receive->Next].Size > 0) break;   //Wait for data of next file
+
+            //Only paths below directory are written, anything else is read and dropped
+            struct DirectoryFile& Entry = Receive->Entries[Receive->Next++];
+            Receive->Left = Entry.Size;
+            if(ValidEntry(Entry.Name)){
+                //Directories of a path are only created when it is in a different directory than the file before
+                std::string Path = Receive->Name + "/" + Entry.Name;
+                size_t Slash = Entry.Name.rfind('/');
+                if(Slash != std::string::npos && (Receive->Next < 2 || Receive->Entries[Receive->Next - 2].Name.compare(0, Slash + 1, Entry.Name, 0, Slash + 1) != 0)){
+                    MakePath(Path);
+                }
+                Receive->File = fopen(Path.c_str(), "wb");
+            }else{
+                std::cout << "File Transfer " << Receive->ID << " (" << Receive->Name << ") skipped unsafe path " << Entry.Name << std::endl << std::endl;
+            }
+            continue;
+        }
+        if(Used == Length) break;
+        size_t Part = Length - Used < (size_t)Receive->Left ? Length - Used : Receive->Left;
+        if(Receive->File != NULL) fwrite(Data + Used, 1, Part, Receive->File);
+        Used += Part;
+        Receive->Left -= Part;
+    }
+}
+
+bool BelowFolder(const char* Path){
+    //Symlinks are resolved before comparing, so a link inside the folder can't hand out a file outside it
+    char Folder[PATH_MAX], Resolved[PATH_MAX];
+    if(getcwd(Folder, sizeof(Folder)) == NULL || realpath(Path, Resolved) == NULL) return false;
+    size_t Length = strlen(Folder);
+    if(Length == 1) return true;    //Working folder is root
+    return strncmp(Resolved, Folder, Length) == 0 && (Resolved[Length] == '/' || Resolved[Length] == '\0');
+}
+
+bool ValidEntry(const std::string& Name){
+    //Path must stay below directory, no absolute paths, empty parts or parent directories
+    if(Name.empty() || Name[0] == '/' || Name.find('\\') != std::string::npos) return false;
+    size_t Start = 0;
+    while(Start <= Name.size()){
+        size_t End = Name.find('/', Start);
+        if(End == std::string::npos) End = Name.size();
+        std::string Part = Name.substr(Start, End - Start);
+        if(Part.empty() || Part == "." || Part == "..") return false;
+        Start = End + 1;
+    }
+    return true;
+}
+
+void MakePath(const std::string& Path){
+    //Creates every directory up to last '/' of path, directories that already exist are left as they are
+    for(size_t Slash = Path.find('/', 1); Slash != std::string::npos; Slash = Path.find('/', Slash + 1)){
+        mkdir(Path.substr(0, Slash).c_str(), 0777);
+    }
+}
+
+bool CanSplice(SSL* TLS, struct Local* Local, struct Capture* Capture){
+    //Data written with sendfile() skips capture and is only encrypted if kernel holds the keys, and rings are
+    //not a socket
+    #ifdef _WIN32
+        (void)TLS;
+        (void)Local;
+        (void)Capture;
+        return false;
+    #else
+        if(Capture != NULL || (Local != NULL && Local->In != NULL)) return false;
+        return TLS == NULL || KernelTLS(TLS);
+    #endif
+}
+
+int SpliceSend(int SocketFD, SSL* TLS, struct Splice* Data){
+    //Kernel writes file data into socket without it passing through the program, encrypting it on a kernel
+    //TLS connection (OpenSSL sends through sendfile() so it can flush anything it still holds first)
+    #ifdef _WIN32
+        (void)SocketFD;
+        (void)TLS;
+        (void)Data;
+        errno = EINVAL;
+        return -1;
+    #else
+        off_t Offset = Data->Offset;
+        ssize_t bytes;
+        #ifdef USE_TLS
+            if(TLS != NULL){
+                bytes = SSL_sendfile(TLS, Data->FD, Offset, Data->Length, 0);
+                if(bytes < 0){
+                    int Error = SSL_get_error(TLS, bytes);
+                    errno = (Error == SSL_ERROR_WANT_WRITE || Error == SSL_ERROR_WANT_READ) ? EAGAIN : EPIPE;
+                    ERR_clear_error();
+                    return -1;
+                }
+            }else{
+                bytes = sendfile(SocketFD, Data->FD, &Offset, Data->Length);
+            }
+        #else
+            (void)TLS;
+            bytes = sendfile(SocketFD, Data->FD, &Offset, Data->Length);
+        #endif
+        if(bytes == 0){
+            //File shrunk since frame was queued
+            errno = ENODATA;
+            return -1;
+        }
+        if(bytes > 0){
+            Data->Offset += bytes;
+            Data->Length -= bytes;
+        }
+        return bytes;
+    #endif
+}
+
+void CloseSplices(std::deque<struct Splice>& Splices, struct Splice* Splicing){
+    //Frames still queued will never be written, their files are closed
+    for(size_t i = 0; i < Splices.size(); i++) close(Splices[i].FD);
+    Splices.clear();
+    if(Splicing->Length > 0) close(Splicing->FD);
+    Splicing->Length = 0;
+}
+
+int OpenUpgrade(int Port){
+    //Only the user running the server may take it over, a socket left behind by a server that ended without cleanup
+    //is replaced (TCP port is already held, so no other server is using it)
+    struct sockaddr_un Address;
+    memset(&Address, '\0', sizeof(Address));
+    Address.sun_family = AF_UNIX;
+    snprintf(Address.sun_path, sizeof(Address.sun_path), UPGRADE_PATH, Port);
+    int SocketFD = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(SocketFD < 0) return -1;
+    unlink(Address.sun_path);
+    mode_t Mask = umask(077);
+    int Bound = bind(SocketFD, (struct sockaddr *) &Address, sizeof(Address));
+    umask(Mask);
+    if(Bound != 0 || listen(SocketFD, 1) != 0){
+        close(SocketFD);
+        return -1;
+    }
+    fcntl(SocketFD, F_SETFL, fcntl(SocketFD, F_GETFL, 0) | O_NONBLOCK);
+    return SocketFD;
+}
+
+int CheckUpgrade(int SocketFD){
+    //New server sends the state layout it reads, a build reading another layout (or leaving) is turned away and this
+    //server carries on, 0 while nothing has arrived
+    unsigned int Version = 0;
+    ssize_t bytes = recv(SocketFD, &Version, sizeof(Version), MSG_DONTWAIT);
+    if(bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+    if(bytes == sizeof(Version) && Version == UPGRADE_VERSION) return 1;
+    if(bytes == sizeof(Version)) std::cout << "Upgrade refused, new server reads another state layout" << std::endl << std::endl;
+    return -1;
+}
+
+bool HandOver(int SocketFD, int BaseSocketFD, std::vector<struct Connection*>& Clients, struct ConsoleState& Console,
+              struct RoomIndex& Index, std::map<unsigned int, struct Connection*>& Tokens, int NextID, struct ServerSettings Settings){
+    //Nothing is read from or written to any client from here on, so the state handed over is exactly where every client is,
+    //steps with the new server wait on it for a while at most
+    long long Stopped = MonotonicTime();
+    struct timeval Wait;
+    Wait.tv_sec = UPGRADE_TIMEOUT / 1000;
+    Wait.tv_usec = (UPGRADE_TIMEOUT % 1000) * 1000;
+    fcntl(SocketFD, F_SETFL, fcntl(SocketFD, F_GETFL, 0) & ~O_NONBLOCK);
+    setsockopt(SocketFD, SOL_SOCKET, SO_RCVTIMEO, &Wait, sizeof(Wait));
+    setsockopt(SocketFD, SOL_SOCKET, SO_SNDTIMEO, &Wait, sizeof(Wait));
+    std::string State;
+    std::vector<int> Handles(1, -1);    //File descriptors passed, memfd holding state goes first
+    std::vector<int> Opened;            //Files opened only to be passed, closed whichever way upgrade ends
+    int Folder = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(Folder >= 0) Opened.push_back(Folder);
+    PutNumber(State, Stopped);
+    PutNumber(State, NextID);
+    PutHandle(State, Handles, Folder);
+    PutHandle(State, Handles, BaseSocketFD);
+    PutHandle(State, Handles, Settings.LocalFD);
+    PutHandle(State, Handles, Settings.DatagramFD);
+    PutNumber(State, Index.Rooms[Console.Member].size());
+    for(size_t i = 0; i < Index.Rooms[Console.Member].size(); i++){
+        PutText(State, Index.Names[Index.Rooms[Console.Member][i].Target]);
+    }
+
+    //TLS state lives in OpenSSL and clients on this host may use shared memory, neither can be handed over so they stay here
+    std::vector<int> Moved;             //IDs of clients handed over
+    for(size_t i = 0; i < Clients.size(); i++){
+        if(!Clients[i]->Closed && Clients[i]->TLS == NULL && Clients[i]->Local == NULL) Moved.push_back(Clients[i]->ID);
+    }
+    PutNumber(State, Moved.size());
+    for(size_t i = 0; i < Clients.size(); i++){
+        if(std::find(Moved.begin(), Moved.end(), Clients[i]->ID) != Moved.end()) SaveClient(State, Handles, Opened, Clients[i], Index);
+    }
+    std::vector<struct FileRequest> Requests;   //File requests of handed over clients waiting on an answer
+    for(size_t i = 0; i < Console.Requests.size(); i++){
+        if(std::find(Moved.begin(), Moved.end(), Console.Requests[i].ClientID) != Moved.end()) Requests.push_back(Console.Requests[i]);
+    }
+    PutNumber(State, Requests.size());
+    for(size_t i = 0; i < Requests.size(); i++){
+        PutNumber(State, Requests[i].ClientID);
+        PutNumber(State, Requests[i].ID);
+        PutText(State, Requests[i].Name);
+    }
+
+    //State goes in a memfd, file descriptors follow in batches the kernel accepts
+    int Memory = memfd_create("chat-upgrade", MFD_CLOEXEC);
+    size_t Written = 0;
+    while(Memory >= 0 && Written < State.size()){
+        ssize_t bytes = write(Memory, State.data() + Written, State.size() - Written);
+        if(bytes <= 0) break;
+        Written += bytes;
+    }
+    bool Ready = Memory >= 0 && Written == State.size();
+    Handles[0] = Memory;
+    unsigned int Header[2] = {UPGRADE_VERSION, (unsigned int)Handles.size()};
+    for(size_t First = 0; Ready && First < Handles.size(); First += UPGRADE_BATCH){
+        size_t Count = Handles.size() - First < UPGRADE_BATCH ? Handles.size() - First : UPGRADE_BATCH;
+        Ready = First == 0 ? SendBatch(SocketFD, (char *)Header, sizeof(Header), &Handles[0], Count)
+                           : SendBatch(SocketFD, "H", 1, &Handles[First], Count);
+    }
+
+    //New server answers once it has read everything, clients are only let go of after that
+    char Answer = 0;
+    Ready = Ready && recv(SocketFD, &Answer, 1, 0) == 1 && Answer == 'A';
+    if(Ready){
+        //Upgrade socket path is freed before new server goes on, it makes its own if it was given -upgradable
+        struct sockaddr_un Address;
+        snprintf(Address.sun_path, sizeof(Address.sun_path), UPGRADE_PATH, Settings.Port);
+        unlink(Address.sun_path);
+    }
+    Ready = Ready && send(SocketFD, "G", 1, MSG_NOSIGNAL) == 1;
+    if(Memory >= 0) close(Memory);
+    for(size_t i = 0; i < Opened.size(); i++) close(Opened[i]);
+    close(SocketFD);
+    if(!Ready){
+        std::cout << "Upgrade failed, new server did not take over, every client is still served here" << std::endl << std::endl;
+        return false;
+    }
+
+    //New server holds every handed over client, copies here are closed without shutdown() so their connections stay up,
+    //and stop being watched first since the new server's copies keep them open
+    size_t Kept = 0;
+    for(size_t i = 0; i < Settings.Pool->Busy.size(); i++){
+        struct Connection* Client = Settings.Pool->Busy[i];
+        if(std::find(Moved.begin(), Moved.end(), Client->ID) == Moved.end()) Settings.Pool->Busy[Kept++] = Client;
+    }
+    Settings.Pool->Busy.resize(Kept);
+    Kept = 0;
+    for(size_t i = 0; i < Clients.size(); i++){
+        struct Connection* Client = Clients[i];
+        if(std::find(Moved.begin(), Moved.end(), Client->ID) == Moved.end()){
+            Client->Position = Kept;
+            Clients[Kept++] = Client;
+            continue;
+        }
+        epoll_ctl(Settings.WatchFD, EPOLL_CTL_DEL, Client->SocketFD, NULL);
+        CloseTransfers(Client);
+        ReleaseBuffers(Client, Settings.Pool);
+        RemoveMember(Index, Client->Member);
+        if(Client->UDP != NULL){
+            Tokens.erase(Client->UDP->Token);
+            delete Client->UDP;
+        }
+        close(Client->SocketFD);
+        delete Client;
+    }
+    Clients.resize(Kept);
+    bool Asking = (Console.Mode == CONSOLE_FILE_ANSWER || Console.Mode == CONSOLE_FILE_SEND) && !Console.Requests.empty() &&
+                  std::find(Moved.begin(), Moved.end(), Console.Requests.front().ClientID) != Moved.end();
+    std::deque<struct FileRequest> Staying;
+    for(size_t i = 0; i < Console.Requests.size(); i++){
+        if(std::find(Moved.begin(), Moved.end(), Console.Requests[i].ClientID) == Moved.end()) Staying.push_back(Console.Requests[i]);
+    }
+    Console.Requests.swap(Staying);
+    if(Asking) Console.Mode = CONSOLE_CHAT;
+
+    //Listening sockets are the new server's now, nobody new connects here
+    epoll_ctl(Settings.WatchFD, EPOLL_CTL_DEL, BaseSocketFD, NULL);
+    close(BaseSocketFD);
+    if(Settings.LocalFD >= 0){
+        epoll_ctl(Settings.WatchFD, EPOLL_CTL_DEL, Settings.LocalFD, NULL);
+        close(Settings.LocalFD);
+    }
+    if(Settings.DatagramFD >= 0){
+        epoll_ctl(Settings.WatchFD, EPOLL_CTL_DEL, Settings.DatagramFD, NULL);
+        close(Settings.DatagramFD);
+    }
+    epoll_ctl(Settings.WatchFD, EPOLL_CTL_DEL, Settings.UpgradeFD, NULL);
+    close(Settings.UpgradeFD);
+    char Pause[32];
+    snprintf(Pause, sizeof(Pause), "%.3f", (MonotonicTime() - Stopped) / 1000000.0);
+    std::cout << "Handed over " << Moved.size() << " clients to new server (" << Pause << " ms), " << Clients.size()
+              << " clients over TLS or on this host stay until they leave" << std::endl << std::endl;
+    if(Asking) std::cout << "File request prompt moved to new server" << std::endl << std::endl;
+    return true;
+}
+
+void SaveClient(std::string& State, std::vector<int>& Handles, std::vector<int>& Opened, struct Connection* Client, struct RoomIndex& Index){
+    PutHandle(State, Handles, Client->SocketFD);
+    PutNumber(State, Client->ID);
+    PutNumber(State, Client->State);
+    PutNumber(State, Client->Paused);
+    PutNumber(State, Client->NextTransfer);
+    PutNumber(State, Client->QueuedBytes);
+    PutNumber(State, Client->PeakBytes);
+    PutNumber(State, Client->Dropped);
+    PutNumber(State, Client->Pauses);
+
+    //Rooms are kept by name, new server gives out its own room and member numbers
+    std::vector<struct Subscription>& Rooms = Index.Rooms[Client->Member];
+    PutNumber(State, Rooms.size());
+    for(size_t i = 0; i < Rooms.size(); i++) PutText(State, Index.Names[Rooms[i].Target]);
+
+    //Queued frames are handed over whole, with how much of the current frame the socket has already taken
+    PutNumber(State, Client->IO != NULL);
+    if(Client->IO != NULL){
+        struct Buffers* IO = Client->IO;
+        FillSplices(IO);
+        PutText(State, IO->Inbox);
+        PutNumber(State, IO->ChatQueue.size());
+        for(size_t i = 0; i < IO->ChatQueue.size(); i++){
+            PutText(State, IO->ChatQueue[i].Data);
+            PutNumber(State, IO->ChatQueue[i].Keep);
+        }
+        PutNumber(State, IO->FileQueue.size());
+        for(size_t i = 0; i < IO->FileQueue.size(); i++) PutText(State, IO->FileQueue[i]);
+        PutText(State, IO->Current);
+        PutNumber(State, IO->Offset);
+    }
+
+    //Rate limits and link measurements start over on the new server
+    PutNumber(State, Client->Files != NULL);
+    if(Client->Files != NULL){
+        PutNumber(State, Client->Files->Sends.size());
+        for(size_t i = 0; i < Client->Files->Sends.size(); i++) SaveTransfer(State, Handles, Opened, Client->Files->Sends[i], false);
+        PutNumber(State, Client->Files->Receives.size());
+        for(std::map<int, struct Transfer*>::iterator It = Client->Files->Receives.begin(); It != Client->Files->Receives.end(); It++){
+            SaveTransfer(State, Handles, Opened, It->second, true);
+        }
+    }
+
+    //UDP socket is handed over too, so datagrams in flight are ACK'd and sent again by the new server
+    PutNumber(State, Client->UDP != NULL);
+    if(Client->UDP != NULL){
+        struct Datagram* UDP = Client->UDP;
+        PutNumber(State, UDP->Token);
+        PutText(State, std::string((char *)&UDP->Address, sizeof(UDP->Address)));
+        PutNumber(State, UDP->Known);
+        PutNumber(State, UDP->Failed);
+        PutNumber(State, UDP->Waiting);
+        PutNumber(State, UDP->NextSequence);
+        PutNumber(State, UDP->Unacked.size());
+        for(std::map<unsigned int, struct SentDatagram>::iterator It = UDP->Unacked.begin(); It != UDP->Unacked.end(); It++){
+            PutNumber(State, It->first);
+            PutText(State, It->second.Frame);
+            PutNumber(State, It->second.Time);
+            PutNumber(State, It->second.First);
+            PutNumber(State, It->second.Tries);
+            PutNumber(State, It->second.Missed);
+        }
+        PutNumber(State, UDP->Pending.size());
+        for(size_t i = 0; i < UDP->Pending.size(); i++) PutText(State, UDP->Pending[i]);
+        PutNumber(State, UDP->Expected);
+        PutNumber(State, UDP->Early.size());
+        for(std::map<unsigned int, std::string>::iterator It = UDP->Early.begin(); It != UDP->Early.end(); It++){
+            PutNumber(State, It->first);
+            PutText(State, It->second);
+        }
+        PutNumber(State, UDP->RTT);
+        PutNumber(State, UDP->Variance);
+        PutNumber(State, UDP->Timeout);
+        PutNumber(State, UDP->Sent);
+        PutNumber(State, UDP->Retransmits);
+        PutNumber(State, UDP->Received);
+        PutNumber(State, UDP->Duplicates);
+    }
+}
+
+void SaveTransfer(std::string& State, std::vector<int>& Handles, std::vector<int>& Opened, struct Transfer* Moved, bool Receiving){
+    PutNumber(State, Moved->ID);
+    PutText(State, Moved->Name);
+    PutNumber(State, Moved->Remaining);
+    PutNumber(State, Moved->Started);
+    PutNumber(State, Moved->Directory);
+    PutNumber(State, Moved->Entries.size());
+    for(size_t i = 0; i < Moved->Entries.size(); i++){
+        PutText(State, Moved->Entries[i].Name);
+        PutNumber(State, Moved->Entries[i].Size);
+    }
+    PutNumber(State, Moved->Next);
+    PutNumber(State, Moved->Left);
+    PutNumber(State, Receiving ? 0 : Moved->Offset);
+    PutNumber(State, Moved->Verify);
+    PutNumber(State, Moved->Checksum);
+    PutNumber(State, Moved->Hash);
+
+    //New server gets its own open file at the same position, so nothing done here afterwards moves it
+    int Handle = -1;
+    long long Position = 0;
+    if(Moved->Cached != NULL){
+        //Cached data is sent from the file, or from a copy of it if the file has changed since
+        Position = Moved->Cached->Data.size() - Moved->Remaining;
+        if(!Moved->Cached->Stale){
+            Handle = open(Moved->Cached->Path.c_str(), O_RDONLY | O_CLOEXEC);
+        }else if((Handle = memfd_create("chat-cached", MFD_CLOEXEC)) >= 0){
+            size_t Written = 0;
+            while(Written < Moved->Cached->Data.size()){
+                ssize_t bytes = write(Handle, Moved->Cached->Data.data() + Written, Moved->Cached->Data.size() - Written);
+                if(bytes <= 0) break;
+                Written += bytes;
+            }
+        }
+    }else if(Moved->File != NULL){
+        fflush(Moved->File);
+        Position = ftell(Moved->File);
+        //Large files of a directory are sent with sendfile(), which leaves the file position where it was
+        if(!Receiving && Position < Moved->Offset) Position = Moved->Offset;
+        char Path[64];
+        snprintf(Path, sizeof(Path), "/proc/self/fd/%d", fileno(Moved->File));
+        Handle = open(Path, (Receiving ? O_WRONLY : O_RDONLY) | O_CLOEXEC);
+    }
+    if(Handle >= 0) Opened.push_back(Handle);
+    PutHandle(State, Handles, Handle);
+    PutNumber(State, Position);
+}
+
+void FillSplices(struct Buffers* IO){
+    //Frames queued without their file data get it read in, so every queued frame can be handed over whole
+    if(IO->Splicing.Length > 0) ReadSplice(&IO->Splicing, IO->Current);
+    for(size_t i = 0; i < IO->FileQueue.size() && !IO->Splices.empty(); i++){
+        if(IO->FileQueue[i].size() == sizeof(struct FrameHeader) && ((struct FrameHeader*)IO->FileQueue[i].data())->Length != 0){
+            ReadSplice(&IO->Splices.front(), IO->FileQueue[i]);
+            IO->Splices.pop_front();
+        }
+    }
+}
+
+void ReadSplice(struct Splice* Data, std::string& Frame){
+    //Data goes behind what is already in the frame, a file that shrunk leaves zeros like SpliceSend() does
+    size_t Start = Frame.size();
+    Frame.resize(Start + Data->Length, '\0');
+    size_t Done = 0;
+    while(Done < Data->Length){
+        ssize_t bytes = pread(Data->FD, &Frame[Start + Done], Data->Length - Done, Data->Offset + Done);
+        if(bytes <= 0) break;
+        Done += bytes;
+    }
+    close(Data->FD);
+    Data->Length = 0;
+}
+
+bool TakeOver(int Port, struct Upgrade* Handoff){
+    //Server being upgraded is found by port number
+    struct sockaddr_un Address;
+    memset(&Address, '\0', sizeof(Address));
+    Address.sun_family = AF_UNIX;
+    snprintf(Address.sun_path, sizeof(Address.sun_path), UPGRADE_PATH, Port);
+    Handoff->SocketFD = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(Handoff->SocketFD < 0 || connect(Handoff->SocketFD, (struct sockaddr *) &Address, sizeof(Address)) != 0) return false;
+    struct timeval Wait;
+    Wait.tv_sec = UPGRADE_TIMEOUT / 1000;
+    Wait.tv_usec = (UPGRADE_TIMEOUT % 1000) * 1000;
+    setsockopt(Handoff->SocketFD, SOL_SOCKET, SO_RCVTIMEO, &Wait, sizeof(Wait));
+    setsockopt(Handoff->SocketFD, SOL_SOCKET, SO_SNDTIMEO, &Wait, sizeof(Wait));
+    unsigned int Version = UPGRADE_VERSION;
+    if(send(Handoff->SocketFD, &Version, sizeof(Version), MSG_NOSIGNAL) != sizeof(Version)) return false;
+
+    //First packet holds old server's layout and how many file descriptors it passes, the rest come in batches
+    unsigned int Header[2];
+    if(ReceiveBatch(Handoff->SocketFD, (char *)Header, sizeof(Header), Handoff->Handles) != sizeof(Header) || Header[0] != UPGRADE_VERSION) return false;
+    while(Handoff->Handles.size() < Header[1]){
+        char Mark;
+        if(ReceiveBatch(Handoff->SocketFD, &Mark, 1, Handoff->Handles) != 1) return false;
+    }
+
+    //State is read out of the memfd passed first
+    int Memory = Handoff->Handles[0];
+    Handoff->Handles[0] = -1;
+    struct stat Info;
+    if(fstat(Memory, &Info) != 0){
+        close(Memory);
+        return false;
+    }
+    Handoff->State.resize(Info.st_size);
+    size_t Done = 0;
+    while(Done < Handoff->State.size()){
+        ssize_t bytes = pread(Memory, &Handoff->State[Done], Handoff->State.size() - Done, Done);
+        if(bytes <= 0) break;
+        Done += bytes;
+    }
+    close(Memory);
+    if(Done < Handoff->State.size()) return false;
+
+    //Relative paths of transfers keep working by carrying on in old server's folder
+    Handoff->Position = 0;
+    Handoff->Failed = false;
+    Handoff->Stopped = GetNumber(Handoff);
+    Handoff->NextID = GetNumber(Handoff);
+    int Folder = GetHandle(Handoff);
+    if(Folder >= 0){
+        if(fchdir(Folder) != 0) std::cerr << "Folder of old server could not be entered, relative paths may differ" << std::endl;
+        close(Folder);
+    }
+    Handoff->BaseSocketFD = GetHandle(Handoff);
+    Handoff->LocalFD = GetHandle(Handoff);
+    Handoff->DatagramFD = GetHandle(Handoff);
+    return !Handoff->Failed && Handoff->BaseSocketFD >= 0;
+}
+
+bool TakeClients(struct Upgrade* Handoff, std::vector<struct Connection*>& Clients, struct ConsoleState& Console, struct RoomIndex& Index,
+                 std::map<unsigned int, struct Connection*>& Tokens, struct ServerSettings Settings){
+    //Server user stays in the rooms it was in
+    long long Count = GetNumber(Handoff);
+    for(long long i = 0; i < Count && !Handoff->Failed; i++) JoinRoom(Index, Console.Member, GetText(Handoff));
+    Count = GetNumber(Handoff);
+    for(long long i = 0; i < Count && !Handoff->Failed; i++) Clients.push_back(LoadClient(Handoff, Index, Tokens, Settings));
+    Count = GetNumber(Handoff);
+    for(long long i = 0; i < Count && !Handoff->Failed; i++){
+        struct FileRequest Request;
+        Request.ClientID = GetNumber(Handoff);
+        Request.ID = GetNumber(Handoff);
+        Request.Name = GetText(Handoff);
+        Console.Requests.push_back(Request);
+    }
+    for(size_t i = 0; i < Handoff->Handles.size(); i++){
+        if(Handoff->Handles[i] >= 0) close(Handoff->Handles[i]);
+    }
+    Handoff->Handles.clear();
+
+    //Old server lets go of every client once state has been read, nothing is served here before it has
+    char Answer = 0;
+    bool Ready = !Handoff->Failed && Handoff->Position == Handoff->State.size() && send(Handoff->SocketFD, "A", 1, MSG_NOSIGNAL) == 1 &&
+                 recv(Handoff->SocketFD, &Answer, 1, 0) == 1 && Answer == 'G';
+    close(Handoff->SocketFD);
+    Handoff->SocketFD = -1;
+    std::string().swap(Handoff->State);
+    return Ready;
+}
+
+struct Connection* LoadClient(struct Upgrade* Handoff, struct RoomIndex& Index, std::map<unsigned int, struct Connection*>& Tokens, struct ServerSettings Settings){
+    struct Connection* Client = new struct Connection();
+    Client->SocketFD = GetHandle(Handoff);
+    Client->ID = GetNumber(Handoff);
+    Client->State = GetNumber(Handoff);
+    Client->Closed = Client->SocketFD < 0;
+    Client->Paused = GetNumber(Handoff);
+    Client->NextTransfer = GetNumber(Handoff);
+    Client->QueuedBytes = GetNumber(Handoff);
+    Client->PeakBytes = GetNumber(Handoff);
+    Client->Dropped = GetNumber(Handoff);
+    Client->Pauses = GetNumber(Handoff);
+    Client->Member = AddMember(Index, Client);
+    Client->IO = NULL;
+    Client->Files = NULL;
+    Client->Capture = Settings.Capture;
+    Client->TLS = NULL;
+    Client->UDP = NULL;
+    Client->Local = NULL;
+    long long Count = GetNumber(Handoff);
+    for(long long i = 0; i < Count && !Handoff->Failed; i++) JoinRoom(Index, Client->Member, GetText(Handoff));
+
+    if(GetNumber(Handoff)){
+        struct Buffers* IO = AttachBuffers(Client, Settings.Pool);
+        IO->Inbox = GetText(Handoff);
+        Count = GetNumber(Handoff);
+        for(long long i = 0; i < Count && !Handoff->Failed; i++){
+            struct QueuedData Queued;
+            Queued.Data = GetText(Handoff);
+            Queued.Keep = GetNumber(Handoff);
+            IO->ChatQueue.push_back(Queued);
+        }
+        Count = GetNumber(Handoff);
+        for(long long i = 0; i < Count && !Handoff->Failed; i++) IO->FileQueue.push_back(GetText(Handoff));
+        IO->Current = GetText(Handoff);
+        IO->Offset = GetNumber(Handoff);
+    }
+
+    if(GetNumber(Handoff)){
+        struct Transfers* Files = AttachTransfers(Client, Settings);
+        Count = GetNumber(Handoff);
+        for(long long i = 0; i < Count && !Handoff->Failed; i++) Files->Sends.push_back(LoadTransfer(Handoff, false, Settings));
+        Count = GetNumber(Handoff);
+        for(long long i = 0; i < Count && !Handoff->Failed; i++){
+            struct Transfer* Receive = LoadTransfer(Handoff, true, Settings);
+            Files->Receives[Receive->ID] = Receive;
+        }
+    }
+
+    if(GetNumber(Handoff)){
+        struct Datagram* UDP = new struct Datagram();
+        SetupDatagram(UDP, GetNumber(Handoff));
+        std::string Address = GetText(Handoff);
+        if(Address.size() == sizeof(UDP->Address)) memcpy(&UDP->Address, Address.data(), sizeof(UDP->Address));
+        UDP->Known = GetNumber(Handoff);
+        UDP->Failed = GetNumber(Handoff);
+        UDP->Waiting = GetNumber(Handoff);
+        UDP->NextSequence = GetNumber(Handoff);
+        Count = GetNumber(Handoff);
+        for(long long i = 0; i < Count && !Handoff->Failed; i++){
+            struct SentDatagram& Sent = UDP->Unacked[GetNumber(Handoff)];
+            Sent.Frame = GetText(Handoff);
+            Sent.Time = GetNumber(Handoff);
+            Sent.First = GetNumber(Handoff);
+            Sent.Tries = GetNumber(Handoff);
+            Sent.Missed = GetNumber(Handoff);
+        }
+        Count = GetNumber(Handoff);
+        for(long long i = 0; i < Count && !Handoff->Failed; i++) UDP->Pending.push_back(GetText(Handoff));
+        UDP->Expected = GetNumber(Handoff);
+        Count = GetNumber(Handoff);
+        for(long long i = 0; i < Count && !Handoff->Failed; i++){
+            unsigned int Sequence = GetNumber(Handoff);
+            UDP->Early[Sequence] = GetText(Handoff);
+        }
+        UDP->RTT = GetNumber(Handoff);
+        UDP->Variance = GetNumber(Handoff);
+        UDP->Timeout = GetNumber(Handoff);
+        UDP->Sent = GetNumber(Handoff);
+        UDP->Retransmits = GetNumber(Handoff);
+        UDP->Received = GetNumber(Handoff);
+        UDP->Duplicates = GetNumber(Handoff);
+        Client->UDP = UDP;
+        Tokens[UDP->Token] = Client;
+    }
+    return Client;
+}
+
+struct Transfer* LoadTransfer(struct Upgrade* Handoff, bool Receiving, struct ServerSettings Settings){
+    struct Transfer* Moved = new struct Transfer();
+    Moved->ID = GetNumber(Handoff);
+    Moved->Name = GetText(Handoff);
+    Moved->Remaining = GetNumber(Handoff);
+    Moved->Started = GetNumber(Handoff);
+    Moved->Directory = GetNumber(Handoff);
+    long long Count = GetNumber(Handoff);
+    for(long long i = 0; i < Count && !Handoff->Failed; i++){
+        struct DirectoryFile Entry;
+        Entry.Name = GetText(Handoff);
+        Entry.Size = GetNumber(Handoff);
+        Moved->Entries.push_back(Entry);
+    }
+    Moved->Next = GetNumber(Handoff);
+    Moved->Left = GetNumber(Handoff);
+    Moved->Offset = GetNumber(Handoff);
+    Moved->Verify = GetNumber(Handoff);
+    Moved->Checksum = GetNumber(Handoff);
+    Moved->Hash = GetNumber(Handoff);
+    Moved->Source = -1;
+    Moved->Cached = NULL;
+    SetupBucket(&Moved->Bucket, Settings.FileRate);
+
+    //File carries on from where old server left it
+    int Handle = GetHandle(Handoff);
+    long long Position = GetNumber(Handoff);
+    Moved->File = Handle >= 0 ? fdopen(Handle, Receiving ? "wb" : "rb") : NULL;
+    if(Moved->File != NULL){
+        fseek(Moved->File, Position, SEEK_SET);
+    }else if(Handle >= 0){
+        close(Handle);
+    }
+    return Moved;
+}
+
+void PutNumber(std::string& State, long long Number){
+    //Both servers run on the same host, numbers are kept in its byte order
+    State.append((char *)&Number, sizeof(Number));
+}
+
+void PutText(std::string& State, const std::string& Text){
+    PutNumber(State, Text.size());
+    State += Text;
+}
+
+void PutHandle(std::string& State, std::vector<int>& Handles, int Handle){
+    //State holds position of file descriptor among those passed, -1 if there is none
+    if(Handle < 0){
+        PutNumber(State, -1);
+        return;
+    }
+    PutNumber(State, Handles.size());
+    Handles.push_back(Handle);
+}
+
+long long GetNumber(struct Upgrade* Handoff){
+    //State cut short reads as zeros and marks the upgrade as failed
+    long long Number = 0;
+    if(Handoff->Position + sizeof(Number) > Handoff->State.size()){
+        Handoff->Failed = true;
+        return 0;
+    }
+    memcpy(&Number, Handoff->State.data() + Handoff->Position, sizeof(Number));
+    Handoff->Position += sizeof(Number);
+    return Number;
+}
+
+std::string GetText(struct Upgrade* Handoff){
+    long long Length = GetNumber(Handoff);
+    if(Length < 0 || Handoff->Position + Length > Handoff->State.size()){
+        Handoff->Failed = true;
+        return std::string();
+    }
+    std::string Text = Handoff->State.substr(Handoff->Position, Length);
+    Handoff->Position += Length;
+    return Text;
+}
+
+int GetHandle(struct Upgrade* Handoff){
+    //Every file descriptor is taken once, any left untaken are closed once the state has been read
+    long long Number = GetNumber(Handoff);
+    if(Number < 0) return -1;
+    if((size_t)Number >= Handoff->Handles.size() || Handoff->Handles[Number] < 0){
+        Handoff->Failed = true;
+        return -1;
+    }
+    int Handle = Handoff->Handles[Number];
+    Handoff->Handles[Number] = -1;
+    return Handle;
+}
+
+bool SendBatch(int SocketFD, const char* Data, size_t Length, const int* Handles, size_t Count){
+    //One packet carries its bytes and up to UPGRADE_BATCH file descriptors, peer gets its own copies of them
+    struct iovec Part;
+    Part.iov_base = (void*)Data;
+    Part.iov_len = Length;
+    struct msghdr Message;
+    memset(&Message, '\0', sizeof(Message));
+    Message.msg_iov = &Part;
+    Message.msg_iovlen = 1;
+    char Control[CMSG_SPACE(UPGRADE_BATCH * sizeof(int))];
+    if(Count > 0){
+        memset(Control, '\0', sizeof(Control));
+        Message.msg_control = Control;
+        Message.msg_controllen = CMSG_SPACE(Count * sizeof(int));
+        struct cmsghdr* Header = CMSG_FIRSTHDR(&Message);
+        Header->cmsg_level = SOL_SOCKET;
+        Header->cmsg_type = SCM_RIGHTS;
+        Header->cmsg_len = CMSG_LEN(Count * sizeof(int));
+        memcpy(CMSG_DATA(Header), Handles, Count * sizeof(int));
+    }
+    return sendmsg(SocketFD, &Message, MSG_NOSIGNAL) == (ssize_t)Length;
+}
+
+int ReceiveBatch(int SocketFD, char* Data, size_t Length, std::vector<int>& Handles){
+    //Reads one packet, keeping every file descriptor passed with it in the order they were sent
+    struct iovec Part;
+    Part.iov_base = Data;
+    Part.iov_len = Length;
+    struct msghdr Message;
+    memset(&Message, '\0', sizeof(Message));
+    Message.msg_iov = &Part;
+    Message.msg_iovlen = 1;
+    char Control[CMSG_SPACE(UPGRADE_BATCH * sizeof(int))];
+    Message.msg_control = Control;
+    Message.msg_controllen = sizeof(Control);
+    int bytes = recvmsg(SocketFD, &Message, MSG_CMSG_CLOEXEC);
+    if(bytes < 0) return -1;
+    for(struct cmsghdr* Header = CMSG_FIRSTHDR(&Message); Header != NULL; Header = CMSG_NXTHDR(&Message, Header)){
+        if(Header->cmsg_level != SOL_SOCKET || Header->cmsg_type != SCM_RIGHTS) continue;
+        size_t Count = (Header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(size_t i = 0; i < Count; i++){
+            int Handle;
+            memcpy(&Handle, CMSG_DATA(Header) + i * sizeof(int), sizeof(int));
+            Handles.push_back(Handle);
+        }
+    }
+    //File descriptors cut off (limit of open files reached) would leave the state pointing at the wrong ones
+    if(Message.msg_flags & MSG_CTRUNC) return -1;
+    return bytes;
+}
+
+void PrintStats(std::vector<struct Connection*>& Clients, struct BufferPool* Pool, struct FileCache* Cache, long long Base){
+    //Display queue depth metrics of each client that is busy or has fallen behind, idle clients are only counted
+    std::cout << "- - QUEUE STATS - -" << std::endl;
+    size_t Idle = 0;
+    for(size_t i = 0; i < Clients.size(); i++){
+        struct Connection* Client = Clients[i];
+        if(Client->IO == NULL && Client->Files == NULL && Client->Dropped == 0 && Client->Pauses == 0){
+            Idle++;
+            continue;
+        }
+        std::cout << "Client " << Client->ID << " : queued " << Client->QueuedBytes << " bytes (peak " << Client->PeakBytes
+                  << "), dropped " << Client->Dropped << " messages, paused " << Client->Pauses << " times"
+                  << (Client->Paused ? " (paused)" : "") << ", sending " << (Client->Files != NULL ? Client->Files->Sends.size() : 0)
+                  << " files, receiving " << (Client->Files != NULL ? Client->Files->Receives.size() : 0) << " files" << std::endl;
+        if(Client->Files != NULL && Client->Files->Pace.Checked != 0){
+            std::cout << "Client " << Client->ID << " link : " << PacingStats(&Client->Files->Pace) << std::endl;
+        }
+    }
+    std::cout << Clients.size() << " clients (" << Idle << " idle), " << Pool->Attached << " with buffers attached, "
+              << Pool->Free.size() << " buffers in pool" << std::endl;
+
+    //Chat sent as datagrams, clients that have sent datagrams again are shown, others are only counted
+    size_t Users = 0;
+    for(size_t i = 0; i < Clients.size(); i++){
+        if(Clients[i]->UDP == NULL) continue;
+        Users++;
+        if(Clients[i]->UDP->Retransmits > 0 || Clients[i]->UDP->Failed || DatagramBusy(Clients[i]->UDP)){
+            std::cout << "Client " << Clients[i]->ID << " UDP : " << DatagramStats(Clients[i]->UDP) << std::endl;
+        }
+    }
+    if(Users > 0) std::cout << Users << " clients sending chat as datagrams" << std::endl;
+
+    //Clients on this host, and files passed to them as file descriptors
+    size_t Locals = 0, Rings = 0, Passed = 0;
+    for(size_t i = 0; i < Clients.size(); i++){
+        if(Clients[i]->Local == NULL) continue;
+        Locals++;
+        if(Clients[i]->Local->In != NULL) Rings++;
+        Passed += Clients[i]->Local->Passed;
+    }
+    if(Locals > 0) std::cout << Locals << " clients on this host (" << Rings << " on shared memory rings), " << Passed << " files passed" << std::endl;
+
+    //Files kept in memory, and how often requests were served from them
+    if(Cache->Budget > 0){
+        std::cout << Cache->Files.size() << " files cached (" << Cache->Bytes / 1024 << " of " << Cache->Budget / 1024 << " KB), "
+                  << Cache->Hits << " hits, " << Cache->Misses << " misses, " << Cache->Dropped << " dropped for changes"
+                  << (Cache->NotifyFD < 0 ? " (no inotify, checked on every request)" : "") << std::endl;
+    }
+
+    //Resident memory of whole server, what it grew by since before clients connected is divided between them
+    long long Bytes = ResidentMemory();
+    if(Bytes >= 0){
+        std::cout << "Resident memory " << Bytes / 1024 << " KB";
+        if(Base >= 0){
+            std::cout << " (" << Base / 1024 << " KB before clients)";
+            if(!Clients.empty()) std::cout << ", " << (Bytes - Base) / (long long)Clients.size() << " bytes per client";
+        }
+        std::cout << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+long long ResidentMemory(){
+    //Second field of statm is resident pages
+    long long Bytes = -1;
+    #ifndef _WIN32
+        FILE* Status = fopen("/proc/self/statm", "r");
+        long Pages = 0, Resident = 0;
+        if(Status != NULL){
+            if(fscanf(Status, "%ld %ld", &Pages, &Resident) == 2) Bytes = (long long)Resident * sysconf(_SC_PAGESIZE);
+            fclose(Status);
+        }
+    #endif
+    return Bytes;
+}
+
+void Exit(std::vector<struct Connection*>& Clients, struct ServerSettings Settings){
+    //Exiting program is represented by all 000, send exit code to every client and exit chat
+    struct MessageProtocol Packet = CreateHeader(0,0,(char *)"Server has exited the chat...");
+    for(size_t i = 0; i < Clients.size(); i++){
+        if(!Clients[i]->Closed) QueuePacket(Clients[i], Packet, true, Settings);
+    }
+}
+
+void StartDisplay(struct Display* Display){
+    SetupQueue(&Display->Output, OUTPUT_QUEUE_SIZE);
+    SetupQueue(&Display->Input, INPUT_QUEUE_SIZE);
+    for(int i = 0; i < LATENCY_BUCKETS; i++) Display->Latency[i].store(0);
+
+    //Everything written to std::cout from now on is handed to renderer thread
+    std::cout.flush();
+    Display->Buffer.Output = &Display->Output;
+    Display->Terminal = std::cout.rdbuf(&Display->Buffer);
+    Display->Renderer = std::thread(RenderLoop, Display);
+    Display->Reader = std::thread(ReadLoop, Display);
+}
+
+void StopDisplay(struct Display* Display){
+    //Hand over last output and wait for renderer to write everything
+    std::cout.flush();
+    std::cout.rdbuf(Display->Terminal);
+    Display->Output.Closed.store(true);
+    char Wake = 0;
+    if(write(Display->Output.WakeFD[1], &Wake, 1) < 0){}
+    Display->Renderer.join();
+
+    //Input thread may be blocked reading console, it ends with the program
+    Display->Reader.detach();
+}
+
+void RenderLoop(struct Display* Display){
+    std::string Batch;                  //Lines written to terminal at once
+    std::vector<long long> Times;       //Time each line in batch was pushed
+    struct Line Output;
+    while(true){
+        bool Closed = Display->Output.Closed.load();
+
+        //Take every waiting line so a fast conversation is written with few system calls
+        while(Batch.size() < RENDER_BATCH && PopLine(&Display->Output, Output)){
+            Batch += Output.Text;
+            Times.push_back(Output.Time);
+        }
+        if(!Batch.empty()){
+            size_t Written = 0;
+            while(Written < Batch.size()){
+                int bytes = write(1, Batch.data() + Written, Batch.size() - Written);
+                if(bytes < 0 && errno == EINTR) continue;
+                if(bytes <= 0) break;   //Terminal is gone, output is lost
+                Written += bytes;
+            }
+            long long Now = MonotonicTime();
+            for(size_t i = 0; i < Times.size(); i++){
+                Display->Latency[LatencyBucket((Now - Times[i]) / 1000)].fetch_add(1, std::memory_order_relaxed);
+            }
+            Batch.clear();
+            Times.clear();
+            continue;
+        }
+        if(Closed) return;
+
+        //Nothing to write, sleep until I/O thread pushes more
+        if(QueueIdle(&Display->Output)){
+            struct pollfd Wake;
+            Wake.fd = Display->Output.WakeFD[0];
+            Wake.events = POLLIN;
+            poll(&Wake, 1, -1);
+        }
+        char Wake[64];
+        while(read(Display->Output.WakeFD[0], Wake, sizeof(Wake)) > 0);
+    }
+}
+
+void ReadLoop(struct Display* Display){
+    std::string Buffer;                 //Console input not yet ending in newline
+    while(true){
+        char Data[MAX_LENGTH];
+        int bytes = read(0, Data, sizeof(Data));
+        if(bytes <= 0){
+            //Console closed, treat as exit
+            Buffer += "EXIT\n";
+        }else{
+            Buffer.append(Data, bytes);
+        }
+
+        //Hand every whole line to I/O thread
+        size_t End;
+        while((End = Buffer.find('\n')) != std::string::npos){
+            std::string Input = Buffer.substr(0, End);
+            Buffer.erase(0, End + 1);
+            if(!Input.empty() && Input[Input.size() - 1] == '\r') Input.erase(Input.size() - 1);
+            while(!PushLine(&Display->Input, Input)) std::this_thread::yield();
+        }
+        if(bytes <= 0) return;
+    }
+}
+
+void SetupQueue(struct LineQueue* Queue, size_t Size){
+    Queue->Slots.resize(Size);
+    Queue->Mask = Size - 1;
+    Queue->Head.store(0);
+    Queue->Tail.store(0);
+    Queue->Sleeping.store(true);
+    Queue->Closed.store(false);
+
+    //Wake pipe never blocks, a byte already waiting in it wakes consumer just as well
+    if(pipe(Queue->WakeFD) < 0){
+        std::cerr << "Creating console pipe failed, program terminated" << std::endl;
+        exit(-1);
+    }
+    fcntl(Queue->WakeFD[0], F_SETFL, fcntl(Queue->WakeFD[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(Queue->WakeFD[1], F_SETFL, fcntl(Queue->WakeFD[1], F_GETFL, 0) | O_NONBLOCK);
+}
+
+bool PushLine(struct LineQueue* Queue, std::string& Text){
+    //Queue is full once producer is a whole ring ahead of consumer
+    size_t Tail = Queue->Tail.load(std::memory_order_relaxed);
+    if(Tail - Queue->Head.load(std::memory_order_acquire) == Queue->Slots.size()) return false;
+
+    //Line is swapped in, leaving Text with the emptied string of an earlier line
+    struct Line& Slot = Queue->Slots[Tail & Queue->Mask];
+    Slot.Text.swap(Text);
+    Slot.Time = MonotonicTime();
+    Queue->Tail.store(Tail + 1, std::memory_order_release);
+
+    //Wake consumer if it has gone to sleep, fence keeps line from being missed by a consumer going to sleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(Queue->Sleeping.load(std::memory_order_relaxed) && Queue->Sleeping.exchange(false)){
+        char Wake = 0;
+        if(write(Queue->WakeFD[1], &Wake, 1) < 0){}
+    }
+    return true;
+}
+
+bool PopLine(struct LineQueue* Queue, struct Line& Line){
+    size_t Head = Queue->Head.load(std::memory_order_relaxed);
+    if(Head == Queue->Tail.load(std::memory_order_acquire)) return false;
+
+    //Swap line out, slot keeps emptied string for reuse by producer
+    struct Line& Slot = Queue->Slots[Head & Queue->Mask];
+    Line.Text.clear();
+    Line.Text.swap(Slot.Text);
+    Line.Time = Slot.Time;
+    Queue->Head.store(Head + 1, std::memory_order_release);
+    return true;
+}
+
+bool QueueIdle(struct LineQueue* Queue){
+    //Mark consumer as sleeping, then check no line was pushed before producer could see it
+    Queue->Sleeping.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(Queue->Head.load(std::memory_order_relaxed) != Queue->Tail.load(std::memory_order_acquire)){
+        Queue->Sleeping.store(false);
+        return false;
+    }
+    return true;
+}
+
+int LatencyBucket(long long Micros){
+    //Every power of 2 is split into 4 buckets, so bucket bounds are within 25% of each other
+    if(Micros < 4) return Micros < 0 ? 0 : (int)Micros;
+    int Power = 2;
+    while((Micros >> (Power + 1)) != 0) Power++;
+    int Bucket = 4 * (Power - 1) + (int)((Micros >> (Power - 2)) & 3);
+    return Bucket < LATENCY_BUCKETS ? Bucket : LATENCY_BUCKETS - 1;
+}
+
+long long LatencyBound(int Bucket){
+    //Largest latency placed in bucket (microseconds)
+    if(Bucket < 4) return Bucket;
+    int Power = Bucket / 4 + 1;
+    return ((long long)(5 + Bucket % 4) << (Power - 2)) - 1;
+}
+
+void PrintLatency(struct Display* Display){
+    //Find buckets holding median and 99th percentile of lines written so far
+    unsigned long Counts[LATENCY_BUCKETS], Total = 0;
+    for(int i = 0; i < LATENCY_BUCKETS; i++){
+        Counts[i] = Display->Latency[i].load(std::memory_order_relaxed);
+        Total += Counts[i];
+    }
+    long long Median = -1, P99 = -1, Max = 0;
+    unsigned long Seen = 0;
+    if(Total == 0) Median = P99 = 0;
+    for(int i = 0; i < LATENCY_BUCKETS; i++){
+        if(Counts[i] == 0) continue;
+        Seen += Counts[i];
+        if(Median < 0 && Seen * 2 >= Total) Median = LatencyBound(i);
+        if(P99 < 0 && Seen * 100 >= Total * 99) P99 = LatencyBound(i);
+        Max = LatencyBound(i);
+    }
+    std::cout << "Display latency : " << Total << " lines, p50 <= " << Median << " us, p99 <= " << P99
+              << " us, max <= " << Max << " us" << std::endl << std::endl;
+}
+
+int DisplayBuffer::overflow(int Char){
+    if(Char != EOF) Pending += (char)Char;
+    return Char;
+}
+
+std::streamsize DisplayBuffer::xsputn(const char* Data, std::streamsize Length){
+    Pending.append(Data, Length);
+    return Length;
+}
+
+int DisplayBuffer::sync(){
+    //Flush (std::endl) hands output to renderer instead of writing to terminal, waiting only if renderer is a whole ring behind
+    if(Pending.empty()) return 0;
+    while(!PushLine(Output, Pending)) std::this_thread::yield();
+    Pending.clear();
+    return 0;
+}